@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "unqlite.h"
+
+// Compares a store using the sampling journal checksum with one that seals every page with a CRC32C.
+// Usage: bench_crc [records] [rounds]
+
+#define BENCH_DB "bench_crc.db"
+#define BENCH_VALUE_SIZE 4096
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, int rc){
+	fprintf(stderr, "bench_crc: %s failed (%d)\n", what, rc);
+	exit(EXIT_FAILURE);
+}
+
+//Write, commit, overwrite half of the records and read everything back after a reopen. Returns the elapsed time.
+static double run_once(int flags, int records){
+	static unsigned char value[BENCH_VALUE_SIZE], out[BENCH_VALUE_SIZE];
+	unqlite *db;
+	unqlite_int64 len;
+	double start;
+	char key[32];
+	int i, rc;
+
+	unlink(BENCH_DB);
+	start = now();
+	rc = unqlite_open(&db, BENCH_DB, UNQLITE_OPEN_CREATE | flags);
+	if( rc != UNQLITE_OK ){ fail("open", rc); }
+	for( i = 0 ; i < records ; i++ ){
+		sprintf(key, "key%d", i);
+		memset(value, i & 0xFF, sizeof(value));
+		rc = unqlite_kv_store(db, key, -1, value, sizeof(value));
+		if( rc != UNQLITE_OK ){ fail("store", rc); }
+	}
+	rc = unqlite_commit(db);
+	if( rc != UNQLITE_OK ){ fail("commit", rc); }
+	// Goes through the journal.
+	for( i = 0 ; i < records ; i += 2 ){
+		sprintf(key, "key%d", i);
+		memset(value, ~i & 0xFF, sizeof(value));
+		rc = unqlite_kv_store(db, key, -1, value, sizeof(value));
+		if( rc != UNQLITE_OK ){ fail("overwrite", rc); }
+	}
+	unqlite_close(db);
+
+	rc = unqlite_open(&db, BENCH_DB, UNQLITE_OPEN_READONLY);
+	if( rc != UNQLITE_OK ){ fail("reopen", rc); }
+	for( i = 0 ; i < records ; i++ ){
+		sprintf(key, "key%d", i);
+		len = sizeof(out);
+		rc = unqlite_kv_fetch(db, key, -1, out, &len);
+		if( rc != UNQLITE_OK ){ fail("fetch", rc); }
+		if( out[0] != (unsigned char) ((i & 1) ? i : ~i) ){ fail("verify", i); }
+	}
+	unqlite_close(db);
+	return now() - start;
+}
+
+int main(int argc, char** argv){
+	int records = argc > 1 ? atoi(argv[1]) : 20000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	double best_plain = 0, best_crc = 0, t;
+	int i;
+
+	// Interleave the runs so that both settings see the same page cache state.
+	for( i = 0 ; i < rounds ; i++ ){
+		t = run_once(0, records);
+		if( i == 0 || t < best_plain ){ best_plain = t; }
+		t = run_once(UNQLITE_OPEN_PAGE_CRC, records);
+		if( i == 0 || t < best_crc ){ best_crc = t; }
+	}
+	unlink(BENCH_DB);
+
+	printf("%d records of %d bytes, best of %d rounds\n", records, BENCH_VALUE_SIZE, rounds);
+	printf("sampling checksum: %.3f s\n", best_plain);
+	printf("page CRC32C:       %.3f s\n", best_crc);
+	printf("overhead:          %+.1f %%\n", (best_crc - best_plain) * 100.0 / best_plain);
+	return 0;
+}
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "newfs.h"
+
+// Workloads of the newfs operations, calling the FUSE callbacks directly on a fresh store each. One JSON
+// object per workload is printed, with the throughput and the latency percentiles.
+// Usage: bench_fs [-w workload] [-n operations] [-s request size] [-f file MiB] [-d depth] [-r seed]
+// Workloads: create, stat, seqwrite, seqread, randwrite, randread, readdir, rename, mixed, all.
+
+struct bench_options {
+	const char *workload;
+	long ops;       // Operations of the create, stat, random, rename and mixed workloads, entries of readdir.
+	size_t size;    // Request size of reads and writes.
+	off_t file;     // Size of the file of the sequential and random workloads.
+	int depth;      // Directories above the file of the stat workload.
+};
+
+// Latencies of the operations of a workload.
+struct bench_run {
+	uint64_t *ns;
+	long count;
+	long capacity;
+	uint64_t start;
+};
+
+static struct bench_options options = {"all", 1000, 4096, (off_t) 16 << 20, 16};
+static mode_t file_mode = S_IFREG | 0644;
+static mode_t dir_mode = S_IFDIR | 0755;
+
+static uint64_t now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void fail(const char *what, int rc){
+	fprintf(stderr, "bench_fs: %s failed (%d)\n", what, rc);
+	exit(EXIT_FAILURE);
+}
+
+static void run_begin(struct bench_run *run, long capacity){
+	run->ns = malloc(capacity * sizeof(uint64_t));
+	if( run->ns == NULL ){ fail("malloc", 0); }
+	run->count = 0;
+	run->capacity = capacity;
+	run->start = now();
+}
+
+static void run_add(struct bench_run *run, uint64_t start){
+	if( run->count < run->capacity ){
+		run->ns[run->count++] = now() - start;
+	}
+}
+
+static int compare_ns(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+//Latency at a percentile of the sorted latencies, in microseconds.
+static double percentile(struct bench_run *run, double p){
+	long index = (long) (p / 100 * run->count);
+	if( index >= run->count ){ index = run->count - 1; }
+	return run->ns[index] / 1e3;
+}
+
+//Print the results of a workload as one JSON object and free the latencies.
+static void run_end(struct bench_run *run, const char *workload, off_t bytes){
+	double seconds = (now() - run->start) / 1e9;
+	qsort(run->ns, run->count, sizeof(uint64_t), compare_ns);
+	printf("{\"workload\":\"%s\",\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f", workload, run->count, seconds,
+	       run->count / seconds);
+	if( bytes > 0 ){
+		printf(",\"mib_per_sec\":%.1f", bytes / 1048576.0 / seconds);
+	}
+	if( run->count > 0 ){
+		printf(",\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f",
+		       percentile(run, 50), percentile(run, 90), percentile(run, 99), percentile(run, 99.9),
+		       run->ns[run->count - 1] / 1e3);
+	}
+	printf("}\n");
+	fflush(stdout);
+	free(run->ns);
+}
+
+//Start every workload on an empty store.
+static void fresh_store(){
+	shutdown_fs();
+	unlink(DATABASE_NAME);
+	init_fs();
+}
+
+static void create_file(const char *path){
+	struct fuse_file_info fi;
+	memset(&fi, 0, sizeof(fi));
+	int rc = newfs_create(path, file_mode, &fi);
+	if( rc != 0 ){ fail("create", rc); }
+	newfs_release(path, &fi);
+}
+
+//Fill a file with options.file bytes, written sequentially.
+static void fill_file(const char *path, char *buf){
+	struct fuse_file_info fi;
+	off_t offset;
+	memset(&fi, 0, sizeof(fi));
+	int rc = newfs_create(path, file_mode, &fi);
+	if( rc != 0 ){ fail("create", rc); }
+	for( offset = 0 ; offset < options.file ; offset += options.size ){
+		rc = newfs_write(path, buf, options.size, offset, &fi);
+		if( rc != (int) options.size ){ fail("write", rc); }
+	}
+	newfs_release(path, &fi);
+}
+
+static void bench_create(){
+	struct bench_run run;
+	char path[64];
+	long i;
+	newfs_mkdir("/dir", dir_mode);
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		sprintf(path, "/dir/f%ld", i);
+		uint64_t start = now();
+		create_file(path);
+		run_add(&run, start);
+	}
+	run_end(&run, "create", 0);
+}
+
+static void bench_stat(){
+	struct bench_run run;
+	struct stat stbuf;
+	char *path = malloc(options.depth * 8 + 16);
+	int level;
+	long i;
+	path[0] = '\0';
+	for( level = 0 ; level < options.depth ; level++ ){
+		sprintf(&path[strlen(path)], "/d%d", level);
+		newfs_mkdir(path, dir_mode);
+	}
+	strcat(path, "/file");
+	create_file(path);
+
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		uint64_t start = now();
+		int rc = newfs_getattr(path, &stbuf);
+		if( rc != 0 ){ fail("getattr", rc); }
+		run_add(&run, start);
+	}
+	run_end(&run, "stat", 0);
+	free(path);
+}
+
+static void bench_seqwrite(char *buf){
+	struct bench_run run;
+	struct fuse_file_info fi;
+	off_t offset;
+	memset(&fi, 0, sizeof(fi));
+	newfs_create("/file", file_mode, &fi);
+	run_begin(&run, (long) (options.file / options.size) + 1);
+	for( offset = 0 ; offset < options.file ; offset += options.size ){
+		uint64_t start = now();
+		int rc = newfs_write("/file", buf, options.size, offset, &fi);
+		if( rc != (int) options.size ){ fail("write", rc); }
+		run_add(&run, start);
+	}
+	// Buffered data is stored on release, which counts in the total time.
+	newfs_release("/file", &fi);
+	run_end(&run, "seqwrite", options.file);
+}
+
+static void bench_seqread(char *buf){
+	struct bench_run run;
+	struct fuse_file_info fi;
+	off_t offset;
+	fill_file("/file", buf);
+	memset(&fi, 0, sizeof(fi));
+	newfs_open("/file", &fi);
+	run_begin(&run, (long) (options.file / options.size) + 1);
+	for( offset = 0 ; offset < options.file ; offset += options.size ){
+		uint64_t start = now();
+		int rc = newfs_read("/file", buf, options.size, offset, &fi);
+		if( rc != (int) options.size ){ fail("read", rc); }
+		run_add(&run, start);
+	}
+	newfs_release("/file", &fi);
+	run_end(&run, "seqread", options.file);
+}
+
+//Random offset of a request within the file, aligned to the request size.
+static off_t random_offset(){
+	long requests = (long) (options.file / options.size);
+	return (off_t) (random() % requests) * options.size;
+}
+
+// Writes insert their data at the offset (see newfs_write), so the file grows by one request each.
+static void bench_randwrite(char *buf){
+	struct bench_run run;
+	struct fuse_file_info fi;
+	long i;
+	fill_file("/file", buf);
+	memset(&fi, 0, sizeof(fi));
+	newfs_open("/file", &fi);
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		uint64_t start = now();
+		int rc = newfs_write("/file", buf, options.size, random_offset(), &fi);
+		if( rc != (int) options.size ){ fail("write", rc); }
+		run_add(&run, start);
+	}
+	newfs_release("/file", &fi);
+	run_end(&run, "randwrite", (off_t) options.ops * options.size);
+}
+
+static void bench_randread(char *buf){
+	struct bench_run run;
+	struct fuse_file_info fi;
+	long i;
+	fill_file("/file", buf);
+	memset(&fi, 0, sizeof(fi));
+	newfs_open("/file", &fi);
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		uint64_t start = now();
+		int rc = newfs_read("/file", buf, options.size, random_offset(), &fi);
+		if( rc != (int) options.size ){ fail("read", rc); }
+		run_add(&run, start);
+	}
+	newfs_release("/file", &fi);
+	run_end(&run, "randread", (off_t) options.ops * options.size);
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf, off_t off){
+	(*(long *) buf)++;
+	return 0;
+}
+
+// Lists a directory of options.ops entries, as many times as it takes to return a million entries.
+static void bench_readdir(){
+	struct bench_run run;
+	char path[64];
+	long i, listings = 1000000 / options.ops + 1;
+	newfs_mkdir("/dir", dir_mode);
+	for( i = 0 ; i < options.ops ; i++ ){
+		sprintf(path, "/dir/f%ld", i);
+		create_file(path);
+	}
+	run_begin(&run, listings);
+	for( i = 0 ; i < listings ; i++ ){
+		long entries = 0;
+		uint64_t start = now();
+		int rc = newfs_readdir("/dir", &entries, count_filler, 0, NULL);
+		if( rc != 0 || entries != options.ops + 2 ){ fail("readdir", rc); }
+		run_add(&run, start);
+	}
+	run_end(&run, "readdir", 0);
+}
+
+// Renames the files of a directory of 100 entries back and forth.
+static void bench_rename(){
+	struct bench_run run;
+	char from[64], to[64];
+	long i;
+	newfs_mkdir("/dir", dir_mode);
+	for( i = 0 ; i < 100 ; i++ ){
+		sprintf(from, "/dir/a%ld", i);
+		create_file(from);
+	}
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		long round = i / 100;
+		sprintf(from, "/dir/%c%ld", (round % 2) ? 'b' : 'a', i % 100);
+		sprintf(to, "/dir/%c%ld", (round % 2) ? 'a' : 'b', i % 100);
+		uint64_t start = now();
+		int rc = newfs_rename(from, to);
+		if( rc != 0 ){ fail("rename", rc); }
+		run_add(&run, start);
+	}
+	run_end(&run, "rename", 0);
+}
+
+// Stats, reads, appends and create/unlink pairs (40/30/20/10) over a directory of 100 files.
+static void bench_mixed(char *buf){
+	struct bench_run run;
+	struct stat stbuf;
+	char path[64];
+	long i, created = 0;
+	int rc;
+	newfs_mkdir("/dir", dir_mode);
+	for( i = 0 ; i < 100 ; i++ ){
+		sprintf(path, "/dir/f%ld", i);
+		create_file(path);
+		newfs_write(path, buf, options.size, 0, NULL);
+	}
+	run_begin(&run, options.ops);
+	for( i = 0 ; i < options.ops ; i++ ){
+		long kind = random() % 10;
+		sprintf(path, "/dir/f%ld", random() % 100);
+		uint64_t start = now();
+		if( kind < 4 ){
+			rc = newfs_getattr(path, &stbuf);
+		}else if( kind < 7 ){
+			rc = newfs_read(path, buf, options.size, 0, NULL);
+			rc = (rc < 0) ? rc : 0;
+		}else if( kind < 9 ){
+			newfs_getattr(path, &stbuf);
+			rc = newfs_write(path, buf, options.size, stbuf.st_size, NULL);
+			rc = (rc < 0) ? rc : 0;
+		}else{
+			sprintf(path, "/dir/tmp%ld", created++);
+			create_file(path);
+			rc = newfs_unlink(path);
+		}
+		if( rc != 0 ){ fail("mixed", rc); }
+		run_add(&run, start);
+	}
+	run_end(&run, "mixed", 0);
+}
+
+static void usage(){
+	fprintf(stderr, "usage: bench_fs [-w workload] [-n operations] [-s request size] [-f file MiB] [-d depth] [-r seed]\n"
+	        "workloads: create stat seqwrite seqread randwrite randread readdir rename mixed all\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv){
+	static const char *workloads[] = {"create", "stat", "seqwrite", "seqread", "randwrite", "randread", "readdir", "rename", "mixed"};
+	unsigned int seed = 1;
+	size_t i;
+	int opt, found = 0;
+
+	while( (opt = getopt(argc, argv, "w:n:s:f:d:r:")) != -1 ){
+		switch( opt ){
+		case 'w': options.workload = optarg; break;
+		case 'n': options.ops = atol(optarg); break;
+		case 's': options.size = (size_t) atol(optarg); break;
+		case 'f': options.file = (off_t) atol(optarg) << 20; break;
+		case 'd': options.depth = atoi(optarg); break;
+		case 'r': seed = (unsigned int) atol(optarg); break;
+		default: usage();
+		}
+	}
+	if( options.ops <= 0 || options.size == 0 || options.file < (off_t) options.size || options.depth < 0 ){ usage(); }
+
+	char *buf = malloc(options.size);
+	if( buf == NULL ){ fail("malloc", 0); }
+	memset(buf, 'x', options.size);
+
+	init_log_file();
+	unlink(DATABASE_NAME);
+	init_fs();
+	for( i = 0 ; i < sizeof(workloads) / sizeof(workloads[0]) ; i++ ){
+		if( strcmp(options.workload, "all") != 0 && strcmp(options.workload, workloads[i]) != 0 ){ continue; }
+		found = 1;
+		srandom(seed);
+		fresh_store();
+		switch( i ){
+		case 0: bench_create(); break;
+		case 1: bench_stat(); break;
+		case 2: bench_seqwrite(buf); break;
+		case 3: bench_seqread(buf); break;
+		case 4: bench_randwrite(buf); break;
+		case 5: bench_randread(buf); break;
+		case 6: bench_readdir(); break;
+		case 7: bench_rename(); break;
+		case 8: bench_mixed(buf); break;
+		}
+	}
+	if( !found ){ usage(); }
+
+	shutdown_fs();
+	unlink(DATABASE_NAME);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "newfs.h"
+
+// Throughput of the newfs data path against the request size, calling the FUSE callbacks directly.
+// Usage: bench_io [MiB per size]
+
+static const size_t request_sizes[] = {4096, 16384, 65536, 131072, 262144, 1048576};
+
+static double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, int rc){
+	fprintf(stderr, "bench_io: %s failed (%d)\n", what, rc);
+	exit(EXIT_FAILURE);
+}
+
+//Write a file of total bytes in requests of the given size, then read it back the same way. Returns the elapsed times.
+static void run_size(size_t size, off_t total, double *write_time, double *read_time){
+	struct fuse_file_info fi;
+	char path[32];
+	char *buf = malloc(size);
+	off_t offset;
+	double start;
+	int rc;
+
+	if( buf == NULL ){ fail("malloc", 0); }
+	sprintf(path, "/bench%zu", size);
+	memset(buf, 'x', size);
+
+	start = now();
+	memset(&fi, 0, sizeof(fi));
+	rc = newfs_create(path, S_IFREG | 0644, &fi);
+	if( rc != 0 ){ fail("create", rc); }
+	for( offset = 0 ; offset < total ; offset += size ){
+		rc = newfs_write(path, buf, size, offset, &fi);
+		if( rc != (int) size ){ fail("write", rc); }
+	}
+	newfs_release(path, &fi);
+	*write_time = now() - start;
+
+	start = now();
+	memset(&fi, 0, sizeof(fi));
+	rc = newfs_open(path, &fi);
+	if( rc != 0 ){ fail("open", rc); }
+	for( offset = 0 ; offset < total ; offset += size ){
+		rc = newfs_read(path, buf, size, offset, &fi);
+		if( rc != (int) size || buf[0] != 'x' ){ fail("read", rc); }
+	}
+	newfs_release(path, &fi);
+	*read_time = now() - start;
+
+	newfs_unlink(path);
+	free(buf);
+}
+
+int main(int argc, char** argv){
+	off_t total = (off_t) (argc > 1 ? atoi(argv[1]) : 64) << 20;
+	double write_time, read_time, mib = total / 1048576.0;
+	size_t i;
+
+	init_log_file();
+	unlink(DATABASE_NAME);
+	init_fs();
+
+	printf("%.0f MiB per request size\n", mib);
+	printf("%10s %10s %12s %12s\n", "request", "requests", "write MiB/s", "read MiB/s");
+	for( i = 0 ; i < sizeof(request_sizes) / sizeof(request_sizes[0]) ; i++ ){
+		run_size(request_sizes[i], total, &write_time, &read_time);
+		printf("%10zu %10lld %12.1f %12.1f\n", request_sizes[i], (long long) (total / request_sizes[i]),
+		       mib / write_time, mib / read_time);
+	}
+
+	shutdown_fs();
+	unlink(DATABASE_NAME);
+	return 0;
+}
@@ -0,0 +1,284 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "unqlite.h"
+
+// Store, fetch, append, cursor scan and delete against the key/value engines, one JSON object per
+// operation and configuration with the throughput, the latency percentiles, the bytes written and the
+// syncs issued by the pager.
+// Usage: bench_kv [-e engines] [-k keys] [-v value sizes] [-n records] [-b MiB per run] [-p page size] [-c cache pages]
+// Engines: disk (linear hash file), nojournal (the same without a journal), mem (UNQLITE_OPEN_IN_MEMORY).
+// Keys: random (16 random bytes, like a uuid) or sequential (16-byte big-endian counter).
+
+#define BENCH_DB "bench_kv.db"
+#define BENCH_KEY_SIZE 16
+#define BENCH_APPEND_SIZE 16
+
+struct bench_options {
+	char *engines;
+	char *keys;
+	char *values;
+	long records;       // Records per run, fewer for large values.
+	long run_bytes;     // Bound of the data stored by a run.
+	int page_size;      // 0 for the default.
+	int cache_pages;    // 0 for the default.
+};
+
+// Counters of a phase of a run.
+struct bench_phase {
+	uint64_t *ns;
+	long count;
+	uint64_t start;
+	long long written;  // Bytes passed to write() by the process, from /proc/self/io.
+	unqlite_int64 syncs;
+};
+
+static struct bench_options options = {"disk,nojournal,mem", "random,sequential", "16,4096,65536,1048576", 10000, 256 << 20, 0, 0};
+
+static uint64_t now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void fail(const char *what, int rc){
+	fprintf(stderr, "bench_kv: %s failed (%d)\n", what, rc);
+	exit(EXIT_FAILURE);
+}
+
+//Bytes the process passed to write() so far, 0 where /proc/self/io is missing.
+static long long bytes_written(){
+	char line[128];
+	long long value = 0;
+	FILE *io = fopen("/proc/self/io", "r");
+	if( io == NULL ){ return 0; }
+	while( fgets(line, sizeof(line), io) != NULL ){
+		if( sscanf(line, "wchar: %lld", &value) == 1 ){ break; }
+	}
+	fclose(io);
+	return value;
+}
+
+static unqlite_int64 pager_syncs(unqlite *db){
+	unqlite_int64 syncs = 0;
+	unqlite_config(db, UNQLITE_CONFIG_PAGER_STATS, NULL, NULL, &syncs);
+	return syncs;
+}
+
+//Key of record i.
+static void make_key(unsigned char *key, long i, int random_keys){
+	int b;
+	if( random_keys ){
+		// The same key for the same record in every phase.
+		unsigned long long state = (unsigned long long) i * 0x9E3779B97F4A7C15ULL + 1;
+		for( b = 0 ; b < BENCH_KEY_SIZE ; b++ ){
+			state ^= state >> 33;
+			state *= 0xFF51AFD7ED558CCDULL;
+			key[b] = (unsigned char) (state >> 56);
+		}
+	}else{
+		memset(key, 0, BENCH_KEY_SIZE);
+		for( b = 0 ; b < 8 ; b++ ){
+			key[BENCH_KEY_SIZE - 1 - b] = (unsigned char) (i >> (8 * b));
+		}
+	}
+}
+
+static void phase_begin(struct bench_phase *phase, unqlite *db, long records){
+	phase->ns = malloc((records + 1) * sizeof(uint64_t));
+	if( phase->ns == NULL ){ fail("malloc", 0); }
+	phase->count = 0;
+	phase->written = bytes_written();
+	phase->syncs = pager_syncs(db);
+	phase->start = now();
+}
+
+static void phase_add(struct bench_phase *phase, uint64_t start){
+	phase->ns[phase->count++] = now() - start;
+}
+
+static int compare_ns(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(struct bench_phase *phase, double p){
+	long index = (long) (p / 100 * phase->count);
+	if( index >= phase->count ){ index = phase->count - 1; }
+	return phase->ns[index] / 1e3;
+}
+
+//Print a phase as one JSON object. bytes is the payload moved by the phase.
+static void phase_end(struct bench_phase *phase, unqlite *db, const char *engine, const char *keys, long value_size,
+                      const char *op, long long bytes){
+	double seconds = (now() - phase->start) / 1e9;
+	qsort(phase->ns, phase->count, sizeof(uint64_t), compare_ns);
+	printf("{\"engine\":\"%s\",\"keys\":\"%s\",\"value_size\":%ld,\"page_size\":%d,\"cache_pages\":%d,\"op\":\"%s\","
+	       "\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mib_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+	       "\"max_us\":%.3f,\"bytes_written\":%lld,\"syncs\":%lld}\n",
+	       engine, keys, value_size, options.page_size, options.cache_pages, op, phase->count, seconds,
+	       phase->count / seconds, bytes / 1048576.0 / seconds, percentile(phase, 50), percentile(phase, 99),
+	       phase->ns[phase->count - 1] / 1e3, bytes_written() - phase->written,
+	       (long long) (pager_syncs(db) - phase->syncs));
+	fflush(stdout);
+	free(phase->ns);
+}
+
+static int discard(const void *data, unsigned int len, void *user_data){
+	*(long long *) user_data += len;
+	return UNQLITE_OK;
+}
+
+//One run: every operation over records of value_size bytes. The commit of each phase counts in its time.
+static void run(const char *engine, const char *keys, long value_size){
+	unsigned char key[BENCH_KEY_SIZE];
+	int random_keys = (strcmp(keys, "random") == 0);
+	long records = options.records, i;
+	struct bench_phase phase;
+	unqlite_kv_cursor *cursor;
+	unqlite *db;
+	char *value;
+	int flags = UNQLITE_OPEN_CREATE, rc;
+
+	if( records > options.run_bytes / value_size ){ records = options.run_bytes / value_size; }
+	if( records < 1 ){ records = 1; }
+	value = malloc(value_size + BENCH_APPEND_SIZE);
+	if( value == NULL ){ fail("malloc", 0); }
+	memset(value, 'v', value_size + BENCH_APPEND_SIZE);
+
+	if( strcmp(engine, "nojournal") == 0 ){
+		flags |= UNQLITE_OPEN_OMIT_JOURNALING;
+	}else if( strcmp(engine, "mem") == 0 ){
+		flags |= UNQLITE_OPEN_IN_MEMORY;
+	}else if( strcmp(engine, "disk") != 0 ){
+		fprintf(stderr, "bench_kv: unknown engine '%s'\n", engine);
+		exit(EXIT_FAILURE);
+	}
+	unlink(BENCH_DB);
+	rc = unqlite_open(&db, BENCH_DB, flags);
+	if( rc != UNQLITE_OK ){ fail("open", rc); }
+	if( options.cache_pages > 0 ){
+		rc = unqlite_config(db, UNQLITE_CONFIG_MAX_PAGE_CACHE, options.cache_pages);
+		if( rc != UNQLITE_OK ){ fail("cache size (at least 256 pages)", rc); }
+	}
+
+	phase_begin(&phase, db, records);
+	for( i = 0 ; i < records ; i++ ){
+		make_key(key, i, random_keys);
+		uint64_t start = now();
+		rc = unqlite_kv_store(db, key, BENCH_KEY_SIZE, value, value_size);
+		if( rc != UNQLITE_OK ){ fail("store", rc); }
+		phase_add(&phase, start);
+	}
+	rc = unqlite_commit(db);
+	if( rc != UNQLITE_OK ){ fail("commit", rc); }
+	phase_end(&phase, db, engine, keys, value_size, "store", (long long) records * value_size);
+
+	// Fetch in a different order than the stores.
+	phase_begin(&phase, db, records);
+	for( i = 0 ; i < records ; i++ ){
+		unqlite_int64 len = value_size;
+		make_key(key, (i * 7919) % records, random_keys);
+		uint64_t start = now();
+		rc = unqlite_kv_fetch(db, key, BENCH_KEY_SIZE, value, &len);
+		if( rc != UNQLITE_OK || len != value_size ){ fail("fetch", rc); }
+		phase_add(&phase, start);
+	}
+	phase_end(&phase, db, engine, keys, value_size, "fetch", (long long) records * value_size);
+
+	phase_begin(&phase, db, records);
+	for( i = 0 ; i < records ; i++ ){
+		make_key(key, i, random_keys);
+		uint64_t start = now();
+		rc = unqlite_kv_append(db, key, BENCH_KEY_SIZE, value, BENCH_APPEND_SIZE);
+		if( rc != UNQLITE_OK ){ fail("append", rc); }
+		phase_add(&phase, start);
+	}
+	rc = unqlite_commit(db);
+	if( rc != UNQLITE_OK ){ fail("commit", rc); }
+	phase_end(&phase, db, engine, keys, value_size, "append", (long long) records * BENCH_APPEND_SIZE);
+
+	// One operation per entry: read the key and the data and move on.
+	long long scanned = 0;
+	rc = unqlite_kv_cursor_init(db, &cursor);
+	if( rc != UNQLITE_OK ){ fail("cursor", rc); }
+	phase_begin(&phase, db, records);
+	for( unqlite_kv_cursor_first_entry(cursor) ; unqlite_kv_cursor_valid_entry(cursor) && phase.count < records ; ){
+		uint64_t start = now();
+		unqlite_kv_cursor_key_callback(cursor, discard, &scanned);
+		unqlite_kv_cursor_data_callback(cursor, discard, &scanned);
+		unqlite_kv_cursor_next_entry(cursor);
+		phase_add(&phase, start);
+	}
+	phase_end(&phase, db, engine, keys, value_size, "cursor", scanned);
+	unqlite_kv_cursor_release(db, cursor);
+
+	phase_begin(&phase, db, records);
+	for( i = 0 ; i < records ; i++ ){
+		make_key(key, i, random_keys);
+		uint64_t start = now();
+		rc = unqlite_kv_delete(db, key, BENCH_KEY_SIZE);
+		if( rc != UNQLITE_OK ){ fail("delete", rc); }
+		phase_add(&phase, start);
+	}
+	rc = unqlite_commit(db);
+	if( rc != UNQLITE_OK ){ fail("commit", rc); }
+	phase_end(&phase, db, engine, keys, value_size, "delete", 0);
+
+	unqlite_close(db);
+	unlink(BENCH_DB);
+	free(value);
+}
+
+static void usage(){
+	fprintf(stderr, "usage: bench_kv [-e disk,nojournal,mem] [-k random,sequential] [-v value sizes] [-n records]\n"
+	        "                [-b MiB per run] [-p page size] [-c cache pages]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv){
+	char *engine, *keys, *value, *engines_save, *keys_save, *values_save;
+	int opt, rc;
+
+	while( (opt = getopt(argc, argv, "e:k:v:n:b:p:c:")) != -1 ){
+		switch( opt ){
+		case 'e': options.engines = optarg; break;
+		case 'k': options.keys = optarg; break;
+		case 'v': options.values = optarg; break;
+		case 'n': options.records = atol(optarg); break;
+		case 'b': options.run_bytes = atol(optarg) << 20; break;
+		case 'p': options.page_size = atoi(optarg); break;
+		case 'c': options.cache_pages = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if( options.records <= 0 || options.run_bytes <= 0 ){ usage(); }
+
+	// The page size of new databases is a library setting, made before the library starts.
+	if( options.page_size > 0 ){
+		rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_PAGE_SIZE, options.page_size);
+		if( rc != UNQLITE_OK ){ fail("page size", rc); }
+	}
+
+	char *engines_list = strdup(options.engines);
+	for( engine = strtok_r(engines_list, ",", &engines_save) ; engine != NULL ; engine = strtok_r(NULL, ",", &engines_save) ){
+		char *keys_list = strdup(options.keys);
+		for( keys = strtok_r(keys_list, ",", &keys_save) ; keys != NULL ; keys = strtok_r(NULL, ",", &keys_save) ){
+			if( strcmp(keys, "random") != 0 && strcmp(keys, "sequential") != 0 ){ usage(); }
+			char *values_list = strdup(options.values);
+			for( value = strtok_r(values_list, ",", &values_save) ; value != NULL ; value = strtok_r(NULL, ",", &values_save) ){
+				long value_size = atol(value);
+				if( value_size <= 0 ){ usage(); }
+				run(engine, keys, value_size);
+			}
+			free(values_list);
+		}
+		free(keys_list);
+	}
+	free(engines_list);
+	return 0;
+}
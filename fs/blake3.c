@@ -0,0 +1,161 @@
+#include <string.h>
+#include "blake3.h"
+
+// Portable BLAKE3 following the reference implementation: 1 KiB chunks of 64-byte blocks, chunk
+// chaining values merged into a binary tree through a stack.
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+
+#define CHUNK_START 1
+#define CHUNK_END 2
+#define PARENT 4
+#define ROOT 8
+
+static const uint32_t blake3_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t blake3_permutation[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+
+// Input of the compression that produces a chaining value or the root output.
+struct blake3_output {
+	uint32_t cv[8];
+	uint32_t block[16];
+	uint64_t counter;
+	uint32_t block_len;
+	uint32_t flags;
+};
+
+static uint32_t rotr32(uint32_t w, int c){
+	return (w >> c) | (w << (32 - c));
+}
+
+static uint32_t load32(const uint8_t *p){
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void blake3_g(uint32_t *s, int a, int b, int c, int d, uint32_t mx, uint32_t my){
+	s[a] = s[a] + s[b] + mx;
+	s[d] = rotr32(s[d] ^ s[a], 16);
+	s[c] = s[c] + s[d];
+	s[b] = rotr32(s[b] ^ s[c], 12);
+	s[a] = s[a] + s[b] + my;
+	s[d] = rotr32(s[d] ^ s[a], 8);
+	s[c] = s[c] + s[d];
+	s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+static void blake3_compress(const uint32_t cv[8], const uint32_t block[16], uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16]){
+	uint32_t s[16], m[16], t[16];
+	int round, i;
+
+	memcpy(s, cv, 8 * sizeof(uint32_t));
+	memcpy(&s[8], blake3_iv, 4 * sizeof(uint32_t));
+	s[12] = (uint32_t) counter;
+	s[13] = (uint32_t) (counter >> 32);
+	s[14] = block_len;
+	s[15] = flags;
+	memcpy(m, block, sizeof(m));
+
+	for( round = 0 ; round < 7 ; round++ ){
+		blake3_g(s, 0, 4, 8, 12, m[0], m[1]);
+		blake3_g(s, 1, 5, 9, 13, m[2], m[3]);
+		blake3_g(s, 2, 6, 10, 14, m[4], m[5]);
+		blake3_g(s, 3, 7, 11, 15, m[6], m[7]);
+		blake3_g(s, 0, 5, 10, 15, m[8], m[9]);
+		blake3_g(s, 1, 6, 11, 12, m[10], m[11]);
+		blake3_g(s, 2, 7, 8, 13, m[12], m[13]);
+		blake3_g(s, 3, 4, 9, 14, m[14], m[15]);
+		for( i = 0 ; i < 16 ; i++ ){
+			t[i] = m[blake3_permutation[i]];
+		}
+		memcpy(m, t, sizeof(m));
+	}
+	for( i = 0 ; i < 8 ; i++ ){
+		out[i] = s[i] ^ s[i + 8];
+		out[i + 8] = s[i + 8] ^ cv[i];
+	}
+}
+
+static void blake3_load_block(const uint8_t *data, size_t len, uint32_t block[16]){
+	uint8_t buf[BLAKE3_BLOCK_LEN];
+	int i;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, data, len);
+	for( i = 0 ; i < 16 ; i++ ){
+		block[i] = load32(&buf[4 * i]);
+	}
+}
+
+static void blake3_chaining_value(const struct blake3_output *o, uint32_t cv[8]){
+	uint32_t out[16];
+	blake3_compress(o->cv, o->block, o->counter, o->block_len, o->flags, out);
+	memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+//Compress every block of a chunk but the last one, which is returned for the caller to finish.
+static void blake3_chunk(const uint8_t *data, size_t len, uint64_t counter, struct blake3_output *o){
+	uint32_t cv[8], out[16], block[16];
+	uint32_t flags = CHUNK_START;
+	memcpy(cv, blake3_iv, sizeof(cv));
+	while( len > BLAKE3_BLOCK_LEN ){
+		blake3_load_block(data, BLAKE3_BLOCK_LEN, block);
+		blake3_compress(cv, block, counter, BLAKE3_BLOCK_LEN, flags, out);
+		memcpy(cv, out, sizeof(cv));
+		flags = 0;
+		data += BLAKE3_BLOCK_LEN;
+		len -= BLAKE3_BLOCK_LEN;
+	}
+	memcpy(o->cv, cv, sizeof(cv));
+	blake3_load_block(data, len, o->block);
+	o->counter = counter;
+	o->block_len = (uint32_t) len;
+	o->flags = flags | CHUNK_END;
+}
+
+static void blake3_parent(const uint32_t left[8], const uint32_t right[8], struct blake3_output *o){
+	memcpy(o->cv, blake3_iv, sizeof(o->cv));
+	memcpy(o->block, left, 8 * sizeof(uint32_t));
+	memcpy(&o->block[8], right, 8 * sizeof(uint32_t));
+	o->counter = 0;
+	o->block_len = BLAKE3_BLOCK_LEN;
+	o->flags = PARENT;
+}
+
+//Hash len bytes. The stack holds the roots of the complete subtrees, merged as chunks complete.
+void blake3_hash(const void *input, size_t len, uint8_t out[BLAKE3_OUT_LEN]){
+	const uint8_t *data = input;
+	uint32_t stack[BLAKE3_MAX_DEPTH][8], cv[8], root[16];
+	struct blake3_output o;
+	uint64_t chunks = 0, total;
+	int depth = 0, i;
+
+	// Every chunk but the last one is known not to be the root.
+	while( len > BLAKE3_CHUNK_LEN ){
+		blake3_chunk(data, BLAKE3_CHUNK_LEN, chunks, &o);
+		blake3_chaining_value(&o, cv);
+		for( total = ++chunks ; (total & 1) == 0 ; total >>= 1 ){
+			blake3_parent(stack[--depth], cv, &o);
+			blake3_chaining_value(&o, cv);
+		}
+		memcpy(stack[depth++], cv, sizeof(cv));
+		data += BLAKE3_CHUNK_LEN;
+		len -= BLAKE3_CHUNK_LEN;
+	}
+
+	// Fold the last chunk into the stack, the final output is the root.
+	blake3_chunk(data, len, chunks, &o);
+	while( depth > 0 ){
+		blake3_chaining_value(&o, cv);
+		blake3_parent(stack[--depth], cv, &o);
+	}
+	blake3_compress(o.cv, o.block, 0, o.block_len, o.flags | ROOT, root);
+	for( i = 0 ; i < 8 ; i++ ){
+		out[4 * i] = (uint8_t) root[i];
+		out[4 * i + 1] = (uint8_t) (root[i] >> 8);
+		out[4 * i + 2] = (uint8_t) (root[i] >> 16);
+		out[4 * i + 3] = (uint8_t) (root[i] >> 24);
+	}
+}
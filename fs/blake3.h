@@ -0,0 +1,12 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Portable BLAKE3, default hash mode with a 32-byte output.
+#define BLAKE3_OUT_LEN 32
+
+void blake3_hash(const void *input, size_t len, uint8_t out[BLAKE3_OUT_LEN]);
+
+#endif
@@ -4,6 +4,9 @@
 
 #include <check.h>
 #include "newfs.h"
+#include <linux/falloc.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 
 void setup() {
@@ -229,6 +232,30 @@ START_TEST(check_initialize_element_file)
     }
 END_TEST
 
+START_TEST(check_initialize_element_keys)
+    {
+        struct fcb first;
+        struct fcb second;
+        initialize_element(&first, false);
+        initialize_element(&second, true);
+
+        // Inodes are allocated in increasing order and shared by the records of an element.
+        uint64_t inode = key_inode(first.uuid);
+        ck_assert_msg(key_inode(second.uuid) > inode, "Inodes not allocated in order.");
+        ck_assert(key_inode(first.data) == inode);
+        ck_assert(key_inode(first.name) == inode);
+        ck_assert(key_inode(first.path) == inode);
+
+        uuid_t key;
+        make_key(key, inode, KEY_KIND_DATA, 0);
+        ck_assert_msg(memcmp(key, first.data, KEY_SIZE) == 0, "Data key not composed from the inode.");
+
+        struct fcb root;
+        resolve_path(&root, "/");
+        ck_assert_msg(root.size == 0, "Root not empty after test.");
+    }
+END_TEST
+
 START_TEST(check_set_get_name)
     {
         char *test_name = "TestName";
@@ -475,6 +502,31 @@ START_TEST(check_dat_insert_chunk)
     }
 END_TEST
 
+START_TEST(check_dat_shift_windows)
+    {
+        // Data spanning several buffers is shifted one buffer at a time.
+        static char data[3 * DATA_BUFFER_SIZE + 100], res_dat[3 * DATA_BUFFER_SIZE + 107];
+        struct fcb test_fcb;
+        off_t i;
+        initialize_element(&test_fcb, false);
+        for (i = 0; i < sizeof(data); i++) {
+            data[i] = (char) ('a' + i % 23);
+        }
+        set_data(&test_fcb, data, sizeof(data));
+
+        ck_assert(dat_insert_chunk(&test_fcb, 5, "1234567", 7) == 0);
+        ck_assert(test_fcb.size == sizeof(data) + 7);
+        get_data(&test_fcb, res_dat);
+        ck_assert_msg(memcmp(res_dat, data, 5) == 0 && memcmp(&res_dat[5], "1234567", 7) == 0 &&
+                      memcmp(&res_dat[12], &data[5], sizeof(data) - 5) == 0, "Shifted data damaged by the insert.");
+
+        ck_assert(dat_del_chunk(&test_fcb, 5, 7) == 0);
+        ck_assert(test_fcb.size == sizeof(data));
+        get_data(&test_fcb, res_dat);
+        ck_assert_msg(memcmp(res_dat, data, sizeof(data)) == 0, "Shifted data damaged by the delete.");
+    }
+END_TEST
+
 START_TEST(check_tokenize_path)
     {
         char **tokens;
@@ -692,7 +744,7 @@ START_TEST(check_remove_UUID_fr_dir)
         newfs_mkdir("/hello", mode);
         resolve_path(&root, "/");
         resolve_path(&tmp_fcb, "/hello");
-        ck_assert(root.size == KEY_SIZE);
+        ck_assert(root.size == dir_entry_size("hello"));
 
         int rc = remove_UUID_from_dir(&root, &tmp_fcb.uuid);
         get_record_size(&root_object.id, &tmp_fcb, sizeof(struct fcb));
@@ -709,7 +761,7 @@ START_TEST(check_remove_UUID_fr_dir)
         newfs_mkdir("/hello1", mode);
         newfs_mkdir("/hello2", mode);
         resolve_path(&root, "/");
-        ck_assert(root.size == 2 * KEY_SIZE);
+        ck_assert(root.size == dir_entry_size("hello1") + dir_entry_size("hello2"));
 
         resolve_path(&tmp_fcb, "/hello1");
         resolve_path(&tmp_fcb2, "/hello2");
@@ -744,7 +796,7 @@ START_TEST(check_rm_element_fr_dir)
         newfs_mkdir("/hello", mode);
         resolve_path(&root, "/");
         resolve_path(&tmp_fcb, "/hello");
-        ck_assert(root.size == KEY_SIZE);
+        ck_assert(root.size == dir_entry_size("hello"));
 
         int rc = rm_element_from_directory(&tmp_fcb, "/hello", true);
         ck_assert_msg(rc == 0, "Error message returned, deleting one directory");
@@ -758,7 +810,7 @@ START_TEST(check_rm_element_fr_dir)
         // Valid; one file present.
         newfs_create("/hello.txt", mode, NULL);
         resolve_path(&root, "/");
-        ck_assert(root.size == KEY_SIZE);
+        ck_assert(root.size == dir_entry_size("hello.txt"));
         resolve_path(&tmp_fcb, "/hello.txt");
         rc = rm_element_from_directory(&tmp_fcb, "/hello.txt", false);
         ck_assert_msg(rc == 0, "Error message returned, deleting one directory");
@@ -774,7 +826,7 @@ START_TEST(check_rm_element_fr_dir)
         rc = resolve_path(&tmp_fcb, "/test");
         ck_assert_msg(rc == 0, "Dir was not found after file deletion on dir.");
         rc = resolve_path(&root, "/");
-        ck_assert_msg(root.size == KEY_SIZE, "Root size incorrect after file del on dir.");
+        ck_assert_msg(root.size == dir_entry_size("test"), "Root size incorrect after file del on dir.");
         newfs_rmdir("/test");
 
         // Invalid; remove directory on file.
@@ -785,7 +837,7 @@ START_TEST(check_rm_element_fr_dir)
         rc = resolve_path(&tmp_fcb, "/test.txt");
         ck_assert_msg(rc == 0, "File was not found after dir deletion on file.");
         rc = resolve_path(&root, "/");
-        ck_assert_msg(root.size == KEY_SIZE, "Root size incorrect after file del on dir.");
+        ck_assert_msg(root.size == dir_entry_size("test.txt"), "Root size incorrect after file del on dir.");
         newfs_unlink("/test.txt");
 
         resolve_path(&root, "/");
@@ -988,7 +1040,7 @@ START_TEST(check_mkdir)
         int rc = newfs_mkdir(first_path, mode);
         resolve_path(&root, "/"); // Get updated root object.
         ck_assert_msg(rc == 0, "Wrong error code returned after first folder creation.");
-        ck_assert_msg(data_len + KEY_SIZE == root.size,
+        ck_assert_msg(data_len + dir_entry_size("mkdirtest1") == root.size,
                         "Size of root has not changed after adding folder.");
         rc = resolve_path(&tmp_dir, first_path);
         ck_assert_msg(rc == 0, "First folder could not be found.");
@@ -1004,7 +1056,7 @@ START_TEST(check_mkdir)
         rc = newfs_mkdir(second_path, mode);
         resolve_path(&root, "/"); // Get updated root object.
         ck_assert_msg(rc == 0, "Wrong error code returned after second folder creation.");
-        ck_assert_msg(data_len + KEY_SIZE == root.size,
+        ck_assert_msg(data_len + dir_entry_size("mkdirtest2") == root.size,
                       "Size of root has not changed after adding second folder.");
         rc = resolve_path(&tmp_dir, second_path);
         ck_assert_msg(rc == 0, "Second folder could not be found.");
@@ -1014,7 +1066,7 @@ START_TEST(check_mkdir)
         rc = newfs_mkdir("/mkdirtest2/mkdirtest1", mode);
         resolve_path(&tmp_dir, "/mkdirtest2"); // Get updated mkdirtest2 object.
         ck_assert_msg(rc == 0, "Wrong error code returned after first nested creation.");
-        ck_assert_msg(data_len + KEY_SIZE == tmp_dir.size,
+        ck_assert_msg(data_len + dir_entry_size("mkdirtest1") == tmp_dir.size,
                       "Size of root has not changed after first nested folder.");
         rc = resolve_path(&tmp_dir, "/mkdirtest2/mkdirtest1");
         ck_assert_msg(rc == 0, "First nested folder could not be found.");
@@ -1025,7 +1077,7 @@ START_TEST(check_mkdir)
         rc = newfs_mkdir("/mkdirtest2/mkdirtest2", mode);
         resolve_path(&tmp_dir, "/mkdirtest2"); // Get updated mkdirtest2 object.
         ck_assert_msg(rc == 0, "Wrong error code returned after second nested creation.");
-        ck_assert_msg(data_len + KEY_SIZE == tmp_dir.size,
+        ck_assert_msg(data_len + dir_entry_size("mkdirtest2") == tmp_dir.size,
                       "Size of root has not changed after second nested folder.");
         rc = resolve_path(&tmp_dir, "/mkdirtest2/mkdirtest2");
         ck_assert_msg(rc == 0, "Second nested folder could not be found.");
@@ -1067,7 +1119,7 @@ START_TEST(check_rmdir)
         // Valid; one folder add and delete.
         int rc = newfs_mkdir("/test", mode);
         resolve_path(&root, "/");
-        ck_assert_msg(root.size == KEY_SIZE, "Size did not change after adding a folder.");
+        ck_assert_msg(root.size == dir_entry_size("test"), "Size did not change after adding a folder.");
 
         rc = newfs_rmdir("/test");
         resolve_path(&root, "/");
@@ -1093,11 +1145,11 @@ START_TEST(check_rmdir)
         rc = resolve_path(&tmp_fcb, "/test1/test2"); ck_assert_msg(rc == 0, "7 not found.");
 
         resolve_path(&root, "/");
-        ck_assert_msg(root.size == KEY_SIZE * 3, "Size did not change correctly after adding 3 folders.");
+        ck_assert_msg(root.size == dir_entry_size("test") + dir_entry_size("test1") + dir_entry_size("test2"), "Size did not change correctly after adding 3 folders.");
         resolve_path(&tmp_fcb, "/test1");
-        ck_assert_msg(tmp_fcb.size == 2 * KEY_SIZE, "Size did not change after adding nested folder 1.");
+        ck_assert_msg(tmp_fcb.size == dir_entry_size("test1") + dir_entry_size("test2"), "Size did not change after adding nested folder 1.");
         resolve_path(&tmp_fcb, "/test2");
-        ck_assert_msg(tmp_fcb.size == 2 * KEY_SIZE, "Size did not change after adding nested folder 2.");
+        ck_assert_msg(tmp_fcb.size == dir_entry_size("test1") + dir_entry_size("test2"), "Size did not change after adding nested folder 2.");
 
         // Invalid; remove not empty folder.
         rc = newfs_rmdir("/test1");
@@ -1109,14 +1161,14 @@ START_TEST(check_rmdir)
         rc = newfs_rmdir("/test1/test1");
         ck_assert_msg(rc == 0, "Removing nested folder returned error. (first)");
         resolve_path(&tmp_fcb, "/test1");
-        ck_assert_msg(tmp_fcb.size == orig_size - KEY_SIZE,
+        ck_assert_msg(tmp_fcb.size == orig_size - dir_entry_size("test1"),
                       "Size of parent folder not updated correctly. (first)");
 
         orig_size = tmp_fcb.size;
         rc = newfs_rmdir("/test1/test2");
         ck_assert_msg(rc == 0, "Removing nested folder returned error. (second)");
         resolve_path(&tmp_fcb, "/test1");
-        ck_assert_msg(tmp_fcb.size == orig_size - KEY_SIZE,
+        ck_assert_msg(tmp_fcb.size == orig_size - dir_entry_size("test2"),
                       "Size of parent folder not updated correctly. (second)");
 
         // Invalid; Remove mount point.
@@ -1134,6 +1186,1515 @@ START_TEST(check_rmdir)
     }
 END_TEST
 
+START_TEST(check_sparse_fallocate)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        newfs_create("/sparse", mode, NULL);
+        char buf[8];
+        struct stat st;
+
+        // A large extension is a hole, it reads as zeroes.
+        off_t big = (off_t) 10 << 30;
+        int rc = newfs_truncate("/sparse", big);
+        ck_assert_msg(rc == 0, "Extending truncate failed.");
+        newfs_getattr("/sparse", &st);
+        ck_assert_msg(st.st_size == big, "Size not set by truncate.");
+        memset(buf, 1, sizeof(buf));
+        rc = newfs_read("/sparse", buf, 4, big / 2, NULL);
+        ck_assert_msg(rc == 4 && memcmp(buf, "\0\0\0\0", 4) == 0, "Hole does not read as zeroes.");
+
+        // Writing past the end leaves a hole before the data.
+        rc = newfs_write("/sparse", "abc", 3, big + 10, NULL);
+        ck_assert_msg(rc == 3, "Write past the end failed.");
+        rc = newfs_read("/sparse", buf, 8, big + 5, NULL);
+        ck_assert_msg(rc == 8 && memcmp(buf, "\0\0\0\0\0abc", 8) == 0, "Write past the end not read back.");
+
+        // Punching a hole keeps the size.
+        rc = newfs_fallocate("/sparse", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, big + 11, 1, NULL);
+        ck_assert_msg(rc == 0, "Punching a hole failed.");
+        rc = newfs_read("/sparse", buf, 3, big + 10, NULL);
+        ck_assert_msg(rc == 3 && memcmp(buf, "a\0c", 3) == 0, "Punched hole not read as zeroes.");
+        newfs_getattr("/sparse", &st);
+        ck_assert_msg(st.st_size == big + 13, "Punching a hole changed the size.");
+
+        // Allocation grows the size unless asked to keep it, other modes are refused.
+        rc = newfs_fallocate("/sparse", 0, big + 13, 100, NULL);
+        newfs_getattr("/sparse", &st);
+        ck_assert_msg(rc == 0 && st.st_size == big + 113, "Allocation did not grow the file.");
+        rc = newfs_fallocate("/sparse", FALLOC_FL_PUNCH_HOLE, 0, 1, NULL);
+        ck_assert_msg(rc == -EOPNOTSUPP, "Punching a hole without keeping the size was accepted.");
+
+        // Clean-up.
+        newfs_unlink("/sparse");
+        struct fcb root;
+        resolve_path(&root, "/");
+        ck_assert_msg(root.size == 0, "Root not empty after test.");
+    }
+END_TEST
+
+START_TEST(check_write_hole)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        off_t size = (off_t) 64 << 20, middle = (off_t) 32 << 20;
+        char buf[8];
+        struct stat st;
+        newfs_create("/hole", mode, NULL);
+        ck_assert(newfs_truncate("/hole", size) == 0);
+
+        // Writes into the hole overwrite it, the size does not change.
+        ck_assert(newfs_write("/hole", "abcd", 4, 0, NULL) == 4);
+        ck_assert(newfs_write("/hole", "efgh", 4, middle + DATA_CHUNK_SIZE - 2, NULL) == 4);
+        ck_assert(newfs_write("/hole", "xy", 2, 1, NULL) == 2);
+        newfs_getattr("/hole", &st);
+        ck_assert_msg(st.st_size == size, "Size %lld after writing into the hole.", (long long) st.st_size);
+        ck_assert(newfs_read("/hole", buf, 6, 0, NULL) == 6 && memcmp(buf, "axyd\0\0", 6) == 0);
+        ck_assert(newfs_read("/hole", buf, 8, middle + DATA_CHUNK_SIZE - 4, NULL) == 8);
+        ck_assert(memcmp(buf, "\0\0efgh\0\0", 8) == 0);
+        ck_assert(newfs_read("/hole", buf, 4, size - 4, NULL) == 4 && memcmp(buf, "\0\0\0\0", 4) == 0);
+
+        // Even in a very large file, where a write only touches the chunks it covers.
+        size = (off_t) 1 << 40;
+        ck_assert(newfs_truncate("/hole", size) == 0);
+        ck_assert(newfs_write("/hole", "1234", 4, 0, NULL) == 4);
+        newfs_getattr("/hole", &st);
+        ck_assert(st.st_size == size);
+        ck_assert(newfs_read("/hole", buf, 4, 0, NULL) == 4 && memcmp(buf, "1234", 4) == 0);
+
+        // Clean-up.
+        newfs_unlink("/hole");
+        struct fcb root;
+        resolve_path(&root, "/");
+        ck_assert_msg(root.size == 0, "Root not empty after test.");
+    }
+END_TEST
+
+// Reference count of a deduplicated chunk, 0 once it is deleted.
+static uint64_t chunk_refs(const char *data, uint32_t len) {
+    struct chunk_ref ref;
+    unsigned char key[CAS_KEY_SIZE];
+    uint64_t refs = 0;
+    unqlite_int64 nBytes = sizeof(refs);
+    blake3_hash(data, len, ref.hash);
+    cas_key(key, &ref, CAS_KIND_REFS);
+    store_fetch(key, CAS_KEY_SIZE, &refs, &nBytes);
+    return refs;
+}
+
+START_TEST(check_dedup)
+    {
+        // Start over with a deduplicating store.
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_features = FEATURE_DEDUP;
+        init_fs();
+
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        size_t len = 2 * DATA_CHUNK_SIZE;
+        char *data = malloc(len);
+        char *back = malloc(len);
+        size_t i;
+        for (i = 0; i < len; i++) {
+            data[i] = (char) (i * 7 + i / 251);
+        }
+
+        // Identical files share their chunks.
+        newfs_create("/a", mode, NULL);
+        newfs_create("/b", mode, NULL);
+        ck_assert(newfs_write("/a", data, len, 0, NULL) == (int) len);
+        ck_assert(newfs_write("/b", data, len, 0, NULL) == (int) len);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 2, "First chunk not shared.");
+        ck_assert_msg(chunk_refs(&data[DATA_CHUNK_SIZE], DATA_CHUNK_SIZE) == 2, "Second chunk not shared.");
+        ck_assert(newfs_read("/b", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Shared data not read back.");
+
+        // Changing one file leaves the other alone.
+        newfs_truncate("/a", 1000);
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 1);
+        ck_assert(chunk_refs(&data[DATA_CHUNK_SIZE], DATA_CHUNK_SIZE) == 1);
+        ck_assert_msg(chunk_refs(data, 1000) == 1, "Cut chunk not stored by content.");
+        ck_assert(newfs_read("/b", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Other file changed.");
+
+        // The last reference deletes the chunk.
+        newfs_unlink("/a");
+        newfs_unlink("/b");
+        ck_assert(chunk_refs(data, 1000) == 0);
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 0);
+        ck_assert(chunk_refs(&data[DATA_CHUNK_SIZE], DATA_CHUNK_SIZE) == 0);
+
+        free(data);
+        free(back);
+        store_features = 0;
+    }
+END_TEST
+
+START_TEST(check_clone)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        size_t len = DATA_CHUNK_SIZE + 5000;
+        char *data = malloc(len);
+        char *back = malloc(len);
+        size_t i;
+        for (i = 0; i < len; i++) {
+            data[i] = (char) (i * 13 + i / 241);
+        }
+
+        // Without dedup the chunks of the source are moved to shared chunks on the first clone.
+        newfs_create("/a", mode, NULL);
+        newfs_create("/b", mode, NULL);
+        newfs_mkdir("/d", mode);
+        ck_assert(newfs_write("/a", data, len, 0, NULL) == (int) len);
+        ck_assert(newfs_write("/b", "old", 3, 0, NULL) == 3);
+        ck_assert(newfs_clone("/a", "/d") == -EISDIR);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 0, "Chunk shared before a clone.");
+        ck_assert(newfs_clone("/a", "/b") == 0);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 2, "First chunk not shared.");
+        ck_assert_msg(chunk_refs(&data[DATA_CHUNK_SIZE], 5000) == 2, "Last chunk not shared.");
+        ck_assert(newfs_read("/a", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Shared source not read back.");
+        ck_assert(newfs_read("/b", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Clone not read back.");
+        ck_assert(newfs_write("/a", "new", 3, 0, NULL) == 3);
+        newfs_release("/a", NULL);
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 1);
+        ck_assert(newfs_read("/b", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Clone changed with the source.");
+        newfs_unlink("/a");
+        newfs_unlink("/b");
+        ck_assert_msg(chunk_refs(&data[DATA_CHUNK_SIZE], 5000) == 0, "Shared chunk not released.");
+
+        // Start over with a deduplicating store.
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_features = FEATURE_DEDUP;
+        init_fs();
+
+        newfs_create("/a", mode, NULL);
+        newfs_create("/b", mode, NULL);
+        ck_assert(newfs_write("/a", data, len, 0, NULL) == (int) len);
+        ck_assert(newfs_write("/b", "old", 3, 0, NULL) == 3);
+        ck_assert(newfs_clone("/a", "/a") == -EINVAL);
+
+        // The clone only adds references.
+        ck_assert(newfs_clone("/a", "/b") == 0);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 2, "First chunk not shared.");
+        ck_assert_msg(chunk_refs(&data[DATA_CHUNK_SIZE], 5000) == 2, "Last chunk not shared.");
+        ck_assert_msg(chunk_refs("old", 3) == 0, "Old data not released.");
+        struct stat stbuf;
+        newfs_getattr("/b", &stbuf);
+        ck_assert(stbuf.st_size == (off_t) len);
+        ck_assert(newfs_read("/b", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Clone not read back.");
+
+        // Writing to the clone copies the chunk it changes.
+        newfs_truncate("/b", 10);
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 1);
+        ck_assert(chunk_refs(&data[DATA_CHUNK_SIZE], 5000) == 1);
+        ck_assert(newfs_read("/a", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Source changed.");
+
+        newfs_unlink("/a");
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 0);
+        free(data);
+        free(back);
+        store_features = 0;
+    }
+END_TEST
+
+START_TEST(check_snapshots)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        // Without deduplication the files are moved to shared chunks by the first snapshot.
+        newfs_create("/p", mode, NULL);
+        ck_assert(newfs_write("/p", "plain", 5, 0, NULL) == 5);
+        ck_assert(newfs_mkdir("/.snapshots/s0", 0) == 0);
+        ck_assert(newfs_write("/p", "PL", 2, 0, NULL) == 2);
+        char plain[5];
+        ck_assert(newfs_read("/.snapshots/s0/p", plain, 5, 0, NULL) == 5);
+        ck_assert_msg(memcmp(plain, "plain", 5) == 0, "Snapshot without deduplication changed.");
+        ck_assert(newfs_read("/p", plain, 5, 0, NULL) == 5);
+        ck_assert(memcmp(plain, "PLain", 5) == 0);
+        ck_assert(newfs_rmdir("/.snapshots/s0") == 0);
+
+        // Start over with a deduplicating store.
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_features = FEATURE_DEDUP;
+        init_fs();
+
+        size_t len = DATA_CHUNK_SIZE + 100;
+        char *data = malloc(len);
+        char *back = malloc(len);
+        size_t i;
+        for (i = 0; i < len; i++) {
+            data[i] = (char) (i * 7 + i / 251);
+        }
+        newfs_mkdir("/d", 0);
+        newfs_create("/d/f", mode, NULL);
+        newfs_create("/g", mode, NULL);
+        ck_assert(newfs_write("/d/f", data, len, 0, NULL) == (int) len);
+        ck_assert(newfs_write("/g", "hello", 5, 0, NULL) == 5);
+
+        // The snapshot shares the chunks of the files.
+        ck_assert(newfs_mkdir("/.snapshots/s1", 0) == 0);
+        ck_assert(newfs_mkdir("/.snapshots/s1", 0) == -EEXIST);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 2, "Chunk not shared.");
+
+        // Changes to the tree do not reach it.
+        ck_assert(newfs_write("/g", "HELLO", 5, 0, NULL) == 5);
+        newfs_unlink("/d/f");
+        newfs_create("/d/new", mode, NULL);
+        shutdown_fs();
+        init_fs();
+
+        struct stat stbuf;
+        ck_assert(newfs_getattr("/.snapshots/s1", &stbuf) == 0 && S_ISDIR(stbuf.st_mode));
+        ck_assert(newfs_getattr("/.snapshots/s1/d/new", &stbuf) == -ENOENT);
+        ck_assert(newfs_read("/.snapshots/s1/g", back, 5, 0, NULL) == 5);
+        ck_assert_msg(memcmp(back, "hello", 5) == 0, "Snapshot changed.");
+        ck_assert(newfs_read("/.snapshots/s1/d/f", back, len, 0, NULL) == (int) len);
+        ck_assert_msg(memcmp(data, back, len) == 0, "Deleted file not kept.");
+        ck_assert(chunk_refs(data, DATA_CHUNK_SIZE) == 1);
+
+        // It is read-only.
+        ck_assert(newfs_write("/.snapshots/s1/g", "x", 1, 0, NULL) == -EROFS);
+        ck_assert(newfs_create("/.snapshots/s1/h", mode, NULL) == -EROFS);
+        ck_assert(newfs_unlink("/.snapshots/s1/g") == -EROFS);
+        ck_assert(newfs_rename("/.snapshots/s1/g", "/h") == -EROFS);
+
+        // Removing it releases the chunks.
+        ck_assert(newfs_rmdir("/.snapshots/s1") == 0);
+        ck_assert(newfs_getattr("/.snapshots/s1", &stbuf) == -ENOENT);
+        ck_assert_msg(chunk_refs(data, DATA_CHUNK_SIZE) == 0, "Chunk not released.");
+        free(data);
+        free(back);
+        store_features = 0;
+    }
+END_TEST
+
+// A snapshot of a tree larger than a directory batch and a few levels deep is complete.
+START_TEST(check_snapshot_large)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        char path[64], text[64], back[64];
+        int dirs = 40, files = 60, d, f;
+        for (d = 0; d < dirs; d++) {
+            sprintf(path, "/d%d", d);
+            newfs_mkdir(path, 0);
+            sprintf(path, "/d%d/sub", d);
+            newfs_mkdir(path, 0);
+            for (f = 0; f < files; f++) {
+                sprintf(path, "/d%d/%s%d", d, f % 2 ? "sub/" : "", f);
+                sprintf(text, "file %d of %d", f, d);
+                newfs_create(path, mode, NULL);
+                ck_assert(newfs_write(path, text, strlen(text), 0, NULL) == (int) strlen(text));
+            }
+        }
+        ck_assert(newfs_mkdir("/.snapshots/big", 0) == 0);
+
+        // Change every file of the tree, then read the snapshot back after a restart.
+        for (d = 0; d < dirs; d++) {
+            for (f = 0; f < files; f++) {
+                sprintf(path, "/d%d/%s%d", d, f % 2 ? "sub/" : "", f);
+                ck_assert(newfs_write(path, "FILE", 4, 0, NULL) == 4);
+            }
+        }
+        shutdown_fs();
+        init_fs();
+        for (d = 0; d < dirs; d++) {
+            for (f = 0; f < files; f++) {
+                sprintf(path, "/.snapshots/big/d%d/%s%d", d, f % 2 ? "sub/" : "", f);
+                sprintf(text, "file %d of %d", f, d);
+                memset(back, 0, sizeof(back));
+                ck_assert_msg(newfs_read(path, back, sizeof(back), 0, NULL) == (int) strlen(text), "Missing %s.", path);
+                ck_assert_msg(strcmp(back, text) == 0, "Changed %s.", path);
+            }
+        }
+        ck_assert(newfs_rmdir("/.snapshots/big") == 0);
+        sprintf(path, "/d%d/sub/%d", dirs - 1, files - 1);
+        ck_assert(newfs_read(path, back, 4, 0, NULL) == 4 && memcmp(back, "FILE", 4) == 0);
+    }
+END_TEST
+
+START_TEST(check_store_options)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        const char *engine;
+        char back[16];
+        newfs_create("/file", mode, NULL);
+        ck_assert(newfs_write("/file", "stored", 6, 0, NULL) == 6);
+
+        // The store mapped read-only shows the same files.
+        shutdown_fs();
+        store_open_flags = UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP;
+        atime_mode = ATIME_NOATIME;
+        init_fs();
+        ck_assert(newfs_read("/file", back, sizeof(back), 0, NULL) == 6);
+        ck_assert_msg(memcmp(back, "stored", 6) == 0, "Mapped store not read back.");
+        shutdown_fs();
+        atime_mode = ATIME_DEFAULT_MODE;
+
+        // An in-memory store leaves the file alone.
+        store_open_flags = STORE_OPEN_FLAGS | UNQLITE_OPEN_IN_MEMORY;
+        store_engine = "mem";
+        init_fs();
+        unqlite_config(pDb, UNQLITE_CONFIG_GET_KV_NAME, &engine);
+        ck_assert_str_eq(engine, "mem");
+        ck_assert(newfs_read("/file", back, sizeof(back), 0, NULL) == -ENOENT);
+        newfs_create("/memory", mode, NULL);
+        ck_assert(newfs_write("/memory", "kept", 4, 0, NULL) == 4);
+        ck_assert(newfs_read("/memory", back, sizeof(back), 0, NULL) == 4);
+        shutdown_fs();
+
+        // The disk store has the engine it was created with.
+        store_open_flags = STORE_OPEN_FLAGS;
+        store_engine = STORE_ENGINE;
+        init_fs();
+        unqlite_config(pDb, UNQLITE_CONFIG_GET_KV_NAME, &engine);
+        ck_assert_str_eq(engine, "hash");
+        ck_assert(newfs_read("/file", back, sizeof(back), 0, NULL) == 6);
+        ck_assert(newfs_getattr("/memory", &(struct stat){0}) == -ENOENT);
+    }
+END_TEST
+
+// Name of a shard file, or of its journal.
+static const char *shard_file(int shard, const char *suffix) {
+    static char name[256];
+    snprintf(name, sizeof(name), "%s.%d%s", DATABASE_NAME, shard, suffix);
+    return name;
+}
+
+// Creates files in a child that stops after preparing every shard, as if it crashed there.
+static void crash_after_prepare(const char *prefix, int decided) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char path[32];
+        int i;
+        init_fs();
+        for (i = 0; i < 8; i++) {
+            snprintf(path, sizeof(path), "/%s%d", prefix, i);
+            newfs_create(path, S_IRUSR | S_IWUSR, NULL);
+        }
+        for (i = 0; i < store_shards; i++) {
+            unqlite_config(store_shard[i], UNQLITE_CONFIG_PREPARE_COMMIT);
+        }
+        if (decided) {
+            close(open(DATABASE_NAME STORE_COMMIT_SUFFIX, O_CREAT | O_WRONLY, 0644));
+        }
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+START_TEST(check_shards)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        struct stat stbuf;
+        char path[32], back[8];
+        int i, used = 0;
+
+        // Start over with a sharded store.
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_shards = 4;
+        init_fs();
+        ck_assert_int_eq(store_shards, 4);
+
+        newfs_mkdir("/d1", mode);
+        for (i = 0; i < 16; i++) {
+            snprintf(path, sizeof(path), "/d1/f%d", i);
+            newfs_create(path, mode, NULL);
+            ck_assert(newfs_write(path, "sharded", 7, 0, NULL) == 7);
+        }
+        ck_assert(newfs_rename("/d1/f0", "/d1/g0") == 0);
+        sync_store();
+        ck_assert_msg(access(DATABASE_NAME STORE_COMMIT_SUFFIX, F_OK) != 0, "Commit record left behind.");
+        for (i = 1; i < 4; i++) {
+            if (stat(shard_file(i, ""), &stbuf) == 0 && stbuf.st_size > 0) {
+                used++;
+            }
+        }
+        ck_assert_msg(used > 1, "Records not spread over the shards.");
+
+        // The shard count is kept by the store.
+        shutdown_fs();
+        store_shards = 1;
+        init_fs();
+        ck_assert_int_eq(store_shards, 4);
+        ck_assert(newfs_read("/d1/g0", back, sizeof(back), 0, NULL) == 7);
+        ck_assert(newfs_read("/d1/f15", back, sizeof(back), 0, NULL) == 7);
+        ck_assert(newfs_getattr("/d1/f0", &stbuf) == -ENOENT);
+
+        // A crash after the commit record keeps the prepared changes, before it loses all of them.
+        shutdown_fs();
+        crash_after_prepare("kept", 1);
+        crash_after_prepare("lost", 0);
+        init_fs();
+        for (i = 0; i < 8; i++) {
+            snprintf(path, sizeof(path), "/kept%d", i);
+            ck_assert_msg(newfs_getattr(path, &stbuf) == 0, "Committed file %s lost.", path);
+            snprintf(path, sizeof(path), "/lost%d", i);
+            ck_assert_msg(newfs_getattr(path, &stbuf) == -ENOENT, "Uncommitted file %s kept.", path);
+        }
+        ck_assert(access(DATABASE_NAME STORE_COMMIT_SUFFIX, F_OK) != 0);
+
+        shutdown_fs();
+        for (i = 1; i < 4; i++) {
+            unlink(shard_file(i, ""));
+            unlink(shard_file(i, UNQLITE_JOURNAL_FILE_SUFFIX));
+        }
+        unlink(DATABASE_NAME);
+        store_shards = 1;
+        init_fs();
+    }
+END_TEST
+
+// Shard of the FCB of an element.
+static int path_shard(const char *path) {
+    struct fcb element;
+    resolve_path(&element, (char *) path);
+    return store_shard_of(element.uuid, KEY_SIZE);
+}
+
+START_TEST(check_fsync_shard)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        struct stat stbuf;
+        char path[32], file[32], back[16];
+        int i, file_shard = -1;
+
+        // A file on a shard of its own: not the first one, which keeps the inode allocator, nor the one of
+        // the root or of /d.
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_shards = 4;
+        init_fs();
+        newfs_mkdir("/d", mode);
+        for (i = 0; i < 16 && file_shard < 0; i++) {
+            snprintf(file, sizeof(file), "/a%d", i);
+            newfs_create(file, mode, NULL);
+            int shard = path_shard(file);
+            if (shard != 0 && shard != path_shard("/") && shard != path_shard("/d")) {
+                file_shard = shard;
+            }
+        }
+        ck_assert(file_shard > 0);
+        shutdown_fs();
+
+        // The fsync of the file commits its shard only, the files created meanwhile are lost by a crash.
+        pid_t pid = fork();
+        if (pid == 0) {
+            init_fs();
+            for (i = 0; i < 4; i++) {
+                uuid_t key;
+                store_change_begin();
+                do {
+                    make_key(key, alloc_inode() + 1, KEY_KIND_FCB, 0);
+                } while (store_shard_of(key, KEY_SIZE) == file_shard);
+                snprintf(path, sizeof(path), "/d/b%d", i);
+                newfs_create(path, mode, NULL);
+            }
+            newfs_write(file, "durable", 7, 0, NULL);
+            newfs_fsync(file, 0, NULL);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+        init_fs();
+        ck_assert(newfs_read(file, back, sizeof(back), 0, NULL) == 7);
+        ck_assert(memcmp(back, "durable", 7) == 0);
+        for (i = 0; i < 4; i++) {
+            snprintf(path, sizeof(path), "/d/b%d", i);
+            ck_assert_msg(newfs_getattr(path, &stbuf) == -ENOENT, "fsync committed %s on another shard.", path);
+        }
+        shutdown_fs();
+
+        // A new file is committed with the entry of its directory, whatever shard that is on.
+        pid = fork();
+        if (pid == 0) {
+            init_fs();
+            newfs_create("/d/c", mode, NULL);
+            newfs_write("/d/c", "linked", 6, 0, NULL);
+            newfs_fsync("/d/c", 0, NULL);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+        init_fs();
+        ck_assert_msg(newfs_read("/d/c", back, sizeof(back), 0, NULL) == 6, "New file lost after fsync.");
+        ck_assert(memcmp(back, "linked", 6) == 0);
+
+        shutdown_fs();
+        for (i = 1; i < 4; i++) {
+            unlink(shard_file(i, ""));
+            unlink(shard_file(i, UNQLITE_JOURNAL_FILE_SUFFIX));
+        }
+        unlink(DATABASE_NAME);
+        store_shards = 1;
+        init_fs();
+    }
+END_TEST
+
+// The file check_fsync_quiesce is creating, and the commit hook of the tree that it wraps.
+static int quiesce_file, quiesce_done, quiesce_checks;
+static void (*quiesce_tree)(int begin);
+
+// Runs as each commit starts. The file being created is either not in /q yet or has its FCB: a commit
+// that took half of the create ends the test in error_handler, when the entry finds no FCB.
+static void quiesce_check(int begin) {
+    struct fcb file_fcb;
+    char path[32];
+    if (quiesce_tree != NULL) {
+        quiesce_tree(begin);
+    }
+    if (begin) {
+        snprintf(path, sizeof(path), "/q/f%d", __atomic_load_n(&quiesce_file, __ATOMIC_ACQUIRE));
+        resolve_path(&file_fcb, path);
+        quiesce_checks++;
+    }
+}
+
+static void *quiesce_creator(void *unused) {
+    char path[32];
+    int i;
+    for (i = 0; i < 5000; i++) {
+        __atomic_store_n(&quiesce_file, i, __ATOMIC_RELEASE);
+        snprintf(path, sizeof(path), "/q/f%d", i);
+        newfs_create(path, S_IRUSR | S_IWUSR, NULL);
+    }
+    __atomic_store_n(&quiesce_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+START_TEST(check_fsync_quiesce)
+    {
+        pthread_t creator;
+        newfs_mkdir("/q", S_IRUSR | S_IWUSR | S_IXUSR);
+        quiesce_tree = store_quiesce;
+        store_quiesce = quiesce_check;
+
+        // The fsyncs of the directory commit while another thread creates files in it.
+        pthread_create(&creator, NULL, quiesce_creator, NULL);
+        while (!__atomic_load_n(&quiesce_done, __ATOMIC_ACQUIRE)) {
+            ck_assert(newfs_fsync("/q", 0, NULL) == 0);
+        }
+        pthread_join(creator, NULL);
+        store_quiesce = quiesce_tree;
+        ck_assert(quiesce_checks > 0);
+    }
+END_TEST
+
+START_TEST(check_durability)
+    {
+        int levels[] = {UNQLITE_SYNC_LEVEL_NONE, UNQLITE_SYNC_LEVEL_COMMIT, UNQLITE_SYNC_LEVEL_FULL};
+        unqlite_int64 syncs[3];
+        int i;
+        ck_assert(parse_durability("none") == UNQLITE_SYNC_LEVEL_NONE);
+        ck_assert(parse_durability("commit") == UNQLITE_SYNC_LEVEL_COMMIT);
+        ck_assert(parse_durability("commit-only") == UNQLITE_SYNC_LEVEL_COMMIT);
+        ck_assert(parse_durability("strict") == UNQLITE_SYNC_LEVEL_FULL);
+        ck_assert(parse_durability("always") == -1);
+
+        // Syncs issued by the fsync of a new file at each level.
+        for (i = 0; i < 3; i++) {
+            unqlite_int64 hits, misses, before, after;
+            shutdown_fs();
+            unlink(DATABASE_NAME);
+            store_sync_level = levels[i];
+            init_fs();
+            newfs_create("/f", S_IRUSR | S_IWUSR, NULL);
+            ck_assert(newfs_write("/f", "durable", 7, 0, NULL) == 7);
+            unqlite_config(pDb, UNQLITE_CONFIG_PAGER_STATS, &hits, &misses, &before);
+            ck_assert(newfs_fsync("/f", 0, NULL) == 0);
+            unqlite_config(pDb, UNQLITE_CONFIG_PAGER_STATS, &hits, &misses, &after);
+            syncs[i] = after - before;
+        }
+        ck_assert_msg(syncs[0] == 0, "durability=none synced.");
+        ck_assert_msg(syncs[1] == 1, "durability=commit issued %lld syncs.", (long long) syncs[1]);
+        ck_assert_msg(syncs[2] > syncs[1], "durability=strict synced no more than commit.");
+
+        shutdown_fs();
+        unlink(DATABASE_NAME);
+        store_sync_level = STORE_SYNC_LEVEL;
+        init_fs();
+    }
+END_TEST
+
+// A file appended to by a thread of check_write_back, and the first failure seen.
+struct append_job {
+    const char *path;
+    int blocks;
+    const char *failure;
+};
+
+// Fills block i of a file of check_write_back.
+static void append_block(char *block, size_t size, const char *path, int i) {
+    size_t j;
+    for (j = 0; j < size; j++) {
+        block[j] = (char) (path[1] + i * 7 + j);
+    }
+}
+
+static void *append_worker(void *arg) {
+    struct append_job *job = arg;
+    struct fuse_file_info fi;
+    struct stat stbuf;
+    char block[4096];
+    int i;
+    memset(&fi, 0, sizeof(fi));
+    fi.flags = O_WRONLY;
+    if (newfs_open(job->path, &fi) != 0) {
+        job->failure = "open";
+        return NULL;
+    }
+    for (i = 0; i < job->blocks && job->failure == NULL; i++) {
+        append_block(block, sizeof(block), job->path, i);
+        if (newfs_write(job->path, block, sizeof(block), (off_t) i * sizeof(block), &fi) != sizeof(block)) {
+            job->failure = "write";
+        } else if (newfs_getattr(job->path, &stbuf) != 0 || stbuf.st_size != (off_t) (i + 1) * sizeof(block)) {
+            job->failure = "size";
+        }
+    }
+    newfs_release(job->path, &fi);
+    return NULL;
+}
+
+START_TEST(check_write_back)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        // Each file passes the size at which its buffer is stored while the other one is appended to.
+        int blocks = WRITE_BACK_FILE_SIZE / 4096 + 200;
+        struct append_job jobs[2] = {{"/a", blocks, NULL}, {"/b", blocks, NULL}};
+        pthread_t workers[2];
+        char block[4096], back[4096];
+        struct stat stbuf;
+        int i, j;
+        for (j = 0; j < 2; j++) {
+            newfs_create(jobs[j].path, mode, NULL);
+            pthread_create(&workers[j], NULL, append_worker, &jobs[j]);
+        }
+        for (j = 0; j < 2; j++) {
+            pthread_join(workers[j], NULL);
+            ck_assert_msg(jobs[j].failure == NULL, "%s: %s failed.", jobs[j].path, jobs[j].failure);
+        }
+
+        // Both files were stored whole.
+        for (j = 0; j < 2; j++) {
+            ck_assert(newfs_getattr(jobs[j].path, &stbuf) == 0);
+            ck_assert(stbuf.st_size == (off_t) blocks * sizeof(block));
+            for (i = 0; i < blocks; i++) {
+                append_block(block, sizeof(block), jobs[j].path, i);
+                ck_assert(newfs_read(jobs[j].path, back, sizeof(back), (off_t) i * sizeof(back), NULL) == sizeof(back));
+                ck_assert_msg(memcmp(block, back, sizeof(back)) == 0, "Block %d of %s differs.", i, jobs[j].path);
+            }
+        }
+    }
+END_TEST
+
+START_TEST(check_write_back_ranges)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        int blocks = 256, i, pass;
+        size_t size = (size_t) blocks * 4096;
+        char *expected = malloc(size + 4096), *back = malloc(size + 4096);
+        struct fuse_file_info fi;
+        struct stat stbuf;
+        struct fcb file_fcb;
+        for (i = 0; i < blocks; i++) {
+            append_block(&expected[(size_t) i * 4096], 4096, "/r", i);
+        }
+        ck_assert(newfs_create("/ranges", mode, NULL) == 0);
+        ck_assert(newfs_write("/ranges", expected, size, 0, NULL) == (int) size);
+
+        // Interleaved overwrites are buffered: the even blocks first, then the odd ones which join them.
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_WRONLY;
+        ck_assert(newfs_open("/ranges", &fi) == 0);
+        for (pass = 0; pass < 2; pass++) {
+            for (i = pass; i < blocks; i += 2) {
+                append_block(&expected[(size_t) i * 4096], 4096, "/x", i);
+                ck_assert(newfs_write("/ranges", &expected[(size_t) i * 4096], 4096, (off_t) i * 4096, &fi) == 4096);
+            }
+        }
+        // And so is a write past the end, which the size shows before it is stored.
+        memset(&expected[size], 0, 4096);
+        memcpy(&expected[size + 100], "tail", 4);
+        ck_assert(newfs_write("/ranges", "tail", 4, (off_t) size + 100, &fi) == 4);
+        ck_assert(newfs_getattr("/ranges", &stbuf) == 0 && stbuf.st_size == (off_t) size + 104);
+        resolve_path(&file_fcb, "/ranges");
+        ck_assert_msg(file_fcb.size == (off_t) size, "The buffered writes were stored.");
+        ck_assert(dat_read(&file_fcb, 0, 4096, back) == 4096);
+        ck_assert_msg(memcmp(back, expected, 4096) != 0, "The buffered writes were stored.");
+
+        // Reads see every write, through the store.
+        ck_assert(newfs_read("/ranges", back, size + 104, 0, NULL) == (int) size + 104);
+        ck_assert_msg(memcmp(back, expected, size + 104) == 0, "Overwritten data differs.");
+        newfs_release("/ranges", &fi);
+        ck_assert(newfs_getattr("/ranges", &stbuf) == 0 && stbuf.st_size == (off_t) size + 104);
+        free(expected);
+        free(back);
+    }
+END_TEST
+
+// Set once the commit of check_commit_readers returned.
+static int commit_finished;
+
+static void *commit_worker(void *unused) {
+    sync_store();
+    __atomic_store_n(&commit_finished, 1, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+// Fills a value of check_commit_readers from its key number.
+static void commit_value(unsigned char *value, size_t size, int n) {
+    size_t j;
+    for (j = 0; j < size; j++) {
+        value[j] = (unsigned char) (n * 131 + j * 7 + (j >> 8));
+    }
+}
+
+// Checks that key prefix<n> holds the value of commit_value.
+static int commit_value_ok(const char *prefix, int n) {
+    unsigned char value[3072], expected[3072];
+    unqlite_int64 size = sizeof(value);
+    char key[16];
+    snprintf(key, sizeof(key), "%s%d", prefix, n);
+    if (store_fetch(key, strlen(key), value, &size) != UNQLITE_OK || size != sizeof(value)) {
+        return 0;
+    }
+    commit_value(expected, sizeof(expected), n);
+    return memcmp(value, expected, sizeof(value)) == 0;
+}
+
+START_TEST(check_commit_readers)
+    {
+        unsigned char value[3072];
+        char key[16];
+        int i, reads = 0, bad = 0;
+        pthread_t worker;
+        // A small cache, so that most reads go to the file the commit is writing.
+        shutdown_fs();
+        store_cache_pages = 256;
+        init_fs();
+
+        for (i = 0; i < 4000; i++) {
+            commit_value(value, sizeof(value), i);
+            snprintf(key, sizeof(key), "base%d", i);
+            ck_assert(store_put(key, strlen(key), value, sizeof(value)) == UNQLITE_OK);
+        }
+        sync_store();
+
+        // A large transaction, committed on another thread while this one reads the committed keys.
+        for (i = 0; i < 8000; i++) {
+            commit_value(value, sizeof(value), i);
+            snprintf(key, sizeof(key), "bulk%d", i);
+            ck_assert(store_put(key, strlen(key), value, sizeof(value)) == UNQLITE_OK);
+        }
+        pthread_create(&worker, NULL, commit_worker, NULL);
+        while (!__atomic_load_n(&commit_finished, __ATOMIC_SEQ_CST)) {
+            if (!commit_value_ok("base", reads % 4000)) {
+                bad++;
+            }
+            reads++;
+        }
+        pthread_join(worker, NULL);
+        ck_assert_msg(bad == 0, "%d of %d reads during the commit returned wrong bytes.", bad, reads);
+        ck_assert(access(DATABASE_NAME UNQLITE_JOURNAL_FILE_SUFFIX, F_OK) != 0);
+
+        // Both transactions are intact in the file.
+        shutdown_fs();
+        store_cache_pages = 0;
+        init_fs();
+        for (i = 0; i < 4000; i++) {
+            ck_assert_msg(commit_value_ok("base", i), "Key base%d damaged.", i);
+        }
+        for (i = 0; i < 8000; i++) {
+            ck_assert_msg(commit_value_ok("bulk", i), "Key bulk%d damaged.", i);
+        }
+    }
+END_TEST
+
+// Set while the first fetch of check_shared_fetch is in its consumer, and once the second one returned.
+static int shared_in_consumer, shared_second_done, shared_overlap;
+// Tells the readers of check_shared_fetch to stop.
+static int shared_stop;
+
+// Size of the value of key shared<n>: local to its bucket page or on overflow pages.
+static size_t shared_size(int n) {
+    return (n % 2) ? 100 : 6000;
+}
+
+// Checks that key shared<n> of pDb holds the value of commit_value.
+static int shared_value_ok(int n) {
+    unsigned char value[6000], expected[6000];
+    unqlite_int64 size = sizeof(value);
+    char key[16];
+    snprintf(key, sizeof(key), "shared%d", n);
+    if (unqlite_kv_fetch(pDb, key, strlen(key), value, &size) != UNQLITE_OK || size != (unqlite_int64) shared_size(n)) {
+        return 0;
+    }
+    commit_value(expected, shared_size(n), n);
+    return memcmp(value, expected, shared_size(n)) == 0;
+}
+
+// Stays in the consumer until the fetch of shared_fetch_worker returned, or for 2 seconds,
+// and records in shared_overlap whether it returned meanwhile.
+static int shared_wait_consumer(const void *data, unsigned int len, void *unused) {
+    int i;
+    __atomic_store_n(&shared_in_consumer, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < 2000 && !__atomic_load_n(&shared_second_done, __ATOMIC_SEQ_CST); i++) {
+        usleep(1000);
+    }
+    shared_overlap = __atomic_load_n(&shared_second_done, __ATOMIC_SEQ_CST);
+    return UNQLITE_OK;
+}
+
+static void *shared_fetch_worker(void *unused) {
+    while (!__atomic_load_n(&shared_in_consumer, __ATOMIC_SEQ_CST)) {
+        usleep(100);
+    }
+    if (shared_value_ok(1)) {
+        __atomic_store_n(&shared_second_done, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+// Reads the keys of check_shared_fetch until shared_stop, counting the wrong values in *bad.
+static void *shared_reader(void *bad) {
+    int n = 0;
+    while (!__atomic_load_n(&shared_stop, __ATOMIC_SEQ_CST)) {
+        if (!shared_value_ok(n % 500)) {
+            __atomic_fetch_add((int *) bad, 1, __ATOMIC_SEQ_CST);
+        }
+        n++;
+    }
+    return NULL;
+}
+
+START_TEST(check_shared_fetch)
+    {
+        unsigned char value[6000];
+        char key[16];
+        int i, bad = 0;
+        pthread_t worker, readers[3];
+        for (i = 0; i < 500; i++) {
+            commit_value(value, shared_size(i), i);
+            snprintf(key, sizeof(key), "shared%d", i);
+            ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, shared_size(i)) == UNQLITE_OK);
+        }
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        for (i = 0; i < 500; i++) {
+            ck_assert(shared_value_ok(i));
+        }
+
+        // Two fetches of cached records run at once: the second one returns while the first is in its consumer.
+        // Both values are on their bucket page, which stays in the cache, unlike the overflow pages.
+        pthread_create(&worker, NULL, shared_fetch_worker, NULL);
+        ck_assert(unqlite_kv_fetch_callback(pDb, "shared3", 7, shared_wait_consumer, NULL) == UNQLITE_OK);
+        pthread_join(worker, NULL);
+        ck_assert_msg(shared_overlap, "The fetches from the cache waited for each other.");
+
+        // Readers check the values while this thread stores other keys and commits, which unloads the pages.
+        for (i = 0; i < 3; i++) {
+            pthread_create(&readers[i], NULL, shared_reader, &bad);
+        }
+        for (i = 0; i < 3000; i++) {
+            commit_value(value, 3000, i);
+            snprintf(key, sizeof(key), "other%d", i);
+            ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, 3000) == UNQLITE_OK);
+            if (i % 500 == 499) {
+                ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+            }
+        }
+        __atomic_store_n(&shared_stop, 1, __ATOMIC_SEQ_CST);
+        for (i = 0; i < 3; i++) {
+            pthread_join(readers[i], NULL);
+        }
+        ck_assert_msg(bad == 0, "%d reads returned wrong values.", bad);
+    }
+END_TEST
+
+START_TEST(check_stats)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        struct stat stbuf;
+        newfs_create("/file", mode, NULL);
+        ck_assert(newfs_write("/file", "data", 4, 0, NULL) == 4);
+        newfs_getattr("/file", &stbuf);
+
+        ck_assert(newfs_getattr(STATS_DIR, &stbuf) == 0 && S_ISDIR(stbuf.st_mode));
+        ck_assert(newfs_getattr(STATS_PATH, &stbuf) == 0 && S_ISREG(stbuf.st_mode));
+        ck_assert(newfs_mkdir(STATS_DIR, mode) == -EEXIST);
+        ck_assert(newfs_create(STATS_PATH, mode, NULL) == -EACCES);
+
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_WRONLY;
+        ck_assert(newfs_open(STATS_PATH, &fi) == -EACCES);
+
+        // The text is read in pieces from the snapshot taken at open.
+        fi.flags = O_RDONLY;
+        ck_assert(newfs_open(STATS_PATH, &fi) == 0);
+        ck_assert(fi.direct_io);
+        char *text = malloc(1 << 16);
+        int len = 0, rc;
+        while ((rc = newfs_read(STATS_PATH, &text[len], 100, len, &fi)) > 0) {
+            len += rc;
+        }
+        text[len] = '\0';
+        newfs_release(STATS_PATH, &fi);
+
+        ck_assert_msg(strstr(text, "newfs_op_duration_seconds_count{op=\"write\"} 1\n") != NULL, "Write not counted.");
+        ck_assert_msg(strstr(text, "newfs_op_duration_seconds_bucket{op=\"getattr\",le=\"+Inf\"} 3\n") != NULL, "Getattr not counted.");
+        ck_assert_msg(strstr(text, "op=\"kv_store\"") != NULL, "Store calls not timed.");
+        ck_assert_msg(strstr(text, "newfs_pager_cache_hits_total ") != NULL, "Pager stats missing.");
+        free(text);
+    }
+END_TEST
+
+// Counts the records of a trace with the given operation and path.
+static int trace_count(struct trace_record *records, int count, int op, const char *path) {
+    int i, found = 0;
+    for (i = 0; i < count; i++) {
+        if (records[i].op == op && strncmp(records[i].path, path, TRACE_PATH_SIZE) == 0) {
+            found++;
+        }
+    }
+    return found;
+}
+
+START_TEST(check_trace)
+    {
+        const char *trace_file = "check_tests.trace";
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        struct stat stbuf;
+        trace_level = TRACE_ALL;
+        ck_assert(trace_start(trace_file) == 0);
+        newfs_create("/file", mode, NULL);
+        ck_assert(newfs_write("/file", "data", 4, 0, NULL) == 4);
+        ck_assert(newfs_getattr("/missing", &stbuf) == -ENOENT);
+
+        // Only failed requests are traced at the errors level.
+        trace_level = TRACE_ERRORS;
+        newfs_getattr("/file", &stbuf);
+        newfs_getattr("/missing2", &stbuf);
+        trace_stop();
+
+        FILE *in = fopen(trace_file, "rb");
+        struct trace_header header;
+        struct trace_record records[16];
+        ck_assert(in != NULL);
+        ck_assert(fread(&header, sizeof(header), 1, in) == 1);
+        ck_assert(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0);
+        ck_assert(header.record_size == sizeof(struct trace_record));
+        int count = (int) fread(records, sizeof(struct trace_record), 16, in);
+        fclose(in);
+        unlink(trace_file);
+
+        ck_assert_msg(trace_count(records, count, STAT_CREATE, "/file") == 1, "Create not traced.");
+        ck_assert_msg(trace_count(records, count, STAT_WRITE, "/file") == 1, "Write not traced.");
+        int i;
+        for (i = 0; i < count && records[i].op != STAT_WRITE; i++);
+        ck_assert(records[i].arg[0] == 0 && records[i].arg[1] == 4 && records[i].result == 4);
+        ck_assert_msg(trace_count(records, count, STAT_GETATTR, "/missing") == 1, "Failed getattr not traced.");
+        ck_assert_msg(trace_count(records, count, STAT_GETATTR, "/file") == 0, "Traced below the level.");
+        ck_assert_msg(trace_count(records, count, STAT_GETATTR, "/missing2") == 1, "Error not traced.");
+        trace_level = TRACE_DEFAULT_LEVEL;
+    }
+END_TEST
+
+// Records the names and types passed to the filler.
+struct readdir_result {
+    int count;
+    char names[8][32];
+    mode_t types[8];
+};
+
+static int readdir_filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    struct readdir_result *result = buf;
+    if (result->count < 8 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        strncpy(result->names[result->count], name, 31);
+        result->types[result->count] = stbuf->st_mode & S_IFMT;
+        result->count++;
+    }
+    return 0;
+}
+
+START_TEST(check_readdir_rename)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        newfs_mkdir("/dir", mode);
+        newfs_create("/file.txt", mode, NULL);
+
+        // Names and types come from the directory entries.
+        struct readdir_result result;
+        memset(&result, 0, sizeof(result));
+        int rc = newfs_readdir("/", &result, readdir_filler, 0, NULL);
+        ck_assert_msg(rc == 0, "readdir returned an error.");
+        ck_assert_msg(result.count == 2, "Wrong number of entries.");
+        ck_assert(strcmp(result.names[0], "dir") == 0 && result.types[0] == S_IFDIR);
+        ck_assert(strcmp(result.names[1], "file.txt") == 0 && result.types[1] == S_IFREG);
+
+        // Renaming replaces the entry.
+        rc = newfs_rename("/file.txt", "/renamed.txt");
+        ck_assert_msg(rc == 0, "rename returned an error.");
+        struct fcb tmp_fcb;
+        ck_assert_msg(resolve_path(&tmp_fcb, "/file.txt") == ENOENT, "Old name still found.");
+        ck_assert_msg(resolve_path(&tmp_fcb, "/renamed.txt") == 0, "New name not found.");
+        memset(&result, 0, sizeof(result));
+        newfs_readdir("/", &result, readdir_filler, 0, NULL);
+        ck_assert_msg(result.count == 2, "Wrong number of entries after rename.");
+        ck_assert(strcmp(result.names[1], "renamed.txt") == 0 && result.types[1] == S_IFREG);
+
+        // Clean-up.
+        newfs_unlink("/renamed.txt");
+        newfs_rmdir("/dir");
+        struct fcb root;
+        resolve_path(&root, "/");
+        ck_assert_msg(root.size == 0, "Root not empty after test.");
+    }
+END_TEST
+
+// Returns the number of entries of a directory, ignoring . and ..
+static int entry_count(const char *path) {
+    struct readdir_result result;
+    memset(&result, 0, sizeof(result));
+    ck_assert(newfs_readdir(path, &result, readdir_filler, 0, NULL) == 0);
+    return result.count;
+}
+
+START_TEST(check_rename_move_replace)
+    {
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        struct fcb tmp_fcb;
+        char data[8];
+        ck_assert(newfs_mkdir("/a", mode) == 0);
+        ck_assert(newfs_mkdir("/b", mode) == 0);
+        ck_assert(newfs_create("/a/file", mode, NULL) == 0);
+        ck_assert(newfs_write("/a/file", "moved", 5, 0, NULL) == 5);
+
+        // Moving to another directory takes the entry out of the old one.
+        ck_assert(newfs_rename("/a/file", "/b/file") == 0);
+        ck_assert(entry_count("/a") == 0 && entry_count("/b") == 1);
+        ck_assert(resolve_path(&tmp_fcb, "/a/file") == ENOENT);
+        ck_assert(resolve_path(&tmp_fcb, "/b/file") == 0);
+        ck_assert(newfs_read("/b/file", data, sizeof(data), 0, NULL) == 5 && memcmp(data, "moved", 5) == 0);
+
+        // Moving onto an existing name replaces the element instead of adding a second entry.
+        ck_assert(newfs_create("/b/other", mode, NULL) == 0);
+        ck_assert(newfs_write("/b/other", "old", 3, 0, NULL) == 3);
+        ck_assert(newfs_rename("/b/file", "/b/other") == 0);
+        ck_assert(entry_count("/b") == 1);
+        ck_assert(newfs_read("/b/other", data, sizeof(data), 0, NULL) == 5 && memcmp(data, "moved", 5) == 0);
+        ck_assert(newfs_create("/a/third", mode, NULL) == 0);
+        ck_assert(newfs_rename("/a/third", "/b/other") == 0);
+        ck_assert(entry_count("/a") == 0 && entry_count("/b") == 1);
+        ck_assert(resolve_path(&tmp_fcb, "/b/other") == 0 && tmp_fcb.size == 0);
+
+        // Directories replace empty directories only, and never move below themselves.
+        ck_assert(newfs_rename("/a", "/b/other") == -ENOTDIR);
+        ck_assert(newfs_rename("/b/other", "/a") == -EISDIR);
+        ck_assert(newfs_rename("/a", "/b") == -ENOTEMPTY);
+        ck_assert(newfs_rename("/b", "/a") == 0);
+        ck_assert(entry_count("/") == 1 && entry_count("/a") == 1);
+        ck_assert(newfs_rename("/a", "/a/sub") == -EINVAL);
+        ck_assert(newfs_rename("/a/other", "/missing/other") == -ENOENT);
+
+        // Clean-up.
+        ck_assert(newfs_unlink("/a/other") == 0);
+        ck_assert(newfs_rmdir("/a") == 0);
+        struct fcb root;
+        resolve_path(&root, "/");
+        ck_assert_msg(root.size == 0, "Root not empty after test.");
+    }
+END_TEST
+
+// Fills the value of key vac<n> of the vacuum tests and returns its size. A third of the values repeat themselves, a
+// third do not, and both span several overflow pages. The rest fit in their bucket page.
+static int vacuum_value(unsigned char *value, int n) {
+    unsigned int seed = (unsigned int) n * 2654435761u;
+    int j, size = n % 3 == 0 ? 20000 : n % 3 == 1 ? 9000 : 200;
+    for (j = 0; j < size; j++) {
+        if (n % 3 == 1) {
+            seed = seed * 1103515245u + 12345u;
+            value[j] = (unsigned char) (seed >> 16);
+        } else {
+            value[j] = (unsigned char) ('a' + (j / 64 + n) % 26);
+        }
+    }
+    return size;
+}
+
+// Checks that key vac<n> holds the value of vacuum_value.
+static int vacuum_value_ok(int n) {
+    unsigned char value[20000], expected[20000];
+    unqlite_int64 size = sizeof(value);
+    char key[16];
+    int expected_size = vacuum_value(expected, n);
+    snprintf(key, sizeof(key), "vac%d", n);
+    if (unqlite_kv_fetch(pDb, key, strlen(key), value, &size) != UNQLITE_OK || size != expected_size) {
+        return 0;
+    }
+    return memcmp(value, expected, (size_t) size) == 0;
+}
+
+// Stores keys vac0 to vac<count - 1>, then deletes the odd ones so the vacuum has pages to reclaim.
+static void vacuum_fill(int count) {
+    unsigned char value[20000];
+    char key[16];
+    int i;
+    for (i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "vac%d", i);
+        ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, vacuum_value(value, i)) == UNQLITE_OK);
+    }
+    ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+    for (i = 1; i < count; i += 2) {
+        snprintf(key, sizeof(key), "vac%d", i);
+        ck_assert(unqlite_kv_delete(pDb, key, strlen(key)) == UNQLITE_OK);
+    }
+    ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+}
+
+// Checks that every page of the store is used once, or free, and returns the free and total page counts.
+static void store_check(unqlite_int64 *free, unqlite_int64 *pages, unqlite_int64 *breaks) {
+    unqlite_int64 used, remain;
+    // Loads the free list mirror and bitmap, which the check compares with the file.
+    ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_VACUUM, 0, NULL, pages, &remain) == UNQLITE_OK);
+    ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_CHECK, &used, free, breaks) == UNQLITE_OK);
+    ck_assert_msg(used + *free + 1 == *pages, "%lld used and %lld free pages out of %lld.",
+                  (long long) used, (long long) *free, (long long) *pages);
+}
+
+// Runs the vacuum until its pass is over.
+static void vacuum_pass() {
+    unqlite_int64 free, pages, remain;
+    do {
+        ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_VACUUM, 4, &free, &pages, &remain) == UNQLITE_OK);
+    } while (remain > 0);
+}
+
+START_TEST(check_vacuum)
+    {
+        unqlite_int64 free, pages, breaks, before;
+        int i;
+        vacuum_fill(600);
+        store_check(&free, &before, &breaks);
+        ck_assert_msg(free > 0, "Deleted values freed no page.");
+
+        // A full pass gives the free pages back to the file system and keeps the values.
+        vacuum_pass();
+        store_check(&free, &pages, &breaks);
+        ck_assert_msg(pages < before, "The vacuum kept %lld of %lld pages.", (long long) pages, (long long) before);
+        for (i = 0; i < 600; i += 2) {
+            ck_assert_msg(vacuum_value_ok(i), "Key vac%d damaged by the vacuum.", i);
+        }
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+
+        // And so does the file once reopened.
+        shutdown_fs();
+        init_fs();
+        store_check(&free, &pages, &breaks);
+        for (i = 0; i < 600; i++) {
+            ck_assert_msg(vacuum_value_ok(i) == (i % 2 == 0), "Key vac%d wrong after reopening.", i);
+        }
+    }
+END_TEST
+
+START_TEST(check_vacuum_rollback)
+    {
+        unqlite_int64 free, pages, remain, breaks, before, free_before;
+        int i;
+        vacuum_fill(600);
+        store_check(&free_before, &before, &breaks);
+
+        // A rollback in the middle of a pass puts every moved page back.
+        ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_VACUUM, 4, &free, &pages, &remain) == UNQLITE_OK);
+        ck_assert_msg(remain > 0, "The pass ended in one step.");
+        ck_assert(unqlite_rollback(pDb) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert(pages == before && free == free_before);
+        for (i = 0; i < 600; i += 2) {
+            ck_assert_msg(vacuum_value_ok(i), "Key vac%d damaged by the rollback.", i);
+        }
+
+        // The next pass starts over.
+        vacuum_pass();
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        shutdown_fs();
+        init_fs();
+        store_check(&free, &pages, &breaks);
+        ck_assert(pages < before);
+        for (i = 0; i < 600; i += 2) {
+            ck_assert_msg(vacuum_value_ok(i), "Key vac%d damaged by the vacuum.", i);
+        }
+    }
+END_TEST
+
+START_TEST(check_slave_pages)
+    {
+        char key[16], value[128];
+        unqlite_int64 size;
+        int i;
+        memset(value, 's', sizeof(value));
+        for (i = 0; i < 1000; i++) {
+            snprintf(key, sizeof(key), "slave%d", i);
+            ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, 100) == UNQLITE_OK);
+        }
+        shutdown_fs();
+        init_fs();
+
+        // Each commit releases the buckets loaded since the last one, with the slave pages of their keys.
+        for (i = 0; i < 1000; i += 7) {
+            snprintf(key, sizeof(key), "slave%d", i);
+            ck_assert(unqlite_kv_append(pDb, key, strlen(key), value, 20) == UNQLITE_OK);
+            ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        }
+        for (i = 0; i < 1000; i++) {
+            snprintf(key, sizeof(key), "slave%d", i);
+            size = 0;
+            ck_assert_msg(unqlite_kv_fetch(pDb, key, strlen(key), NULL, &size) == UNQLITE_OK, "Key %s lost.", key);
+            ck_assert(size == ((i % 7 == 0) ? 120 : 100));
+        }
+    }
+END_TEST
+
+// Fills an incompressible value of check_extents, so that it takes as many overflow pages as bytes.
+static void extent_value(unsigned char *value, size_t size, unsigned int seed) {
+    size_t j;
+    for (j = 0; j < size; j++) {
+        seed = seed * 1103515245u + 12345u;
+        value[j] = (unsigned char) (seed >> 16);
+    }
+}
+
+START_TEST(check_extents)
+    {
+        static unsigned char value[1 << 20], back[1 << 20];
+        unqlite_int64 free, pages, breaks, size, free_before, pages_before;
+        char key[16];
+        int i;
+
+        // A large value lies in one run of pages, and stays there when it grows.
+        extent_value(value, sizeof(value), 1);
+        ck_assert(unqlite_kv_store(pDb, "large", 5, value, sizeof(value) / 2) == UNQLITE_OK);
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert_msg(breaks == 0, "The chain of a new value has %lld breaks.", (long long) breaks);
+        ck_assert(unqlite_kv_append(pDb, "large", 5, value + sizeof(value) / 2, sizeof(value) / 2) == UNQLITE_OK);
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert_msg(breaks == 0, "The chain of an appended value has %lld breaks.", (long long) breaks);
+        size = sizeof(back);
+        ck_assert(unqlite_kv_fetch(pDb, "large", 5, back, &size) == UNQLITE_OK && size == sizeof(value));
+        ck_assert(memcmp(back, value, sizeof(value)) == 0);
+
+        // The bitmap follows the free list through deletes.
+        for (i = 0; i < 64; i++) {
+            snprintf(key, sizeof(key), "ext%d", i);
+            extent_value(value, 16384, (unsigned int) i);
+            ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, 16384) == UNQLITE_OK);
+        }
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        for (i = 0; i < 64; i += 2) {
+            snprintf(key, sizeof(key), "ext%d", i);
+            ck_assert(unqlite_kv_delete(pDb, key, strlen(key)) == UNQLITE_OK);
+        }
+        ck_assert(unqlite_kv_delete(pDb, "large", 5) == UNQLITE_OK);
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert(free > 0);
+
+        // And through a rollback of a transaction that took free pages.
+        free_before = free;
+        pages_before = pages;
+        extent_value(value, sizeof(value), 2);
+        ck_assert(unqlite_kv_store(pDb, "large", 5, value, sizeof(value)) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert(free < free_before);
+        ck_assert(unqlite_rollback(pDb) == UNQLITE_OK);
+        store_check(&free, &pages, &breaks);
+        ck_assert(free == free_before && pages == pages_before);
+
+        // And when the file is reopened.
+        shutdown_fs();
+        init_fs();
+        store_check(&free, &pages, &breaks);
+        ck_assert(free == free_before && pages == pages_before);
+        for (i = 1; i < 64; i += 2) {
+            snprintf(key, sizeof(key), "ext%d", i);
+            extent_value(value, 16384, (unsigned int) i);
+            size = sizeof(back);
+            ck_assert_msg(unqlite_kv_fetch(pDb, key, strlen(key), back, &size) == UNQLITE_OK && size == 16384 &&
+                          memcmp(back, value, 16384) == 0, "Key %s damaged.", key);
+        }
+        ck_assert(unqlite_kv_fetch(pDb, "large", 5, back, &size) == UNQLITE_NOTFOUND);
+    }
+END_TEST
+
+// Stores a value and returns the number of pages it added to the store.
+static unqlite_int64 codec_store(const char *key, const unsigned char *value, unqlite_int64 size) {
+    unqlite_int64 used, before, free, breaks;
+    ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_CHECK, &before, &free, &breaks) == UNQLITE_OK);
+    ck_assert(unqlite_kv_store(pDb, key, strlen(key), value, size) == UNQLITE_OK);
+    ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+    ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_CHECK, &used, &free, &breaks) == UNQLITE_OK);
+    return used - before;
+}
+
+// Checks that key holds size bytes of value.
+static int codec_value_ok(unqlite *db, const char *key, const unsigned char *value, unqlite_int64 size) {
+    static unsigned char back[1 << 18];
+    unqlite_int64 got = sizeof(back);
+    return unqlite_kv_fetch(db, key, strlen(key), back, &got) == UNQLITE_OK && got == size &&
+           memcmp(back, value, (size_t) size) == 0;
+}
+
+START_TEST(check_compression)
+    {
+        static unsigned char text[1 << 18], noise[1 << 18];
+        unqlite_int64 pages;
+        unqlite *db;
+        int j;
+        for (j = 0; j < sizeof(text); j++) {
+            text[j] = (unsigned char) ('a' + (j / 64) % 26);
+        }
+        extent_value(noise, sizeof(noise), 7);
+
+        // A value that compresses well takes a few pages and reads back whole.
+        pages = codec_store("text", text, sizeof(text));
+        ck_assert_msg(pages * 4096 < sizeof(text) / 8, "A compressible value took %lld pages.", (long long) pages);
+        ck_assert(codec_value_ok(pDb, "text", text, sizeof(text)));
+
+        // One that does not is stored raw.
+        pages = codec_store("noise", noise, sizeof(noise));
+        ck_assert_msg(pages * 4096 >= sizeof(noise), "An incompressible value took %lld pages.", (long long) pages);
+        ck_assert(codec_value_ok(pDb, "noise", noise, sizeof(noise)));
+
+        // A store opened without compression still reads both.
+        shutdown_fs();
+        ck_assert(unqlite_open(&db, store_name, UNQLITE_OPEN_CREATE) == UNQLITE_OK);
+        ck_assert(unqlite_kv_config(db, UNQLITE_KV_CONFIG_COMPRESSION, UNQLITE_KV_CODEC_NONE) == UNQLITE_OK);
+        ck_assert(codec_value_ok(db, "text", text, sizeof(text)));
+        ck_assert(codec_value_ok(db, "noise", noise, sizeof(noise)));
+        ck_assert(unqlite_close(db) == UNQLITE_OK);
+        init_fs();
+    }
+END_TEST
+
+// Reads the read-ahead request counters from the stats text.
+static void readahead_counts(unsigned long long *queued, unsigned long long *dropped) {
+    size_t len;
+    char *text = stats_text(&len);
+    char *at = strstr(text, "newfs_readahead_requests_total{result=\"queued\"} ");
+    ck_assert(at != NULL && sscanf(at, "newfs_readahead_requests_total{result=\"queued\"} %llu", queued) == 1);
+    at = strstr(text, "newfs_readahead_requests_total{result=\"dropped\"} ");
+    ck_assert(at != NULL && sscanf(at, "newfs_readahead_requests_total{result=\"dropped\"} %llu", dropped) == 1);
+    free(text);
+}
+
+// Fetch consumer that submits read-ahead requests while the fetch holds the store, so the worker
+// cannot take them off the queue.
+static int readahead_flood(const void *chunk, unsigned int len, void *user_data) {
+    struct readahead ra;
+    int i;
+    memset(&ra, 0, sizeof(ra));
+    for (i = 0; i < 4 * READAHEAD_QUEUE_SIZE; i++) {
+        // A read from the start always requests the first window.
+        readahead_update(&ra, user_data, 0, 4096, 1 << 30);
+    }
+    return UNQLITE_OK;
+}
+
+START_TEST(check_readahead)
+    {
+        static unsigned char value[1 << 20], back[1 << 20];
+        unsigned long long queued, dropped, queued_after, dropped_after;
+        struct readahead ra;
+        off_t offset, window = READAHEAD_MIN_WINDOW;
+        uuid_t key;
+        int i;
+        make_key(key, 1000, KEY_KIND_DATA, 0);
+
+        // Sequential reads double the window up to its maximum, and stay ahead of the reads.
+        memset(&ra, 0, sizeof(ra));
+        for (offset = 0; offset < 64 * READAHEAD_MAX_WINDOW; offset += 65536) {
+            off_t end = ra.end;
+            readahead_update(&ra, &key, offset, 65536, (off_t) 1 << 40);
+            if (ra.end != end) {
+                ck_assert_msg(ra.end - end == window || end == 0, "Window of %lld bytes requested, %lld expected.",
+                              (long long) (ra.end - end), (long long) window);
+                window = (window < READAHEAD_MAX_WINDOW) ? window * 2 : window;
+            }
+            ck_assert(ra.window == window && ra.end > offset + 65536);
+        }
+        ck_assert(window == READAHEAD_MAX_WINDOW);
+
+        // A random read resets the window, and the next sequential run starts again from the smallest one.
+        readahead_update(&ra, &key, 12345, 4096, (off_t) 1 << 40);
+        ck_assert(ra.window == 0);
+        readahead_update(&ra, &key, 12345 + 4096, 4096, (off_t) 1 << 40);
+        ck_assert(ra.window == 2 * READAHEAD_MIN_WINDOW && ra.end == 12345 + 8192 + READAHEAD_MIN_WINDOW);
+
+        // Requests that find the queue full are dropped.
+        readahead_counts(&queued, &dropped);
+        ck_assert(unqlite_kv_store(pDb, "ra", 2, "x", 1) == UNQLITE_OK);
+        ck_assert(unqlite_kv_fetch_callback(pDb, "ra", 2, readahead_flood, &key) == UNQLITE_OK);
+        readahead_counts(&queued_after, &dropped_after);
+        ck_assert(queued_after - queued + dropped_after - dropped == 4 * READAHEAD_QUEUE_SIZE);
+        ck_assert_msg(queued_after - queued <= READAHEAD_QUEUE_SIZE + 1, "%llu requests queued.", queued_after - queued);
+
+        // The store reads a value ahead from where the previous request stopped, or from its start.
+        extent_value(value, sizeof(value), 3);
+        ck_assert(unqlite_kv_store(pDb, "large", 5, value, sizeof(value)) == UNQLITE_OK);
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        for (i = 0; i < 16; i++) {
+            ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_PREFETCH, "large", 5, (unqlite_int64) i * 65536,
+                                        (unqlite_int64) 65536) == UNQLITE_OK);
+        }
+        ck_assert(unqlite_kv_config(pDb, UNQLITE_KV_CONFIG_PREFETCH, "large", 5, (unqlite_int64) 4096,
+                                    (unqlite_int64) 65536) == UNQLITE_OK);
+        unqlite_int64 size = sizeof(back);
+        ck_assert(unqlite_kv_fetch(pDb, "large", 5, back, &size) == UNQLITE_OK && size == sizeof(value));
+        ck_assert(memcmp(back, value, sizeof(value)) == 0);
+    }
+END_TEST
+
+// Counts the entries passed to the filler.
+static int count_entries(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+    (*(int *) buf)++;
+    return 0;
+}
+
+START_TEST(check_large_directory)
+    {
+        // The entries are appended to one record, which fills its overflow pages exactly at some point.
+        mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH;
+        char path[32];
+        int i, entries = 0;
+        ck_assert(newfs_mkdir("/dir", mode) == 0);
+        for (i = 0; i < 2000; i++) {
+            sprintf(path, "/dir/f%d", i);
+            ck_assert(newfs_create(path, mode, NULL) == 0);
+        }
+        ck_assert(newfs_readdir("/dir", &entries, count_entries, 0, NULL) == 0);
+        ck_assert_int_eq(entries, 2002);
+    }
+END_TEST
+
+START_TEST(check_append_fill)
+    {
+        // Grows a value one byte at a time, so that it fills its last overflow page exactly at some point.
+        static unsigned char value[65536], back[65536];
+        unqlite_int64 size = sizeof(back);
+        int i;
+        for (i = 0; i < sizeof(value); i++) {
+            value[i] = (unsigned char) ('a' + i % 26);
+            ck_assert_msg(unqlite_kv_append(pDb, "fill", 4, value + i, 1) == UNQLITE_OK, "Append %d failed.", i);
+        }
+        ck_assert(unqlite_commit(pDb) == UNQLITE_OK);
+        ck_assert(unqlite_kv_fetch(pDb, "fill", 4, back, &size) == UNQLITE_OK && size == sizeof(value));
+        ck_assert(memcmp(back, value, sizeof(value)) == 0);
+    }
+END_TEST
+
 // ---- Set up the test suite. ----
 Suite *helper_suite(void) {
     Suite *s;
@@ -1155,6 +2716,7 @@ Suite *helper_suite(void) {
     tcase_add_test(tc_core, check_initialize_element_common);
     tcase_add_test(tc_core, check_initialize_element_dir);
     tcase_add_test(tc_core, check_initialize_element_file);
+    tcase_add_test(tc_core, check_initialize_element_keys);
     // get_name and set_name.
     tcase_add_test(tc_core, check_set_get_name);
     // get_path and set_path.
@@ -1167,6 +2729,7 @@ Suite *helper_suite(void) {
     tcase_add_test(tc_core, check_dat_del_chunk);
     // dat_insert_chunk
     tcase_add_test(tc_core, check_dat_insert_chunk);
+    tcase_add_test(tc_core, check_dat_shift_windows);
     // tokenize_path
     tcase_add_test(tc_core, check_tokenize_path);
     // separate_path
@@ -1187,7 +2750,35 @@ Suite *helper_suite(void) {
     tcase_add_checked_fixture(tc_fuse, setup, teardown);
     // getattr, chmod, chown.
     tcase_add_test(tc_fuse, check_getattr_chown_chmod);
-    // readdir TODO - impl
+    // truncate and fallocate on sparse files
+    tcase_add_test(tc_fuse, check_sparse_fallocate);
+    tcase_add_test(tc_fuse, check_write_hole);
+    // deduplicated chunks
+    tcase_add_test(tc_fuse, check_dedup);
+    tcase_add_test(tc_fuse, check_clone);
+    // snapshots
+    tcase_add_test(tc_fuse, check_snapshots);
+    tcase_add_test(tc_fuse, check_snapshot_large);
+    // mapped and in-memory stores
+    tcase_add_test(tc_fuse, check_store_options);
+    // sharded store
+    tcase_add_test(tc_fuse, check_shards);
+    tcase_add_test(tc_fuse, check_fsync_shard);
+    tcase_add_test(tc_fuse, check_fsync_quiesce);
+    tcase_add_test(tc_fuse, check_durability);
+    // write-back of appends
+    tcase_add_test(tc_fuse, check_write_back);
+    tcase_add_test(tc_fuse, check_write_back_ranges);
+    // reads during a commit
+    tcase_add_test(tc_fuse, check_commit_readers);
+    tcase_add_test(tc_fuse, check_shared_fetch);
+    // stats file
+    tcase_add_test(tc_fuse, check_stats);
+    // binary trace
+    tcase_add_test(tc_fuse, check_trace);
+    // readdir and rename
+    tcase_add_test(tc_fuse, check_readdir_rename);
+    tcase_add_test(tc_fuse, check_rename_move_replace);
     // open
     tcase_add_test(tc_fuse, check_open);
     // read and write
@@ -1199,6 +2790,19 @@ Suite *helper_suite(void) {
     tcase_add_test(tc_fuse, check_mkdir);
     // rmdir
     tcase_add_test(tc_fuse, check_rmdir);
+    // online vacuum
+    tcase_add_test(tc_fuse, check_vacuum);
+    tcase_add_test(tc_fuse, check_vacuum_rollback);
+    tcase_add_test(tc_fuse, check_slave_pages);
+    // overflow extents
+    tcase_add_test(tc_fuse, check_extents);
+    // value compression
+    tcase_add_test(tc_fuse, check_compression);
+    // read-ahead
+    tcase_add_test(tc_fuse, check_readahead);
+    // appends filling overflow pages
+    tcase_add_test(tc_fuse, check_append_fill);
+    tcase_add_test(tc_fuse, check_large_directory);
 
     suite_add_tcase(s, tc_core);
     suite_add_tcase(s, tc_fuse);
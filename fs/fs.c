@@ -1,4 +1,8 @@
 #include "fs.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
 
 unqlite *pDb;
 
@@ -7,9 +11,113 @@ unqlite_int64 root_object_size_value = sizeof(struct rootS);
 unqlite *pDb;
 struct rootS root_object;
 int root_is_empty;
+int store_sync_level = STORE_SYNC_LEVEL;
+int store_features;
+// Store settings, see the db, engine, journal, mmap, page_size and cache_pages mount options.
+const char *store_name = DATABASE_NAME;
+const char *store_engine = STORE_ENGINE;
+unsigned int store_open_flags = STORE_OPEN_FLAGS;
+int store_page_size;    // 0 for the library default, existing stores keep theirs.
+int store_cache_pages;  // 0 for the library default.
+
+// Shards of the store, the first one is also pDb. store_shards is the count asked for until the store is open.
+unqlite *store_shard[STORE_MAX_SHARDS];
+int store_shards = 1;
+// Shards written since their last commit. Writes hold store_commit_lock and the lock of their shard shared. A
+// commit of a single shard holds the lock of the shard exclusively, so the other shards take writes meanwhile.
+// A commit over several shards holds store_commit_lock exclusively from the prepare of the first shard to the
+// removal of the commit record.
+static int store_dirty[STORE_MAX_SHARDS];
+static pthread_rwlock_t store_commit_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t store_shard_lock[STORE_MAX_SHARDS];
+// Shards that must be committed together with each shard, since a change wrote to all of them after their last
+// commit. store_change is the mask of the shards written by the change the thread is making.
+static uint64_t store_linked[STORE_MAX_SHARDS];
+static pthread_mutex_t store_link_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint64_t store_change;
+// Called with 1 before a commit picks the shards it commits, and with 0 once it holds their locks. newfs makes
+// the changes to the tree wait in between, so that no commit takes half of one.
+void (*store_quiesce)(int begin);
 
 FILE *logfile;
 
+// One arena per thread. Blocks are chained newest first, the data follows the header.
+struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+	size_t reserved; // Keeps the data 16-byte aligned.
+};
+static __thread struct arena_block *arena_head;
+
+// Read-ahead requests, consumed by a single worker thread.
+struct readahead_request {
+	uuid_t key;
+	off_t offset;
+	off_t length;
+};
+static struct readahead_request readahead_queue[READAHEAD_QUEUE_SIZE];
+static int readahead_head, readahead_count, readahead_running;
+static uint64_t readahead_queued, readahead_dropped;    // Requests taken and requests that found the queue full.
+static pthread_t readahead_thread;
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_cond = PTHREAD_COND_INITIALIZER;
+
+// Group commit: every sync_store() call made while a commit runs is served by the next one. Slot i is for the
+// commits of shard i, slot STORE_MAX_SHARDS for the commits of the whole store.
+static unsigned long commit_requested[STORE_MAX_SHARDS + 1], commit_done[STORE_MAX_SHARDS + 1];
+static int commit_running[STORE_MAX_SHARDS + 1];
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+// Serialises the reference count updates of deduplicated chunks.
+static pthread_mutex_t cas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stats of a thread. Only the owner thread writes to it, readers add up every block. Blocks are never
+// freed, the block of a thread that exits goes to the next new thread.
+struct stats_thread {
+	struct stats_thread *next;      // Next of all the blocks.
+	struct stats_thread *next_free; // Next block without a thread.
+	uint64_t count[STAT_COUNT];
+	uint64_t sum[STAT_COUNT];       // Total nanoseconds.
+	uint64_t hist[STAT_COUNT][STATS_BUCKETS];
+};
+static struct stats_thread *stats_all, *stats_free;
+static __thread struct stats_thread *stats_mine;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Trace ring of a thread, a single producer and a single consumer. Rings are never freed, the ring of
+// a thread that exits goes to the next new thread.
+struct trace_ring {
+	struct trace_ring *next;        // Next of all the rings.
+	struct trace_ring *next_free;   // Next ring without a thread.
+	uint64_t head;                  // Written by the owner thread.
+	uint64_t tail;                  // Written by the drain thread.
+	uint64_t dropped;               // Records that found the ring full.
+	uint64_t dropped_reported;      // Drops written to the file so far.
+	uint16_t thread;
+	struct trace_record records[TRACE_RING_SIZE];
+};
+int trace_level = TRACE_DEFAULT_LEVEL;
+static struct trace_ring *trace_all, *trace_free;
+static __thread struct trace_ring *trace_mine;
+static uint16_t trace_threads;
+static pthread_key_t trace_key;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t trace_thread;
+static int trace_fd = -1, trace_running;
+
+// Inode allocator: the next inode and the end of the batch reserved in the store. Until the first shard is
+// committed, the changes using an inode of the batch are linked to it, so the batch is never lost while they
+// are kept.
+static uint64_t inode_next, inode_limit;
+static int inode_batch_pending;
+static pthread_mutex_t inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
 FILE *init_log_file(){
     
     //Open logfile.
@@ -23,14 +131,6 @@ FILE *init_log_file(){
     return logfile;
 }
 
-void write_log(const char *format, ...){
-    va_list ap;
-    va_start(ap, format);
-#ifndef IS_LIB
-    vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
-#endif
-}
-
 void write_log_direct(const char *format, ...){
     va_list ap;
     va_start(ap, format);
@@ -40,14 +140,19 @@ void write_log_direct(const char *format, ...){
 void error_handler(int rc){
 	if( rc != UNQLITE_OK ){
 		const char *zBuf;
-		int iLen;
-		unqlite_config(pDb,UNQLITE_CONFIG_ERR_LOG,&zBuf,&iLen);
-		if( iLen > 0 ){
-			write_log_direct("error_handler: %s\n",zBuf);
+		int iLen, shard;
+		for( shard = 0 ; shard < store_shards && store_shard[shard] != NULL ; shard++ ){
+			iLen = 0;
+			unqlite_config(store_shard[shard],UNQLITE_CONFIG_ERR_LOG,&zBuf,&iLen);
+			if( iLen > 0 ){
+				write_log_direct("error_handler: %s\n",zBuf);
+			}
 		}
 		if( rc != UNQLITE_BUSY && rc != UNQLITE_NOTIMPLEMENTED ){
 			/* Rollback */
-			unqlite_rollback(pDb);
+			for( shard = 0 ; shard < store_shards && store_shard[shard] != NULL ; shard++ ){
+				unqlite_rollback(store_shard[shard]);
+			}
 		}
 		exit(rc);
 	}
@@ -60,13 +165,114 @@ void print_id(uuid_t *id){
     }
 }
 
+//Path of a shard of the store.
+static void store_shard_name(char *name, size_t size, int shard){
+	if( shard == 0 ){
+		snprintf(name, size, "%s", store_name);
+	}else{
+		snprintf(name, size, "%s.%d", store_name, shard);
+	}
+}
+
+//Sync the directory of the store, which makes the creation or removal of the commit record durable.
+static int store_sync_dir(){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s", store_name);
+	int fd = open(dirname(path), O_RDONLY | O_DIRECTORY);
+	if( fd < 0 ){ return UNQLITE_IOERR; }
+	int rc = fsync(fd);
+	close(fd);
+	return (rc == 0) ? UNQLITE_OK : UNQLITE_IOERR;
+}
+
+//Create or remove the commit record. Once it exists, the prepared shards of the commit are committed.
+static int store_commit_record(int present){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s%s", store_name, STORE_COMMIT_SUFFIX);
+	if( present ){
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+		if( fd < 0 ){ return UNQLITE_IOERR; }
+		close(fd);
+	}else if( unlink(path) != 0 ){
+		return UNQLITE_IOERR;
+	}
+	return (store_sync_level == UNQLITE_SYNC_LEVEL_NONE) ? UNQLITE_OK : store_sync_dir();
+}
+
+//Finish a commit over several shards interrupted by a crash. With a commit record every prepared shard is
+//committed and its journal is dropped, otherwise the journals roll the shards back when they are opened.
+static void store_recover(){
+	char path[PATH_MAX];
+	int shard;
+	snprintf(path, sizeof(path), "%s%s", store_name, STORE_COMMIT_SUFFIX);
+	if( (store_open_flags & UNQLITE_OPEN_IN_MEMORY) || access(path, F_OK) != 0 ){ return; }
+	write_log_direct("init_store: completing an interrupted commit\n");
+	for( shard = 0 ; shard < STORE_MAX_SHARDS ; shard++ ){
+		char journal[PATH_MAX + sizeof(UNQLITE_JOURNAL_FILE_SUFFIX)];
+		store_shard_name(path, sizeof(path), shard);
+		snprintf(journal, sizeof(journal), "%s%s", path, UNQLITE_JOURNAL_FILE_SUFFIX);
+		unlink(journal);
+	}
+	if( store_commit_record(0) != UNQLITE_OK ){
+		perror("newfs: unable to remove the commit record");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//Open a shard of the store with the engine and pager settings.
+static void store_open_shard(int shard){
+	char name[PATH_MAX];
+	unqlite *db;
+	int rc;
+	store_shard_name(name, sizeof(name), shard);
+	rc = unqlite_open(&store_shard[shard],name,store_open_flags);
+	if( rc != UNQLITE_OK ){
+		fprintf(stderr, "newfs: unable to open the store '%s' (%d)\n", name, rc);
+		exit(rc);
+	}
+	db = store_shard[shard];
+	store_dirty[shard] = 0;
+	store_linked[shard] = 0;
+	pthread_rwlock_init(&store_shard_lock[shard], NULL);
+	rc = unqlite_config(db,UNQLITE_CONFIG_KV_ENGINE,store_engine);
+	if( rc != UNQLITE_OK ){
+		fprintf(stderr, "newfs: unable to use the engine '%s'\n", store_engine);
+		error_handler(rc);
+	}
+	if( store_cache_pages > 0 ){
+		rc = unqlite_config(db,UNQLITE_CONFIG_MAX_PAGE_CACHE,store_cache_pages);
+		if( rc != UNQLITE_OK ){
+			fprintf(stderr, "newfs: the cache needs at least 256 pages\n");
+			error_handler(rc);
+		}
+	}
+	// Engines without overflow pages (mem) keep their values as given.
+	rc = unqlite_kv_config(db,UNQLITE_KV_CONFIG_COMPRESSION,STORE_CODEC);
+	if( rc != UNQLITE_OK && rc != UNQLITE_UNKNOWN ){ error_handler(rc); }
+	rc = unqlite_config(db,UNQLITE_CONFIG_SYNC_LEVEL,store_sync_level);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+}
+
 //Initialise the store. If no root object is found, create one and write it to the store.
 void init_store(){
-	int rc;
+	int rc, shard, shards = store_shards;
 	write_log_direct("init_store\n");
-	// Open the database.
-	rc = unqlite_open(&pDb,DATABASE_NAME,UNQLITE_OPEN_CREATE);
-	if( rc != UNQLITE_OK ){ error_handler(rc); }
+	// The page size of new stores is a library setting, it only changes before the first store is opened.
+	if( store_page_size > 0 ){
+		rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_PAGE_SIZE,store_page_size);
+		if( rc != UNQLITE_OK && rc != UNQLITE_LOCKED ){
+			fprintf(stderr, "newfs: invalid page size %d\n", store_page_size);
+			exit(rc);
+		}
+	}
+	// Open the database. The other shards are opened once the first one tells how many there are.
+	store_recover();
+	store_shards = 1;
+	store_open_shard(0);
+	pDb = store_shard[0];
+	// The allocator reads its state from this store on first use.
+	inode_next = inode_limit = 0;
+	inode_batch_pending = 0;
 
 	// Does root already exist?
 	rc = fetch_root();
@@ -96,15 +302,908 @@ void init_store(){
 		 	error_handler(rc);
 		 }
     }
+	// A read-only (mapped) store cannot be initialised.
+	if( root_is_empty && (store_open_flags & UNQLITE_OPEN_READONLY) ){
+		fprintf(stderr, "newfs: '%s' is empty, a read-only store must be created first\n", store_name);
+		exit(UNQLITE_NOTFOUND);
+	}
+
+	// The features of an existing store win over the requested ones.
+	int features;
+	unqlite_int64 nBytes = sizeof(features);
+	rc = store_fetch(FEATURES_KEY,FEATURES_KEY_SIZE,&features,&nBytes);
+	if( rc == UNQLITE_OK ){
+		if( features != store_features ){
+			fprintf(stderr, "newfs: the store was created with features 0x%x, using them\n", features);
+		}
+		store_features = features;
+	}else if( rc == UNQLITE_NOTFOUND && root_is_empty ){
+		rc = store_put(FEATURES_KEY,FEATURES_KEY_SIZE,&store_features,sizeof(store_features));
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+	}else{
+		store_features = 0;
+	}
+
+	// So does the shard count.
+	int stored_shards;
+	nBytes = sizeof(stored_shards);
+	rc = store_fetch(SHARDS_KEY,SHARDS_KEY_SIZE,&stored_shards,&nBytes);
+	if( rc == UNQLITE_OK ){
+		if( stored_shards != shards ){
+			fprintf(stderr, "newfs: the store was created with %d shards, using them\n", stored_shards);
+		}
+		shards = stored_shards;
+	}else if( rc == UNQLITE_NOTFOUND && root_is_empty ){
+		rc = store_put(SHARDS_KEY,SHARDS_KEY_SIZE,&shards,sizeof(shards));
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+	}else{
+		shards = 1;
+	}
+	for( shard = 1 ; shard < shards ; shard++ ){
+		store_open_shard(shard);
+		store_shards = shard + 1;
+	}
+}
+
+//Shard of a key. The records of an inode stay together.
+int store_shard_of(const void *key, int len){
+	if( store_shards == 1 ){ return 0; }
+	if( len == KEY_SIZE ){
+		return (int) (((key_inode(key) * 0x9E3779B97F4A7C15ULL) >> 32) % (uint64_t) store_shards);
+	}
+	if( len == CAS_KEY_SIZE ){
+		return ((const unsigned char *) key)[0] % store_shards;
+	}
+	return 0;
+}
+
+//Store holding a key.
+unqlite *store_of(const void *key, int len){
+	return store_shard[store_shard_of(key, len)];
+}
+
+//Start a change made of several writes. Returns the shards written by the change made so far, for
+//store_change_end(), once the new change is independent of it.
+uint64_t store_change_begin(){
+	uint64_t outer = store_change;
+	store_change = 0;
+	return outer;
+}
+
+void store_change_end(uint64_t outer){
+	store_change = outer;
+}
+
+//Add a shard to the change of the thread, which links it to the shards the change wrote before.
+static void store_link(int shard){
+	uint64_t bit = (uint64_t) 1 << shard;
+	int i;
+	if( store_change & bit ){ return; }
+	store_change |= bit;
+	if( store_change == bit ){ return; }
+	pthread_mutex_lock(&store_link_lock);
+	for( i = 0 ; i < store_shards ; i++ ){
+		if( store_change & ((uint64_t) 1 << i) ){ store_linked[i] |= store_change; }
+	}
+	pthread_mutex_unlock(&store_link_lock);
+}
+
+//Start and end a write to a shard. Writes wait while their shard or several shards are committed.
+static void store_write_begin(int shard, int link){
+	if( store_shards > 1 ){
+		pthread_rwlock_rdlock(&store_commit_lock);
+		pthread_rwlock_rdlock(&store_shard_lock[shard]);
+		__atomic_store_n(&store_dirty[shard], 1, __ATOMIC_RELAXED);
+		if( link ){ store_link(shard); }
+	}
+}
+
+static void store_write_end(int shard){
+	if( store_shards > 1 ){
+		pthread_rwlock_unlock(&store_shard_lock[shard]);
+		pthread_rwlock_unlock(&store_commit_lock);
+	}
+}
+
+int store_fetch(const void *key, int len, void *buf, unqlite_int64 *size){
+	return unqlite_kv_fetch(store_of(key, len),key,len,buf,size);
+}
+
+int store_fetch_callback(const void *key, int len, int (*consumer)(const void *, unsigned int, void *), void *data){
+	return unqlite_kv_fetch_callback(store_of(key, len),key,len,consumer,data);
+}
+
+int store_put(const void *key, int len, const void *data, unqlite_int64 size){
+	int shard = store_shard_of(key, len);
+	store_write_begin(shard, 1);
+	int rc = unqlite_kv_store(store_shard[shard],key,len,data,size);
+	store_write_end(shard);
+	return rc;
+}
+
+int store_append(const void *key, int len, const void *data, unqlite_int64 size){
+	int shard = store_shard_of(key, len);
+	store_write_begin(shard, 1);
+	int rc = unqlite_kv_append(store_shard[shard],key,len,data,size);
+	store_write_end(shard);
+	return rc;
+}
+
+int store_delete(const void *key, int len){
+	int shard = store_shard_of(key, len);
+	store_write_begin(shard, 1);
+	int rc = unqlite_kv_delete(store_shard[shard],key,len);
+	store_write_end(shard);
+	return rc;
+}
+
+//Worker thread: prepare the commit of a shard.
+static void *store_prepare_worker(void *db){
+	return (void *) (intptr_t) unqlite_config((unqlite *) db, UNQLITE_CONFIG_PREPARE_COMMIT);
+}
+
+//Shards linked to a shard, directly or through other shards, including itself. Called with store_link_lock held.
+static uint64_t store_closure(int shard){
+	uint64_t closure = (uint64_t) 1 << shard, grown;
+	int i;
+	do{
+		grown = closure;
+		for( i = 0 ; i < store_shards ; i++ ){
+			if( closure & ((uint64_t) 1 << i) ){ grown |= store_linked[i]; }
+		}
+		if( grown == closure ){ break; }
+		closure = grown;
+	}while( 1 );
+	return closure;
+}
+
+//Commit the shards of mask that were written. Each shard commits on its own when it is the only one changed.
+//Otherwise every changed shard is prepared, in parallel, then the commit record decides the commit before the
+//journals go. Called with store_commit_lock held exclusively, or with the lock of the only shard of mask.
+static int store_commit_shards(uint64_t mask){
+	unqlite *dirty[STORE_MAX_SHARDS];
+	pthread_t workers[STORE_MAX_SHARDS];
+	int started[STORE_MAX_SHARDS];
+	int shard, count = 0, i, rc = UNQLITE_OK;
+
+	for( shard = 0 ; shard < store_shards ; shard++ ){
+		if( (mask & ((uint64_t) 1 << shard)) && store_dirty[shard] ){
+			dirty[count++] = store_shard[shard];
+			store_dirty[shard] = 0;
+		}
+	}
+	if( count == 1 || (store_open_flags & (UNQLITE_OPEN_IN_MEMORY | UNQLITE_OPEN_OMIT_JOURNALING)) ){
+		// Nothing to roll back together without journals.
+		for( i = 0 ; i < count && rc == UNQLITE_OK ; i++ ){
+			rc = unqlite_commit(dirty[i]);
+		}
+	}else if( count > 1 ){
+		for( i = 1 ; i < count ; i++ ){
+			started[i] = (pthread_create(&workers[i], NULL, store_prepare_worker, dirty[i]) == 0);
+		}
+		rc = unqlite_config(dirty[0], UNQLITE_CONFIG_PREPARE_COMMIT);
+		for( i = 1 ; i < count ; i++ ){
+			void *result;
+			if( started[i] ){
+				pthread_join(workers[i], &result);
+			}else{
+				result = store_prepare_worker(dirty[i]);
+			}
+			if( rc == UNQLITE_OK ){ rc = (int) (intptr_t) result; }
+		}
+		if( rc == UNQLITE_OK ){
+			rc = store_commit_record(1);
+			// A record that may not be on disk must not decide the commit at the next mount either.
+			if( rc != UNQLITE_OK ){ store_commit_record(0); }
+		}
+		if( rc != UNQLITE_OK ){
+			// Nothing is committed without the record. Undo the prepared shards now, not at the next mount.
+			for( i = 0 ; i < count ; i++ ){
+				unqlite_rollback(dirty[i]);
+			}
+		}
+		for( i = 0 ; i < count && rc == UNQLITE_OK ; i++ ){
+			rc = unqlite_commit(dirty[i]);
+		}
+		if( rc == UNQLITE_OK ){ rc = store_commit_record(0); }
+	}
+	if( rc == UNQLITE_OK ){
+		// The committed shards no longer depend on any other.
+		pthread_mutex_lock(&store_link_lock);
+		for( shard = 0 ; shard < store_shards ; shard++ ){
+			if( mask & ((uint64_t) 1 << shard) ){ store_linked[shard] = 0; }
+		}
+		pthread_mutex_unlock(&store_link_lock);
+		if( mask & 1 ){ __atomic_store_n(&inode_batch_pending, 0, __ATOMIC_RELAXED); }
+	}
+	return rc;
+}
+
+//Commit a shard with the shards linked to it, or the whole store for STORE_MAX_SHARDS. A shard linked to no
+//other commits under its own lock, the other shards keep taking writes.
+static int store_commit(int slot){
+	uint64_t mask = ~(uint64_t) 0;
+	int rc;
+	if( store_quiesce ){ store_quiesce(1); }
+	if( store_shards == 1 ){
+		// The writes wait for the commit of the only shard anyway.
+		rc = unqlite_commit(pDb);
+		if( store_quiesce ){ store_quiesce(0); }
+		return rc;
+	}
+
+	if( slot < store_shards ){
+		pthread_mutex_lock(&store_link_lock);
+		mask = store_closure(slot);
+		pthread_mutex_unlock(&store_link_lock);
+	}
+	if( slot < store_shards && mask == ((uint64_t) 1 << slot) ){
+		pthread_rwlock_rdlock(&store_commit_lock);
+		pthread_rwlock_wrlock(&store_shard_lock[slot]);
+		if( store_quiesce ){ store_quiesce(0); }
+		rc = store_commit_shards(mask);
+		pthread_rwlock_unlock(&store_shard_lock[slot]);
+	}else{
+		pthread_rwlock_wrlock(&store_commit_lock);
+		if( store_quiesce ){ store_quiesce(0); }
+		rc = store_commit_shards(mask);
+	}
+	pthread_rwlock_unlock(&store_commit_lock);
+	return rc;
+}
+
+//Commit and close every shard. The shard count stays, for the next init_store().
+void store_close(){
+	int shard, rc = store_commit(STORE_MAX_SHARDS);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+	for( shard = store_shards - 1 ; shard >= 0 ; shard-- ){
+		unqlite_close(store_shard[shard]);
+		store_shard[shard] = NULL;
+	}
+	pDb = NULL;
 }
 
 //Fetch the root object.
 int fetch_root(){
-	return unqlite_kv_fetch(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE_P);
+	return store_fetch(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE_P);
 }
 
 //Store the root object.
 int store_root(){
-	return unqlite_kv_store(pDb,ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE);
+	return store_put(ROOT_OBJECT_KEY,ROOT_OBJECT_KEY_SIZE,&root_object,ROOT_OBJECT_SIZE);
+}
+
+//Run one step of the online vacuum, on each shard in turn. A new pass is only started once enough of the
+//shard is free.
+void vacuum_step(){
+	static unsigned next_shard;
+	unqlite_int64 nFree, nPage, nRemain;
+	int shard = (int) (__atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % (unsigned) store_shards);
+	int rc = unqlite_kv_config(store_shard[shard], UNQLITE_KV_CONFIG_VACUUM, 0, &nFree, &nPage, &nRemain);
+	if( rc != UNQLITE_OK ){ return; }
+	if( nRemain == 0 && nFree * VACUUM_FREE_RATIO < nPage ){ return; }
+
+	// Moving pages changes no record, the shard is not linked to the others.
+	store_write_begin(shard, 0);
+	rc = unqlite_kv_config(store_shard[shard], UNQLITE_KV_CONFIG_VACUUM, VACUUM_STEP_PAGES, &nFree, &nPage, &nRemain);
+	store_write_end(shard);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+	trace_write(TRACE_OP_VACUUM, stats_now(), "", nFree, nPage, (int) nRemain);
+}
+
+//Worker thread: hand the queued requests to the store, which reads the pages ahead.
+static void *readahead_worker(void *unused){
+	struct readahead_request req;
+	pthread_mutex_lock(&readahead_lock);
+	for(;;){
+		while( readahead_running && readahead_count == 0 ){
+			pthread_cond_wait(&readahead_cond, &readahead_lock);
+		}
+		if( !readahead_running ){ break; }
+		req = readahead_queue[readahead_head];
+		readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_SIZE;
+		readahead_count--;
+		pthread_mutex_unlock(&readahead_lock);
+		// Only a hint, errors show up again when the data is read.
+		off_t index;
+		for( index = req.offset / DATA_CHUNK_SIZE ; index <= (req.offset + req.length - 1) / DATA_CHUNK_SIZE ; index++ ){
+			uuid_t chunk;
+			key_with_index(chunk, req.key, (uint32_t) index);
+			if( (store_features & FEATURE_DEDUP) || key_kind(req.key) == KEY_KIND_SHARED ){
+				// Read the shared chunk the file chunk refers to.
+				struct chunk_ref ref;
+				unsigned char data_key[CAS_KEY_SIZE];
+				if( cas_fetch_ref(chunk, &ref) != UNQLITE_OK ){ continue; }
+				cas_key(data_key, &ref, CAS_KIND_DATA);
+				unqlite_kv_config(store_of(data_key, CAS_KEY_SIZE), UNQLITE_KV_CONFIG_PREFETCH, data_key, CAS_KEY_SIZE, (unqlite_int64) 0, (unqlite_int64) ref.length);
+				continue;
+			}
+			unqlite_kv_config(store_of(chunk, KEY_SIZE), UNQLITE_KV_CONFIG_PREFETCH, chunk, KEY_SIZE, (unqlite_int64) 0, (unqlite_int64) DATA_CHUNK_SIZE);
+		}
+		pthread_mutex_lock(&readahead_lock);
+	}
+	pthread_mutex_unlock(&readahead_lock);
+	return NULL;
 }
 
+//Start the read-ahead worker. The store must be open and its handle thread safe.
+void readahead_start(){
+	readahead_head = readahead_count = 0;
+	readahead_running = unqlite_lib_is_threadsafe();
+	if( readahead_running && pthread_create(&readahead_thread, NULL, readahead_worker, NULL) != 0 ){
+		readahead_running = 0;
+	}
+}
+
+//Stop the worker, dropping the requests still queued.
+void readahead_stop(){
+	pthread_mutex_lock(&readahead_lock);
+	if( !readahead_running ){
+		pthread_mutex_unlock(&readahead_lock);
+		return;
+	}
+	readahead_running = 0;
+	pthread_cond_signal(&readahead_cond);
+	pthread_mutex_unlock(&readahead_lock);
+	pthread_join(readahead_thread, NULL);
+}
+
+//Queue a request, or drop it if the worker is behind.
+static void readahead_submit(uuid_t *key, off_t offset, off_t length){
+	pthread_mutex_lock(&readahead_lock);
+	if( readahead_running && readahead_count < READAHEAD_QUEUE_SIZE ){
+		struct readahead_request *req = &readahead_queue[(readahead_head + readahead_count) % READAHEAD_QUEUE_SIZE];
+		memcpy(req->key, *key, KEY_SIZE);
+		req->offset = offset;
+		req->length = length;
+		readahead_count++;
+		readahead_queued++;
+		pthread_cond_signal(&readahead_cond);
+	}else if( readahead_running ){
+		readahead_dropped++;
+	}
+	pthread_mutex_unlock(&readahead_lock);
+}
+
+//Record a read of an open file. Sequential reads request the next window once half of the previous one is consumed, and the window doubles each time like the kernel read-ahead. Any other access resets it.
+void readahead_update(struct readahead *ra, uuid_t *key, off_t offset, size_t size, off_t file_size){
+	if( offset != ra->next && offset != 0 ){
+		ra->window = 0;
+	}else if( ra->window == 0 || offset == 0 ){
+		ra->window = READAHEAD_MIN_WINDOW;
+		ra->end = offset + size;
+	}
+	ra->next = offset + size;
+	if( ra->window == 0 || ra->end >= file_size || ra->next + ra->window / 2 < ra->end ){ return; }
+
+	readahead_submit(key, ra->end, ra->window);
+	ra->end += ra->window;
+	if( ra->window < READAHEAD_MAX_WINDOW ){ ra->window *= 2; }
+}
+
+//Commit through the group commit of a slot, see store_commit(). Returns once a commit of the slot that
+//started after the call has completed.
+static void store_sync(int slot){
+	unsigned long ticket, upto;
+	int rc;
+	pthread_mutex_lock(&commit_lock);
+	ticket = ++commit_requested[slot];
+	while( commit_done[slot] < ticket ){
+		if( commit_running[slot] ){
+			pthread_cond_wait(&commit_cond, &commit_lock);
+			continue;
+		}
+		// Run the commit for every request queued so far.
+		upto = commit_requested[slot];
+		commit_running[slot] = 1;
+		pthread_mutex_unlock(&commit_lock);
+		uint64_t start = stats_now();
+		rc = store_commit(slot);
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+		stats_record(STAT_COMMIT, start);
+		pthread_mutex_lock(&commit_lock);
+		commit_running[slot] = 0;
+		commit_done[slot] = upto;
+		pthread_cond_broadcast(&commit_cond);
+	}
+	pthread_mutex_unlock(&commit_lock);
+}
+
+//Commit the changes made so far.
+void sync_store(){
+	store_sync(STORE_MAX_SHARDS);
+}
+
+//Commit the changes made so far to a shard, and to the shards they depend on.
+void sync_store_shard(int shard){
+	store_sync((store_shards == 1) ? STORE_MAX_SHARDS : shard);
+}
+
+//Allocate an inode. A batch is reserved in the store at a time, so inodes are never reused after a restart.
+uint64_t alloc_inode(){
+	uint64_t inode;
+	pthread_mutex_lock(&inode_lock);
+	if( inode_next >= inode_limit ){
+		if( inode_limit == 0 ){
+			unqlite_int64 nBytes = sizeof(inode_next);
+			if( store_fetch(INODE_KEY,INODE_KEY_SIZE,&inode_next,&nBytes) != UNQLITE_OK ){
+				inode_next = INODE_FIRST;
+			}
+		}
+		inode_limit = inode_next + INODE_BATCH;
+		int rc = store_put(INODE_KEY,INODE_KEY_SIZE,&inode_limit,sizeof(inode_limit));
+		if( rc != UNQLITE_OK ){ error_handler(rc); }
+		__atomic_store_n(&inode_batch_pending, 1, __ATOMIC_RELAXED);
+	}
+	if( store_shards > 1 && __atomic_load_n(&inode_batch_pending, __ATOMIC_RELAXED) ){ store_link(0); }
+	inode = inode_next++;
+	pthread_mutex_unlock(&inode_lock);
+	return inode;
+}
+
+//Build the key of a record of an inode.
+void make_key(uuid_t key, uint64_t inode, uint32_t kind, uint32_t index){
+	int i;
+	for( i = 0 ; i < 8 ; i++ ){
+		key[i] = (unsigned char) (inode >> (56 - 8 * i));
+	}
+	for( i = 0 ; i < 4 ; i++ ){
+		key[8 + i] = (unsigned char) (kind >> (24 - 8 * i));
+		key[12 + i] = (unsigned char) (index >> (24 - 8 * i));
+	}
+}
+
+//Copy a key with another index, which addresses the chunks of the data of an inode.
+void key_with_index(uuid_t out, const uuid_t key, uint32_t index){
+	int i;
+	memcpy(out, key, KEY_SIZE);
+	for( i = 0 ; i < 4 ; i++ ){
+		out[12 + i] = (unsigned char) (index >> (24 - 8 * i));
+	}
+}
+
+//Extract the inode from a key.
+uint64_t key_inode(const uuid_t key){
+	uint64_t inode = 0;
+	int i;
+	for( i = 0 ; i < 8 ; i++ ){
+		inode = (inode << 8) | key[i];
+	}
+	return inode;
+}
+
+//Extract the kind from a key.
+uint32_t key_kind(const uuid_t key){
+	uint32_t kind = 0;
+	int i;
+	for( i = 8 ; i < 12 ; i++ ){
+		kind = (kind << 8) | key[i];
+	}
+	return kind;
+}
+
+//Build the key of the data or the reference count of a deduplicated chunk.
+void cas_key(unsigned char key[CAS_KEY_SIZE], const struct chunk_ref *ref, char kind){
+	memcpy(key, ref->hash, BLAKE3_OUT_LEN);
+	key[BLAKE3_OUT_LEN] = (unsigned char) kind;
+}
+
+//Fetch the reference held by a file chunk record.
+int cas_fetch_ref(const uuid_t key, struct chunk_ref *ref){
+	unqlite_int64 nBytes = sizeof(struct chunk_ref);
+	int rc = store_fetch(key,KEY_SIZE,ref,&nBytes);
+	if( rc == UNQLITE_OK && nBytes != sizeof(struct chunk_ref) ){ rc = UNQLITE_CORRUPT; }
+	if( rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND ){ error_handler(rc); }
+	return rc;
+}
+
+//Store a chunk by content. A chunk that is already stored only gains a reference.
+void cas_put(const void *data, uint32_t len, struct chunk_ref *ref){
+	unsigned char key[CAS_KEY_SIZE];
+	uint64_t refs = 0;
+	unqlite_int64 nBytes = sizeof(refs);
+	int rc;
+
+	blake3_hash(data, len, ref->hash);
+	ref->length = len;
+	cas_key(key, ref, CAS_KIND_REFS);
+	pthread_mutex_lock(&cas_lock);
+	rc = store_fetch(key,CAS_KEY_SIZE,&refs,&nBytes);
+	if( rc == UNQLITE_NOTFOUND ){
+		unsigned char data_key[CAS_KEY_SIZE];
+		cas_key(data_key, ref, CAS_KIND_DATA);
+		rc = store_put(data_key,CAS_KEY_SIZE,data,len);
+		refs = 0;
+	}
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+	refs++;
+	rc = store_put(key,CAS_KEY_SIZE,&refs,sizeof(refs));
+	pthread_mutex_unlock(&cas_lock);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+}
+
+//Add a reference to a chunk that is already stored, for a file chunk that shares it.
+void cas_hold(const struct chunk_ref *ref){
+	unsigned char key[CAS_KEY_SIZE];
+	uint64_t refs = 0;
+	unqlite_int64 nBytes = sizeof(refs);
+	int rc;
+
+	cas_key(key, ref, CAS_KIND_REFS);
+	pthread_mutex_lock(&cas_lock);
+	rc = store_fetch(key,CAS_KEY_SIZE,&refs,&nBytes);
+	if( rc == UNQLITE_OK ){
+		refs++;
+		rc = store_put(key,CAS_KEY_SIZE,&refs,sizeof(refs));
+	}
+	pthread_mutex_unlock(&cas_lock);
+	if( rc != UNQLITE_OK ){ error_handler(rc); }
+}
+
+//Drop a reference to a chunk, deleting the chunk with its last reference.
+void cas_release(const struct chunk_ref *ref){
+	unsigned char key[CAS_KEY_SIZE], data_key[CAS_KEY_SIZE];
+	uint64_t refs = 0;
+	unqlite_int64 nBytes = sizeof(refs);
+	int rc;
+
+	cas_key(key, ref, CAS_KIND_REFS);
+	pthread_mutex_lock(&cas_lock);
+	rc = store_fetch(key,CAS_KEY_SIZE,&refs,&nBytes);
+	if( rc == UNQLITE_OK && refs > 1 ){
+		refs--;
+		rc = store_put(key,CAS_KEY_SIZE,&refs,sizeof(refs));
+	}else if( rc == UNQLITE_OK ){
+		cas_key(data_key, ref, CAS_KIND_DATA);
+		rc = store_delete(data_key,CAS_KEY_SIZE);
+		if( rc == UNQLITE_OK ){ rc = store_delete(key,CAS_KEY_SIZE); }
+	}
+	pthread_mutex_unlock(&cas_lock);
+	if( rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND ){ error_handler(rc); }
+}
+
+//Monotonic time in nanoseconds.
+uint64_t stats_now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+//Thread exit: hand the stats block over to the next new thread.
+static void stats_thread_exit(void *block){
+	struct stats_thread *stats = block;
+	pthread_mutex_lock(&stats_lock);
+	stats->next_free = stats_free;
+	stats_free = stats;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_key_create(){
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+//Stats block of the calling thread.
+static struct stats_thread *stats_thread_get(){
+	if( stats_mine == NULL ){
+		pthread_once(&stats_once, stats_key_create);
+		pthread_mutex_lock(&stats_lock);
+		if( stats_free != NULL ){
+			stats_mine = stats_free;
+			stats_free = stats_free->next_free;
+		}else{
+			stats_mine = calloc(1, sizeof(struct stats_thread));
+			if( stats_mine == NULL ){
+				pthread_mutex_unlock(&stats_lock);
+				error_handler(UNQLITE_NOMEM);
+			}
+			stats_mine->next = stats_all;
+			stats_all = stats_mine;
+		}
+		pthread_mutex_unlock(&stats_lock);
+		pthread_setspecific(stats_key, stats_mine);
+	}
+	return stats_mine;
+}
+
+//Histogram bucket of a latency: exact below 8ns, then 8 buckets per power of two.
+static int stats_bucket(uint64_t ns){
+	if( ns < STATS_SUB_BUCKETS ){ return (int) ns; }
+	int msb = 63 - __builtin_clzll(ns);
+	int bucket = (msb - 2) * STATS_SUB_BUCKETS + (int) ((ns >> (msb - 3)) & (STATS_SUB_BUCKETS - 1));
+	return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+//Smallest latency of a bucket, in nanoseconds.
+static uint64_t stats_bucket_start(int bucket){
+	if( bucket < STATS_SUB_BUCKETS ){ return (uint64_t) bucket; }
+	return (uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS) << (bucket / STATS_SUB_BUCKETS - 1);
+}
+
+//Add to a counter of the calling thread. Readers may run concurrently, so the store is atomic.
+static void stats_add(uint64_t *counter, uint64_t n){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+//Record an operation that started at start (stats_now()).
+void stats_record(int op, uint64_t start){
+	struct stats_thread *stats = stats_thread_get();
+	uint64_t ns = stats_now() - start;
+	stats_add(&stats->count[op], 1);
+	stats_add(&stats->sum[op], ns);
+	stats_add(&stats->hist[op][stats_bucket(ns)], 1);
+}
+
+//Render the stats of every thread and of the pager in the Prometheus text format. The text is
+//allocated with malloc and its length stored in len.
+char *stats_text(size_t *len){
+	uint64_t hist[STATS_BUCKETS];
+	char *text = NULL;
+	FILE *out = open_memstream(&text, len);
+	struct stats_thread *stats;
+	unqlite_int64 hits = 0, misses = 0, syncs = 0;
+	int op, bucket, shard;
+
+	if( out == NULL ){ error_handler(UNQLITE_NOMEM); }
+	fprintf(out, "# HELP newfs_op_duration_seconds Latency of the file system callbacks and of the store calls.\n");
+	fprintf(out, "# TYPE newfs_op_duration_seconds histogram\n");
+	pthread_mutex_lock(&stats_lock);
+	for( op = 0 ; op < STAT_COUNT ; op++ ){
+		uint64_t count = 0, sum = 0, cumulative = 0;
+		memset(hist, 0, sizeof(hist));
+		for( stats = stats_all ; stats != NULL ; stats = stats->next ){
+			count += __atomic_load_n(&stats->count[op], __ATOMIC_RELAXED);
+			sum += __atomic_load_n(&stats->sum[op], __ATOMIC_RELAXED);
+			for( bucket = 0 ; bucket < STATS_BUCKETS ; bucket++ ){
+				hist[bucket] += __atomic_load_n(&stats->hist[op][bucket], __ATOMIC_RELAXED);
+			}
+		}
+		if( count == 0 ){ continue; }
+		// Only the buckets in use are listed, each bound is the start of the next bucket.
+		for( bucket = 0 ; bucket < STATS_BUCKETS - 1 ; bucket++ ){
+			if( hist[bucket] == 0 ){ continue; }
+			cumulative += hist[bucket];
+			fprintf(out, "newfs_op_duration_seconds_bucket{op=\"%s\",le=\"%.9g\"} %llu\n", stats_names[op],
+			        stats_bucket_start(bucket + 1) / 1e9, (unsigned long long) cumulative);
+		}
+		fprintf(out, "newfs_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", stats_names[op], (unsigned long long) count);
+		fprintf(out, "newfs_op_duration_seconds_sum{op=\"%s\"} %.9f\n", stats_names[op], sum / 1e9);
+		fprintf(out, "newfs_op_duration_seconds_count{op=\"%s\"} %llu\n", stats_names[op], (unsigned long long) count);
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	for( shard = 0 ; shard < store_shards ; shard++ ){
+		unqlite_int64 shard_hits = 0, shard_misses = 0, shard_syncs = 0;
+		unqlite_config(store_shard[shard], UNQLITE_CONFIG_PAGER_STATS, &shard_hits, &shard_misses, &shard_syncs);
+		hits += shard_hits;
+		misses += shard_misses;
+		syncs += shard_syncs;
+	}
+	fprintf(out, "# HELP newfs_pager_cache_hits_total Pages found in the page cache.\n");
+	fprintf(out, "# TYPE newfs_pager_cache_hits_total counter\n");
+	fprintf(out, "newfs_pager_cache_hits_total %lld\n", (long long) hits);
+	fprintf(out, "# HELP newfs_pager_cache_misses_total Pages read from the file.\n");
+	fprintf(out, "# TYPE newfs_pager_cache_misses_total counter\n");
+	fprintf(out, "newfs_pager_cache_misses_total %lld\n", (long long) misses);
+	fprintf(out, "# HELP newfs_pager_syncs_total Syncs of the journal and of the database file.\n");
+	fprintf(out, "# TYPE newfs_pager_syncs_total counter\n");
+	fprintf(out, "newfs_pager_syncs_total %lld\n", (long long) syncs);
+	pthread_mutex_lock(&readahead_lock);
+	fprintf(out, "# HELP newfs_readahead_requests_total Read-ahead requests, queued or dropped because the queue was full.\n");
+	fprintf(out, "# TYPE newfs_readahead_requests_total counter\n");
+	fprintf(out, "newfs_readahead_requests_total{result=\"queued\"} %llu\n", (unsigned long long) readahead_queued);
+	fprintf(out, "newfs_readahead_requests_total{result=\"dropped\"} %llu\n", (unsigned long long) readahead_dropped);
+	pthread_mutex_unlock(&readahead_lock);
+	fclose(out);
+	return text;
+}
+
+//Thread exit: hand the trace ring over to the next new thread. Its records are still drained.
+static void trace_thread_exit(void *ring){
+	struct trace_ring *trace = ring;
+	pthread_mutex_lock(&trace_lock);
+	trace->next_free = trace_free;
+	trace_free = trace;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_key_create(){
+	pthread_key_create(&trace_key, trace_thread_exit);
+}
+
+//Trace ring of the calling thread, NULL if there is no memory for it.
+static struct trace_ring *trace_ring_get(){
+	if( trace_mine == NULL ){
+		pthread_once(&trace_once, trace_key_create);
+		pthread_mutex_lock(&trace_lock);
+		if( trace_free != NULL ){
+			trace_mine = trace_free;
+			trace_free = trace_free->next_free;
+		}else{
+			trace_mine = calloc(1, sizeof(struct trace_ring));
+			if( trace_mine != NULL ){
+				trace_mine->thread = trace_threads++;
+				trace_mine->next = trace_all;
+				// The drain thread walks the list without the lock.
+				__atomic_store_n(&trace_all, trace_mine, __ATOMIC_RELEASE);
+			}
+		}
+		pthread_mutex_unlock(&trace_lock);
+		if( trace_mine != NULL ){ pthread_setspecific(trace_key, trace_mine); }
+	}
+	return trace_mine;
+}
+
+//Trace an operation that started at start (stats_now()). Never blocks: the record is dropped if the ring
+//of the thread is full.
+void trace_write(int op, uint64_t start, const char *path, int64_t arg0, int64_t arg1, int result){
+	if( !__atomic_load_n(&trace_running, __ATOMIC_RELAXED) ){ return; }
+	int level = __atomic_load_n(&trace_level, __ATOMIC_RELAXED);
+	if( level == TRACE_OFF || (level == TRACE_ERRORS && result >= 0) ){ return; }
+
+	struct trace_ring *ring = trace_ring_get();
+	if( ring == NULL ){ return; }
+	uint64_t head = ring->head;
+	if( head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE ){
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	struct trace_record *record = &ring->records[head % TRACE_RING_SIZE];
+	record->start = start;
+	record->duration = stats_now() - start;
+	record->arg[0] = arg0;
+	record->arg[1] = arg1;
+	record->result = result;
+	record->op = (uint16_t) op;
+	record->thread = ring->thread;
+	strncpy(record->path, path, TRACE_PATH_SIZE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Write the records of every ring to the trace file, with a record for the drops since the last drain.
+static void trace_drain(){
+	struct trace_ring *ring;
+	for( ring = __atomic_load_n(&trace_all, __ATOMIC_ACQUIRE) ; ring != NULL ; ring = ring->next ){
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = ring->tail;
+		while( tail < head ){
+			// Up to the end of the ring at a time.
+			uint64_t first = tail % TRACE_RING_SIZE;
+			uint64_t count = head - tail;
+			if( count > TRACE_RING_SIZE - first ){ count = TRACE_RING_SIZE - first; }
+			if( write(trace_fd, &ring->records[first], count * sizeof(struct trace_record)) < 0 ){ break; }
+			tail += count;
+		}
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if( dropped != ring->dropped_reported ){
+			struct trace_record record;
+			memset(&record, 0, sizeof(record));
+			record.start = stats_now();
+			record.arg[0] = (int64_t) (dropped - ring->dropped_reported);
+			record.op = TRACE_OP_DROPPED;
+			record.thread = ring->thread;
+			if( write(trace_fd, &record, sizeof(record)) == sizeof(record) ){
+				ring->dropped_reported = dropped;
+			}
+		}
+	}
+}
+
+//Drain thread: empties the rings every TRACE_DRAIN_INTERVAL_MS until the trace stops.
+static void *trace_worker(void *unused){
+	struct timespec deadline;
+	pthread_mutex_lock(&trace_lock);
+	while( trace_running ){
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += TRACE_DRAIN_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&trace_cond, &trace_lock, &deadline);
+		pthread_mutex_unlock(&trace_lock);
+		trace_drain();
+		pthread_mutex_lock(&trace_lock);
+	}
+	pthread_mutex_unlock(&trace_lock);
+	return NULL;
+}
+
+//Start tracing to file, which is truncated. Returns 0, or -1 with errno set.
+int trace_start(const char *file){
+	struct trace_header header;
+	struct timespec real, mono;
+
+	trace_fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if( trace_fd < 0 ){ return -1; }
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.record_size = sizeof(struct trace_record);
+	clock_gettime(CLOCK_REALTIME, &real);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	header.clock_offset = ((int64_t) real.tv_sec - mono.tv_sec) * 1000000000 + (real.tv_nsec - mono.tv_nsec);
+	if( write(trace_fd, &header, sizeof(header)) != sizeof(header) ){
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+
+	trace_running = 1;
+	if( pthread_create(&trace_thread, NULL, trace_worker, NULL) != 0 ){
+		trace_running = 0;
+		close(trace_fd);
+		trace_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+//Stop tracing: write what is left in the rings and close the file.
+void trace_stop(){
+	pthread_mutex_lock(&trace_lock);
+	if( !trace_running ){
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+	__atomic_store_n(&trace_running, 0, __ATOMIC_RELAXED);
+	pthread_cond_signal(&trace_cond);
+	pthread_mutex_unlock(&trace_lock);
+	pthread_join(trace_thread, NULL);
+	trace_drain();
+	close(trace_fd);
+	trace_fd = -1;
+}
+
+//Allocate a temporary from the arena of the calling thread. It stays valid until arena_reset().
+void *arena_alloc(size_t size){
+	struct arena_block *block = arena_head;
+	void *ptr;
+	size = (size + 15) & ~(size_t) 15;
+	if( block == NULL || block->size - block->used < size ){
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct arena_block) + block_size);
+		if( block == NULL ){ error_handler(UNQLITE_NOMEM); }
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena_head;
+		arena_head = block;
+	}
+	ptr = (char *) (block + 1) + block->used;
+	block->used += size;
+	return ptr;
+}
+
+//Copy a string into the arena.
+char *arena_strdup(const char *str){
+	size_t len = strlen(str) + 1;
+	return memcpy(arena_alloc(len), str, len);
+}
+
+//Position of the next temporary of the calling thread.
+struct arena_mark arena_save(){
+	struct arena_mark mark;
+	mark.block = arena_head;
+	mark.used = (arena_head != NULL) ? arena_head->used : 0;
+	return mark;
+}
+
+//Release the temporaries allocated since mark, for the loops of a request that would fill the arena.
+void arena_rewind(struct arena_mark mark){
+	while( arena_head != NULL && arena_head != mark.block ){
+		struct arena_block *next = arena_head->next;
+		free(arena_head);
+		arena_head = next;
+	}
+	if( arena_head != NULL ){ arena_head->used = mark.used; }
+}
+
+//Release every temporary of the calling thread. The first regular block is kept for the next request.
+void arena_reset(){
+	struct arena_block *block = arena_head, *next;
+	while( block != NULL && (block->next != NULL || block->size > ARENA_BLOCK_SIZE) ){
+		next = block->next;
+		free(block);
+		block = next;
+	}
+	arena_head = block;
+	if( block != NULL ){ block->used = 0; }
+}
@@ -7,7 +7,10 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
 #include <fuse.h>
+#include <sys/ioctl.h>
+#include "blake3.h"
 
 extern unqlite_int64 root_object_size_value;
 #define ROOT_OBJECT_KEY "root"
@@ -19,6 +22,164 @@ extern unqlite_int64 root_object_size_value;
 
 #define KEY_SIZE 16
 
+// Version of the layout of the store, kept under FORMAT_KEY. Stores without it use the first layout.
+#define FORMAT_KEY "format"
+#define FORMAT_KEY_SIZE 6
+#define FORMAT_VERSION 5
+
+// Record keys are (inode, kind, index) stored big-endian in a uuid_t, so the records of an object sort
+// together. Inodes are handed out in batches, the end of the last batch is kept under INODE_KEY.
+#define KEY_KIND_FCB 0
+#define KEY_KIND_DATA 1
+#define KEY_KIND_NAME 2
+#define KEY_KIND_PATH 3
+#define KEY_KIND_SHARED 4
+#define INODE_KEY "inode"
+#define INODE_KEY_SIZE 5
+#define INODE_FIRST 1
+#define INODE_BATCH 1024
+
+// Data is stored in chunks keyed by their index, which bounds the size of an element.
+#define DATA_CHUNK_SIZE 65536
+#define DATA_MAX_SIZE ((off_t) DATA_CHUNK_SIZE << 32)
+
+// Optional features of a store, chosen when it is created and kept under FEATURES_KEY.
+#define FEATURES_KEY "features"
+#define FEATURES_KEY_SIZE 8
+#define FEATURE_DEDUP 1
+
+// The store can be split in shards, each with its own file, pager and journal. The records of an inode go
+// to the shard picked by a hash of the inode, deduplicated chunks by their hash and the named records to
+// the first shard, which is the store file itself. Shard i > 0 is the store file followed by ".i". The
+// count is chosen when the store is created and kept under SHARDS_KEY. A commit that changed several
+// shards is decided by a commit record, the store file followed by STORE_COMMIT_SUFFIX.
+#define SHARDS_KEY "shards"
+#define SHARDS_KEY_SIZE 6
+#define STORE_MAX_SHARDS 64
+#define STORE_COMMIT_SUFFIX ".commit"
+
+// With FEATURE_DEDUP the chunks of regular files are stored once under their BLAKE3 hash followed by
+// CAS_KIND_DATA, with a reference count under the hash followed by CAS_KIND_REFS. The chunk record of
+// a file then holds a struct chunk_ref. Without it, a regular file that was cloned keeps its chunks the
+// same way under data keys of KEY_KIND_SHARED instead of KEY_KIND_DATA.
+#define CAS_KEY_SIZE (BLAKE3_OUT_LEN + 1)
+#define CAS_KIND_DATA 'd'
+#define CAS_KIND_REFS 'r'
+
+// Clone ioctl, issued on the destination file with the path of the source within the file system.
+// The destination gets the content of the source, sharing its deduplicated chunks.
+#define NEWFS_CLONE_PATH_MAX 1024
+struct newfs_clone_args {
+	char source[NEWFS_CLONE_PATH_MAX];
+};
+#define NEWFS_IOC_CLONE _IOW('N', 1, struct newfs_clone_args)
+
+// Online vacuum: pages visited per step and free page ratio (1/n of the file) that starts a pass.
+#define VACUUM_STEP_PAGES 64
+#define VACUUM_FREE_RATIO 8
+
+// Per-request arena: size of the block kept between requests, and size of the bounded data buffers.
+#define ARENA_BLOCK_SIZE 4096
+#define DATA_BUFFER_SIZE 65536
+
+// Codec of the values large enough to go to overflow pages (UNQLITE_KV_CODEC_NONE stores them raw).
+#define STORE_CODEC UNQLITE_KV_CODEC_LZ4
+
+// Flags used to open the store. New stores get a CRC32C in every page, existing ones keep their format.
+#define STORE_OPEN_FLAGS (UNQLITE_OPEN_CREATE | UNQLITE_OPEN_PAGE_CRC)
+
+// Key/value engine of new stores, see the engine mount option. "mem" keeps the store in memory until unmount.
+#define STORE_ENGINE "hash"
+
+// Default durability of the store (UNQLITE_SYNC_LEVEL_*), see the durability mount option.
+#define STORE_SYNC_LEVEL UNQLITE_SYNC_LEVEL_FULL
+
+// Read-ahead of sequential reads: first and largest window, and requests queued for the worker.
+#define READAHEAD_MIN_WINDOW 131072
+#define READAHEAD_MAX_WINDOW 2097152
+#define READAHEAD_QUEUE_SIZE 16
+
+// Write-back of small writes: buffer size and number of dirty ranges of a file that trigger a store, total
+// buffered across files, timeout in seconds and the write size from which writes bypass the buffer.
+#define WRITE_BACK_FILE_SIZE 8388608
+#define WRITE_BACK_RANGES 1024
+#define WRITE_BACK_TOTAL_SIZE 67108864
+#define WRITE_BACK_TIMEOUT 5
+#define WRITE_BACK_DIRECT_SIZE 262144
+
+// Access time modes, see the atime mount options. Relatime only stores an atime that is not newer than
+// mtime and ctime or older than the interval. Lazytime keeps atimes in memory, up to a number of files and
+// for at most the interval, and stores them on fsync and unmount.
+#define ATIME_STRICT 0
+#define ATIME_RELATIME 1
+#define ATIME_LAZYTIME 2
+#define ATIME_NOATIME 3
+#define ATIME_DEFAULT_MODE ATIME_RELATIME
+#define ATIME_INTERVAL 86400
+#define LAZY_ATIME_MAX_FILES 4096
+#define LAZY_ATIME_BUCKETS 256
+
+// Request sizes asked from FUSE, 4 KiB writes are the default otherwise.
+#define FUSE_LARGE_IO_OPTS "-obig_writes,max_write=1048576,max_read=1048576,max_readahead=1048576"
+
+// Operations timed by the stats: the FUSE callbacks, then the store calls.
+#define STAT_GETATTR 0
+#define STAT_READDIR 1
+#define STAT_OPEN 2
+#define STAT_READ 3
+#define STAT_CREATE 4
+#define STAT_UTIME 5
+#define STAT_WRITE 6
+#define STAT_TRUNCATE 7
+#define STAT_FLUSH 8
+#define STAT_RELEASE 9
+#define STAT_FSYNC 10
+#define STAT_FSYNCDIR 11
+#define STAT_FALLOCATE 12
+#define STAT_IOCTL 13
+#define STAT_MKDIR 14
+#define STAT_RENAME 15
+#define STAT_CHMOD 16
+#define STAT_CHOWN 17
+#define STAT_UNLINK 18
+#define STAT_RMDIR 19
+#define STAT_KV_FETCH 20
+#define STAT_KV_STORE 21
+#define STAT_COMMIT 22
+#define STAT_COUNT 23
+
+// Latency histograms have 8 linear buckets per power of two of nanoseconds, up to about 9 minutes.
+#define STATS_SUB_BUCKETS 8
+#define STATS_BUCKETS 304
+
+// Read-only virtual file with the stats in the Prometheus text format, generated when it is opened.
+#define STATS_DIR "/.newfs"
+#define STATS_PATH "/.newfs/stats"
+
+// Named snapshots of the tree are read-only directories under SNAPSHOT_DIR, kept in a directory of their
+// own under SNAPSHOT_KEY. A snapshot copies the FCBs and the directories and shares the deduplicated
+// chunks of the files, so it needs a store created with dedup.
+#define SNAPSHOT_DIR "/.snapshots"
+#define SNAPSHOT_KEY "snapshots"
+#define SNAPSHOT_KEY_SIZE 9
+
+// Request trace: one binary record per callback, kept in a ring per thread and drained to a file by a
+// background thread. Records that find the ring full are dropped and counted. See trace_decode.
+#define TRACE_OFF 0
+#define TRACE_ERRORS 1
+#define TRACE_ALL 2
+#define TRACE_DEFAULT_LEVEL TRACE_ALL
+#define TRACE_FILE "newfs.trace"
+#define TRACE_MAGIC "NEWFSTR1"
+#define TRACE_RING_SIZE 4096
+#define TRACE_PATH_SIZE 64
+#define TRACE_DRAIN_INTERVAL_MS 100
+
+// Trace records that are not callbacks, numbered after the STAT_* operations.
+#define TRACE_OP_VACUUM STAT_COUNT
+#define TRACE_OP_DROPPED (STAT_COUNT + 1)
+#define TRACE_OP_COUNT (STAT_COUNT + 2)
+
 #define STUPID_MAX_PATH 100
 #define STUPID_MAX_FILE_SIZE 100
 
@@ -35,15 +196,106 @@ typedef struct rootS{
 extern unqlite *pDb;
 extern struct rootS root_object;
 extern int root_is_empty;
+extern int store_sync_level;
+extern int store_features;
+extern const char *store_name;
+extern unqlite *store_shard[STORE_MAX_SHARDS];
+extern int store_shards;
+extern const char *store_engine;
+extern unsigned int store_open_flags;
+extern int store_page_size;
+extern int store_cache_pages;
+
+// Start of a trace file.
+struct trace_header {
+	char magic[8];          // TRACE_MAGIC, not terminated.
+	uint32_t record_size;   // sizeof(struct trace_record).
+	uint32_t reserved;
+	int64_t clock_offset;   // Realtime minus monotonic clock, in nanoseconds.
+};
+
+// A traced operation. The arguments depend on the operation, an offset and a size for reads and writes.
+struct trace_record {
+	uint64_t start;         // Monotonic nanoseconds.
+	uint64_t duration;      // Nanoseconds.
+	int64_t arg[2];
+	int32_t result;         // Return value of the callback.
+	uint16_t op;            // STAT_* or TRACE_OP_*.
+	uint16_t thread;
+	char path[TRACE_PATH_SIZE]; // Truncated, only terminated if shorter.
+};
+
+// Reference from a file chunk to a deduplicated chunk.
+struct chunk_ref {
+	uint8_t hash[BLAKE3_OUT_LEN];
+	uint32_t length;
+};
 
 extern void error_handler(int);
 void print_id(uuid_t *);
 void init_store();
 int update_root();
 int store_root();
+void vacuum_step();
+void sync_store();
+void sync_store_shard(int shard);
+uint64_t store_change_begin();
+void store_change_end(uint64_t outer);
+extern void (*store_quiesce)(int begin);
+void store_close();
+int store_shard_of(const void *key, int len);
+unqlite *store_of(const void *key, int len);
+int store_fetch(const void *key, int len, void *buf, unqlite_int64 *size);
+int store_fetch_callback(const void *key, int len, int (*consumer)(const void *, unsigned int, void *), void *data);
+int store_put(const void *key, int len, const void *data, unqlite_int64 size);
+int store_append(const void *key, int len, const void *data, unqlite_int64 size);
+int store_delete(const void *key, int len);
+uint64_t alloc_inode();
+void make_key(uuid_t key, uint64_t inode, uint32_t kind, uint32_t index);
+uint64_t key_inode(const uuid_t key);
+uint32_t key_kind(const uuid_t key);
+void key_with_index(uuid_t out, const uuid_t key, uint32_t index);
+void cas_key(unsigned char key[CAS_KEY_SIZE], const struct chunk_ref *ref, char kind);
+int cas_fetch_ref(const uuid_t key, struct chunk_ref *ref);
+void cas_put(const void *data, uint32_t len, struct chunk_ref *ref);
+void cas_hold(const struct chunk_ref *ref);
+void cas_release(const struct chunk_ref *ref);
+
+// Sequential access detector of an open file.
+struct readahead {
+	off_t next;     // Offset following the last read.
+	off_t window;   // Size of the next request, 0 while the reads are not sequential.
+	off_t end;      // End of the data requested so far.
+};
+
+void readahead_start();
+void readahead_stop();
+void readahead_update(struct readahead *ra, uuid_t *key, off_t offset, size_t size, off_t file_size);
+
+uint64_t stats_now();
+void stats_record(int op, uint64_t start);
+char *stats_text(size_t *len);
+
+void *arena_alloc(size_t size);
+char *arena_strdup(const char *str);
+void arena_reset();
+
+// Position in the arena of a thread, see arena_rewind.
+struct arena_mark {
+	void *block;
+	size_t used;
+};
+struct arena_mark arena_save();
+void arena_rewind(struct arena_mark mark);
+
+extern int trace_level;
+int trace_start(const char *file);
+void trace_stop();
+void trace_write(int op, uint64_t start, const char *path, int64_t arg0, int64_t arg1, int result);
+extern const char *stats_names[STAT_COUNT];
+const char *trace_op_name(int op);
 
 extern FILE* init_log_file();
-extern void write_log(const char *, ...);
 
 struct newfs_state {
     FILE *logfile;
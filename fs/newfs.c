@@ -19,6 +19,11 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "fs.h"
 
@@ -59,6 +64,161 @@ int put_record(uuid_t *uuid, void *data, unqlite_int64 datasize);
 int get_record_size(uuid_t *uuid, void *data, unqlite_int64 size);
 int get_fcb_from_name(struct fcb *dir_fcb, char *name, struct fcb *found_el);
 
+off_t dat_read(struct fcb *file, off_t start_index, off_t size, char *buffer);
+int dat_append(struct fcb *dir, const char *data, off_t size);
+void dat_write(struct fcb *dir, off_t offset, const char *data, off_t size);
+void dat_trim(struct fcb *dir, off_t new_size);
+
+off_t write_back_end(uuid_t *uuid);
+void write_back_expire();
+time_t lazy_atime_get(uuid_t *uuid, time_t stored);
+void lazy_atime_expire();
+
+// How reads update the access time, one of ATIME_*.
+int atime_mode = ATIME_DEFAULT_MODE;
+
+// The data of a directory is a sequence of entries, each a header followed by the name without the null
+// character. The file type is kept with the name, so listing a directory does not fetch every child.
+struct dir_entry {
+    uint64_t inode;     // The FCB key of the element is (inode, KEY_KIND_FCB, 0).
+    uint32_t type;      // S_IFMT bits of its mode.
+    uint32_t name_len;
+};
+
+// Reads the entries of a directory one bounded batch at a time.
+struct dir_cursor {
+    struct fcb *dir;
+    char *batch;
+    off_t batch_start;  // Offset of the batch in the directory data.
+    off_t batch_len;
+    off_t offset;       // Offset of the next entry.
+    off_t entry_offset; // Offset of the entry returned last.
+};
+
+// State of an open file, kept in fi->fh from open/create until release.
+struct open_file {
+    uuid_t uuid;    // FCB of the file.
+    struct readahead ra;
+    char *text;     // Content of a virtual file, NULL for stored files.
+    size_t text_len;
+};
+
+// Returns the state of an open file, or NULL when the call does not come from an open file.
+static struct open_file *get_open_file(struct fuse_file_info *fi) {
+    return (fi != NULL) ? (struct open_file *) (uintptr_t) fi->fh : NULL;
+}
+
+// Attaches a new open file state to fi.
+static void attach_open_file(struct fuse_file_info *fi, struct fcb *file_fcb) {
+    if (fi != NULL) {
+        struct open_file *file = calloc(1, sizeof(struct open_file));
+        if (file == NULL) {
+            error_handler(UNQLITE_NOMEM);
+        }
+        memcpy(file->uuid, file_fcb->uuid, KEY_SIZE);
+        fi->fh = (uint64_t) (uintptr_t) file;
+    }
+}
+
+// The request running on this thread, for the stats and the trace.
+static __thread int request_op = -1;
+static __thread uint64_t request_start;
+static __thread const char *request_path;
+static __thread int64_t request_arg[2];
+
+// Callbacks that change the tree hold tree_lock for reading, a snapshot holds it for writing so that
+// it copies a tree that does not change under it. Readers pass tree_gate first, which a snapshot holds
+// while it waits for the write lock, so that a stream of changes cannot starve it.
+static pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t tree_gate = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool request_changes;
+
+static void tree_lock_shared() {
+    pthread_mutex_lock(&tree_gate);
+    pthread_rwlock_rdlock(&tree_lock);
+    pthread_mutex_unlock(&tree_gate);
+}
+
+// Trades the read lock of the current request for the write lock, and back.
+static void tree_exclusive_begin() {
+    pthread_rwlock_unlock(&tree_lock);
+    pthread_mutex_lock(&tree_gate);
+    pthread_rwlock_wrlock(&tree_lock);
+}
+
+static void tree_exclusive_end() {
+    pthread_rwlock_unlock(&tree_lock);
+    pthread_rwlock_rdlock(&tree_lock);
+    pthread_mutex_unlock(&tree_gate);
+}
+
+// Holds the changes to the tree while a commit starts, see store_quiesce. The thread holds no tree_lock then.
+static void tree_quiesce(int begin) {
+    if (begin) {
+        pthread_mutex_lock(&tree_gate);
+        pthread_rwlock_wrlock(&tree_lock);
+    } else {
+        pthread_rwlock_unlock(&tree_lock);
+        pthread_mutex_unlock(&tree_gate);
+    }
+}
+
+// True for the callbacks which change the tree. fsync commits, which waits for the others to stop, so it
+// holds no lock: the buffers it stores take it, see write_back_store.
+static bool changes_tree(int op) {
+    switch (op) {
+        case STAT_CREATE:
+        case STAT_UTIME:
+        case STAT_WRITE:
+        case STAT_TRUNCATE:
+        case STAT_FLUSH:
+        case STAT_RELEASE:
+        case STAT_FALLOCATE:
+        case STAT_IOCTL:
+        case STAT_MKDIR:
+        case STAT_RENAME:
+        case STAT_CHMOD:
+        case STAT_CHOWN:
+        case STAT_UNLINK:
+        case STAT_RMDIR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Starts timing a callback, one of STAT_*. The path and the arguments go to its trace record.
+static void begin_request(int op, const char *path, int64_t arg0, int64_t arg1) {
+    request_changes = changes_tree(op);
+    if (request_changes) {
+        tree_lock_shared();
+    }
+    store_change_begin();
+    request_op = op;
+    request_path = path;
+    request_arg[0] = arg0;
+    request_arg[1] = arg1;
+    request_start = stats_now();
+}
+
+// Releases the temporaries of the current request and stores the write-back buffers that timed out.
+// Every callback returns through it.
+static int end_request(int rc) {
+    arena_reset();
+    write_back_expire();
+    lazy_atime_expire();
+    if (request_op >= 0) {
+        stats_record(request_op, request_start);
+        trace_write(request_op, request_start, request_path, request_arg[0], request_arg[1], rc);
+        request_op = -1;
+    }
+    if (request_changes) {
+        pthread_rwlock_unlock(&tree_lock);
+        request_changes = false;
+    }
+    return rc;
+}
+
 // ---- FCB related. ----
 // Print UUID.
 void print_UUID(uuid_t *uuid) {
@@ -88,16 +248,15 @@ int initialize_element(struct fcb *object, bool isDir) {
     object->uid = getuid();
     object->gid = getgid();
 
-    // Generate a uuid.
-    uuid_generate_random(object->uuid);
-    // Generate uuid for data field.
-    uuid_generate_random(object->data);
-    put_record(&object->data, 0, 0);
+    // The records of the element share a new inode.
+    uint64_t inode = alloc_inode();
+    make_key(object->uuid, inode, KEY_KIND_FCB, 0);
+    make_key(object->data, inode, KEY_KIND_DATA, 0);
 
-    // Generate uuid for name and path.
-    uuid_generate_random(object->path);
+    // Name and path.
+    make_key(object->path, inode, KEY_KIND_PATH, 0);
     put_record(&object->path, '\0', 1);
-    uuid_generate_random(object->name);
+    make_key(object->name, inode, KEY_KIND_NAME, 0);
     put_record(&object->name, '\0', 1);
     return 0;
 }
@@ -107,16 +266,19 @@ void copy_stat_from_fcb(struct fcb *origin, struct stat *target) {
     memset(target, 0, sizeof(struct stat));
 
     target->st_dev = 0;     /* ID of device containing file */
-    target->st_ino = 0;     /* inode number */
+    target->st_ino = (ino_t) key_inode(origin->uuid);     /* inode number */
     target->st_mode = origin->mode;    /* protection */
     target->st_nlink = 1;   /* number of hard links */
     target->st_uid = origin->uid;     /* user ID of owner */
     target->st_gid = origin->gid;     /* group ID of owner */
     target->st_rdev = 0;    /* device ID (if special file) */
-    target->st_size = origin->size;    /* total size, in bytes */
+    target->st_size = write_back_end(&origin->uuid);    /* total size, in bytes */
+    if (target->st_size < origin->size) {
+        target->st_size = origin->size;
+    }
     target->st_blksize = 0; /* blocksize for file system I/O */
     target->st_blocks = 0;  /* number of 512B blocks allocated */
-    target->st_atime = origin->atime;   /* time of last access */
+    target->st_atime = lazy_atime_get(&origin->uuid, origin->atime);   /* time of last access */
     target->st_mtime = origin->mtime;   /* time of last modification */
     target->st_ctime = origin->ctime;   /* time of last status change */
 }
@@ -127,8 +289,9 @@ bool is_dir(struct fcb *dir_fcb) {
 
 // Gets an FCB struct from UUID.
 int get_fcb(uuid_t *uuid, struct fcb *fetchedFCB) {
+    uint64_t start = stats_now();
     unqlite_int64 nBytes;  //Data length.
-    int rc = unqlite_kv_fetch(pDb, uuid, KEY_SIZE, NULL, &nBytes);
+    int rc = store_fetch(uuid, KEY_SIZE, NULL, &nBytes);
     if (rc != UNQLITE_OK) {
         error_handler(rc);
     }
@@ -138,7 +301,8 @@ int get_fcb(uuid_t *uuid, struct fcb *fetchedFCB) {
     }
 
     // Fetch data.
-    unqlite_kv_fetch(pDb, uuid, KEY_SIZE, fetchedFCB, &nBytes);
+    store_fetch(uuid, KEY_SIZE, fetchedFCB, &nBytes);
+    stats_record(STAT_KV_FETCH, start);
 
     return 0;
 }
@@ -167,29 +331,272 @@ int get_path(struct fcb *dir, char *path) {
 }
 
 int set_data(struct fcb *dir, char *data, size_t size) {
-    int rc = put_record(&dir->data, data, (unqlite_int64) size);
-    dir->size = size;
-    return rc;
+    dat_trim(dir, 0);
+    dat_write(dir, 0, data, (off_t) size);
+    return 0;
 }
 
 int get_data(struct fcb *dir, char *data) {
-    int rc = get_record_size(&dir->data, data, dir->size);
-    return rc;
+    dat_read(dir, 0, dir->size, data);
+    return 0;
 }
 
 // ---- FCB data helpers. ----
-// Function which manipulate the data of a file object, and then flushes the changes to the database.
+// The data of an element is stored in chunks of DATA_CHUNK_SIZE bytes, chunk i under the data key with
+// index i. Missing chunks and the bytes past the end of a shorter chunk read as zeroes, so holes are not
+// stored. Nothing is stored beyond the size of the element.
+// Functions which manipulate the data of a file object, and then flush the changes to the database.
 // All return 1 on error.
 
+// Part of a record to be copied out by dat_window_consumer.
+struct dat_window {
+    char *buffer;
+    off_t start;    // First byte of the window.
+    off_t end;      // One past the last byte of the window.
+    off_t offset;   // Record offset of the next chunk delivered.
+};
+
+int dat_window_consumer(const void *chunk, unsigned int len, void *user_data) {
+    struct dat_window *window = user_data;
+    off_t chunk_start = window->offset;
+    off_t chunk_end = chunk_start + len;
+    window->offset = chunk_end;
+
+    // Copy the overlap of the chunk and the window.
+    off_t from = (chunk_start > window->start) ? chunk_start : window->start;
+    off_t to = (chunk_end < window->end) ? chunk_end : window->end;
+    if (from < to) {
+        memcpy(&window->buffer[from - window->start], (const char *) chunk + (from - chunk_start), (size_t) (to - from));
+    }
+
+    // Stop streaming once the window is complete.
+    return (chunk_end >= window->end) ? UNQLITE_ABORT : UNQLITE_OK;
+}
+
+// Key of a chunk of the data of an element.
+static void dat_chunk_key(uuid_t key, struct fcb *dir, off_t index) {
+    key_with_index(key, dir->data, (uint32_t) index);
+}
+
+// True if the chunks of the element are deduplicated. Only regular files are, directories change too often.
+// Without FEATURE_DEDUP only the files that were cloned are, see dat_share.
+static bool dat_dedup(struct fcb *dir) {
+    return S_ISREG(dir->mode) && ((store_features & FEATURE_DEDUP) || key_kind(dir->data) == KEY_KIND_SHARED);
+}
+
+// Stored length of a chunk, 0 if it is missing.
+static off_t dat_chunk_length(struct fcb *dir, uuid_t key) {
+    if (dat_dedup(dir)) {
+        struct chunk_ref ref;
+        return (cas_fetch_ref(key, &ref) == UNQLITE_OK) ? (off_t) ref.length : 0;
+    }
+
+    unqlite_int64 nBytes = 0;
+    int rc = store_fetch(key, KEY_SIZE, NULL, &nBytes);
+    if (rc == UNQLITE_NOTFOUND) {
+        return 0;
+    }
+    if (rc != UNQLITE_OK) {
+        error_handler(rc);
+    }
+    return (off_t) nBytes;
+}
+
+// Copies len bytes of a chunk from offset into buffer. Returns the number of bytes the chunk holds
+// there, the rest of the buffer is left alone.
+static off_t dat_chunk_fetch(struct fcb *dir, uuid_t key, off_t offset, char *buffer, off_t len) {
+    // Deduplicated chunks are read from the shared record.
+    const void *record = key;
+    int record_len = KEY_SIZE;
+    unsigned char data_key[CAS_KEY_SIZE];
+    if (dat_dedup(dir)) {
+        struct chunk_ref ref;
+        if (cas_fetch_ref(key, &ref) != UNQLITE_OK) {
+            return 0;
+        }
+        cas_key(data_key, &ref, CAS_KIND_DATA);
+        record = data_key;
+        record_len = CAS_KEY_SIZE;
+    }
+
+    off_t got;
+    int rc;
+    uint64_t start = stats_now();
+    if (offset == 0 && len == DATA_CHUNK_SIZE) {
+        unqlite_int64 nBytes = len;
+        rc = store_fetch(record, record_len, buffer, &nBytes);
+        got = (rc == UNQLITE_OK) ? (off_t) nBytes : 0;
+    } else {
+        struct dat_window window = {buffer, offset, offset + len, 0};
+        rc = store_fetch_callback(record, record_len, dat_window_consumer, &window);
+        got = (window.offset > offset) ? window.offset - offset : 0;
+        if (got > len) {
+            got = len;
+        }
+        if (rc == UNQLITE_ABORT) {
+            rc = UNQLITE_OK;
+        }
+    }
+    stats_record(STAT_KV_FETCH, start);
+    if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND) {
+        error_handler(rc);
+    }
+    return got;
+}
+
+// Replaces a chunk. A deduplicated chunk gains its new reference before the old one is dropped, so
+// rewriting identical data never deletes it.
+static void dat_chunk_store(struct fcb *dir, uuid_t key, const char *data, off_t len) {
+    uint64_t start = stats_now();
+    int rc;
+    if (dat_dedup(dir)) {
+        struct chunk_ref old_ref, ref;
+        bool had_ref = (cas_fetch_ref(key, &old_ref) == UNQLITE_OK);
+        cas_put(data, (uint32_t) len, &ref);
+        rc = store_put(key, KEY_SIZE, &ref, sizeof(struct chunk_ref));
+        if (had_ref) {
+            cas_release(&old_ref);
+        }
+    } else {
+        rc = store_put(key, KEY_SIZE, data, len);
+    }
+    stats_record(STAT_KV_STORE, start);
+    if (rc != UNQLITE_OK) {
+        error_handler(rc);
+    }
+}
+
+// Deletes a chunk if it exists.
+static void dat_chunk_delete(struct fcb *dir, uuid_t key) {
+    if (dat_dedup(dir)) {
+        struct chunk_ref ref;
+        if (cas_fetch_ref(key, &ref) != UNQLITE_OK) {
+            return;
+        }
+        cas_release(&ref);
+    }
+    int rc = store_delete(key, KEY_SIZE);
+    if (rc != UNQLITE_OK && rc != UNQLITE_NOTFOUND) {
+        error_handler(rc);
+    }
+}
+
+// Keeps the first len bytes of a chunk.
+static void dat_chunk_cut(struct fcb *dir, uuid_t key, off_t len) {
+    if (len == 0) {
+        dat_chunk_delete(dir, key);
+        return;
+    }
+    char *data = arena_alloc((size_t) len);
+    dat_chunk_fetch(dir, key, 0, data, len);
+    dat_chunk_store(dir, key, data, len);
+}
+
+// Writes len bytes at offset within one chunk. Appends go straight to the record, other writes
+// replace it, reading it first unless it is overwritten completely. Deduplicated chunks are
+// always replaced.
+static void dat_chunk_write(struct fcb *dir, uuid_t key, off_t offset, const char *data, off_t len) {
+    off_t stored = dat_chunk_length(dir, key);
+    if (offset == stored && !dat_dedup(dir)) {
+        uint64_t start = stats_now();
+        int rc = store_append(key, KEY_SIZE, data, len);
+        stats_record(STAT_KV_STORE, start);
+        if (rc != UNQLITE_OK) {
+            error_handler(rc);
+        }
+    } else if (offset == 0 && len >= stored) {
+        dat_chunk_store(dir, key, data, len);
+    } else {
+        off_t new_len = (offset + len > stored) ? offset + len : stored;
+        char *chunk = arena_alloc((size_t) new_len);
+        if (stored > 0) {
+            dat_chunk_fetch(dir, key, 0, chunk, stored);
+        }
+        if (offset > stored) {
+            memset(&chunk[stored], 0, (size_t) (offset - stored));
+        }
+        memcpy(&chunk[offset], data, (size_t) len);
+        dat_chunk_store(dir, key, chunk, new_len);
+    }
+}
+
+// Writes size bytes at offset, overwriting the data there and growing the element if needed.
+// The FCB is not stored.
+void dat_write(struct fcb *dir, off_t offset, const char *data, off_t size) {
+    off_t done = 0;
+    while (done < size) {
+        off_t index = (offset + done) / DATA_CHUNK_SIZE;
+        off_t in_chunk = (offset + done) % DATA_CHUNK_SIZE;
+        off_t len = DATA_CHUNK_SIZE - in_chunk;
+        if (len > size - done) {
+            len = size - done;
+        }
+        uuid_t key;
+        dat_chunk_key(key, dir, index);
+        dat_chunk_write(dir, key, in_chunk, &data[done], len);
+        done += len;
+    }
+    if (offset + size > dir->size) {
+        dir->size = offset + size;
+    }
+}
+
+// Drops the data from new_size on and sets the size. The FCB is not stored.
+void dat_trim(struct fcb *dir, off_t new_size) {
+    if (new_size < dir->size) {
+        off_t first = (new_size + DATA_CHUNK_SIZE - 1) / DATA_CHUNK_SIZE;
+        off_t last = (dir->size - 1) / DATA_CHUNK_SIZE;
+        uuid_t key;
+        off_t index;
+        for (index = first; index <= last; index++) {
+            dat_chunk_key(key, dir, index);
+            dat_chunk_delete(dir, key);
+        }
+
+        // Cut the chunk that now holds the end.
+        if (new_size % DATA_CHUNK_SIZE != 0) {
+            dat_chunk_key(key, dir, new_size / DATA_CHUNK_SIZE);
+            if (dat_chunk_length(dir, key) > new_size % DATA_CHUNK_SIZE) {
+                dat_chunk_cut(dir, key, new_size % DATA_CHUNK_SIZE);
+            }
+        }
+    }
+    dir->size = new_size;
+}
+
+// Turns len bytes from offset into a hole. Whole chunks are deleted, only partly covered chunks are
+// rewritten. The size does not change and the FCB is not stored.
+void dat_punch(struct fcb *dir, off_t offset, off_t len) {
+    off_t end = (offset + len < dir->size) ? offset + len : dir->size;
+    while (offset < end) {
+        off_t index = offset / DATA_CHUNK_SIZE;
+        off_t in_chunk = offset % DATA_CHUNK_SIZE;
+        off_t piece = DATA_CHUNK_SIZE - in_chunk;
+        if (piece > end - offset) {
+            piece = end - offset;
+        }
+
+        uuid_t key;
+        dat_chunk_key(key, dir, index);
+        off_t stored = dat_chunk_length(dir, key);
+        if (in_chunk + piece >= stored) {
+            // The hole reaches the end of the stored bytes, which are cut.
+            if (in_chunk < stored) {
+                dat_chunk_cut(dir, key, in_chunk);
+            }
+        } else {
+            char *zeroes = arena_alloc((size_t) piece);
+            memset(zeroes, 0, (size_t) piece);
+            dat_chunk_write(dir, key, in_chunk, zeroes, piece);
+        }
+        offset += piece;
+    }
+}
+
 int dat_truncate(struct fcb *dir, int new_size) {
     int curr_size = (int) dir->size;
     if (new_size <= curr_size && new_size >= 0) {
-        char data[curr_size];
-        get_data(dir, data);
-
-        // Update the size.
-        dir->size = new_size;
-        set_data(dir, data, (size_t) new_size);
+        dat_trim(dir, new_size);
 
         // Save FCB to backing store.
         put_record(&dir->uuid, dir, sizeof(struct fcb));
@@ -200,24 +607,23 @@ int dat_truncate(struct fcb *dir, int new_size) {
     }
 }
 
-int dat_del_chunk(struct fcb *dir, int start_index, int size) {
+// Removes size bytes from start_index, shifting the data after them one buffer at a time.
+int dat_del_chunk(struct fcb *dir, off_t start_index, off_t size) {
     // Input validation.
-    int end_index = start_index + size - 1;
-    int dat_size = (int) dir->size;
+    off_t end_index = start_index + size - 1;
+    off_t dat_size = dir->size;
     if (end_index < dat_size && start_index >= 0) {
-        // Get data.
-        char data[dat_size];
-        get_data(dir, data);
-
-        // Shift other content.
-        int next_index = end_index + 1;
-        int bytes_to_copy = dat_size - next_index;
-        memmove(&data[start_index], &data[next_index], (size_t) bytes_to_copy);
+        // Shift the content after the chunk, front to back so no window overwrites bytes yet to be moved.
+        char *window = arena_alloc(DATA_BUFFER_SIZE);
+        off_t from;
+        for (from = end_index + 1; from < dat_size; from += DATA_BUFFER_SIZE) {
+            off_t len = (dat_size - from < DATA_BUFFER_SIZE) ? dat_size - from : DATA_BUFFER_SIZE;
+            dat_read(dir, from, len, window);
+            dat_write(dir, from - size, window, len);
+        }
 
-        // Set updated data.
-        int new_total_size = dat_size - size;
-        dir->size = new_total_size;
-        set_data(dir, data, (size_t) new_total_size);
+        // Set updated size.
+        dat_trim(dir, dat_size - size);
 
         // Update FCB in backing store.
         put_record(&dir->uuid, dir, sizeof(struct fcb));
@@ -228,29 +634,34 @@ int dat_del_chunk(struct fcb *dir, int start_index, int size) {
     }
 }
 
+// Inserts size bytes at start_index, shifting the data after them one buffer at a time.
 // If -1 index is passed, data is appended.
-int dat_insert_chunk(struct fcb *dir, int start_index, char *insert_data, int size) {
-    int curr_size = (int) dir->size;
+int dat_insert_chunk(struct fcb *dir, off_t start_index, const char *insert_data, size_t size) {
+    off_t curr_size = dir->size;
     if (start_index == -1) {
         start_index = curr_size;
     }
 
     if (start_index > curr_size || start_index < 0) { // Error occurred
         return 1;
-    } else {
-        // Get the data.
-        int new_data_size = curr_size + size;
-        char dir_data[new_data_size];
-        get_data(dir, dir_data);
-
-        // Shift content from start_index to start_index + size
-        int bytes_to_copy = curr_size - start_index;
-        memmove(&dir_data[start_index + size], &dir_data[start_index], (size_t) bytes_to_copy);
-
-        memcpy(&dir_data[start_index], insert_data, (size_t) size);
+    } else if (start_index == curr_size) {
+        // Plain append, the current data is not needed.
+        dat_append(dir, insert_data, (off_t) size);
 
-        // Set data.
-        set_data(dir, dir_data, (size_t) new_data_size);
+        // Save changes of fcb.
+        put_record(&dir->uuid, dir, sizeof(struct fcb));
+        return 0;
+    } else {
+        // Shift content from start_index to start_index + size, back to front so no window overwrites
+        // bytes yet to be moved.
+        char *window = arena_alloc(DATA_BUFFER_SIZE);
+        off_t end;
+        for (end = curr_size; end > start_index; end -= DATA_BUFFER_SIZE) {
+            off_t len = (end - start_index < DATA_BUFFER_SIZE) ? end - start_index : DATA_BUFFER_SIZE;
+            dat_read(dir, end - len, len, window);
+            dat_write(dir, end - len + (off_t) size, window, len);
+        }
+        dat_write(dir, start_index, insert_data, (off_t) size);
 
         // Save changes of fcb.
         put_record(&dir->uuid, dir, sizeof(struct fcb));
@@ -258,26 +669,535 @@ int dat_insert_chunk(struct fcb *dir, int start_index, char *insert_data, int si
     }
 }
 
-int dat_get_chunk(struct fcb *file, int start_index, int size, char *buffer) {
-    if (size < 0 || start_index < 0 || buffer == NULL) {
+int dat_get_chunk(struct fcb *file, off_t start_index, size_t size, char *buffer) {
+    if (start_index < 0 || buffer == NULL) {
         return 0;
     }
 
-    // Calculate the maximum size which can be extracted.
-    off_t bytes_copied = file->size - start_index;
-    bytes_copied = (bytes_copied <= size) ? bytes_copied : size;
+    // Read straight into the caller's buffer, however large the request.
+    return (int) dat_read(file, start_index, (off_t) size, buffer);
+}
 
-    char data[file->size];
-    get_data(file, data);
-    memcpy(buffer, &data[start_index], bytes_copied);
+// Appends to the data field without reading it.
+int dat_append(struct fcb *dir, const char *data, off_t size) {
+    if (size > 0) {
+        dat_write(dir, dir->size, data, size);
+    }
+    return 0;
+}
 
-    return bytes_copied;
+// Grows the data field to new_size. The new bytes are a hole, nothing is written.
+int dat_extend(struct fcb *dir, off_t new_size) {
+    if (dir->size < new_size) {
+        dir->size = new_size;
+    }
+    return 0;
+}
+
+// Moves the chunks of a regular file of a store without FEATURE_DEDUP to shared chunks, so that clones
+// can refer to them. The data key of the file changes to KEY_KIND_SHARED. The FCB is not stored.
+static void dat_share(struct fcb *dir) {
+    if (dat_dedup(dir)) {
+        return;
+    }
+    uuid_t shared;
+    make_key(shared, key_inode(dir->data), KEY_KIND_SHARED, 0);
+    off_t index;
+    for (index = 0; index * DATA_CHUNK_SIZE < dir->size; index++) {
+        struct arena_mark mark = arena_save();
+        uuid_t key, shared_key;
+        dat_chunk_key(key, dir, index);
+        off_t len = dat_chunk_length(dir, key);
+        if (len > 0) {
+            struct chunk_ref ref;
+            char *data = arena_alloc((size_t) len);
+            dat_chunk_fetch(dir, key, 0, data, len);
+            cas_put(data, (uint32_t) len, &ref);
+            key_with_index(shared_key, shared, (uint32_t) index);
+            int rc = store_put(shared_key, KEY_SIZE, &ref, sizeof(struct chunk_ref));
+            if (rc != UNQLITE_OK) {
+                error_handler(rc);
+            }
+            dat_chunk_delete(dir, key);
+        }
+        arena_rewind(mark);
+    }
+    memcpy(dir->data, shared, KEY_SIZE);
+}
+
+// Replaces the data of dir with the data of from, sharing its deduplicated chunks: only the
+// references are copied. Both must be regular files, see dat_share. The first write to a shared chunk stores a new one. The FCB is not stored.
+void dat_clone(struct fcb *dir, struct fcb *from) {
+    dat_trim(dir, 0);
+    dat_share(dir);
+    off_t index;
+    for (index = 0; index * DATA_CHUNK_SIZE < from->size; index++) {
+        uuid_t from_key, key;
+        struct chunk_ref ref;
+        dat_chunk_key(from_key, from, index);
+        if (cas_fetch_ref(from_key, &ref) != UNQLITE_OK) {
+            continue;
+        }
+        cas_hold(&ref);
+        dat_chunk_key(key, dir, index);
+        int rc = store_put(key, KEY_SIZE, &ref, sizeof(struct chunk_ref));
+        if (rc != UNQLITE_OK) {
+            error_handler(rc);
+        }
+    }
+    dir->size = from->size;
+}
+
+// Reads up to size bytes of the data field from start_index, one chunk at a time. Whole chunks are
+// fetched straight into the buffer. Holes read as zeroes.
+// Returns the number of bytes copied.
+off_t dat_read(struct fcb *file, off_t start_index, off_t size, char *buffer) {
+    if (start_index >= file->size || size <= 0) {
+        return 0;
+    }
+    if (size > file->size - start_index) {
+        size = file->size - start_index;
+    }
+
+    off_t done = 0;
+    while (done < size) {
+        off_t index = (start_index + done) / DATA_CHUNK_SIZE;
+        off_t in_chunk = (start_index + done) % DATA_CHUNK_SIZE;
+        off_t len = DATA_CHUNK_SIZE - in_chunk;
+        if (len > size - done) {
+            len = size - done;
+        }
+
+        uuid_t key;
+        dat_chunk_key(key, file, index);
+        off_t got = dat_chunk_fetch(file, key, in_chunk, &buffer[done], len);
+
+        // The rest of the piece is a hole.
+        if (got < len) {
+            memset(&buffer[done + got], 0, (size_t) (len - got));
+        }
+        done += len;
+    }
+    return size;
+}
+
+// ---- Write-back cache. ----
+// Small writes through an open file are buffered as dirty ranges of the file, sorted by offset. A write
+// that overlaps or touches ranges merges with them, so runs of appends or of neighbouring overwrites
+// become one range. The ranges are stored when the buffer is full or has too many ranges, on flush and
+// release, when too much data is buffered overall or when the buffer times out. Large writes store the
+// buffer first. Callers that need the stored data or size of a file call write_back_sync first.
+// A buffer is stored without write_back_lock, so that other files keep buffering meanwhile. It stays
+// in the list, marked, until its store is done, and every other user of that buffer waits for it.
+struct write_back_range {
+    off_t offset;
+    char *data;
+    size_t len;
+    size_t capacity;
+    struct write_back_range *next;
+};
+
+struct write_back {
+    uuid_t uuid;            // FCB of the file.
+    struct write_back_range *ranges;
+    int range_count;
+    size_t len;             // Bytes buffered in all the ranges.
+    off_t end;              // End of the last range.
+    time_t first_write;     // Start of the timeout.
+    time_t last_write;      // Becomes the mtime of the file.
+    bool storing;           // Being stored by a thread that released write_back_lock.
+    struct write_back *next;
+};
+
+// The head is also read without the lock, to skip it when nothing is buffered.
+static struct write_back *write_back_list;
+static size_t write_back_total;
+static pthread_mutex_t write_back_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_back_stored = PTHREAD_COND_INITIALIZER;
+
+// Returns the link to the buffer of a file, or to the NULL at the end of the list. A store of the buffer
+// in progress is waited for first, and *waited tells whether there was one: the stored data of the file
+// changed then. Called with write_back_lock held.
+static struct write_back **write_back_find(uuid_t *uuid, bool *waited) {
+    struct write_back **link;
+    *waited = false;
+    for (;;) {
+        link = &write_back_list;
+        while (*link != NULL && uuid_compare((*link)->uuid, *uuid) != 0) {
+            link = &(*link)->next;
+        }
+        if (*link == NULL || !(*link)->storing) {
+            return link;
+        }
+        pthread_cond_wait(&write_back_stored, &write_back_lock);
+        *waited = true;
+    }
+}
+
+// Unlinks and frees a buffer. Called with write_back_lock held.
+static void write_back_free(struct write_back **link) {
+    struct write_back *wb = *link;
+    __atomic_store_n(link, wb->next, __ATOMIC_RELEASE);
+    write_back_total -= wb->len;
+    while (wb->ranges != NULL) {
+        struct write_back_range *range = wb->ranges;
+        wb->ranges = range->next;
+        free(range->data);
+        free(range);
+    }
+    free(wb);
+}
+
+// Writes the buffered ranges to the file, then frees the buffer. Called with write_back_lock held, which
+// is released during the store.
+static void write_back_store(struct write_back *wb) {
+    struct write_back_range *range;
+    struct fcb file_fcb;
+    wb->storing = true;
+    pthread_mutex_unlock(&write_back_lock);
+    // A commit must not see half of the buffer, even when the request storing it reads only.
+    bool lock = !request_changes;
+    if (lock) {
+        tree_lock_shared();
+    }
+    // The buffer may belong to another file than the request storing it.
+    uint64_t outer = store_change_begin();
+    get_fcb(&wb->uuid, &file_fcb);
+    for (range = wb->ranges; range != NULL; range = range->next) {
+        dat_write(&file_fcb, range->offset, range->data, (off_t) range->len);
+    }
+    file_fcb.mtime = wb->last_write;
+    put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+    store_change_end(outer);
+    if (lock) {
+        pthread_rwlock_unlock(&tree_lock);
+    }
+    pthread_mutex_lock(&write_back_lock);
+
+    struct write_back **link = &write_back_list;
+    while (*link != wb) {
+        link = &(*link)->next;
+    }
+    write_back_free(link);
+    pthread_cond_broadcast(&write_back_stored);
+}
+
+// Stores the buffers older than the timeout, or all of them. Storing all of them also waits for the
+// stores in progress in other threads.
+static void write_back_store_all(bool expired_only) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&write_back_lock);
+    struct write_back *wb = write_back_list;
+    while (wb != NULL) {
+        if (wb->storing && !expired_only) {
+            pthread_cond_wait(&write_back_stored, &write_back_lock);
+        } else if (!wb->storing && (!expired_only || now - wb->first_write >= WRITE_BACK_TIMEOUT)) {
+            write_back_store(wb);
+        } else {
+            wb = wb->next;
+            continue;
+        }
+        // The lock was released and the list may have changed.
+        wb = write_back_list;
+    }
+    pthread_mutex_unlock(&write_back_lock);
+}
+
+void write_back_expire() {
+    if (__atomic_load_n(&write_back_list, __ATOMIC_ACQUIRE) != NULL) {
+        write_back_store_all(true);
+    }
+}
+
+// Stores the buffer of a file. Returns true if the stored data changed, by this store or by one that
+// was in progress.
+bool write_back_flush(uuid_t *uuid) {
+    bool waited;
+    pthread_mutex_lock(&write_back_lock);
+    struct write_back **link = write_back_find(uuid, &waited);
+    bool found = (*link != NULL);
+    if (found) {
+        write_back_store(*link);
+    }
+    pthread_mutex_unlock(&write_back_lock);
+    return found || waited;
+}
+
+// Stores the buffer of a file and reloads its FCB if it changed.
+void write_back_sync(struct fcb *file) {
+    if (write_back_flush(&file->uuid)) {
+        get_fcb(&file->uuid, file);
+    }
+}
+
+// Drops the buffer of a file that is being deleted.
+void write_back_discard(uuid_t *uuid) {
+    bool waited;
+    pthread_mutex_lock(&write_back_lock);
+    struct write_back **link = write_back_find(uuid, &waited);
+    if (*link != NULL) {
+        write_back_free(link);
+    }
+    pthread_mutex_unlock(&write_back_lock);
+}
+
+// End of the data buffered for a file, 0 if nothing is.
+off_t write_back_end(uuid_t *uuid) {
+    off_t end = 0;
+    bool waited;
+    if (__atomic_load_n(&write_back_list, __ATOMIC_ACQUIRE) != NULL) {
+        pthread_mutex_lock(&write_back_lock);
+        struct write_back *wb = *write_back_find(uuid, &waited);
+        end = (wb != NULL) ? wb->end : 0;
+        pthread_mutex_unlock(&write_back_lock);
+    }
+    return end;
+}
+
+// Grows the data of a range to hold len bytes.
+static void write_back_reserve(struct write_back_range *range, size_t len) {
+    if (len > range->capacity) {
+        size_t capacity = (range->capacity > 0) ? range->capacity : DATA_BUFFER_SIZE;
+        while (capacity < len) {
+            capacity *= 2;
+        }
+        range->data = realloc(range->data, capacity);
+        if (range->data == NULL) {
+            error_handler(UNQLITE_NOMEM);
+        }
+        range->capacity = capacity;
+    }
+}
+
+// Copies a write into the ranges of a buffer. The write and the ranges it overlaps or touches become
+// one range, the data of the write replacing theirs.
+static void write_back_merge(struct write_back *wb, const char *buf, size_t size, off_t offset) {
+    off_t end = offset + (off_t) size;
+    struct write_back_range **link = &wb->ranges;
+    while (*link != NULL && (*link)->offset + (off_t) (*link)->len < offset) {
+        link = &(*link)->next;
+    }
+
+    struct write_back_range *range = *link;
+    if (range == NULL || range->offset > end) {
+        // Nothing to merge with, the write gets a range of its own.
+        range = calloc(1, sizeof(struct write_back_range));
+        if (range == NULL) {
+            error_handler(UNQLITE_NOMEM);
+        }
+        range->offset = offset;
+        range->next = *link;
+        *link = range;
+        wb->range_count++;
+    }
+
+    // The merged range runs from the first start to the last end of the write and the ranges it reaches.
+    off_t start = (range->offset < offset) ? range->offset : offset;
+    off_t merged_end = (range->offset + (off_t) range->len > end) ? range->offset + (off_t) range->len : end;
+    struct write_back_range *next = range->next;
+    while (next != NULL && next->offset <= end) {
+        if (next->offset + (off_t) next->len > merged_end) {
+            merged_end = next->offset + (off_t) next->len;
+        }
+        next = next->next;
+    }
+
+    size_t old_len = range->len;
+    write_back_reserve(range, (size_t) (merged_end - start));
+    if (range->offset > start) {
+        memmove(&range->data[range->offset - start], range->data, old_len);
+    }
+    range->offset = start;
+    range->len = (size_t) (merged_end - start);
+    while (range->next != next) {
+        struct write_back_range *merged = range->next;
+        memcpy(&range->data[merged->offset - start], merged->data, merged->len);
+        range->next = merged->next;
+        wb->len -= merged->len;
+        write_back_total -= merged->len;
+        wb->range_count--;
+        free(merged->data);
+        free(merged);
+    }
+    memcpy(&range->data[offset - start], buf, size);
+    wb->len += range->len - old_len;
+    write_back_total += range->len - old_len;
+    if (merged_end > wb->end) {
+        wb->end = merged_end;
+    }
+}
+
+// Buffers a write to a file. Returns false if the write is too large to be buffered.
+bool write_back_write(struct fcb *file, const char *buf, size_t size, off_t offset) {
+    bool waited;
+    pthread_mutex_lock(&write_back_lock);
+    struct write_back *wb = *write_back_find(&file->uuid, &waited);
+    if (waited) {
+        // The FCB of the caller predates that store, the write takes the stored path with a fresh one.
+        pthread_mutex_unlock(&write_back_lock);
+        get_fcb(&file->uuid, file);
+        return false;
+    }
+    // Large writes are stored directly, copying them would cost more than the buffer saves.
+    if (size >= WRITE_BACK_DIRECT_SIZE) {
+        pthread_mutex_unlock(&write_back_lock);
+        return false;
+    }
+
+    if (wb == NULL) {
+        wb = calloc(1, sizeof(struct write_back));
+        if (wb == NULL) {
+            error_handler(UNQLITE_NOMEM);
+        }
+        memcpy(wb->uuid, file->uuid, KEY_SIZE);
+        wb->first_write = time(NULL);
+        wb->next = write_back_list;
+        __atomic_store_n(&write_back_list, wb, __ATOMIC_RELEASE);
+    }
+    write_back_merge(wb, buf, size, offset);
+    wb->last_write = time(NULL);
+
+    // Store the full buffer, or everything when too much memory is used.
+    if (wb->len >= WRITE_BACK_FILE_SIZE || wb->range_count > WRITE_BACK_RANGES) {
+        write_back_store(wb);
+    }
+    bool pressure = (write_back_total > WRITE_BACK_TOTAL_SIZE);
+    pthread_mutex_unlock(&write_back_lock);
+    if (pressure) {
+        write_back_store_all(false);
+    }
+    return true;
+}
+
+// ---- Access times. ----
+// In lazytime mode the atimes of read files are kept in a hash table keyed by the inode and
+// stored all at once on fsync, on unmount, when the table is full or when the oldest entry is too old.
+struct lazy_atime {
+    uuid_t uuid;            // FCB of the file.
+    time_t atime;
+    struct lazy_atime *next;
+};
+
+static struct lazy_atime *lazy_atime_table[LAZY_ATIME_BUCKETS];
+static size_t lazy_atime_count;
+static time_t lazy_atime_oldest;
+static pthread_mutex_t lazy_atime_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the link to the entry of a file, or to the NULL at the end of its bucket.
+static struct lazy_atime **lazy_atime_find(uuid_t *uuid) {
+    struct lazy_atime **link = &lazy_atime_table[key_inode(*uuid) % LAZY_ATIME_BUCKETS];
+    while (*link != NULL && uuid_compare((*link)->uuid, *uuid) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Stores every pending atime. Files deleted in the meantime have no entry left.
+static void lazy_atime_store_all() {
+    pthread_mutex_lock(&lazy_atime_lock);
+    int i;
+    for (i = 0; i < LAZY_ATIME_BUCKETS; i++) {
+        while (lazy_atime_table[i] != NULL) {
+            struct lazy_atime *entry = lazy_atime_table[i];
+            struct fcb file_fcb;
+            get_fcb(&entry->uuid, &file_fcb);
+            if (file_fcb.atime < entry->atime) {
+                // Each access time is a change of its own.
+                uint64_t outer = store_change_begin();
+                file_fcb.atime = entry->atime;
+                put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+                store_change_end(outer);
+            }
+            lazy_atime_table[i] = entry->next;
+            free(entry);
+        }
+    }
+    lazy_atime_count = 0;
+    pthread_mutex_unlock(&lazy_atime_lock);
+}
+
+void lazy_atime_expire() {
+    if (lazy_atime_count > 0 && time(NULL) - lazy_atime_oldest >= ATIME_INTERVAL) {
+        lazy_atime_store_all();
+    }
+}
+
+// Remembers an access without storing it.
+static void lazy_atime_set(uuid_t *uuid, time_t atime) {
+    pthread_mutex_lock(&lazy_atime_lock);
+    struct lazy_atime **link = lazy_atime_find(uuid);
+    if (*link == NULL) {
+        struct lazy_atime *entry = malloc(sizeof(struct lazy_atime));
+        if (entry == NULL) {
+            error_handler(UNQLITE_NOMEM);
+        }
+        memcpy(entry->uuid, *uuid, KEY_SIZE);
+        entry->next = NULL;
+        *link = entry;
+        if (lazy_atime_count++ == 0) {
+            lazy_atime_oldest = atime;
+        }
+    }
+    (*link)->atime = atime;
+    pthread_mutex_unlock(&lazy_atime_lock);
+
+    if (lazy_atime_count > LAZY_ATIME_MAX_FILES) {
+        lazy_atime_store_all();
+    }
+}
+
+// Returns the atime of a file, including an access that is not stored yet.
+time_t lazy_atime_get(uuid_t *uuid, time_t stored) {
+    if (lazy_atime_count > 0) {
+        pthread_mutex_lock(&lazy_atime_lock);
+        struct lazy_atime *entry = *lazy_atime_find(uuid);
+        if (entry != NULL && entry->atime > stored) {
+            stored = entry->atime;
+        }
+        pthread_mutex_unlock(&lazy_atime_lock);
+    }
+    return stored;
+}
+
+// Forgets the pending atime of a file that is being deleted.
+static void lazy_atime_discard(uuid_t *uuid) {
+    if (lazy_atime_count > 0) {
+        pthread_mutex_lock(&lazy_atime_lock);
+        struct lazy_atime **link = lazy_atime_find(uuid);
+        if (*link != NULL) {
+            struct lazy_atime *entry = *link;
+            *link = entry->next;
+            free(entry);
+            lazy_atime_count--;
+        }
+        pthread_mutex_unlock(&lazy_atime_lock);
+    }
+}
+
+// Records a read of a file according to atime_mode. Only strictatime stores the FCB on every read.
+static void touch_atime(struct fcb *file) {
+    time_t now = time(NULL);
+    switch (atime_mode) {
+        case ATIME_NOATIME:
+            return;
+        case ATIME_LAZYTIME:
+            lazy_atime_set(&file->uuid, now);
+            return;
+        case ATIME_RELATIME:
+            if (file->atime > file->mtime && file->atime > file->ctime && now - file->atime < ATIME_INTERVAL) {
+                return;
+            }
+            break;
+    }
+    file->atime = now;
+    put_record(&file->uuid, file, sizeof(struct fcb));
 }
 
 // ---- Database access shorthands. ----
 int get_record_size(uuid_t *uuid, void *data, unqlite_int64 size) {
+    uint64_t start = stats_now();
     unqlite_int64 nBytes;
-    int rc = unqlite_kv_fetch(pDb, uuid, KEY_SIZE, NULL, &nBytes);
+    int rc = store_fetch(uuid, KEY_SIZE, NULL, &nBytes);
     if (rc != UNQLITE_OK) {
         error_handler(rc);
     }
@@ -287,7 +1207,8 @@ int get_record_size(uuid_t *uuid, void *data, unqlite_int64 size) {
     }
 
     // Fetch data.
-    unqlite_kv_fetch(pDb, uuid, KEY_SIZE, data, &nBytes);
+    store_fetch(uuid, KEY_SIZE, data, &nBytes);
+    stats_record(STAT_KV_FETCH, start);
 
     return 0;
 }
@@ -295,7 +1216,9 @@ int get_record_size(uuid_t *uuid, void *data, unqlite_int64 size) {
 int put_record(uuid_t *uuid, void *data, unqlite_int64 datasize) {
 
     // Store data object.
-    int rc = unqlite_kv_store(pDb, uuid, KEY_SIZE, data, datasize);
+    uint64_t start = stats_now();
+    int rc = store_put(uuid, KEY_SIZE, data, datasize);
+    stats_record(STAT_KV_STORE, start);
 
     if (rc != UNQLITE_OK) {
         error_handler(rc);
@@ -304,85 +1227,63 @@ int put_record(uuid_t *uuid, void *data, unqlite_int64 datasize) {
 }
 
 int delete_record(uuid_t *uuid) {
-    int rc = unqlite_kv_delete(pDb, uuid, KEY_SIZE);
+    int rc = store_delete(uuid, KEY_SIZE);
     return rc;
 }
 
 // ---- Path related functionality. ----
 
 // Separates a string by the '/' character.
-// tokens parameter is set to point the array of tokens.
-// IMPORTANT: Requires freeing after assignment.
+// tokens parameter is set to point the array of tokens. The path is copied once into the request
+// arena and split in place, the tokens point into that copy and live until the end of the request.
 int tokenize_path(char *path, char ***tokens2, int *count) {
     size_t path_len = strlen(path);
     // Input validation.
-    if (path_len == 0) return 0;
-
-    int i = 0;
-    int numOfSlashes = 0;
-
-    // Check whether there are leading or trailing slashes.
-    bool has_leading_slash = (path[0] == '/');
-    bool has_trailing_slash = (path[path_len - 1] == '/');
+    if (path_len == 0) {
+        *count = 0;
+        return 0;
+    }
 
-    // Copy path.
-    char pathCopy[strlen(path) + 1];
-    strcpy(pathCopy, path);
-    // Detect number of slashes.
-    for (i = 0; i < strlen(path); ++i) {
-        if (path[i] == '/') numOfSlashes++;
+    // Count the segments.
+    int num_of_slashes = 0;
+    size_t i;
+    for (i = 0; i < path_len; ++i) {
+        if (path[i] == '/') num_of_slashes++;
     }
+    *count = num_of_slashes + 1;
 
-    *count = numOfSlashes + 1;
-    char **tokens = malloc((numOfSlashes + 1) * sizeof(char *));
+    char **tokens = arena_alloc((num_of_slashes + 1) * sizeof(char *));
+    char *path_copy = arena_strdup(path);
     *tokens2 = tokens;
 
-    // Split string by "/".
-    char *token = strtok(pathCopy, "/");
+    // Split in place. A leading or trailing slash yields an empty first or last token.
     int current_index = 0;
-    int num_tokens_to_read = *count;
-
-    // Adjust for special case of leading and trailing slash.
-    if (has_leading_slash) {
-        current_index++;
-        num_tokens_to_read--;
-    }
-    if (has_trailing_slash) {
-        num_tokens_to_read--;
+    tokens[current_index++] = path_copy;
+    for (i = 0; i < path_len; ++i) {
+        if (path_copy[i] == '/') {
+            path_copy[i] = '\0';
+            tokens[current_index++] = &path_copy[i + 1];
+        }
     }
 
-    while (token != NULL) {
-        size_t token_len = strlen(token);
-
-        // Set pointer in array.
-        tokens[current_index] = (char *) malloc((token_len + 1) * sizeof(char));
-
-        // Copy memory over.
-        memcpy(tokens[current_index], token, token_len + 1);
-
-        // Get next token.
-        token = strtok(NULL, "/");
-
-        num_tokens_to_read++;
-        current_index++;
+    // Empty tokens are only allowed at either end.
+    for (current_index = 1; current_index < *count - 1; ++current_index) {
+        if (tokens[current_index][0] == '\0') {
+            // Error occurred.
+            return ENOENT;
+        }
     }
+    return 0;
+}
 
-    if (has_leading_slash) {
-        tokens[0] = (char *) malloc(sizeof(char));
-        tokens[0][0] = '\0';
-    }
-    if (has_trailing_slash) {
-        tokens[*count - 1] = (char *) malloc(sizeof(char));
-        tokens[*count - 1][0] = '\0';
-    }
+// Key of the directory of the snapshots, if the store has one.
+static uuid_t snapshot_dir_id;
+static bool snapshot_dir_found;
 
-    // Check for error.
-    if (current_index + (has_trailing_slash) == *count) {
-        return 0;
-    } else {
-        // Error occurred.
-        return ENOENT;
-    }
+// True for SNAPSHOT_DIR and the paths below it.
+static bool is_snapshot_path(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
 }
 
 // Resolves a path and places FCB in id_pointer.
@@ -393,14 +1294,29 @@ int resolve_path(struct fcb *dir_fcb, char *path) {
         get_record_size(&root_object.id, dir_fcb, sizeof(struct fcb));
         return 0;
     }
-    // Get root object from database.
+    // Get the directory the path starts from, the root or the directory of the snapshots.
     struct fcb root;
-    resolve_path(&root, "/");
+    if (is_snapshot_path(path)) {
+        if (!snapshot_dir_found) {
+            return ENOENT;
+        }
+        get_record_size(&snapshot_dir_id, &root, sizeof(struct fcb));
+        path += strlen(SNAPSHOT_DIR);
+        if (path[0] == '\0') {
+            memcpy(dir_fcb, &root, sizeof(struct fcb));
+            return 0;
+        }
+    } else {
+        resolve_path(&root, "/");
+    }
 
     // Split the path into segments.
     char **tokens;
     int num_of_elements;
     int rc = tokenize_path(path, &tokens, &num_of_elements);
+    if (rc != 0) {
+        return rc;
+    }
 
     // Traverse through the path.
     bool path_error = 1;
@@ -422,14 +1338,8 @@ int resolve_path(struct fcb *dir_fcb, char *path) {
                 break;
             }
         }
-
-        // Free each element of the token array. // TODO move before the if statement to avoid mem leak.
-        free(tokens[i]);
     } // For each element in path.
 
-    // Free the token array indices.
-    free(tokens);
-
     if (rc != 0) {
         return rc;
     } else {
@@ -503,82 +1413,129 @@ int resolve_ancestor(struct fcb *ancestor_fcb, char *path, int ancestor_level) {
 
 // --- Directory related code. ---
 
-// READDIR - Gets the UUID at offset.
-// Returns 1 if successful, and 0 if failed.
-int get_UUID_from_fcb(struct fcb *dir_fcb, off_t offset, uuid_t *uuid) {
-    // TODO check data field, possibly check.
-    char data_ptr[dir_fcb->size];
-    get_data(dir_fcb, data_ptr);
-
-    offset = KEY_SIZE * offset;
-    // If the offset can be retrieved.
-    if (dir_fcb->size >= offset + KEY_SIZE) {
-        memcpy(uuid, &data_ptr[offset], KEY_SIZE);
-        return 1;
+// Size of the directory entry of an element named name.
+off_t dir_entry_size(const char *name) {
+    return (off_t) (sizeof(struct dir_entry) + strlen(name));
+}
 
-    } else {
-        return 0;
-    }
+static void dir_open(struct dir_cursor *cursor, struct fcb *dir_fcb) {
+    cursor->dir = dir_fcb;
+    cursor->batch = arena_alloc(DATA_BUFFER_SIZE);
+    cursor->batch_start = 0;
+    cursor->batch_len = 0;
+    cursor->offset = 0;
+    cursor->entry_offset = 0;
 }
 
-// Function which goes through all entries in the directory's data field, and finds the element named with the passed name.
-int get_fcb_from_name(struct fcb *dir_fcb, char *name, struct fcb *found_el) {
-    // Get the data block of the fcb which contains all UUIDs. TODO change to indirect reference.
-    char data_block[dir_fcb->size];
-    get_data(dir_fcb, data_block);
+// Reads the batch starting at the next entry.
+static void dir_fill(struct dir_cursor *cursor) {
+    cursor->batch_start = cursor->offset;
+    cursor->batch_len = dat_read(cursor->dir, cursor->offset, DATA_BUFFER_SIZE, cursor->batch);
+}
 
-    off_t data_size = dir_fcb->size;
-    off_t num_of_entries = data_size / KEY_SIZE;
-    int current_index = 0;
-    int return_code = ENOENT;
+// Gets the next entry and its name, which is not null terminated. Returns false at the end of the directory.
+static bool dir_next(struct dir_cursor *cursor, struct dir_entry *entry, const char **name) {
+    if (cursor->offset + (off_t) sizeof(struct dir_entry) > cursor->dir->size) {
+        return false;
+    }
 
-    // For each UUID in data buffer.
-    for (current_index = 0; current_index < num_of_entries; current_index++) {
-        uuid_t tmp_uuid;
-        memcpy(&tmp_uuid, &data_block[current_index * KEY_SIZE], KEY_SIZE);
+    off_t pos = cursor->offset - cursor->batch_start;
+    if (pos + (off_t) sizeof(struct dir_entry) > cursor->batch_len) {
+        dir_fill(cursor);
+        pos = 0;
+    }
+    memcpy(entry, &cursor->batch[pos], sizeof(struct dir_entry));
+
+    // Entries never straddle the end of a batch after a refill, names are at most NAME_MAX long.
+    off_t entry_size = (off_t) sizeof(struct dir_entry) + entry->name_len;
+    if (pos + entry_size > cursor->batch_len) {
+        dir_fill(cursor);
+        pos = 0;
+        if (entry_size > cursor->batch_len) {
+            return false;
+        }
+    }
+
+    *name = &cursor->batch[pos + sizeof(struct dir_entry)];
+    cursor->entry_offset = cursor->offset;
+    cursor->offset += entry_size;
+    return true;
+}
 
-        // Get fcb from uuid.
-        struct fcb tmp_fcb;
-        get_record_size(&tmp_uuid, &tmp_fcb, sizeof(struct fcb));
+// Appends the entry of an element to a directory and stores the directory FCB.
+// Returns ENAMETOOLONG if the name does not fit in an entry.
+int dir_add_entry(struct fcb *dir_fcb, struct fcb *element, const char *name) {
+    size_t name_len = strlen(name);
+    if (name_len > NAME_MAX) {
+        return ENAMETOOLONG;
+    }
 
-        // Get name from FCB.
-        char temp_name[tmp_fcb.name_len];
-        get_name(&tmp_fcb, temp_name);
+    struct dir_entry entry;
+    memset(&entry, 0, sizeof(struct dir_entry));
+    entry.inode = key_inode(element->uuid);
+    entry.type = (uint32_t) (element->mode & S_IFMT);
+    entry.name_len = (uint32_t) name_len;
 
-        if (strcmp(temp_name, name) == 0) { // If name corresponds to search term.
-            memcpy(found_el, &tmp_fcb, sizeof(struct fcb));
-            return_code = 0;
-            break;
+    char *record = arena_alloc(sizeof(struct dir_entry) + name_len);
+    memcpy(record, &entry, sizeof(struct dir_entry));
+    memcpy(&record[sizeof(struct dir_entry)], name, name_len);
+    dat_insert_chunk(dir_fcb, -1, record, sizeof(struct dir_entry) + name_len);
+    return 0;
+}
+
+// READDIR - Gets the UUID of the entry at offset.
+// Returns 1 if successful, and 0 if failed.
+int get_UUID_from_fcb(struct fcb *dir_fcb, off_t offset, uuid_t *uuid) {
+    struct dir_cursor cursor;
+    struct dir_entry entry;
+    const char *name;
+    dir_open(&cursor, dir_fcb);
+    while (dir_next(&cursor, &entry, &name)) {
+        if (offset-- == 0) {
+            make_key(*uuid, entry.inode, KEY_KIND_FCB, 0);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function which goes through all entries in the directory's data field, and finds the element named with the passed name.
+// Only the FCB of the matching element is fetched.
+int get_fcb_from_name(struct fcb *dir_fcb, char *name, struct fcb *found_el) {
+    struct dir_cursor cursor;
+    struct dir_entry entry;
+    const char *entry_name;
+    size_t name_len = strlen(name);
+
+    dir_open(&cursor, dir_fcb);
+    while (dir_next(&cursor, &entry, &entry_name)) {
+        if (entry.name_len == name_len && memcmp(entry_name, name, name_len) == 0) {
+            uuid_t key;
+            make_key(key, entry.inode, KEY_KIND_FCB, 0);
+            get_record_size(&key, found_el, sizeof(struct fcb));
+            return 0;
         }
-    } // For each UUID in data buffer.
+    }
 
-    return return_code;
+    return ENOENT;
 }
 
 // Returns 1 if uuid is not found.
 int remove_UUID_from_dir(struct fcb *dir_fcb, uuid_t *uuid) {
-    char data[dir_fcb->size];
-    get_data(dir_fcb, data);
-
-    off_t num_of_elements = dir_fcb->size / KEY_SIZE;
-    off_t i;
-    bool found = false;
-    for (i = 0; i < num_of_elements; ++i) {
-        // Get UUID at offset.
-        uuid_t curr_uuid;
-        get_UUID_from_fcb(dir_fcb, i, &curr_uuid);
-
-        // Compare the UUID with the one looked for.
-        int cmp = memcmp(&curr_uuid, uuid, sizeof(uuid_t));
-
-        if (cmp == 0) { // If UUID is found, remove it.
-            dat_del_chunk(dir_fcb, i * KEY_SIZE, KEY_SIZE);
-            found = true;
-            break;
+    struct dir_cursor cursor;
+    struct dir_entry entry;
+    const char *name;
+    uint64_t inode = key_inode(*uuid);
+
+    dir_open(&cursor, dir_fcb);
+    while (dir_next(&cursor, &entry, &name)) {
+        if (entry.inode == inode) { // If UUID is found, remove its entry.
+            dat_del_chunk(dir_fcb, cursor.entry_offset, cursor.offset - cursor.entry_offset);
+            return 0;
         }
     }
 
-    return (found) ? 0 : 1;
+    return 1;
 }
 
 int rm_element_from_directory(struct fcb *dir_fcb, char *path, bool delete_dir) {
@@ -594,7 +1551,10 @@ int rm_element_from_directory(struct fcb *dir_fcb, char *path, bool delete_dir)
         // Delete UUID from parent_dir.
         remove_UUID_from_dir(&parent_fcb, &dir_fcb->uuid);
 
-        // Delete UUID from backing store.
+        // Delete the records of the element from backing store.
+        dat_trim(dir_fcb, 0);
+        delete_record(&dir_fcb->name);
+        delete_record(&dir_fcb->path);
         delete_record(&dir_fcb->uuid);
 
         // Store updated parent FCB.
@@ -615,18 +1575,248 @@ int rm_element_from_directory(struct fcb *dir_fcb, char *path, bool delete_dir)
 void store_thing() {
     int datasize = sizeof(struct fcb);
     // Store data object.
-    int rc = unqlite_kv_store(pDb, &(root_object.id), KEY_SIZE, &rootDirectory, datasize);
+    int rc = store_put(&(root_object.id), KEY_SIZE, &rootDirectory, datasize);
+    if (rc != UNQLITE_OK) {
+        error_handler(rc);
+    }
+}
+
+// ---- Stats directory, not stored. ----
+// True for STATS_DIR and the paths below it.
+static bool is_stats_path(const char *path) {
+    size_t len = strlen(STATS_DIR);
+    return strncmp(path, STATS_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Attributes of the stats directory and file. The file has no size, it is read with direct I/O.
+static int stats_getattr(const char *path, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    if (strcmp(path, STATS_DIR) == 0) {
+        stbuf->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+        stbuf->st_nlink = 2;
+    } else if (strcmp(path, STATS_PATH) == 0) {
+        stbuf->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        stbuf->st_nlink = 1;
+    } else {
+        return -ENOENT;
+    }
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+    return 0;
+}
+
+// Opens the stats file on a snapshot of the stats, read a piece at a time until release.
+static int stats_open(const char *path, struct fuse_file_info *fi) {
+    if (strcmp(path, STATS_PATH) != 0) {
+        return (strcmp(path, STATS_DIR) == 0) ? -EISDIR : -ENOENT;
+    }
+    if (fi == NULL) {
+        return 0;
+    }
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    struct open_file *file = calloc(1, sizeof(struct open_file));
+    if (file == NULL) {
+        error_handler(UNQLITE_NOMEM);
+    }
+    file->text = stats_text(&file->text_len);
+    fi->fh = (uint64_t) (uintptr_t) file;
+    fi->direct_io = 1;
+    return 0;
+}
+
+// ---- Snapshots. ----
+// True for the snapshots themselves, SNAPSHOT_DIR/<name>.
+static bool is_snapshot_root(const char *path) {
+    if (!is_snapshot_path(path)) {
+        return false;
+    }
+    const char *name = &path[strlen(SNAPSHOT_DIR)];
+    return name[0] == '/' && name[1] != '\0' && strchr(&name[1], '/') == NULL;
+}
+
+// Finds the directory of the snapshots. A writable store without one gets it.
+static void snapshot_init() {
+    unqlite_int64 nBytes = KEY_SIZE;
+    snapshot_dir_found = (store_fetch(SNAPSHOT_KEY, SNAPSHOT_KEY_SIZE, snapshot_dir_id, &nBytes) == UNQLITE_OK);
+    if (snapshot_dir_found || (store_open_flags & UNQLITE_OPEN_READONLY)) {
+        return;
+    }
+
+    struct fcb dir;
+    initialize_element(&dir, true);
+    dir.mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    set_name(&dir, &SNAPSHOT_DIR[1]);
+    set_path(&dir, SNAPSHOT_DIR);
+    put_record(&dir.uuid, &dir, sizeof(struct fcb));
+    int rc = store_put(SNAPSHOT_KEY, SNAPSHOT_KEY_SIZE, dir.uuid, KEY_SIZE);
     if (rc != UNQLITE_OK) {
         error_handler(rc);
     }
+    memcpy(snapshot_dir_id, dir.uuid, KEY_SIZE);
+    snapshot_dir_found = true;
+}
+
+// Copies an element, and everything below it for a directory, into new inodes and stores the copy.
+// The chunks of the files are shared with dat_clone, the directories are rewritten with the new inodes.
+// Without FEATURE_DEDUP the files of the tree are moved to shared chunks first, which changes their data
+// keys: the caller holds tree_lock for writing.
+static void snapshot_copy(struct fcb *from, struct fcb *copy) {
+    struct arena_mark mark = arena_save();
+    memcpy(copy, from, sizeof(struct fcb));
+    uint64_t inode = alloc_inode();
+    make_key(copy->uuid, inode, KEY_KIND_FCB, 0);
+    make_key(copy->data, inode, KEY_KIND_DATA, 0);
+    make_key(copy->name, inode, KEY_KIND_NAME, 0);
+    make_key(copy->path, inode, KEY_KIND_PATH, 0);
+    copy->size = 0;
+
+    char *text = arena_alloc(from->name_len + 1);
+    get_name(from, text);
+    put_record(&copy->name, text, from->name_len + 1);
+    text = arena_alloc(from->path_len + 1);
+    get_path(from, text);
+    put_record(&copy->path, text, from->path_len + 1);
+
+    if (is_dir(from)) {
+        // The entries of the copy are gathered and appended a batch at a time.
+        struct dir_cursor cursor;
+        struct dir_entry entry;
+        const char *name;
+        char *batch = arena_alloc(DATA_BUFFER_SIZE);
+        off_t batch_len = 0;
+        dir_open(&cursor, from);
+        struct arena_mark entry_mark = arena_save();
+        while (dir_next(&cursor, &entry, &name)) {
+            struct fcb child, child_copy;
+            uuid_t key;
+            make_key(key, entry.inode, KEY_KIND_FCB, 0);
+            get_fcb(&key, &child);
+            snapshot_copy(&child, &child_copy);
+            entry.inode = key_inode(child_copy.uuid);
+
+            off_t entry_size = (off_t) sizeof(struct dir_entry) + entry.name_len;
+            if (batch_len + entry_size > DATA_BUFFER_SIZE) {
+                dat_append(copy, batch, batch_len);
+                batch_len = 0;
+            }
+            memcpy(&batch[batch_len], &entry, sizeof(struct dir_entry));
+            memcpy(&batch[batch_len + sizeof(struct dir_entry)], name, entry.name_len);
+            batch_len += entry_size;
+            arena_rewind(entry_mark);
+        }
+        dat_append(copy, batch, batch_len);
+    } else {
+        if (!dat_dedup(from)) {
+            dat_share(from);
+            put_record(&from->uuid, from, sizeof(struct fcb));
+        }
+        dat_clone(copy, from);
+    }
+
+    put_record(&copy->uuid, copy, sizeof(struct fcb));
+    arena_rewind(mark);
+}
+
+// Deletes the records of a copy made by snapshot_copy. The shared chunks are released.
+static void snapshot_delete(struct fcb *element) {
+    struct arena_mark mark = arena_save();
+    if (is_dir(element)) {
+        struct dir_cursor cursor;
+        struct dir_entry entry;
+        const char *name;
+        dir_open(&cursor, element);
+        struct arena_mark entry_mark = arena_save();
+        while (dir_next(&cursor, &entry, &name)) {
+            struct fcb child;
+            uuid_t key;
+            make_key(key, entry.inode, KEY_KIND_FCB, 0);
+            get_fcb(&key, &child);
+            snapshot_delete(&child);
+            arena_rewind(entry_mark);
+        }
+    }
+
+    dat_trim(element, 0);
+    delete_record(&element->name);
+    delete_record(&element->path);
+    delete_record(&element->uuid);
+    arena_rewind(mark);
+}
+
+// Takes a snapshot of the tree, named after the last segment of path.
+// The copy is not lazy: every inode of the tree is copied and every chunk reference is held, so a
+// snapshot costs time and records in proportion to the whole tree, not to what changes after it. The
+// changes to the tree wait for the whole copy, the reads do not. Without FEATURE_DEDUP the first
+// snapshot also moves the chunks of every file to shared chunks, see dat_share.
+static int snapshot_take(const char *path) {
+    const char *name = &path[strlen(SNAPSHOT_DIR) + 1];
+    if (!snapshot_dir_found) {
+        return -EROFS;
+    }
+    if (strlen(name) > NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    tree_exclusive_begin();
+    struct fcb snapshots, existing;
+    get_fcb(&snapshot_dir_id, &snapshots);
+    int rc = get_fcb_from_name(&snapshots, (char *) name, &existing);
+    if (rc == 0) {
+        tree_exclusive_end();
+        return -EEXIST;
+    }
+
+    // Buffered writes belong to the snapshot.
+    write_back_store_all(false);
+
+    struct fcb root, copy;
+    get_fcb(&root_object.id, &root);
+    snapshot_copy(&root, &copy);
+    set_name(&copy, (char *) name);
+    set_path(&copy, (char *) path);
+    put_record(&copy.uuid, &copy, sizeof(struct fcb));
+
+    dir_add_entry(&snapshots, &copy, name);
+    time(&snapshots.mtime);
+    put_record(&snapshots.uuid, &snapshots, sizeof(struct fcb));
+    tree_exclusive_end();
+    return 0;
+}
+
+// Deletes the snapshot at path.
+static int snapshot_remove(const char *path) {
+    const char *name = &path[strlen(SNAPSHOT_DIR) + 1];
+    if (!snapshot_dir_found) {
+        return -ENOENT;
+    }
+
+    tree_exclusive_begin();
+    struct fcb snapshots, snapshot;
+    get_fcb(&snapshot_dir_id, &snapshots);
+    int rc = get_fcb_from_name(&snapshots, (char *) name, &snapshot);
+    if (rc == 0) {
+        remove_UUID_from_dir(&snapshots, &snapshot.uuid);
+        snapshot_delete(&snapshot);
+        time(&snapshots.mtime);
+        put_record(&snapshots.uuid, &snapshots, sizeof(struct fcb));
+    }
+    tree_exclusive_end();
+    vacuum_step();
+    return -rc;
 }
 
 //Get file and directory attributes (meta-data).
 //Read 'man 2 stat' and 'man 2 chmod'.
 LOCAL int newfs_getattr(const char *path, struct stat *stbuf) {
+    begin_request(STAT_GETATTR, path, 0, 0);
     int res = 0;
 
-    write_log("newfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+    if (is_stats_path(path)) {
+        return end_request(stats_getattr(path, stbuf));
+    }
 
     struct fcb object;
     int rc = resolve_path(&object, (char *) path);
@@ -636,118 +1826,148 @@ LOCAL int newfs_getattr(const char *path, struct stat *stbuf) {
     else
         res = -ENOENT;
 
-    return res;
+    return end_request(res);
 }
 
 //Read a directory.
 //Read 'man 2 readdir'.
 LOCAL int newfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    begin_request(STAT_READDIR, path, offset, 0);
     // Add current and parent folder.
     filler(buf, ".", NULL, 0);
     filler(buf, "..", NULL, 0);
+    if (is_stats_path(path)) {
+        if (strcmp(path, STATS_DIR) != 0) {
+            return end_request(-ENOTDIR);
+        }
+        filler(buf, &STATS_PATH[strlen(STATS_DIR) + 1], NULL, 0);
+        return end_request(0);
+    }
 
     // Get fcb of directory from path.
     struct fcb directory;
     int rc = resolve_path(&directory, (char *) path);
     if (rc != 0) {
-        return -rc;
-    }
-
-    //Go through all entries in the FCB's data block and print them. ---
-    // Get data block from UUID.
-    off_t numOfDirs = directory.size / KEY_SIZE;
-
-    // Loop through all entries in the directory's data block and print the name.
-    int i;
-    for (i = 0; i < numOfDirs; i++) {
-        uuid_t current_el_uuid;
-        rc = get_UUID_from_fcb(&directory, i, &current_el_uuid);
-
-        struct fcb current_el_fcb;
-        get_fcb(&current_el_uuid, &current_el_fcb);
-
-        // Add the name to the buffer.
-        // Drop leading '/' TODO get only last part of path.
-        char element_name[current_el_fcb.name_len];
-        get_name(&current_el_fcb, element_name);
-        if (*element_name != '\0') {
-            struct stat element_stat;
-            copy_stat_from_fcb(&current_el_fcb, &element_stat);
-            filler(buf, element_name, &element_stat, 0);
+        return end_request(-rc);
+    }
+
+    // Go through all entries in the directory's data and pass on their names and types, without fetching the children.
+    struct dir_cursor cursor;
+    struct dir_entry entry;
+    const char *name;
+    char *element_name = arena_alloc(NAME_MAX + 1);
+    dir_open(&cursor, &directory);
+    while (dir_next(&cursor, &entry, &name)) {
+        if (entry.name_len == 0 || entry.name_len > NAME_MAX) {
+            continue;
         }
-    }
+        memcpy(element_name, name, entry.name_len);
+        element_name[entry.name_len] = '\0';
 
-    write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler,
-              offset, fi);
+        struct stat element_stat;
+        memset(&element_stat, 0, sizeof(struct stat));
+        element_stat.st_mode = (mode_t) entry.type;
+        filler(buf, element_name, &element_stat, 0);
+    }
 
-    return 0;
+    return end_request(0);
 }
 
 //Open a file.
 //Read 'man 2 open'.
 LOCAL int newfs_open(const char *path_in, struct fuse_file_info *fi) {
+    begin_request(STAT_OPEN, path_in, (fi != NULL) ? fi->flags : 0, 0);
     // Create copy of the path.
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
 
-    write_log("newfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+    if (is_stats_path(path)) {
+        return end_request(stats_open(path, fi));
+    }
+    if (is_snapshot_path(path) && fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY) {
+        return end_request(-EROFS);
+    }
 
     // Check if file exists.
     struct fcb file_fcb;
     int rc = resolve_path(&file_fcb, path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
     // Check if it is a file.
     if (is_dir(&file_fcb)) {
-        return -EISDIR;
+        return end_request(-EISDIR);
     }
 
-    return 0;
+    attach_open_file(fi, &file_fcb);
+    return end_request(0);
 }
 
 //Read a file.
 //Read 'man 2 read'.
 LOCAL int newfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    write_log("newfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    begin_request(STAT_READ, path, offset, (int64_t) size);
+    struct open_file *file = get_open_file(fi);
+    if (file != NULL && file->text != NULL) {
+        if (offset >= (off_t) file->text_len) {
+            return end_request(0);
+        }
+        if (size > file->text_len - (size_t) offset) {
+            size = file->text_len - (size_t) offset;
+        }
+        memcpy(buf, &file->text[offset], size);
+        return end_request((int) size);
+    }
     // Check file exists.
     struct fcb file_fcb;
     int rc = resolve_path(&file_fcb, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
     // Check if file.
     if (is_dir(&file_fcb)) {
-        return -EISDIR;
+        return end_request(-EISDIR);
     }
+    write_back_sync(&file_fcb);
 
-    // Update access time.
-    time(&file_fcb.atime);
-    put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+    // Update access time, snapshots are not changed.
+    if (!is_snapshot_path(path)) {
+        touch_atime(&file_fcb);
+    }
 
-    rc = dat_get_chunk(&file_fcb, (int) offset, (int) size, buf);
+    // Queue the read-ahead first so that it overlaps this read.
+    if (file != NULL) {
+        readahead_update(&file->ra, &file_fcb.data, offset, size, file_fcb.size);
+    }
 
-    return rc;
+    rc = dat_get_chunk(&file_fcb, offset, size, buf);
+
+    return end_request(rc);
 }
 
 //Read 'man 2 creat'.
 LOCAL int newfs_create(const char *path_in, mode_t mode, struct fuse_file_info *fi) {
+    begin_request(STAT_CREATE, path_in, mode, 0);
+    if (is_stats_path(path_in)) {
+        return end_request(-EACCES);
+    }
+    if (is_snapshot_path(path_in)) {
+        return end_request(-EROFS);
+    }
     // Create copy of the path.
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
 
-    write_log("newfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
-
     // Check if already exists.
     struct fcb temp_fcb;
     int rc = resolve_path(&temp_fcb, path);
     if (rc != ENOENT) {
         if (rc == 0) {
-            return -EEXIST;
+            return end_request(-EEXIST);
         } else {
-            return -rc;
+            return end_request(-rc);
         }
     }
 
@@ -757,7 +1977,7 @@ LOCAL int newfs_create(const char *path_in, mode_t mode, struct fuse_file_info *
     strcpy(path_copy1, path); // Create copy as resolve ancestor manipulates the array.
     rc = resolve_ancestor(&parent_dir, path_copy1, 1);
     if (rc != 0) {
-        return -ENOENT;
+        return end_request(-ENOENT);
     }
 
     // Initialize the FCB.
@@ -776,78 +1996,98 @@ LOCAL int newfs_create(const char *path_in, mode_t mode, struct fuse_file_info *
     set_name(&new_file, &path_copy2[file_name_index]);
     set_path(&new_file, (char *) path);
 
-    // Append UUID of new directory to parent directory.
-    dat_insert_chunk(&parent_dir, -1, new_file.uuid, KEY_SIZE);
+    // Append the entry of the new file to the parent directory.
+    rc = dir_add_entry(&parent_dir, &new_file, &path_copy2[file_name_index]);
+    if (rc != 0) {
+        return end_request(-rc);
+    }
 
     // Store old and new fcb in backing store.
     put_record(&parent_dir.uuid, &parent_dir, sizeof(struct fcb));
     put_record(&new_file.uuid, &new_file, sizeof(struct fcb));
 
-    return 0;
+    attach_open_file(fi, &new_file);
+    return end_request(0);
 }
 
 //Set update the times (actime, modtime) for a file. This FS only supports modtime.
 //Read 'man 2 utime'.
 LOCAL int newfs_utime(const char *path, struct utimbuf *ubuf) {
+    begin_request(STAT_UTIME, path, 0, 0);
     int retstat = 0;
-
-    write_log("newfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
 
     struct fcb curr_dir;
     int rc = resolve_path(&curr_dir, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
+    // Buffered data would overwrite the new mtime later.
+    write_back_sync(&curr_dir);
     curr_dir.mtime = ubuf->modtime;
     curr_dir.atime = ubuf->actime;
 
     put_record(&curr_dir.uuid, &curr_dir, sizeof(struct fcb));
 
-    return retstat;
+    return end_request(retstat);
 }
 
 //Write to a file.
 //Read 'man 2 write'
 LOCAL int newfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    write_log("newfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    begin_request(STAT_WRITE, path, offset, (int64_t) size);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
 
     // Check file exists.
     struct fcb file_fcb;
     int rc = resolve_path(&file_fcb, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
     // Check if file.
     if (is_dir(&file_fcb)) {
-        return -EISDIR;
+        return end_request(-EISDIR);
     }
 
-    // Update change time.
-    time(&file_fcb.mtime);
-    put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+    if (offset + (off_t) size > DATA_MAX_SIZE) {
+        return end_request(-EFBIG);
+    }
 
-    rc = dat_insert_chunk(&file_fcb, (int) offset, (char *) buf, (int) size);
-    if (rc != 0) {
-        return -EXDEV;
+    // Small writes through an open file go to the write-back buffer, large ones store it first.
+    if (get_open_file(fi) != NULL && write_back_write(&file_fcb, buf, size, offset)) {
+        return end_request(size);
     }
+    write_back_sync(&file_fcb);
 
-    // Save the FCB.
+    // Overwrite the data at offset, only the chunks written to are touched. Writing past the end
+    // grows the file and leaves a hole.
+    dat_write(&file_fcb, offset, buf, (off_t) size);
+
+    // Update change time and save the FCB.
+    time(&file_fcb.mtime);
     put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
 
-    return size;
+    return end_request(size);
 }
 
 //Set permissions.
 //Read 'man 2 chmod'.
 LOCAL int newfs_chmod(const char *path, mode_t mode) {
-    write_log("newfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+    begin_request(STAT_CHMOD, path, mode, 0);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
 
     struct fcb curr_fcb;
     int rc = resolve_path(&curr_fcb, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
     // Set mode.
@@ -859,16 +2099,20 @@ LOCAL int newfs_chmod(const char *path, mode_t mode) {
     // Update stored FCB.
     put_record(&curr_fcb.uuid, &curr_fcb, sizeof(struct fcb));
 
-    return 0;
+    return end_request(0);
 }
 
 //Set ownership.
 //Read 'man 2 chown'.
 int newfs_chown(const char *path, uid_t uid, gid_t gid) {
+    begin_request(STAT_CHOWN, path, uid, gid);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
     struct fcb curr_fcb;
     int rc = resolve_path(&curr_fcb, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
     bool changed = false;
@@ -889,14 +2133,23 @@ int newfs_chown(const char *path, uid_t uid, gid_t gid) {
     // Save the updated FCB.
     put_record(&curr_fcb.uuid, &curr_fcb, sizeof(struct fcb));
 
-    write_log("newfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
-
-    return 0;
+    return end_request(0);
 }
 
 //Create a directory.
 //Read 'man 2 mkdir'.
 int newfs_mkdir(const char *path_in, mode_t mode) {
+    begin_request(STAT_MKDIR, path_in, mode, 0);
+    if (is_stats_path(path_in)) {
+        return end_request((strcmp(path_in, STATS_DIR) == 0) ? -EEXIST : -EACCES);
+    }
+    // Making a directory in SNAPSHOT_DIR takes a snapshot.
+    if (is_snapshot_path(path_in)) {
+        if (strcmp(path_in, SNAPSHOT_DIR) == 0) {
+            return end_request(snapshot_dir_found ? -EEXIST : -EROFS);
+        }
+        return end_request(is_snapshot_root(path_in) ? snapshot_take(path_in) : -EROFS);
+    }
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
     int retstat = 0;
@@ -905,7 +2158,7 @@ int newfs_mkdir(const char *path_in, mode_t mode) {
     struct fcb tmp_dir;
     int rc = resolve_path(&tmp_dir, path);
     if (rc == 0) {
-        return -EEXIST;
+        return end_request(-EEXIST);
     }
 
     char path_copy[strlen(path) + 1];
@@ -919,7 +2172,7 @@ int newfs_mkdir(const char *path_in, mode_t mode) {
     struct fcb parent_dir;
     rc = resolve_ancestor(&parent_dir, (char *) path_copy1, 1);
     if (rc == ENOENT) {
-        return -ENOENT;
+        return end_request(-ENOENT);
     }
 
     // Initialise new directory.
@@ -935,21 +2188,26 @@ int newfs_mkdir(const char *path_in, mode_t mode) {
     set_name(&new_dir, &path_copy[dir_name_index]);
     set_path(&new_dir, (char *) path);
 
-    // Append UUID of new directory to parent directory.
-    dat_insert_chunk(&parent_dir, -1, new_dir.uuid, KEY_SIZE);
+    // Append the entry of the new directory to the parent directory.
+    rc = dir_add_entry(&parent_dir, &new_dir, &path_copy[dir_name_index]);
+    if (rc != 0) {
+        return end_request(-rc);
+    }
 
     // Store old and new fcb in backing store.
     put_record(&parent_dir.uuid, &parent_dir, sizeof(struct fcb));
     put_record(&new_dir.uuid, &new_dir, sizeof(struct fcb));
 
-    write_log("newfs_mkdir: %s\n", path);
-
-    return retstat;
+    return end_request(retstat);
 }
 
 //Delete a file.
 //Read 'man 2 unlink'.
 int newfs_unlink(const char *path_in) {
+    begin_request(STAT_UNLINK, path_in, 0, 0);
+    if (is_snapshot_path(path_in)) {
+        return end_request(-EROFS);
+    }
     // Create copy of the path.
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
@@ -959,26 +2217,35 @@ int newfs_unlink(const char *path_in) {
     int rc = resolve_path(&file_fcb, path);
     // Return error if does not exist.
     if (rc == ENOENT) {
-        return -ENOENT;
+        return end_request(-ENOENT);
     }
 
+    if (!is_dir(&file_fcb)) {
+        write_back_discard(&file_fcb.uuid);
+        lazy_atime_discard(&file_fcb.uuid);
+    }
     rc = rm_element_from_directory(&file_fcb, path, false);
 
-    write_log("newfs_unlink: %s\n", path);
+    vacuum_step();
 
-    return -rc;
+    return end_request(-rc);
 }
 
 //Delete a directory.
 //Read 'man 2 rmdir'.
 int newfs_rmdir(const char *path_in) {
+    begin_request(STAT_RMDIR, path_in, 0, 0);
+    // Removing a snapshot deletes it.
+    if (is_snapshot_path(path_in)) {
+        return end_request(is_snapshot_root(path_in) ? snapshot_remove(path_in) : -EROFS);
+    }
     // Create copy of the path.
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
 
     if (strcmp(path, "/") == 0) {
         // Return EBUSY as specified in man 2 rmdir.
-        return -EBUSY;
+        return end_request(-EBUSY);
     }
 
     // Get directory's fcb.
@@ -986,103 +2253,324 @@ int newfs_rmdir(const char *path_in) {
     int rc = resolve_path(&dir_fcb, path);
     // Return error if does not exist.
     if (rc == ENOENT) {
-        return -ENOENT;
+        return end_request(-ENOENT);
     }
 
     // Check that it is a directory.
     if (!is_dir(&dir_fcb)) {
-        return -ENOTDIR;
+        return end_request(-ENOTDIR);
     }
 
     // Check that directory is empty.
     if (dir_fcb.size != 0) {
-        return -ENOTEMPTY;
+        return end_request(-ENOTEMPTY);
     }
 
     rc = rm_element_from_directory(&dir_fcb, path, true);
 
-    return -rc;
+    return end_request(-rc);
 }
 
 //Set the size of a file.
 //Read 'man 2 truncate'.
 int newfs_truncate(const char *path_in, off_t newsize) {
+    begin_request(STAT_TRUNCATE, path_in, newsize, 0);
+    if (is_snapshot_path(path_in)) {
+        return end_request(-EROFS);
+    }
     if (newsize < 0) { // If size is negative, return error.
-        return -EINVAL;
+        return end_request(-EINVAL);
+    }
+    if (newsize > DATA_MAX_SIZE) {
+        return end_request(-EFBIG);
     }
 
     // Create copy of the path.
     char path[strlen(path_in) + 1];
     strcpy(path, path_in);
-    write_log("newfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
 
     // Get the file.
     struct fcb curr_fcb;
     int rc = resolve_path(&curr_fcb, path);
     if (rc != 0) { // If file does not exist.
-        return -rc;
+        return end_request(-rc);
     }
 
     // If it is a directory.
     if (is_dir(&curr_fcb)) {
-        return -EISDIR;
+        return end_request(-EISDIR);
     }
+    write_back_sync(&curr_fcb);
 
-    if (newsize <= curr_fcb.size) { // If smaller use dat_truncate
-        dat_truncate(&curr_fcb, (int) newsize);
+    if (newsize <= curr_fcb.size) { // If smaller drop the chunks past the end.
+        dat_trim(&curr_fcb, newsize);
 
     } else {
-        // Get data and pad with zeroes.
-        char data[newsize];
-        memset(data, 0, newsize);
-        get_data(&curr_fcb, data);
-        set_data(&curr_fcb, data, newsize);
+        // The new bytes are a hole.
+        dat_extend(&curr_fcb, newsize);
     }
 
     // Store updated fcb.
     put_record(&curr_fcb.uuid, &curr_fcb, sizeof(struct fcb));
+    vacuum_step();
 
-    return 0;
+    return end_request(0);
+}
+
+// Stores the write-back buffer of the file behind fi, or behind path when there is no open file state.
+// Returns false if there is no such file, otherwise its FCB key goes to uuid unless it is NULL.
+static bool flush_open_file(const char *path, struct fuse_file_info *fi, uuid_t *uuid) {
+    struct open_file *file = get_open_file(fi);
+    struct fcb file_fcb;
+    if (file != NULL) {
+        memcpy(file_fcb.uuid, file->uuid, KEY_SIZE);
+    } else if (path == NULL || resolve_path(&file_fcb, (char *) path) != 0) {
+        return false;
+    }
+    write_back_flush(&file_fcb.uuid);
+    if (uuid != NULL) {
+        memcpy(*uuid, file_fcb.uuid, KEY_SIZE);
+    }
+    return true;
 }
 
-//Flush any cached data. You don't need to do anything here unless you have implemented a caching mechanism.
+//Flush any cached data.
 int newfs_flush(const char *path, struct fuse_file_info *fi) {
+    begin_request(STAT_FLUSH, path, 0, 0);
     int retstat = 0;
 
-    write_log("newfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+    flush_open_file(path, fi, NULL);
 
-    return retstat;
+    return end_request(retstat);
 }
 
-//Release the file. There will be one call to release for each call to open. You don't need to do anything here unless you have implemented a caching mechanism.
+//Release the file. There will be one call to release for each call to open.
 int newfs_release(const char *path, struct fuse_file_info *fi) {
+    begin_request(STAT_RELEASE, path, 0, 0);
     int retstat = 0;
 
-    write_log("newfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+    flush_open_file(path, fi, NULL);
+    struct open_file *file = get_open_file(fi);
+    if (file != NULL) {
+        free(file->text);
+        free(file);
+    }
+    vacuum_step();
+
+    return end_request(retstat);
+}
+
+//Synchronise the file: store its buffered data and commit. Only the shard of the file is committed, with the
+//shards its changes depend on.
+//Read 'man 2 fsync'.
+int newfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    begin_request(STAT_FSYNC, path, datasync, 0);
+
+    uuid_t uuid;
+    bool found = flush_open_file(path, fi, &uuid);
+    lazy_atime_store_all();
+    if (found) {
+        sync_store_shard(store_shard_of(uuid, KEY_SIZE));
+    } else {
+        sync_store();
+    }
+
+    return end_request(0);
+}
+
+//Synchronise a directory. Directory entries live in the same transaction as everything else.
+int newfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    begin_request(STAT_FSYNCDIR, path, datasync, 0);
+
+    sync_store();
+
+    return end_request(0);
+}
+
+//Allocate or deallocate space. Allocation only grows the size as a hole, the store has no way to reserve space.
+//Punching a hole deletes the chunks it covers.
+//Read 'man 2 fallocate'.
+int newfs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+    begin_request(STAT_FALLOCATE, path, offset, len);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
+    if (offset < 0 || len <= 0) {
+        return end_request(-EINVAL);
+    }
+    if (offset + len > DATA_MAX_SIZE) {
+        return end_request(-EFBIG);
+    }
+    if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+        return end_request(-EOPNOTSUPP);
+    }
+
+    struct fcb file_fcb;
+    int rc = resolve_path(&file_fcb, (char *) path);
+    if (rc != 0) {
+        return end_request(-rc);
+    }
+    if (is_dir(&file_fcb)) {
+        return end_request(-EISDIR);
+    }
+    write_back_sync(&file_fcb);
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        dat_punch(&file_fcb, offset, len);
+        time(&file_fcb.mtime);
+    } else if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        dat_extend(&file_fcb, offset + len);
+    }
+    put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+    vacuum_step();
+
+    return end_request(0);
+}
+
+//Give the file at path the content of the file at from. Only the chunk references are copied. Without
+//dedup the chunks of both files are moved to shared chunks first, which waits for the other changes to
+//the tree. The source may be in a snapshot, to restore a file from it.
+int newfs_clone(const char *from, const char *path) {
+    begin_request(STAT_IOCTL, path, NEWFS_IOC_CLONE, 0);
+    if (is_snapshot_path(path)) {
+        return end_request(-EROFS);
+    }
+    struct fcb from_fcb, file_fcb;
+    int rc = resolve_path(&from_fcb, (char *) from);
+    if (rc == 0) {
+        rc = resolve_path(&file_fcb, (char *) path);
+    }
+    if (rc != 0) {
+        return end_request(-rc);
+    }
+    if (is_dir(&from_fcb) || is_dir(&file_fcb)) {
+        return end_request(-EISDIR);
+    }
+    if (!S_ISREG(from_fcb.mode) || !S_ISREG(file_fcb.mode) || uuid_compare(from_fcb.uuid, file_fcb.uuid) == 0) {
+        return end_request(-EINVAL);
+    }
+
+    // Readers must not see the data keys change under them.
+    bool exclusive = !dat_dedup(&from_fcb) || !dat_dedup(&file_fcb);
+    if (exclusive) {
+        tree_exclusive_begin();
+        get_fcb(&from_fcb.uuid, &from_fcb);
+        get_fcb(&file_fcb.uuid, &file_fcb);
+    }
+    write_back_sync(&from_fcb);
+    write_back_sync(&file_fcb);
+
+    if (!dat_dedup(&from_fcb)) {
+        dat_share(&from_fcb);
+        put_record(&from_fcb.uuid, &from_fcb, sizeof(struct fcb));
+    }
+    dat_clone(&file_fcb, &from_fcb);
+    time(&file_fcb.mtime);
+    file_fcb.ctime = file_fcb.mtime;
+    put_record(&file_fcb.uuid, &file_fcb, sizeof(struct fcb));
+    if (exclusive) {
+        tree_exclusive_end();
+    }
+    vacuum_step();
+
+    return end_request(0);
+}
+
+#if FUSE_VERSION >= 28
+//Handle the ioctls of the file system, see NEWFS_IOC_CLONE.
+int newfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    if ((unsigned int) cmd != NEWFS_IOC_CLONE) {
+        begin_request(STAT_IOCTL, path, (unsigned int) cmd, 0);
+        return end_request(-ENOTTY);
+    }
 
-    return retstat;
+    struct newfs_clone_args *args = data;
+    args->source[NEWFS_CLONE_PATH_MAX - 1] = '\0';
+    return newfs_clone(args->source, path);
 }
+#endif
 
 LOCAL int newfs_rename(const char *path, const char *to) {
+    begin_request(STAT_RENAME, path, 0, 0);
+    if (is_stats_path(path) || is_stats_path(to)) {
+        return end_request(-EACCES);
+    }
+    if (is_snapshot_path(path) || is_snapshot_path(to)) {
+        return end_request(-EROFS);
+    }
     struct fcb curr_el;
     int rc = resolve_path(&curr_el, (char *) path);
     if (rc != 0) {
-        return -rc;
+        return end_request(-rc);
     }
 
-    set_path(&curr_el, (char *) to);
-
     // Extract name.
     char to_copy[strlen(to) + 1];
     strcpy(to_copy, to);
     int name_start;
     separate_path(to_copy, &name_start);
+    if (strlen(&to_copy[name_start]) > NAME_MAX) {
+        return end_request(-ENAMETOOLONG);
+    }
+
+    if (strcmp(path, "/") == 0 || to_copy[name_start] == '\0') {
+        return end_request(-EBUSY);
+    }
+
+    // A directory cannot move below itself.
+    size_t path_len = strlen(path);
+    if (is_dir(&curr_el) && strncmp(to, path, path_len) == 0 && to[path_len] == '/') {
+        return end_request(-EINVAL);
+    }
+
+    // The new entry goes to the parent directory of to.
+    char to_parent[strlen(to) + 1];
+    strcpy(to_parent, to);
+    struct fcb to_dir;
+    rc = resolve_ancestor(&to_dir, to_parent, 1);
+    if (rc != 0) {
+        return end_request(-rc);
+    }
+    if (!is_dir(&to_dir)) {
+        return end_request(-ENOTDIR);
+    }
+
+    // An element already named to is replaced, if it is of the same kind and not a directory with entries.
+    struct fcb target;
+    if (get_fcb_from_name(&to_dir, &to_copy[name_start], &target) == 0) {
+        if (uuid_compare(target.uuid, curr_el.uuid) == 0) {
+            return end_request(0);
+        }
+        if (is_dir(&target) != is_dir(&curr_el)) {
+            return end_request(is_dir(&target) ? -EISDIR : -ENOTDIR);
+        }
+        if (is_dir(&target) && target.size != 0) {
+            return end_request(-ENOTEMPTY);
+        }
+        if (!is_dir(&target)) {
+            write_back_discard(&target.uuid);
+            lazy_atime_discard(&target.uuid);
+        }
+        rm_element_from_directory(&target, (char *) to, is_dir(&target));
+    }
+
+    // Move the entry. The directories are fetched again, the removals above stored them.
+    char path_copy[strlen(path) + 1];
+    strcpy(path_copy, path);
+    struct fcb parent_dir;
+    if (resolve_ancestor(&parent_dir, path_copy, 1) == 0) {
+        remove_UUID_from_dir(&parent_dir, &curr_el.uuid);
+    }
+    get_fcb(&to_dir.uuid, &to_dir);
+    dir_add_entry(&to_dir, &curr_el, &to_copy[name_start]);
+
+    set_path(&curr_el, (char *) to);
     set_name(&curr_el, &to_copy[name_start]);
 
     // Save the FCB.
     put_record(&curr_el.uuid, &curr_el, sizeof(struct fcb));
 
-    return 0;
+    return end_request(0);
 }
 
 
@@ -1097,6 +2585,14 @@ static struct fuse_operations newfs_oper = {
         .truncate    = newfs_truncate,
         .flush        = newfs_flush,
         .release    = newfs_release,
+        .fsync      = newfs_fsync,
+        .fsyncdir   = newfs_fsyncdir,
+#if FUSE_VERSION >= 29
+        .fallocate  = newfs_fallocate,
+#endif
+#if FUSE_VERSION >= 28
+        .ioctl      = newfs_ioctl,
+#endif
         .mkdir      = newfs_mkdir,
         .rename     = newfs_rename,
         .chmod      = newfs_chmod,
@@ -1157,13 +2653,15 @@ void init_fs() {
     write_log_direct("init_fs\n");
     //Initialise the store.
     init_store();
+    store_quiesce = tree_quiesce;
+    readahead_start();
     if (!root_is_empty) {
         write_log_direct("init_fs: root is not empty\n");
 
         uuid_t *dataid = &(root_object.id);
 
         unqlite_int64 nBytes;  //Data length.
-        rc = unqlite_kv_fetch(pDb, dataid, KEY_SIZE, NULL, &nBytes);
+        rc = store_fetch(dataid, KEY_SIZE, NULL, &nBytes);
         if (rc != UNQLITE_OK) {
             error_handler(rc);
         }
@@ -1173,19 +2671,33 @@ void init_fs() {
         }
 
         //Fetch the directory that the root object points at.
-        unqlite_kv_fetch(pDb, dataid, KEY_SIZE, &rootDirectory, &nBytes);
+        store_fetch(dataid, KEY_SIZE, &rootDirectory, &nBytes);
+
+        // Directories of older stores only hold UUIDs.
+        int format = 1;
+        nBytes = sizeof(format);
+        store_fetch(FORMAT_KEY, FORMAT_KEY_SIZE, &format, &nBytes);
+        if (format != FORMAT_VERSION) {
+            printf("Store has layout version %d, expected %d. Doing nothing.(init_fs)\n", format, FORMAT_VERSION);
+            exit(-1);
+        }
     } else {
         write_log_direct("init_fs: root is empty\n");
 
         initialize_element(&rootDirectory, true);
 
-        //Generate a key for rootDirectory and update the root object, and rootDirectory.
-        uuid_generate(root_object.id);
-        memcpy(rootDirectory.uuid, root_object.id, KEY_SIZE);
+        //The root object points at the key of rootDirectory.
+        memcpy(root_object.id, rootDirectory.uuid, KEY_SIZE);
 
         write_log_direct("init_fs: storing thing\n");
         put_record(&root_object.id, &rootDirectory, sizeof(struct fcb));
 
+        int format = FORMAT_VERSION;
+        rc = store_put(FORMAT_KEY, FORMAT_KEY_SIZE, &format, sizeof(format));
+        if (rc != UNQLITE_OK) {
+            error_handler(rc);
+        }
+
         write_log_direct("init_fs: storing updated root\n");
         //Store root object.
         rc = store_root();
@@ -1193,14 +2705,79 @@ void init_fs() {
             error_handler(rc);
         }
     }
+    snapshot_init();
 }
 
 void shutdown_fs() {
-    unqlite_close(pDb);
+    write_back_store_all(false);
+    lazy_atime_store_all();
+    readahead_stop();
+    store_close();
+}
+
+// Maps the durability mount option to a sync level of the store. Returns -1 if unknown.
+int parse_durability(const char *name) {
+    if (strcmp(name, "none") == 0) {
+        return UNQLITE_SYNC_LEVEL_NONE;
+    }
+    if (strcmp(name, "commit") == 0 || strcmp(name, "commit-only") == 0) {
+        return UNQLITE_SYNC_LEVEL_COMMIT;
+    }
+    if (strcmp(name, "strict") == 0) {
+        return UNQLITE_SYNC_LEVEL_FULL;
+    }
+    return -1;
 }
 
 #ifndef IS_LIB
 
+// Mount options handled by newfs itself, the others are passed on to FUSE.
+struct newfs_options {
+    char *durability;   // none, commit (or commit-only) or strict.
+    int atime;          // One of ATIME_*.
+    int dedup;          // Deduplicate file chunks, only when the store is created.
+    char *trace;        // off, errors or all.
+    char *db;           // Path of the store.
+    char *engine;       // Key/value engine of a new store, hash or mem.
+    char *journal;      // on or off.
+    int mmap;           // Map an existing store read-only.
+    int page_size;      // Page size of a new store.
+    int cache_pages;    // Pages kept in the store cache.
+    int shards;         // Shards of a new store.
+};
+
+static struct fuse_opt newfs_opts[] = {
+        {"durability=%s", offsetof(struct newfs_options, durability), 0},
+        {"strictatime", offsetof(struct newfs_options, atime), ATIME_STRICT},
+        {"relatime", offsetof(struct newfs_options, atime), ATIME_RELATIME},
+        {"lazytime", offsetof(struct newfs_options, atime), ATIME_LAZYTIME},
+        {"noatime", offsetof(struct newfs_options, atime), ATIME_NOATIME},
+        {"dedup", offsetof(struct newfs_options, dedup), 1},
+        {"trace=%s", offsetof(struct newfs_options, trace), 0},
+        {"db=%s", offsetof(struct newfs_options, db), 0},
+        {"engine=%s", offsetof(struct newfs_options, engine), 0},
+        {"journal=%s", offsetof(struct newfs_options, journal), 0},
+        {"mmap", offsetof(struct newfs_options, mmap), 1},
+        {"page_size=%d", offsetof(struct newfs_options, page_size), 0},
+        {"cache_pages=%d", offsetof(struct newfs_options, cache_pages), 0},
+        {"shards=%d", offsetof(struct newfs_options, shards), 0},
+        FUSE_OPT_END
+};
+
+// Maps the trace mount option to a trace level. Returns -1 if unknown.
+static int parse_trace(const char *name) {
+    if (strcmp(name, "off") == 0) {
+        return TRACE_OFF;
+    }
+    if (strcmp(name, "errors") == 0) {
+        return TRACE_ERRORS;
+    }
+    if (strcmp(name, "all") == 0) {
+        return TRACE_ALL;
+    }
+    return -1;
+}
+
 int main(int argc, char *argv[]) {
 
     // Run tests.
@@ -1208,18 +2785,94 @@ int main(int argc, char *argv[]) {
 
     int fuserc;
     struct newfs_state *newfs_internal_state;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct newfs_options options;
+
+    // Ask for large requests first, so that options given on the command line take precedence.
+    if (fuse_opt_insert_arg(&args, 1, FUSE_LARGE_IO_OPTS) == -1) {
+        return 1;
+    }
+
+    // Pick up the newfs mount options.
+    memset(&options, 0, sizeof(options));
+    options.atime = atime_mode;
+    if (fuse_opt_parse(&args, &options, newfs_opts, NULL) == -1) {
+        return 1;
+    }
+    atime_mode = options.atime;
+    if (options.dedup) {
+        store_features |= FEATURE_DEDUP;
+    }
+    if (options.durability != NULL) {
+        store_sync_level = parse_durability(options.durability);
+        if (store_sync_level < 0) {
+            fprintf(stderr, "newfs: unknown durability '%s' (none, commit or strict)\n", options.durability);
+            return 1;
+        }
+    }
+    if (options.trace != NULL) {
+        trace_level = parse_trace(options.trace);
+        if (trace_level < 0) {
+            fprintf(stderr, "newfs: unknown trace level '%s' (off, errors or all)\n", options.trace);
+            return 1;
+        }
+    }
+    if (options.db != NULL) {
+        store_name = options.db;
+    }
+    if (options.engine != NULL) {
+        // The in-memory engine only runs on an in-memory store, the other engines are checked when it opens.
+        store_engine = options.engine;
+        if (strcmp(options.engine, "mem") == 0) {
+            store_open_flags |= UNQLITE_OPEN_IN_MEMORY;
+        }
+    }
+    if (options.journal != NULL) {
+        if (strcmp(options.journal, "off") == 0) {
+            store_open_flags |= UNQLITE_OPEN_OMIT_JOURNALING;
+        } else if (strcmp(options.journal, "on") != 0) {
+            fprintf(stderr, "newfs: unknown journal mode '%s' (on or off)\n", options.journal);
+            return 1;
+        }
+    }
+    if (options.mmap) {
+        // The store only maps a file opened read-only, so the mount is read-only and never updates atimes.
+        store_open_flags = (store_open_flags & ~UNQLITE_OPEN_CREATE) | UNQLITE_OPEN_READONLY | UNQLITE_OPEN_MMAP;
+        atime_mode = ATIME_NOATIME;
+        if (fuse_opt_add_arg(&args, "-oro") == -1) {
+            return 1;
+        }
+    }
+    if (options.page_size < 0 || options.cache_pages < 0) {
+        fprintf(stderr, "newfs: page_size and cache_pages must be positive\n");
+        return 1;
+    }
+    store_page_size = options.page_size;
+    store_cache_pages = options.cache_pages;
+    if (options.shards != 0) {
+        if (options.shards < 1 || options.shards > STORE_MAX_SHARDS) {
+            fprintf(stderr, "newfs: shards must be between 1 and %d\n", STORE_MAX_SHARDS);
+            return 1;
+        }
+        store_shards = options.shards;
+    }
 
     //Setup the log file and store the FILE* in the private data object for the file system.
     newfs_internal_state = malloc(sizeof(struct newfs_state));
     newfs_internal_state->logfile = init_log_file();
+    if (trace_level != TRACE_OFF && trace_start(TRACE_FILE) != 0) {
+        perror("newfs: unable to open the trace file");
+    }
 
     //Initialise the file system. This is being done outside of fuse for ease of debugging.
     init_fs();
 
-    fuserc = fuse_main(argc, argv, &newfs_oper, newfs_internal_state);
+    fuserc = fuse_main(args.argc, args.argv, &newfs_oper, newfs_internal_state);
+    fuse_opt_free_args(&args);
 
     //Shutdown the file system.
     shutdown_fs();
+    trace_stop();
 
     return fuserc;
 }
@@ -60,8 +60,16 @@ int get_path(struct fcb *dir,char *path);
 int set_data(struct fcb *dir,char *data,size_t size);
 int get_data(struct fcb *dir,char *data);
 int dat_truncate(struct fcb *dir,int new_size);
-int dat_del_chunk(struct fcb *dir,int start_index,int size);
-int dat_insert_chunk(struct fcb *dir,int start_index,char *insert_data,int size);
+int dat_del_chunk(struct fcb *dir,off_t start_index,off_t size);
+int dat_insert_chunk(struct fcb *dir,off_t start_index,const char *insert_data,size_t size);
+int dat_get_chunk(struct fcb *file,off_t start_index,size_t size,char *buffer);
+int dat_append(struct fcb *dir,const char *data,off_t size);
+int dat_extend(struct fcb *dir,off_t new_size);
+void dat_write(struct fcb *dir,off_t offset,const char *data,off_t size);
+void dat_trim(struct fcb *dir,off_t new_size);
+void dat_punch(struct fcb *dir,off_t offset,off_t len);
+void dat_clone(struct fcb *dir,struct fcb *from);
+off_t dat_read(struct fcb *file,off_t start_index,off_t size,char *buffer);
 int get_record_size(uuid_t *uuid,void *data,unqlite_int64 size);
 int delete_record(uuid_t *uuid);
 int tokenize_path(char *path,char ***tokens2,int *count);
@@ -69,9 +77,12 @@ int separate_path(char *path,int* current);
 int resolve_ancestor(struct fcb *ancestor_fcb,char *path,int ancestor_level);
 int get_fcb_from_name(struct fcb *dir_fcb,char *name,struct fcb *found_el);
 int remove_UUID_from_dir(struct fcb *dir_fcb,uuid_t *uuid);
+int dir_add_entry(struct fcb *dir_fcb,struct fcb *element,const char *name);
+off_t dir_entry_size(const char *name);
 int rm_element_from_directory(struct fcb *dir_fcb,char *path,bool delete_dir);
 void store_thing();
 int newfs_chmod(const char *path,mode_t mode);
+int newfs_rename(const char *path,const char *to);
 int newfs_chown(const char *path,uid_t uid,gid_t gid);
 int newfs_mkdir(const char *path_in,mode_t mode);
 int newfs_unlink(const char *path);
@@ -79,11 +90,18 @@ int newfs_rmdir(const char *path_in);
 int newfs_truncate(const char *path,off_t newsize);
 int newfs_flush(const char *path,struct fuse_file_info *fi);
 int newfs_release(const char *path,struct fuse_file_info *fi);
+int newfs_fsync(const char *path,int datasync,struct fuse_file_info *fi);
+int newfs_fsyncdir(const char *path,int datasync,struct fuse_file_info *fi);
+int newfs_fallocate(const char *path,int mode,off_t offset,off_t len,struct fuse_file_info *fi);
+int newfs_clone(const char *from,const char *path);
+int newfs_ioctl(const char *path,int cmd,void *arg,struct fuse_file_info *fi,unsigned int flags,void *data);
 bool test_tokenization();
 void run_test(bool test_res,char *error_string);
 void test_endpoint();
+extern int atime_mode;
 void init_fs();
 void shutdown_fs();
+int parse_durability(const char *name);
 #if !defined(IS_LIB)
 int main(int argc,char *argv[]);
 #endif
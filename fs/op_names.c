@@ -0,0 +1,18 @@
+#include "fs.h"
+
+// Names of the operations in the statistics and the traces. Kept apart from fs.c so that trace_decode
+// links without the store.
+
+const char *stats_names[STAT_COUNT] = {
+	"getattr", "readdir", "open", "read", "create", "utime", "write", "truncate", "flush", "release",
+	"fsync", "fsyncdir", "fallocate", "ioctl", "mkdir", "rename", "chmod", "chown", "unlink", "rmdir",
+	"kv_fetch", "kv_store", "commit"
+};
+
+//Name of a traced operation.
+const char *trace_op_name(int op){
+	if( op >= 0 && op < STAT_COUNT ){ return stats_names[op]; }
+	if( op == TRACE_OP_VACUUM ){ return "vacuum"; }
+	if( op == TRACE_OP_DROPPED ){ return "dropped"; }
+	return "unknown";
+}
@@ -0,0 +1,42 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fs.h"
+
+// Prints the records of a trace file written by newfs, one line per record.
+// Usage: trace_decode [trace file]
+
+int main(int argc, char** argv){
+	const char *name = (argc > 1) ? argv[1] : TRACE_FILE;
+	struct trace_header header;
+	struct trace_record record;
+	FILE *in = fopen(name, "rb");
+
+	if( in == NULL ){
+		perror(name);
+		return EXIT_FAILURE;
+	}
+	if( fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+	    || header.record_size != sizeof(struct trace_record) ){
+		fprintf(stderr, "trace_decode: %s is not a trace of this version of newfs\n", name);
+		return EXIT_FAILURE;
+	}
+
+	while( fread(&record, sizeof(record), 1, in) == 1 ){
+		int64_t real = (int64_t) record.start + header.clock_offset;
+		time_t seconds = (time_t) (real / 1000000000);
+		char date[32];
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+
+		printf("%s.%09lld t%u %s", date, (long long) (real % 1000000000), record.thread, trace_op_name(record.op));
+		if( record.op == TRACE_OP_DROPPED ){
+			printf(" %lld records\n", (long long) record.arg[0]);
+			continue;
+		}
+		printf(" \"%.*s\" %lld %lld = %d (%.3f us)\n", TRACE_PATH_SIZE, record.path, (long long) record.arg[0],
+		       (long long) record.arg[1], record.result, record.duration / 1e3);
+	}
+	fclose(in);
+	return 0;
+}
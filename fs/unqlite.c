@@ -464,6 +464,20 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_CONFIG_KV_ENGINE           4  /* ONE ARGUMENT: const char *zKvName */
 #define UNQLITE_CONFIG_DISABLE_AUTO_COMMIT 5  /* NO ARGUMENTS */
 #define UNQLITE_CONFIG_GET_KV_NAME         6  /* ONE ARGUMENT: const char **pzPtr */
+#define UNQLITE_CONFIG_SYNC_LEVEL          7  /* ONE ARGUMENT: int iLevel */
+#define UNQLITE_CONFIG_PAGER_STATS         8  /* THREE ARGUMENTS: unqlite_int64 *pnHit,unqlite_int64 *pnMiss,unqlite_int64 *pnSync */
+#define UNQLITE_CONFIG_PREPARE_COMMIT      9  /* NO ARGUMENTS */
+/*
+ * Durability levels for [unqlite_config()] with UNQLITE_CONFIG_SYNC_LEVEL.
+ *
+ * UNQLITE_SYNC_LEVEL_NONE:   Never sync. A crash of the host may lose or corrupt the database.
+ * UNQLITE_SYNC_LEVEL_COMMIT: A single data-only sync of the database file per commit. The journal
+ *                            is not synced so a power loss during a commit may corrupt the database.
+ * UNQLITE_SYNC_LEVEL_FULL:   Sync the journal before and the database after each commit (Default).
+ */
+#define UNQLITE_SYNC_LEVEL_NONE   0
+#define UNQLITE_SYNC_LEVEL_COMMIT 1
+#define UNQLITE_SYNC_LEVEL_FULL   2
 /*
  * UnQLite/Jx9 Virtual Machine Configuration Commands.
  *
@@ -509,6 +523,15 @@ typedef sxi64 unqlite_int64;
  */
 #define UNQLITE_KV_CONFIG_HASH_FUNC  1 /* ONE ARGUMENT: unsigned int (*xHash)(const void *,unsigned int) */
 #define UNQLITE_KV_CONFIG_CMP_FUNC   2 /* ONE ARGUMENT: int (*xCmp)(const void *,const void *,unsigned int) */
+#define UNQLITE_KV_CONFIG_VACUUM     3 /* FOUR ARGUMENTS: int nStep,unqlite_int64 *pnFree,unqlite_int64 *pnPage,unqlite_int64 *pnRemain */
+#define UNQLITE_KV_CONFIG_CHECK      4 /* THREE ARGUMENTS: unqlite_int64 *pnUsed,unqlite_int64 *pnFree,unqlite_int64 *pnBreak */
+#define UNQLITE_KV_CONFIG_COMPRESSION 5 /* ONE ARGUMENT: int iCodec */
+#define UNQLITE_KV_CONFIG_PREFETCH   6 /* FOUR ARGUMENTS: const void *pKey,int nKey,unqlite_int64 iOfft,unqlite_int64 nLen */
+/*
+ * Value codecs for UNQLITE_KV_CONFIG_COMPRESSION.
+ */
+#define UNQLITE_KV_CODEC_NONE 0 /* Store values raw */
+#define UNQLITE_KV_CODEC_LZ4  1 /* LZ4 block format */
 /*
  * Global Library Configuration Commands.
  *
@@ -554,6 +577,7 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_OPEN_OMIT_JOURNALING  0x00000040  /* Omit journaling for this database. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_IN_MEMORY        0x00000080  /* An in memory database. Ok for [unqlite_open]*/
 #define UNQLITE_OPEN_MMAP             0x00000100  /* Obtain a memory view of the whole file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_PAGE_CRC         0x00000200  /* Store a CRC32C in every page of a new database. Ok for [unqlite_open] */
 /*
  * Synchronization Type Flags
  *
@@ -768,6 +792,10 @@ struct unqlite_kv_io
 	void (*xSetUnpin)(unqlite_kv_handle,void (*xPageUnpin)(void *)); 
 	void (*xSetReload)(unqlite_kv_handle,void (*xPageReload)(void *));
 	void (*xErr)(unqlite_kv_handle,const char *);
+	pgno (*xPageCount)(unqlite_kv_handle);
+	int (*xTruncate)(unqlite_kv_handle,pgno);
+	int (*xSwap)(unqlite_page *,unqlite_page *);
+	int (*xPrefetch)(unqlite_kv_handle,pgno,pgno);
 };
 /*
  * Key/Value Storage Engine Cursor Object
@@ -820,7 +848,7 @@ struct unqlite_kv_methods
   const char *zName; /* Storage engine name [i.e. Hash, B+tree, LSM, R-tree, Mem, etc.]*/
   int szKv;          /* 'unqlite_kv_engine' subclass size */
   int szCursor;      /* 'unqlite_kv_cursor' subclass size */
-  int iVersion;      /* Structure version, currently 1 */
+  int iVersion;      /* Structure version, 2 with xFetchCached */
   /* Storage engine methods */
   int (*xInit)(unqlite_kv_engine *,int iPageSize);
   void (*xRelease)(unqlite_kv_engine *);
@@ -850,6 +878,12 @@ struct unqlite_kv_methods
   int (*xData)(unqlite_kv_cursor *,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
   void (*xReset)(unqlite_kv_cursor *);
   void (*xCursorRelease)(unqlite_kv_cursor *);
+  /* Version 2: fetch a record from the pages in the cache only, without changing anything, so that
+   * several threads can run it at once. No consumer asks for the data length. Returns UNQLITE_BUSY
+   * when the record is not in memory: the caller then seeks it with a cursor.
+   */
+  int (*xFetchCached)(unqlite_kv_engine *,const void *pKey,int nByte,
+	  int (*xConsumer)(const void *,unsigned int,void *),void *pUserData,unqlite_int64 *pDataLen);
 };
 /*
  * UnQLite journal file suffix.
@@ -3238,6 +3272,15 @@ JX9_PRIVATE void SyDosTimeFormat(sxu32 nDosDate, Sytm *pOut);
 #endif 
 /* forward declaration */
 typedef struct unqlite_db unqlite_db;
+/*
+ * With threads, the fetches served from the page cache run under the shared
+ * side of a per-handle read/write lock, the other calls under the handle
+ * mutex and the exclusive side (See unqliteDbEnter()).
+ */
+#if defined(UNQLITE_ENABLE_THREADS) && defined(__UNIXES__) && defined(__GNUC__)
+#define UNQLITE_SHARED_FETCH
+#include <pthread.h>
+#endif
 /*
 ** The following values may be passed as the second argument to
 ** UnqliteOsLock(). The various locks exhibit the following semantics:
@@ -3327,6 +3370,12 @@ struct unqlite
 #if defined(UNQLITE_ENABLE_THREADS)
 	const SyMutexMethods *pMethods;  /* Mutex methods */
 	SyMutex *pMutex;                 /* Per-handle mutex */
+	SyMutex *pCommitMutex;           /* Held by the thread whose commit is in flight */
+#endif
+#if defined(UNQLITE_SHARED_FETCH)
+	pthread_rwlock_t sShared;        /* Shared by the fetches from the cache, exclusive with pMutex */
+	sxu32 nEnter;                    /* Recursion depth of pMutex */
+	sxu32 nExclusiveWait;            /* Threads waiting for the exclusive side */
 #endif
 	unqlite_vm *pVms;                /* List of active VM */
 	sxi32 iVm;                       /* Total number of active VM */
@@ -3515,6 +3564,9 @@ UNQLITE_PRIVATE void unqliteBitvecDestroy(Bitvec *p);
 UNQLITE_PRIVATE int unqliteInitCursor(unqlite *pDb,unqlite_kv_cursor **ppOut);
 UNQLITE_PRIVATE int unqliteReleaseCursor(unqlite *pDb,unqlite_kv_cursor *pCur);
 UNQLITE_PRIVATE int unqlitePagerSetCachesize(Pager *pPager,int mxPage);
+UNQLITE_PRIVATE int unqlitePagerSetSyncLevel(Pager *pPager,int iLevel);
+UNQLITE_PRIVATE void unqlitePagerStats(Pager *pPager,sxi64 *pnHit,sxi64 *pnMiss,sxi64 *pnSync);
+UNQLITE_PRIVATE void unqlitePagerCountHit(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerClose(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerOpen(
   unqlite_vfs *pVfs,       /* The virtual file system to use */
@@ -3523,12 +3575,18 @@ UNQLITE_PRIVATE int unqlitePagerOpen(
   unsigned int iFlags      /* flags controlling this file */
   );
 UNQLITE_PRIVATE int unqlitePagerRegisterKvEngine(Pager *pPager,unqlite_kv_methods *pMethods);
+UNQLITE_PRIVATE int unqlitePagerSetKvEngine(Pager *pPager,const char *zName);
 UNQLITE_PRIVATE unqlite_kv_engine * unqlitePagerGetKvEngine(unqlite *pDb);
 UNQLITE_PRIVATE int unqlitePagerBegin(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager);
+UNQLITE_PRIVATE int unqlitePagerCommitBegin(Pager *pPager,int bPrepare);
+UNQLITE_PRIVATE int unqlitePagerCommitFlush(Pager *pPager,int bPrepare);
+UNQLITE_PRIVATE int unqlitePagerCommitEnd(Pager *pPager,int rc,int bPrepare);
+UNQLITE_PRIVATE int unqlitePagerInCommit(Pager *pPager);
 UNQLITE_PRIVATE int unqlitePagerRollback(Pager *pPager,int bResetKvEngine);
 UNQLITE_PRIVATE void unqlitePagerRandomString(Pager *pPager,char *zBuf,sxu32 nLen);
 UNQLITE_PRIVATE sxu32 unqlitePagerRandomNum(Pager *pPager);
+UNQLITE_PRIVATE void unqlitePagerInitCrc32c(void);
 #endif /* __UNQLITEINT_H__ */
 /*
  * ----------------------------------------------------------
@@ -3887,6 +3945,8 @@ static sxi32 unqliteCoreInitialize(void)
 		if( sUnqlMPGlobal.iPageSize < UNQLITE_MIN_PAGE_SIZE ){
 			unqlite_lib_config(UNQLITE_LIB_CONFIG_PAGE_SIZE,UNQLITE_DEFAULT_PAGE_SIZE);
 		}
+		/* Page checksum tables */
+		unqlitePagerInitCrc32c();
 		/* Our library is initialized, set the magic number */
 		sUnqlMPGlobal.nMagic = UNQLITE_LIB_MAGIC;
 		rc = UNQLITE_OK;
@@ -4239,6 +4299,90 @@ UNQLITE_PRIVATE int unqliteGenOutofMem(unqlite *pDb)
 	rc = unqliteGenError(pDb,"unQLite is running out of memory");
 	return rc;
 }
+#if defined(UNQLITE_ENABLE_THREADS)
+/*
+ * Enter and leave the handle mutex. The outermost entry also takes the
+ * exclusive side of the handle read/write lock, so that the fetches served
+ * from the cache without the mutex (See unqliteDbFetchShared()) never see
+ * the pages, the cells or the bucket map change under them. While a thread
+ * waits for the exclusive side the fetches take the mutex instead, so that
+ * a stream of cache hits cannot starve it.
+ */
+static void unqliteDbEnter(unqlite *pDb)
+{
+	SyMutexEnter(sUnqlMPGlobal.pMutexMethods,pDb->pMutex);
+#if defined(UNQLITE_SHARED_FETCH)
+	if( pDb->pMutex && pDb->nEnter++ == 0 ){
+		__atomic_fetch_add(&pDb->nExclusiveWait,1,__ATOMIC_SEQ_CST);
+		pthread_rwlock_wrlock(&pDb->sShared);
+		__atomic_fetch_sub(&pDb->nExclusiveWait,1,__ATOMIC_SEQ_CST);
+	}
+#endif
+}
+static void unqliteDbLeave(unqlite *pDb)
+{
+#if defined(UNQLITE_SHARED_FETCH)
+	if( pDb->pMutex && --pDb->nEnter == 0 ){
+		pthread_rwlock_unlock(&pDb->sShared);
+	}
+#endif
+	SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex);
+}
+#endif
+/*
+ * Wait for the end of the commit in flight, if any, before changing the
+ * database: the commit writes its pages without the DB mutex (See
+ * unqliteDbCommit()) and they must not change meanwhile.
+ * Called with the DB mutex held.
+ */
+static void unqliteDbWaitCommit(unqlite *pDb)
+{
+#if defined(UNQLITE_ENABLE_THREADS)
+	while( unqlitePagerInCommit(pDb->sDB.pPager) ){
+		unqliteDbLeave(pDb);
+		/* The committing thread holds this one until the end */
+		SyMutexEnter(sUnqlMPGlobal.pMutexMethods,pDb->pCommitMutex);
+		SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pCommitMutex);
+		unqliteDbEnter(pDb);
+	}
+#else
+	SXUNUSED(pDb);
+#endif
+}
+/*
+ * Commit the transaction of a database handle, or prepare it only when
+ * bPrepare is set. The file IO is done without the DB mutex so that
+ * readers are still served meanwhile: they read the version being
+ * committed from the page cache. Writers wait in unqliteDbWaitCommit().
+ * Called with the DB mutex held.
+ */
+static int unqliteDbCommit(unqlite *pDb,int bPrepare)
+{
+	Pager *pPager = pDb->sDB.pPager;
+	int rc;
+	unqliteDbWaitCommit(pDb);
+	rc = unqlitePagerCommitBegin(pPager,bPrepare);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( !unqlitePagerInCommit(pPager) ){
+		/* No IO to do */
+		return unqlitePagerCommitEnd(pPager,UNQLITE_OK,bPrepare);
+	}
+#if defined(UNQLITE_ENABLE_THREADS)
+	SyMutexEnter(sUnqlMPGlobal.pMutexMethods,pDb->pCommitMutex);
+	unqliteDbLeave(pDb);
+#endif
+	rc = unqlitePagerCommitFlush(pPager,bPrepare);
+#if defined(UNQLITE_ENABLE_THREADS)
+	unqliteDbEnter(pDb);
+#endif
+	rc = unqlitePagerCommitEnd(pPager,rc,bPrepare);
+#if defined(UNQLITE_ENABLE_THREADS)
+	SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pCommitMutex);
+#endif
+	return rc;
+}
 /*
  * Configure a working UnQLite database handle.
  */
@@ -4256,6 +4400,30 @@ static int unqliteConfigure(unqlite *pDb,int nOp,va_list ap)
 		rc = unqlitePagerSetCachesize(pDb->sDB.pPager,max_page);
 		break;
 										}
+	case UNQLITE_CONFIG_PREPARE_COMMIT:
+		/* Commit phase one, the journal is kept until [unqlite_commit()] */
+		rc = unqliteDbCommit(pDb,TRUE);
+		break;
+	case UNQLITE_CONFIG_KV_ENGINE: {
+		const char *zName = va_arg(ap,const char *);
+		/* Key/Value storage engine of a new database */
+		rc = unqlitePagerSetKvEngine(pDb->sDB.pPager,zName);
+		break;
+								   }
+	case UNQLITE_CONFIG_SYNC_LEVEL: {
+		int iLevel = va_arg(ap,int);
+		/* Durability of the commits */
+		rc = unqlitePagerSetSyncLevel(pDb->sDB.pPager,iLevel);
+		break;
+									}
+	case UNQLITE_CONFIG_PAGER_STATS: {
+		sxi64 *pnHit = va_arg(ap,sxi64 *);
+		sxi64 *pnMiss = va_arg(ap,sxi64 *);
+		sxi64 *pnSync = va_arg(ap,sxi64 *);
+		/* Page cache and sync counters since the database was opened */
+		unqlitePagerStats(pDb->sDB.pPager,pnHit,pnMiss,pnSync);
+		break;
+									 }
 	case UNQLITE_CONFIG_ERR_LOG: {
 		/* Database error log if any */
 		const char **pzPtr = va_arg(ap, const char **);
@@ -4350,6 +4518,17 @@ int unqlite_open(unqlite **ppDB,const char *zFilename,unsigned int iMode)
 			 rc = UNQLITE_NOMEM;
 			 goto Release;
 		 }
+		 /* Commits in flight (See unqliteDbCommit()) */
+		 pHandle->pCommitMutex = SyMutexNew(sUnqlMPGlobal.pMutexMethods, SXMUTEX_TYPE_FAST);
+		 if( pHandle->pCommitMutex == 0 ){
+			 SyMutexRelease(sUnqlMPGlobal.pMutexMethods, pHandle->pMutex);
+			 rc = UNQLITE_NOMEM;
+			 goto Release;
+		 }
+#if defined(UNQLITE_SHARED_FETCH)
+		 /* Fetches from the cache (See unqliteDbFetchShared()) */
+		 pthread_rwlock_init(&pHandle->sShared,0);
+#endif
 	 }
 #endif
 	/* Link to the list of active DB handles */
@@ -4386,18 +4565,22 @@ int unqlite_config(unqlite *pDb,int nConfigOp,...)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 if( nConfigOp != UNQLITE_CONFIG_PAGER_STATS ){
+		 /* Wait for the commit in flight if any, the statistics are only read */
+		 unqliteDbWaitCommit(pDb);
+	 }
 	 va_start(ap, nConfigOp);
 	 rc = unqliteConfigure(&(*pDb),nConfigOp, ap);
 	 va_end(ap);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -4413,19 +4596,27 @@ int unqlite_close(unqlite *pDb)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	/* Wait for the commit in flight if any */
+	unqliteDbWaitCommit(pDb);
 	/* Release the database handle */
 	rc = unqliteDbRelease(pDb);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 /* Release DB mutex */
 	 SyMutexRelease(sUnqlMPGlobal.pMutexMethods, pDb->pMutex) /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 SyMutexRelease(sUnqlMPGlobal.pMutexMethods, pDb->pCommitMutex) /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+#if defined(UNQLITE_SHARED_FETCH)
+	 if( pDb->pMutex ){
+		 pthread_rwlock_destroy(&pDb->sShared);
+	 }
+#endif
 #endif
 #if defined(UNQLITE_ENABLE_THREADS)
 	/* Enter the global mutex */
@@ -4455,7 +4646,7 @@ int unqlite_compile(unqlite *pDb,const char *zJx9,int nByte,unqlite_vm **ppOut)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT;
@@ -4473,7 +4664,7 @@ int unqlite_compile(unqlite *pDb,const char *zJx9,int nByte,unqlite_vm **ppOut)
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -4490,7 +4681,7 @@ int unqlite_compile_file(unqlite *pDb,const char *zPath,unqlite_vm **ppOut)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT;
@@ -4508,7 +4699,7 @@ int unqlite_compile_file(unqlite *pDb,const char *zPath,unqlite_vm **ppOut)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -4606,7 +4797,7 @@ int unqlite_vm_release(unqlite_vm *pVm)
 		 /* Unlink from the list of active VM's */
 #if defined(UNQLITE_ENABLE_THREADS)
 			/* Acquire DB mutex */
-			SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+			unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 			if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 				UNQLITE_THRD_DB_RELEASE(pDb) ){
 					return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -4618,7 +4809,7 @@ int unqlite_vm_release(unqlite_vm *pVm)
 		SyMemBackendPoolFree(&pDb->sMem,pVm);
 #if defined(UNQLITE_ENABLE_THREADS)
 			/* Leave DB mutex */
-			SyMutexLeave(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+			unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 }
 	 return rc;
@@ -5439,12 +5630,14 @@ int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 if( pEngine->pIo->pMethods->xReplace == 0 ){
@@ -5466,7 +5659,7 @@ int unqlite_kv_store(unqlite *pDb,const void *pKey,int nKeyLen,const void *pData
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5483,12 +5676,14 @@ int unqlite_kv_store_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *z
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 if( pEngine->pIo->pMethods->xReplace == 0 ){
@@ -5519,7 +5714,7 @@ int unqlite_kv_store_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *z
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5536,12 +5731,14 @@ int unqlite_kv_append(unqlite *pDb,const void *pKey,int nKeyLen,const void *pDat
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 if( pEngine->pIo->pMethods->xAppend == 0 ){
@@ -5563,7 +5760,7 @@ int unqlite_kv_append(unqlite *pDb,const void *pKey,int nKeyLen,const void *pDat
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5580,12 +5777,14 @@ int unqlite_kv_append_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 if( pEngine->pIo->pMethods->xAppend == 0 ){
@@ -5616,10 +5815,50 @@ int unqlite_kv_append_fmt(unqlite *pDb,const void *pKey,int nKeyLen,const char *
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
+#if defined(UNQLITE_SHARED_FETCH)
+/*
+ * Fetch a record from the page cache under the shared side of the handle
+ * lock, along with the other threads doing the same (See xFetchCached).
+ * UNQLITE_BUSY is returned when the fetch needs the handle mutex: the
+ * record is not in memory, the engine cannot fetch from the cache or a
+ * thread waits for the exclusive side (See unqliteDbEnter()). The consumer
+ * must not call the handle.
+ */
+static int unqliteDbFetchShared(
+	unqlite *pDb,
+	const void *pKey,int nKeyLen,
+	int (*xConsumer)(const void *,unsigned int,void *),void *pUserData,
+	unqlite_int64 *pDataLen
+	)
+{
+	unqlite_kv_methods *pMethods;
+	unqlite_kv_engine *pEngine;
+	int rc;
+	if( pDb->pMutex == 0 || nKeyLen < 1 || __atomic_load_n(&pDb->nExclusiveWait,__ATOMIC_SEQ_CST) > 0 ){
+		return UNQLITE_BUSY;
+	}
+	pthread_rwlock_rdlock(&pDb->sShared);
+	if( UNQLITE_THRD_DB_RELEASE(pDb) ){
+		pthread_rwlock_unlock(&pDb->sShared);
+		return UNQLITE_ABORT; /* Another thread have released this instance */
+	}
+	pEngine = unqlitePagerGetKvEngine(pDb);
+	pMethods = pEngine->pIo->pMethods;
+	rc = UNQLITE_BUSY;
+	if( pMethods->iVersion >= 2 && pMethods->xFetchCached ){
+		rc = pMethods->xFetchCached(pEngine,pKey,nKeyLen,xConsumer,pUserData,pDataLen);
+		if( rc == UNQLITE_OK || rc == UNQLITE_NOTFOUND ){
+			unqlitePagerCountHit(pDb->sDB.pPager);
+		}
+	}
+	pthread_rwlock_unlock(&pDb->sShared);
+	return rc;
+}
+#endif
 /*
  * [CAPIREF: unqlite_kv_fetch()]
  * Please refer to the official documentation for function purpose and expected parameters.
@@ -5633,9 +5872,30 @@ int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlit
 	if( UNQLITE_DB_MISUSE(pDb) ){
 		return UNQLITE_CORRUPT;
 	}
+	 if( nKeyLen < 0 ){
+		 /* Assume a null terminated string and compute it's length */
+		 nKeyLen = SyStrlen((const char *)pKey);
+	 }
+#if defined(UNQLITE_SHARED_FETCH)
+	 if( pBuf == 0 ){
+		 rc = unqliteDbFetchShared(pDb,pKey,nKeyLen,0,0,pBufLen);
+	 }else{
+		 SyBlob sBlob;
+		 SyBlobInitFromBuf(&sBlob,pBuf,(sxu32)*pBufLen);
+		 rc = unqliteDbFetchShared(pDb,pKey,nKeyLen,unqliteDataConsumer,&sBlob,0);
+		 if( rc != UNQLITE_BUSY && rc != UNQLITE_NOTFOUND ){
+			 *pBufLen = (unqlite_int64)SyBlobLength(&sBlob);
+		 }
+		 SyBlobRelease(&sBlob);
+	 }
+	 if( rc != UNQLITE_BUSY ){
+		 /* Served from the cache */
+		 return rc;
+	 }
+#endif
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -5645,10 +5905,6 @@ int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlit
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 pMethods = pEngine->pIo->pMethods;
 	 pCur = pDb->sDB.pCursor;
-	 if( nKeyLen < 0 ){
-		 /* Assume a null terminated string and compute it's length */
-		 nKeyLen = SyStrlen((const char *)pKey);
-	 }
 	 if( !nKeyLen ){
 		  unqliteGenError(pDb,"Empty key");
 		  rc = UNQLITE_EMPTY;
@@ -5674,7 +5930,7 @@ int unqlite_kv_fetch(unqlite *pDb,const void *pKey,int nKeyLen,void *pBuf,unqlit
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5691,9 +5947,23 @@ int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,int (*xC
 	if( UNQLITE_DB_MISUSE(pDb) ){
 		return UNQLITE_CORRUPT;
 	}
+	 if( nKeyLen < 0 ){
+		 /* Assume a null terminated string and compute it's length */
+		 nKeyLen = SyStrlen((const char *)pKey);
+	 }
+#if defined(UNQLITE_SHARED_FETCH)
+	 {
+		 unqlite_int64 nLen;
+		 rc = unqliteDbFetchShared(pDb,pKey,nKeyLen,xConsumer,pUserData,&nLen);
+		 if( rc != UNQLITE_BUSY ){
+			 /* Served from the cache */
+			 return rc;
+		 }
+	 }
+#endif
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -5703,10 +5973,6 @@ int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,int (*xC
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 pMethods = pEngine->pIo->pMethods;
 	 pCur = pDb->sDB.pCursor;
-	 if( nKeyLen < 0 ){
-		 /* Assume a null terminated string and compute it's length */
-		 nKeyLen = SyStrlen((const char *)pKey);
-	 }
 	 if( !nKeyLen ){
 		 unqliteGenError(pDb,"Empty key");
 		 rc = UNQLITE_EMPTY;
@@ -5720,7 +5986,7 @@ int unqlite_kv_fetch_callback(unqlite *pDb,const void *pKey,int nKeyLen,int (*xC
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5739,12 +6005,14 @@ int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 pMethods = pEngine->pIo->pMethods;
@@ -5772,7 +6040,7 @@ int unqlite_kv_delete(unqlite *pDb,const void *pKey,int nKeyLen)
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5789,12 +6057,16 @@ int unqlite_kv_config(unqlite *pDb,int iOp,...)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 if( iOp != UNQLITE_KV_CONFIG_PREFETCH ){
+		 /* Wait for the commit in flight if any, prefetching only reads */
+		 unqliteDbWaitCommit(pDb);
+	 }
 	 /* Point to the underlying storage engine */
 	 pEngine = unqlitePagerGetKvEngine(pDb);
 	 if( pEngine->pIo->pMethods->xConfig == 0 ){
@@ -5810,7 +6082,7 @@ int unqlite_kv_config(unqlite *pDb,int iOp,...)
 	 }
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	return rc;
 }
@@ -5826,7 +6098,7 @@ int unqlite_kv_cursor_init(unqlite *pDb,unqlite_kv_cursor **ppOut)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -5836,7 +6108,7 @@ int unqlite_kv_cursor_init(unqlite *pDb,unqlite_kv_cursor **ppOut)
 	 rc = unqliteInitCursor(pDb,ppOut);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return rc;
 }
@@ -5852,7 +6124,7 @@ int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -5862,7 +6134,7 @@ int unqlite_kv_cursor_release(unqlite *pDb,unqlite_kv_cursor *pCur)
 	 rc = unqliteReleaseCursor(pDb,pCur);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return rc;
 }
@@ -6157,17 +6429,19 @@ int unqlite_begin(unqlite *pDb)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Begin the write transaction */
 	 rc = unqlitePagerBegin(pDb->sDB.pPager);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return rc;
 }
@@ -6183,17 +6457,17 @@ int unqlite_commit(unqlite *pDb)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
 	 /* Commit the transaction */
-	 rc = unqlitePagerCommit(pDb->sDB.pPager);
+	 rc = unqliteDbCommit(pDb,FALSE);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return rc;
 }
@@ -6209,17 +6483,19 @@ int unqlite_rollback(unqlite *pDb)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
 	 }
 #endif
+	 /* Wait for the commit in flight if any */
+	 unqliteDbWaitCommit(pDb);
 	 /* Rollback the transaction */
 	 rc = unqlitePagerRollback(pDb->sDB.pPager,TRUE);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return rc;
 }
@@ -6285,7 +6561,7 @@ UNQLITE_APIEXPORT int unqlite_util_random_string(unqlite *pDb,char *zBuf,unsigne
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return UNQLITE_ABORT; /* Another thread have released this instance */
@@ -6295,7 +6571,7 @@ UNQLITE_APIEXPORT int unqlite_util_random_string(unqlite *pDb,char *zBuf,unsigne
 	 unqlitePagerRandomString(pDb->sDB.pPager,zBuf,buf_size);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return UNQLITE_OK;
 }
@@ -6311,7 +6587,7 @@ UNQLITE_APIEXPORT unsigned int unqlite_util_random_num(unqlite *pDb)
 	}
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Acquire DB mutex */
-	 SyMutexEnter(sUnqlMPGlobal.pMutexMethods, pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbEnter(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 	 if( sUnqlMPGlobal.nThreadingLevel > UNQLITE_THREAD_LEVEL_SINGLE && 
 		 UNQLITE_THRD_DB_RELEASE(pDb) ){
 			 return 0; /* Another thread have released this instance */
@@ -6321,7 +6597,7 @@ UNQLITE_APIEXPORT unsigned int unqlite_util_random_num(unqlite *pDb)
 	 iNum = unqlitePagerRandomNum(pDb->sDB.pPager);
 #if defined(UNQLITE_ENABLE_THREADS)
 	 /* Leave DB mutex */
-	 SyMutexLeave(sUnqlMPGlobal.pMutexMethods,pDb->pMutex); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
+	 unqliteDbLeave(pDb); /* NO-OP if sUnqlMPGlobal.nThreadingLevel != UNQLITE_THREAD_LEVEL_MULTI */
 #endif
 	 return iNum;
 }
@@ -48701,6 +48977,31 @@ static sxi32 VmGetNextLine(SyString *pCursor, SyString *pCurrent)
 ** The maximum number of bytes of payload allowed on a single overflow page.
 */
 #define L_HASH_OVERFLOW_SIZE(PageSize) (PageSize-8)
+/*
+** Shortest run of free pages worth reusing for a multi-page overflow chain.
+** Shorter runs are left to single page allocations.
+*/
+#define L_HASH_MIN_EXTENT 8
+/*
+** Overflow values may be stored compressed. The codec is kept in the most
+** significant byte of the 8 byte data length of the cell (0 means raw data).
+** A compressed payload starts with the 8 byte uncompressed length followed by
+** frames of at most L_HASH_FRAME_SIZE raw bytes. Each frame is made of its raw
+** length, its stored length and the stored bytes. A frame whose stored length
+** equals its raw length did not compress and is kept as is.
+*/
+#define L_HASH_CODEC_SHIFT 56
+#define L_HASH_DATA_MASK ((((sxu64)1) << L_HASH_CODEC_SHIFT) - 1)
+#define L_HASH_CELL_DATA_LEN(pCell) ((pCell)->nData | (((sxu64)(pCell)->iCodec) << L_HASH_CODEC_SHIFT))
+#define L_HASH_FRAME_SIZE 65536
+#define L_HASH_FRAME_HDR_SZ (4/*Raw length*/+4/*Stored length*/)
+/* Values shorter than this are always stored raw */
+#define L_HASH_COMPRESS_MIN 1024
+/* LZ4 block format parameters */
+#define L_HASH_LZ4_HASH_LOG 12
+#define L_HASH_LZ4_MINMATCH 4
+#define L_HASH_LZ4_MFLIMIT  12 /* A match must start at least this far from the end of the block */
+#define L_HASH_LZ4_LAST     5  /* The last bytes of a block are always literals */
 /* Forward declaration */
 typedef struct lhash_kv_engine lhash_kv_engine;
 typedef struct lhpage lhpage;
@@ -48722,6 +49023,8 @@ struct lhcell
 	sxu16 iStart;      /* Offset of this cell */
 	pgno iDataPage;    /* Data page number when overflow */
 	sxu16 iDataOfft;   /* Offset of the data in iDataPage */
+	sxu8 iCodec;       /* Data codec, kept in the most significant byte of the on-disk data length */
+	sxu64 nRaw;        /* Uncompressed data length if iCodec != 0, SXU64_HIGH when not yet known */
 	SyBlob sKey;       /* Record key for fast lookup (Kept in-memory if < 256KB ) */
 	lhcell *pNext,*pPrev;         /* Linked list of the loaded memory cells */
 	lhcell *pNextCol,*pPrevCol;   /* Collison chain  */
@@ -48765,6 +49068,8 @@ struct lhash_bmap_rec
 {
 	pgno iLogic;                   /* Logical bucket number */
 	pgno iReal;                    /* Real bucket number */
+	pgno iPage;                    /* Bucket map page this record is stored in */
+	sxu16 iOfft;                   /* Offset of this record in iPage */
 	lhash_bmap_rec *pNext,*pPrev;  /* Link to other bucket map */     
 	lhash_bmap_rec *pNextCol,*pPrevCol; /* Collision links */
 };
@@ -48776,6 +49081,29 @@ struct lhash_bmap_page
 	sxu32 nRec;  /* Total number of records in this page */
 	pgno iNext;  /* Next map page */
 };
+/*
+ * Each entry of the free page list is mirrored in-memory by an instance of the
+ * following structure while an online vacuum is in use (See lhVacuumStep()).
+ */
+typedef struct lhash_free_page lhash_free_page;
+struct lhash_free_page
+{
+	pgno iNum;                           /* Free page number */
+	lhash_free_page *pNext,*pPrev;       /* Same order as the on-disk list */
+	lhash_free_page *pNextCol,*pPrevCol; /* Collision links */
+};
+/*
+ * Where a read ahead walk of an overflow chain stopped, so the next one
+ * resumes there instead of walking the chain from its head again.
+ */
+#define L_HASH_CHAIN_POS 8 /* Chains remembered at once */
+typedef struct lhash_chain_pos lhash_chain_pos;
+struct lhash_chain_pos
+{
+	pgno iHead; /* First data page of the chain, 0 for an unused entry */
+	pgno iPage; /* A page of the chain */
+	sxu64 nPos; /* Offset of the first data byte of iPage in the stored value */
+};
 /*
  * An in memory linear hash implemenation is represented by in an isntance
  * of the following structure.
@@ -48800,6 +49128,23 @@ struct lhash_kv_engine
 	pgno max_split_bucket;        /* Maximum split bucket: MUST BE A POWER OF TWO */
 	pgno nmax_split_nucket;       /* Next maximum split bucket (1 << nMsb): In-memory only */
 	sxu32 nMagic;                 /* Magic number to identify a valid linear hash disk database */
+	sxu8 iCodec;                  /* Codec of new overflow values (UNQLITE_KV_CODEC_NONE to store them raw) */
+	/* Free space management and online vacuum */
+	lhash_free_page **apFree;     /* In-memory mirror of the free list */
+	sxu32 nFreeSize;              /* apFree[] size */
+	sxu32 nFreePage;              /* Total number of free pages */
+	lhash_free_page *pFreeHead;   /* Head of the mirror (i.e. nFreeList) */
+	lhash_free_page *pFreeTail;   /* Tail of the mirror */
+	sxu32 *aFreeMap;              /* Free space bitmap: One bit per page */
+	pgno nFreeMapBits;            /* Total number of pages covered by aFreeMap[] */
+	pgno iExtNext;                /* Next page of the reserved extent */
+	pgno nExtLeft;                /* Pages left in the reserved extent */
+	pgno iVacTarget;              /* Live pages past this one are relocated. 0 when no pass is active */
+	pgno iVacLow;                 /* Lowest free page candidate */
+	pgno iVacBucket;              /* Next logical bucket to visit */
+	/* Read ahead */
+	lhash_chain_pos aChainPos[L_HASH_CHAIN_POS]; /* Where the last walks stopped */
+	sxu32 iChainPos;              /* Next entry of aChainPos[] to recycle */
 };
 /*
  * Given a logical bucket number, return the record associated with it.
@@ -48828,7 +49173,7 @@ static lhash_bmap_rec * lhMapFindBucket(lhash_kv_engine *pEngine,pgno iLogic)
 /*
  * Install a new bucket map record.
  */
-static int lhMapInstallBucket(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
+static int lhMapInstallBucket(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal,pgno iPage,sxu16 iOfft)
 {
 	lhash_bmap_rec *pRec;
 	sxu32 iBucket;
@@ -48842,6 +49187,8 @@ static int lhMapInstallBucket(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
 	/* Fill in the structure */
 	pRec->iLogic = iLogic;
 	pRec->iReal = iReal;
+	pRec->iPage = iPage;
+	pRec->iOfft = iOfft;
 	iBucket = iLogic & (pEngine->nBuckSize - 1);
 	pRec->pNextCol = pEngine->apMap[iBucket];
 	if( pEngine->apMap[iBucket] ){
@@ -48902,6 +49249,7 @@ static int lhMapLoadPage(lhash_kv_engine *pEngine,lhash_bmap_page *pMap,const un
 	const unsigned char *zEnd = &zRaw[pEngine->iPageSize];
 	const unsigned char *zPtr = zRaw;
 	pgno iLogic,iReal;
+	sxu16 iOfft;
 	sxu32 n;
 	int rc;
 	if( pMap->iPtr == 0 ){
@@ -48919,13 +49267,14 @@ static int lhMapLoadPage(lhash_kv_engine *pEngine,lhash_bmap_page *pMap,const un
 		if( zRaw >= zEnd ){
 			break;
 		}
+		iOfft = (sxu16)(zRaw-zPtr);
 		/* Extract the logical and real bucket number */
 		SyBigEndianUnpack64(zRaw,&iLogic);
 		zRaw += 8;
 		SyBigEndianUnpack64(zRaw,&iReal);
 		zRaw += 8;
 		/* Install the record in the map */
-		rc = lhMapInstallBucket(pEngine,iLogic,iReal);
+		rc = lhMapInstallBucket(pEngine,iLogic,iReal,pMap->iNum,iOfft);
 		if( rc != UNQLITE_OK ){
 			return rc;
 		}
@@ -49163,7 +49512,9 @@ static int lhParseOneCell(lhpage *pPage,const unsigned char *zRaw,const unsigned
 	/* Fill in the structure */
 	pCell->iNext = iNext;
 	pCell->nKey  = nKey;
-	pCell->nData = nData;
+	pCell->nData = nData & L_HASH_DATA_MASK;
+	pCell->iCodec = (sxu8)(nData >> L_HASH_CODEC_SHIFT);
+	pCell->nRaw = SXU64_HIGH;
 	pCell->nHash = iHash;
 	/* Overflow page if any */
 	SyBigEndianUnpack64(zRaw,&pCell->iOvfl);
@@ -49446,11 +49797,15 @@ static int lhConsumeCellkey(
 }
 /*
  * Given a cell, Consume its data by invoking the given callback for each extracted chunk.
+ * With bCached, only the overflow pages in the cache are used and no reference is taken
+ * (See lhash_kv_fetch_cached()): UNQLITE_BUSY is returned if one is missing. Without a
+ * consumer, the pages are only looked up.
  */
 static int lhConsumeCellData(
 	lhcell *pCell, /* Target cell */
 	int (*xConsumer)(const void *,unsigned int,void *), /* Data consumer callback */
-	void *pUserData /* Last argument to xConsumer() */
+	void *pUserData, /* Last argument to xConsumer() */
+	int bCached /* Cache lookups only */
 	)
 {
 	lhpage *pPage = pCell->pPage;
@@ -49462,6 +49817,9 @@ static int lhConsumeCellData(
 	if( pCell->iOvfl == 0 ){
 		/* Best scenario, consume the data directly without any overflow page */
 		zPayload += L_HASH_CELL_SZ + pCell->nKey;
+		if( xConsumer == 0 ){
+			return UNQLITE_OK;
+		}
 		rc = xConsumer((const void *)zPayload,(sxu32)pCell->nData,pUserData);
 		if( rc != UNQLITE_OK ){
 			rc = UNQLITE_ABORT;
@@ -49481,9 +49839,15 @@ static int lhConsumeCellData(
 				break;
 			}
 			/* Point to the overflow page */
-			rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
-			if( rc != UNQLITE_OK ){
-				return rc;
+			if( bCached ){
+				if( pEngine->pIo->xLookup(pEngine->pIo->pHandle,iOvfl,&pOvfl) != UNQLITE_OK ){
+					return UNQLITE_BUSY;
+				}
+			}else{
+				rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
+				if( rc != UNQLITE_OK ){
+					return rc;
+				}
 			}
 			/* Point to the raw content */
 			zPayload = pOvfl->zData;
@@ -49499,17 +49863,19 @@ static int lhConsumeCellData(
 			}
 			/* Consume the data */
 			if( nData <= (sxu64)nByte ){
-				rc = xConsumer((const void *)zPayload,(unsigned int)nData,pUserData);
-				if( rc != UNQLITE_OK ){
-					pEngine->pIo->xPageUnref(pOvfl);
+				if( xConsumer && xConsumer((const void *)zPayload,(unsigned int)nData,pUserData) != UNQLITE_OK ){
+					if( !bCached ){
+						pEngine->pIo->xPageUnref(pOvfl);
+					}
 					return UNQLITE_ABORT;
 				}
 				nData = 0;
 			}else{
 				if( nByte > 0 ){
-					rc = xConsumer((const void *)zPayload,nByte,pUserData);
-					if( rc != UNQLITE_OK ){
-						pEngine->pIo->xPageUnref(pOvfl);
+					if( xConsumer && xConsumer((const void *)zPayload,nByte,pUserData) != UNQLITE_OK ){
+						if( !bCached ){
+							pEngine->pIo->xPageUnref(pOvfl);
+						}
 						return UNQLITE_ABORT;
 					}
 					nData -= nByte;
@@ -49518,12 +49884,456 @@ static int lhConsumeCellData(
 			/* Next overflow page in the chain */
 			SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
 			/* Unref the page */
-			pEngine->pIo->xPageUnref(pOvfl);
+			if( !bCached ){
+				pEngine->pIo->xPageUnref(pOvfl);
+			}
 		}
 		rc = UNQLITE_OK;
 	}
 	return rc;
 }
+/*
+ * Read 4 bytes (little-endian) for the LZ4 match finder.
+ */
+static sxu32 lhLz4Read32(const unsigned char *zPtr)
+{
+	return (sxu32)zPtr[0] | ((sxu32)zPtr[1] << 8) | ((sxu32)zPtr[2] << 16) | ((sxu32)zPtr[3] << 24);
+}
+/*
+ * Emit a single LZ4 sequence: literals followed by an optional match.
+ * Return the new output position or NULL if the output is full.
+ */
+static unsigned char * lhLz4Sequence(
+	unsigned char *zOp,unsigned char *zOpEnd, /* Output */
+	const unsigned char *zLit,sxu32 nLit,     /* Literals */
+	sxu32 iOfft,sxu32 nMatch                  /* Match if nMatch > 0 */
+	)
+{
+	unsigned char *zToken;
+	sxu32 n;
+	/* Worst case: token, literal length, literals, offset and match length */
+	if( (sxu32)(zOpEnd - zOp) < 1 + (nLit / 255 + 1) + nLit + 2 + (nMatch / 255 + 1) ){
+		return 0;
+	}
+	zToken = zOp++;
+	n = nLit;
+	if( n >= 15 ){
+		*zToken = 15 << 4;
+		for( n -= 15 ; n >= 255 ; n -= 255 ){
+			*zOp++ = 255;
+		}
+		*zOp++ = (unsigned char)n;
+	}else{
+		*zToken = (unsigned char)(n << 4);
+	}
+	SyMemcpy((const void *)zLit,(void *)zOp,nLit);
+	zOp += nLit;
+	if( nMatch > 0 ){
+		/* 2 byte offset (little-endian) */
+		zOp[0] = (unsigned char)iOfft;
+		zOp[1] = (unsigned char)(iOfft >> 8);
+		zOp += 2;
+		n = nMatch - L_HASH_LZ4_MINMATCH;
+		if( n >= 15 ){
+			*zToken |= 15;
+			for( n -= 15 ; n >= 255 ; n -= 255 ){
+				*zOp++ = 255;
+			}
+			*zOp++ = (unsigned char)n;
+		}else{
+			*zToken |= (unsigned char)n;
+		}
+	}
+	return zOp;
+}
+/*
+ * Compress a block using the LZ4 block format.
+ * Return the compressed length or zero if it does not fit in nOutMax bytes.
+ */
+static sxu32 lhLz4Compress(
+	const unsigned char *zIn,sxu32 nIn, /* Block to compress */
+	unsigned char *zOut,sxu32 nOutMax,  /* Output buffer */
+	sxu32 *aTable                       /* Match finder table of (1 << L_HASH_LZ4_HASH_LOG) entries */
+	)
+{
+	const unsigned char *zEnd = &zIn[nIn];
+	const unsigned char *zAnchor = zIn;
+	const unsigned char *zPtr = zIn;
+	const unsigned char *zRef;
+	unsigned char *zOp = zOut;
+	unsigned char *zOpEnd = &zOut[nOutMax];
+	sxu32 iSeq,iHash,nMatch;
+	SyZero(aTable,sizeof(sxu32) << L_HASH_LZ4_HASH_LOG);
+	if( nIn > L_HASH_LZ4_MFLIMIT ){
+		const unsigned char *zLimit = &zEnd[-L_HASH_LZ4_MFLIMIT];
+		const unsigned char *zMatchEnd = &zEnd[-L_HASH_LZ4_LAST];
+		while( zPtr < zLimit ){
+			iSeq = lhLz4Read32(zPtr);
+			iHash = (iSeq * 2654435761U) >> (32 - L_HASH_LZ4_HASH_LOG);
+			zRef = &zIn[aTable[iHash]];
+			aTable[iHash] = (sxu32)(zPtr - zIn);
+			if( zRef >= zPtr || zPtr - zRef > 0xFFFF || lhLz4Read32(zRef) != iSeq ){
+				/* No match, skip faster over incompressible data */
+				zPtr += 1 + ((zPtr - zAnchor) >> 6);
+				continue;
+			}
+			/* Extend the match backward then forward */
+			while( zPtr > zAnchor && zRef > zIn && zPtr[-1] == zRef[-1] ){
+				zPtr--;
+				zRef--;
+			}
+			nMatch = 0;
+			while( &zPtr[nMatch] < zMatchEnd && zPtr[nMatch] == zRef[nMatch] ){
+				nMatch++;
+			}
+			zOp = lhLz4Sequence(zOp,zOpEnd,zAnchor,(sxu32)(zPtr - zAnchor),(sxu32)(zPtr - zRef),nMatch);
+			if( zOp == 0 ){
+				return 0;
+			}
+			zPtr += nMatch;
+			zAnchor = zPtr;
+		}
+	}
+	/* Last literals */
+	zOp = lhLz4Sequence(zOp,zOpEnd,zAnchor,(sxu32)(zEnd - zAnchor),0,0);
+	if( zOp == 0 ){
+		return 0;
+	}
+	return (sxu32)(zOp - zOut);
+}
+/*
+ * Decompress an LZ4 block which must expand to exactly nOut bytes.
+ */
+static int lhLz4Decompress(const unsigned char *zIn,sxu32 nIn,unsigned char *zOut,sxu32 nOut)
+{
+	const unsigned char *zEnd = &zIn[nIn];
+	unsigned char *zOp = zOut;
+	unsigned char *zOpEnd = &zOut[nOut];
+	const unsigned char *zRef;
+	sxu32 nLit,nMatch,iOfft;
+	unsigned char c;
+	for(;;){
+		if( zIn >= zEnd ){
+			return UNQLITE_CORRUPT;
+		}
+		c = *zIn++;
+		/* Literals */
+		nLit = c >> 4;
+		if( nLit == 15 ){
+			do{
+				if( zIn >= zEnd ){
+					return UNQLITE_CORRUPT;
+				}
+				nLit += *zIn;
+			}while( *zIn++ == 255 );
+		}
+		if( nLit > (sxu32)(zEnd - zIn) || nLit > (sxu32)(zOpEnd - zOp) ){
+			return UNQLITE_CORRUPT;
+		}
+		SyMemcpy((const void *)zIn,(void *)zOp,nLit);
+		zIn += nLit;
+		zOp += nLit;
+		if( zIn >= zEnd ){
+			/* Last sequence */
+			break;
+		}
+		/* Match */
+		if( zEnd - zIn < 2 ){
+			return UNQLITE_CORRUPT;
+		}
+		iOfft = (sxu32)zIn[0] | ((sxu32)zIn[1] << 8);
+		zIn += 2;
+		if( iOfft == 0 || iOfft > (sxu32)(zOp - zOut) ){
+			return UNQLITE_CORRUPT;
+		}
+		nMatch = c & 15;
+		if( nMatch == 15 ){
+			do{
+				if( zIn >= zEnd ){
+					return UNQLITE_CORRUPT;
+				}
+				nMatch += *zIn;
+			}while( *zIn++ == 255 );
+		}
+		nMatch += L_HASH_LZ4_MINMATCH;
+		if( nMatch > (sxu32)(zOpEnd - zOp) ){
+			return UNQLITE_CORRUPT;
+		}
+		zRef = zOp - iOfft;
+		if( iOfft >= nMatch ){
+			SyMemcpy((const void *)zRef,(void *)zOp,nMatch);
+			zOp += nMatch;
+		}else{
+			/* Overlapping copy */
+			while( nMatch-- > 0 ){
+				*zOp++ = *zRef++;
+			}
+		}
+	}
+	return zOp == zOpEnd ? UNQLITE_OK : UNQLITE_CORRUPT;
+}
+/*
+ * Append the frames of a chunk of data to the given blob.
+ */
+static int lhCompressFrames(lhash_kv_engine *pEngine,SyBlob *pOut,const unsigned char *zData,sxu64 nData)
+{
+	unsigned char zHdr[L_HASH_FRAME_HDR_SZ];
+	sxu32 nRaw,nStored;
+	unsigned char *zBuf;
+	sxu32 *aTable;
+	int rc = UNQLITE_OK;
+	if( nData < 1 ){
+		return UNQLITE_OK;
+	}
+	if( nData > (sxu64)(SXU32_HIGH >> 1) ){
+		pEngine->pIo->xErr(pEngine->pIo->pHandle,"Chunk too large for compression");
+		return UNQLITE_LIMIT;
+	}
+	aTable = (sxu32 *)SyMemBackendAlloc(&pEngine->sAllocator,(sizeof(sxu32) << L_HASH_LZ4_HASH_LOG) + L_HASH_FRAME_SIZE);
+	if( aTable == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	zBuf = (unsigned char *)&aTable[1 << L_HASH_LZ4_HASH_LOG];
+	while( nData > 0 ){
+		nRaw = nData > L_HASH_FRAME_SIZE ? L_HASH_FRAME_SIZE : (sxu32)nData;
+		/* Keep the frame raw unless it shrinks by at least one eighth */
+		nStored = lhLz4Compress(zData,nRaw,zBuf,nRaw - (nRaw >> 3) - 1,aTable);
+		SyBigEndianPack32(zHdr,nRaw);
+		SyBigEndianPack32(&zHdr[4],nStored > 0 ? nStored : nRaw);
+		rc = SyBlobAppend(pOut,(const void *)zHdr,sizeof(zHdr));
+		if( rc == SXRET_OK ){
+			if( nStored > 0 ){
+				rc = SyBlobAppend(pOut,(const void *)zBuf,nStored);
+			}else{
+				rc = SyBlobAppend(pOut,(const void *)zData,nRaw);
+			}
+		}
+		if( rc != SXRET_OK ){
+			break;
+		}
+		zData += nRaw;
+		nData -= nRaw;
+	}
+	SyMemBackendFree(&pEngine->sAllocator,aTable);
+	return rc;
+}
+/*
+ * Compress a value made of up to two chunks into the given blob.
+ * Return the codec to record in the cell header or zero if the value
+ * is to be stored raw (Compression disabled, short value or not worth it).
+ */
+static sxu8 lhCompressValue(
+	lhash_kv_engine *pEngine,
+	SyBlob *pOut,
+	const void *pFirst,sxu64 nFirst,
+	const void *pSecond,sxu64 nSecond
+	)
+{
+	unsigned char zHdr[8];
+	sxu64 nRaw = nFirst + nSecond;
+	if( pEngine->iCodec != UNQLITE_KV_CODEC_LZ4 || nRaw < L_HASH_COMPRESS_MIN || nRaw > (sxu64)(SXU32_HIGH >> 1) ){
+		return 0;
+	}
+	/* 8 byte uncompressed length */
+	SyBigEndianPack64(zHdr,nRaw);
+	if( SyBlobAppend(pOut,(const void *)zHdr,sizeof(zHdr)) != SXRET_OK
+		|| lhCompressFrames(pEngine,pOut,(const unsigned char *)pFirst,nFirst) != UNQLITE_OK
+		|| lhCompressFrames(pEngine,pOut,(const unsigned char *)pSecond,nSecond) != UNQLITE_OK
+		|| (sxu64)SyBlobLength(pOut) >= nRaw - (nRaw >> 3) ){
+		/* Store the value raw */
+		SyBlobReset(pOut);
+		return 0;
+	}
+	return pEngine->iCodec;
+}
+/*
+ * Streaming decoder of a compressed value.
+ */
+#define L_HASH_DEC_VALUE 1 /* Collecting the value header */
+#define L_HASH_DEC_FRAME 2 /* Collecting a frame header */
+#define L_HASH_DEC_BODY  3 /* Inside a frame */
+typedef struct lhash_decoder lhash_decoder;
+struct lhash_decoder
+{
+	lhash_kv_engine *pEngine;
+	int (*xConsumer)(const void *,unsigned int,void *); /* Consumer of the decoded data */
+	void *pUserData;      /* Last argument to xConsumer() */
+	int iState;           /* Decoder state (L_HASH_DEC_* above) */
+	int bHdrOnly;         /* Stop once the uncompressed length is known */
+	unsigned char zHdr[8];/* Header being collected */
+	sxu32 nHdr;           /* Bytes collected in zHdr[] */
+	sxu64 nRaw;           /* Uncompressed value length */
+	sxu64 nDone;          /* Decoded bytes so far */
+	sxu32 nFrameRaw;      /* Raw length of the current frame */
+	sxu32 nFrameStored;   /* Stored length of the current frame */
+	sxu32 nGot;           /* Stored bytes of the current frame seen so far */
+	unsigned char *zBuf;  /* Compressed frame followed by its decoded content */
+	int rc;               /* Decoding error if any */
+};
+/*
+ * Consume a chunk of a compressed value and pass the decoded data to the caller.
+ */
+static int lhDecoderConsumer(const void *pData,unsigned int nLen,void *pUserData)
+{
+	lhash_decoder *pDec = (lhash_decoder *)pUserData;
+	const unsigned char *zPtr = (const unsigned char *)pData;
+	const unsigned char *zEnd = &zPtr[nLen];
+	sxu32 n,nWant;
+	int rc;
+	while( zPtr < zEnd ){
+		if( pDec->iState != L_HASH_DEC_BODY ){
+			/* Collect the value or frame header */
+			nWant = pDec->iState == L_HASH_DEC_VALUE ? 8 : L_HASH_FRAME_HDR_SZ;
+			n = nWant - pDec->nHdr;
+			if( n > (sxu32)(zEnd - zPtr) ){
+				n = (sxu32)(zEnd - zPtr);
+			}
+			SyMemcpy((const void *)zPtr,(void *)&pDec->zHdr[pDec->nHdr],n);
+			pDec->nHdr += n;
+			zPtr += n;
+			if( pDec->nHdr < nWant ){
+				break;
+			}
+			pDec->nHdr = 0;
+			if( pDec->iState == L_HASH_DEC_VALUE ){
+				SyBigEndianUnpack64(pDec->zHdr,&pDec->nRaw);
+				pDec->iState = L_HASH_DEC_FRAME;
+				if( pDec->bHdrOnly ){
+					return UNQLITE_ABORT;
+				}
+			}else{
+				SyBigEndianUnpack32(pDec->zHdr,&pDec->nFrameRaw);
+				SyBigEndianUnpack32(&pDec->zHdr[4],&pDec->nFrameStored);
+				if( pDec->nFrameRaw < 1 || pDec->nFrameRaw > L_HASH_FRAME_SIZE || pDec->nFrameStored > pDec->nFrameRaw ){
+					pDec->rc = UNQLITE_CORRUPT;
+					return UNQLITE_ABORT;
+				}
+				pDec->nGot = 0;
+				pDec->iState = L_HASH_DEC_BODY;
+			}
+			continue;
+		}
+		n = pDec->nFrameStored - pDec->nGot;
+		if( n > (sxu32)(zEnd - zPtr) ){
+			n = (sxu32)(zEnd - zPtr);
+		}
+		if( pDec->nFrameStored == pDec->nFrameRaw ){
+			/* Raw frame, pass it through */
+			if( pDec->xConsumer(zPtr,n,pDec->pUserData) != UNQLITE_OK ){
+				return UNQLITE_ABORT;
+			}
+			pDec->nDone += n;
+		}else{
+			if( pDec->zBuf == 0 ){
+				pDec->zBuf = (unsigned char *)SyMemBackendAlloc(&pDec->pEngine->sAllocator,2 * L_HASH_FRAME_SIZE);
+				if( pDec->zBuf == 0 ){
+					pDec->rc = UNQLITE_NOMEM;
+					return UNQLITE_ABORT;
+				}
+			}
+			SyMemcpy((const void *)zPtr,(void *)&pDec->zBuf[pDec->nGot],n);
+		}
+		pDec->nGot += n;
+		zPtr += n;
+		if( pDec->nGot < pDec->nFrameStored ){
+			break;
+		}
+		if( pDec->nFrameStored != pDec->nFrameRaw ){
+			/* Decode the whole frame */
+			rc = lhLz4Decompress(pDec->zBuf,pDec->nFrameStored,&pDec->zBuf[L_HASH_FRAME_SIZE],pDec->nFrameRaw);
+			if( rc != UNQLITE_OK ){
+				pDec->rc = rc;
+				return UNQLITE_ABORT;
+			}
+			if( pDec->xConsumer(&pDec->zBuf[L_HASH_FRAME_SIZE],pDec->nFrameRaw,pDec->pUserData) != UNQLITE_OK ){
+				return UNQLITE_ABORT;
+			}
+			pDec->nDone += pDec->nFrameRaw;
+		}
+		pDec->iState = L_HASH_DEC_FRAME;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Run the decoder over the stored data of a compressed cell.
+ */
+static int lhDecodeCellData(lhcell *pCell,lhash_decoder *pDec)
+{
+	int rc;
+	if( pCell->iCodec != UNQLITE_KV_CODEC_LZ4 ){
+		/* Codec unknown to this version */
+		return UNQLITE_NOTIMPLEMENTED;
+	}
+	pDec->pEngine = pCell->pPage->pHash;
+	pDec->iState = L_HASH_DEC_VALUE;
+	pDec->nHdr = 0;
+	pDec->nDone = 0;
+	pDec->zBuf = 0;
+	pDec->rc = UNQLITE_OK;
+	rc = lhConsumeCellData(pCell,lhDecoderConsumer,pDec,0);
+	if( pDec->zBuf ){
+		SyMemBackendFree(&pDec->pEngine->sAllocator,pDec->zBuf);
+	}
+	if( pDec->rc != UNQLITE_OK ){
+		return pDec->rc;
+	}
+	if( pDec->iState == L_HASH_DEC_VALUE ){
+		/* Truncated header */
+		return rc != UNQLITE_OK && rc != UNQLITE_ABORT ? rc : UNQLITE_CORRUPT;
+	}
+	if( rc == UNQLITE_OK && (pDec->iState != L_HASH_DEC_FRAME || pDec->nDone != pDec->nRaw) ){
+		return UNQLITE_CORRUPT;
+	}
+	return rc;
+}
+/*
+ * Return the (uncompressed) data length of a cell.
+ */
+static int lhCellDataLength(lhcell *pCell,sxu64 *pLen)
+{
+	lhash_decoder sDec;
+	int rc;
+	if( pCell->iCodec == 0 ){
+		*pLen = pCell->nData;
+		return UNQLITE_OK;
+	}
+	if( pCell->nRaw == SXU64_HIGH ){
+		/* Read the uncompressed length from the payload */
+		sDec.xConsumer = 0;
+		sDec.pUserData = 0;
+		sDec.bHdrOnly = 1;
+		rc = lhDecodeCellData(pCell,&sDec);
+		if( rc != UNQLITE_OK && rc != UNQLITE_ABORT ){
+			return rc;
+		}
+		pCell->nRaw = sDec.nRaw;
+	}
+	*pLen = pCell->nRaw;
+	return UNQLITE_OK;
+}
+/*
+ * Consume the data of a cell, decoding it first if it was stored compressed.
+ */
+static int lhCellConsumeData(
+	lhcell *pCell, /* Target cell */
+	int (*xConsumer)(const void *,unsigned int,void *), /* Data consumer callback */
+	void *pUserData /* Last argument to xConsumer() */
+	)
+{
+	lhash_decoder sDec;
+	int rc;
+	if( pCell->iCodec == 0 ){
+		return lhConsumeCellData(pCell,xConsumer,pUserData,0);
+	}
+	sDec.xConsumer = xConsumer;
+	sDec.pUserData = pUserData;
+	sDec.bHdrOnly = 0;
+	rc = lhDecodeCellData(pCell,&sDec);
+	if( rc == UNQLITE_OK ){
+		pCell->nRaw = sDec.nRaw;
+	}
+	return rc;
+}
 /*
  * Read the linear hash header (Page one of the database).
  */
@@ -49654,6 +50464,297 @@ static int lhRecordLookup(
 	}
 	return UNQLITE_OK;
 }
+/*
+ * Set (bFree != 0) or clear the bit of a given page in the free space bitmap.
+ */
+static int lhFreeMapSet(lhash_kv_engine *pEngine,pgno iNum,int bFree)
+{
+	if( iNum >= pEngine->nFreeMapBits ){
+		sxu32 *aNew;
+		pgno nNew;
+		if( !bFree ){
+			/* Not covered, nothing to clear */
+			return UNQLITE_OK;
+		}
+		/* Grow the bitmap */
+		nNew = pEngine->nFreeMapBits > 0 ? pEngine->nFreeMapBits : 1024;
+		while( nNew <= iNum ){
+			nNew <<= 1;
+		}
+		aNew = (sxu32 *)SyMemBackendRealloc(&pEngine->sAllocator,(void *)pEngine->aFreeMap,(sxu32)(nNew >> 5) * sizeof(sxu32));
+		if( aNew == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		/* Zero the new words */
+		SyZero((void *)&aNew[pEngine->nFreeMapBits >> 5],(sxu32)((nNew - pEngine->nFreeMapBits) >> 5) * sizeof(sxu32));
+		pEngine->aFreeMap = aNew;
+		pEngine->nFreeMapBits = nNew;
+	}
+	if( bFree ){
+		pEngine->aFreeMap[iNum >> 5] |= (sxu32)1 << (iNum & 31);
+	}else{
+		pEngine->aFreeMap[iNum >> 5] &= ~((sxu32)1 << (iNum & 31));
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Check whether a given page is marked free in the free space bitmap.
+ */
+static int lhFreeMapTest(lhash_kv_engine *pEngine,pgno iNum)
+{
+	if( iNum >= pEngine->nFreeMapBits ){
+		return 0;
+	}
+	return (pEngine->aFreeMap[iNum >> 5] >> (iNum & 31)) & 1;
+}
+/*
+ * Lookup a page in the in-memory mirror of the free list.
+ */
+static lhash_free_page * lhFreeMirrorFind(lhash_kv_engine *pEngine,pgno iNum)
+{
+	lhash_free_page *pEntry;
+	if( pEngine->apFree == 0 ){
+		return 0;
+	}
+	pEntry = pEngine->apFree[iNum & (pEngine->nFreeSize - 1)];
+	for(;;){
+		if( pEntry == 0 ){
+			break;
+		}
+		if( pEntry->iNum == iNum ){
+			return pEntry;
+		}
+		/* Point to the next entry */
+		pEntry = pEntry->pNextCol;
+	}
+	/* Not a free page */
+	return 0;
+}
+/*
+ * Release the in-memory mirror of the free list.
+ */
+static void lhFreeMirrorRelease(lhash_kv_engine *pEngine)
+{
+	lhash_free_page *pNext,*pEntry = pEngine->pFreeHead;
+	for(;;){
+		if( pEntry == 0 ){
+			break;
+		}
+		pNext = pEntry->pNext;
+		SyMemBackendPoolFree(&pEngine->sAllocator,pEntry);
+		pEntry = pNext;
+	}
+	if( pEngine->apFree ){
+		SyMemBackendFree(&pEngine->sAllocator,(void *)pEngine->apFree);
+	}
+	if( pEngine->aFreeMap ){
+		SyMemBackendFree(&pEngine->sAllocator,(void *)pEngine->aFreeMap);
+	}
+	pEngine->apFree = 0;
+	pEngine->nFreeSize = pEngine->nFreePage = 0;
+	pEngine->pFreeHead = pEngine->pFreeTail = 0;
+	pEngine->aFreeMap = 0;
+	pEngine->nFreeMapBits = pEngine->nExtLeft = 0;
+}
+/*
+ * Link a page to the in-memory mirror of the free list.
+ * The entry is installed at the head of the list unless bTail is set.
+ */
+static int lhFreeMirrorLink(lhash_kv_engine *pEngine,pgno iNum,int bTail)
+{
+	lhash_free_page *pEntry;
+	sxu32 iBucket;
+	if( pEngine->nFreePage >= pEngine->nFreeSize * 2 ){
+		/* Allocate a new larger table */
+		sxu32 nNewSize = pEngine->nFreeSize << 1;
+		lhash_free_page **apNew;
+		apNew = (lhash_free_page **)SyMemBackendAlloc(&pEngine->sAllocator,nNewSize * sizeof(lhash_free_page *));
+		if( apNew == 0 ){
+			return UNQLITE_NOMEM;
+		}
+		/* Zero the new table */
+		SyZero((void *)apNew,nNewSize * sizeof(lhash_free_page *));
+		/* Rehash all entries */
+		for( pEntry = pEngine->pFreeHead ; pEntry ; pEntry = pEntry->pNext ){
+			iBucket = (sxu32)(pEntry->iNum & (nNewSize - 1));
+			pEntry->pPrevCol = 0;
+			pEntry->pNextCol = apNew[iBucket];
+			if( apNew[iBucket] ){
+				apNew[iBucket]->pPrevCol = pEntry;
+			}
+			apNew[iBucket] = pEntry;
+		}
+		/* Release the old table and reflect the change */
+		SyMemBackendFree(&pEngine->sAllocator,(void *)pEngine->apFree);
+		pEngine->apFree = apNew;
+		pEngine->nFreeSize = nNewSize;
+	}
+	if( lhFreeMapSet(pEngine,iNum,1) != UNQLITE_OK ){
+		return UNQLITE_NOMEM;
+	}
+	pEntry = (lhash_free_page *)SyMemBackendPoolAlloc(&pEngine->sAllocator,sizeof(lhash_free_page));
+	if( pEntry == 0 ){
+		lhFreeMapSet(pEngine,iNum,0);
+		return UNQLITE_NOMEM;
+	}
+	/* Zero the structure */
+	SyZero(pEntry,sizeof(lhash_free_page));
+	pEntry->iNum = iNum;
+	/* Install in the corresponding bucket */
+	iBucket = (sxu32)(iNum & (pEngine->nFreeSize - 1));
+	pEntry->pNextCol = pEngine->apFree[iBucket];
+	if( pEngine->apFree[iBucket] ){
+		pEngine->apFree[iBucket]->pPrevCol = pEntry;
+	}
+	pEngine->apFree[iBucket] = pEntry;
+	/* Link in list order */
+	if( pEngine->pFreeHead == 0 ){
+		pEngine->pFreeHead = pEngine->pFreeTail = pEntry;
+	}else if( bTail ){
+		pEntry->pPrev = pEngine->pFreeTail;
+		pEngine->pFreeTail->pNext = pEntry;
+		pEngine->pFreeTail = pEntry;
+	}else{
+		pEntry->pNext = pEngine->pFreeHead;
+		pEngine->pFreeHead->pPrev = pEntry;
+		pEngine->pFreeHead = pEntry;
+	}
+	pEngine->nFreePage++;
+	return UNQLITE_OK;
+}
+/*
+ * Unlink an entry from the in-memory mirror of the free list.
+ */
+static void lhFreeMirrorUnlink(lhash_kv_engine *pEngine,lhash_free_page *pEntry)
+{
+	if( pEntry->pNextCol ){
+		pEntry->pNextCol->pPrevCol = pEntry->pPrevCol;
+	}
+	if( pEntry->pPrevCol ){
+		pEntry->pPrevCol->pNextCol = pEntry->pNextCol;
+	}else{
+		pEngine->apFree[pEntry->iNum & (pEngine->nFreeSize - 1)] = pEntry->pNextCol;
+	}
+	if( pEntry->pNext ){
+		pEntry->pNext->pPrev = pEntry->pPrev;
+	}else{
+		pEngine->pFreeTail = pEntry->pPrev;
+	}
+	if( pEntry->pPrev ){
+		pEntry->pPrev->pNext = pEntry->pNext;
+	}else{
+		pEngine->pFreeHead = pEntry->pNext;
+	}
+	lhFreeMapSet(pEngine,pEntry->iNum,0);
+	pEngine->nFreePage--;
+	SyMemBackendPoolFree(&pEngine->sAllocator,pEntry);
+}
+/*
+ * Load the in-memory mirror of the free list by walking the on-disk list.
+ */
+static int lhFreeMirrorLoad(lhash_kv_engine *pEngine)
+{
+	unqlite_page *pPage;
+	pgno iNum,nPage;
+	int rc;
+	pEngine->nFreeSize = 64;
+	pEngine->apFree = (lhash_free_page **)SyMemBackendAlloc(&pEngine->sAllocator,pEngine->nFreeSize * sizeof(lhash_free_page *));
+	if( pEngine->apFree == 0 ){
+		pEngine->nFreeSize = 0;
+		return UNQLITE_NOMEM;
+	}
+	/* Zero the table */
+	SyZero((void *)pEngine->apFree,pEngine->nFreeSize * sizeof(lhash_free_page *));
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	iNum = pEngine->nFreeList;
+	while( iNum != 0 ){
+		if( iNum >= nPage || pEngine->nFreePage >= nPage || lhFreeMirrorFind(pEngine,iNum) ){
+			/* Corrupt free list */
+			lhFreeMirrorRelease(pEngine);
+			return UNQLITE_CORRUPT;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pPage);
+		if( rc == UNQLITE_OK ){
+			rc = lhFreeMirrorLink(pEngine,iNum,1);
+			/* Next free page on the list */
+			SyBigEndianUnpack64(pPage->zData,&iNum);
+			pEngine->pIo->xPageUnref(pPage);
+		}
+		if( rc != UNQLITE_OK ){
+			lhFreeMirrorRelease(pEngine);
+			return rc;
+		}
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Keep the in-memory mirror of the free list in sync after the head
+ * of the on-disk list was popped (bPush == 0) or pushed (bPush != 0).
+ * The mirror is simply dropped if it cannot be kept accurate and will
+ * be reloaded on the next vacuum step or extent reservation.
+ */
+static void lhFreeMirrorUpdate(lhash_kv_engine *pEngine,pgno iNum,int bPush)
+{
+	lhash_free_page *pEntry;
+	if( pEngine->apFree == 0 ){
+		/* Mirror not in use */
+		return;
+	}
+	if( bPush ){
+		if( lhFreeMirrorLink(pEngine,iNum,0) == UNQLITE_OK ){
+			return;
+		}
+	}else{
+		pEntry = pEngine->pFreeHead;
+		if( pEntry && pEntry->iNum == iNum ){
+			lhFreeMirrorUnlink(pEngine,pEntry);
+			return;
+		}
+	}
+	lhFreeMirrorRelease(pEngine);
+}
+/*
+ * Store a page number at a given offset of a raw page.
+ */
+static int lhSetPagePointer(lhash_kv_engine *pEngine,unqlite_page *pPage,sxu32 iOfft,pgno iNum)
+{
+	int rc;
+	rc = pEngine->pIo->xWrite(pPage);
+	if( rc == UNQLITE_OK ){
+		SyBigEndianPack64(&pPage->zData[iOfft],iNum);
+	}
+	return rc;
+}
+/*
+ * Unlink an arbitrary page from the on-disk free list.
+ */
+static int lhFreeUnlinkPage(lhash_kv_engine *pEngine,lhash_free_page *pEntry)
+{
+	unqlite_page *pPrev;
+	pgno iNext;
+	int rc;
+	iNext = pEntry->pNext ? pEntry->pNext->iNum : 0;
+	if( pEntry->pPrev == 0 ){
+		/* Head of the list */
+		rc = lhSetPagePointer(pEngine,pEngine->pHeader,4/*Magic*/+4/*Hash*/,iNext);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		pEngine->nFreeList = iNext;
+	}else{
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pEntry->pPrev->iNum,&pPrev);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = lhSetPagePointer(pEngine,pPrev,0,iNext);
+		pEngine->pIo->xPageUnref(pPrev);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	lhFreeMirrorUnlink(pEngine,pEntry);
+	return UNQLITE_OK;
+}
 /*
  * Acquire a new page either from the free list or ask the pager
  * for a new one.
@@ -49674,6 +50775,7 @@ static int lhAcquirePage(lhash_kv_engine *pEngine,unqlite_page **ppOut)
 				return rc;
 			}
 			SyBigEndianPack64(&pEngine->pHeader->zData[4/*Magic*/+4/*Hash*/],pEngine->nFreeList);
+			lhFreeMirrorUpdate(pEngine,pPage->pgno,0);
 			/* Tell the pager do not journal this page */
 			pEngine->pIo->xDontJournal(pPage);
 			/* Return to the caller */
@@ -49691,6 +50793,157 @@ static int lhAcquirePage(lhash_kv_engine *pEngine,unqlite_page **ppOut)
 	*ppOut = pPage;
 	return UNQLITE_OK;
 }
+/*
+ * Count the pages available for an extent starting at iStart, capped
+ * at nWant. Pages past the end of the file are always available.
+ */
+static pgno lhFreeMapRun(lhash_kv_engine *pEngine,pgno iStart,pgno nWant,pgno nPage)
+{
+	pgno n = 0;
+	while( n < nWant ){
+		if( iStart + n < nPage && !lhFreeMapTest(pEngine,iStart + n) ){
+			break;
+		}
+		n++;
+	}
+	return n;
+}
+/*
+ * Reserve an extent of contiguous pages for an overflow chain which
+ * need nWant more pages. In order of preference, the extent is:
+ *  The free run starting at iNear (the page right after the chain tail).
+ *  The first free run long enough.
+ *  The longest free run of at least L_HASH_MIN_EXTENT pages.
+ *  The end of the file.
+ * The reservation is advisory: pages are unlinked from the free list
+ * only when taken by lhExtentTake().
+ */
+static void lhReserveExtent(lhash_kv_engine *pEngine,pgno iNear,pgno nWant)
+{
+	pgno nPage,iNum,iBest,nBest,n;
+	pEngine->nExtLeft = 0;
+	if( pEngine->apFree == 0 && lhFreeMirrorLoad(pEngine) != UNQLITE_OK ){
+		/* Fall back to the plain free list */
+		return;
+	}
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	if( iNear > 1 ){
+		n = lhFreeMapRun(pEngine,iNear,nWant,nPage);
+		if( n > 0 ){
+			/* Keep the chain sequential */
+			pEngine->iExtNext = iNear;
+			pEngine->nExtLeft = n;
+			return;
+		}
+	}
+	iBest = nBest = 0;
+	iNum = 2; /* Page zero is reserved, page one is the hash header */
+	while( pEngine->nFreePage > 0 && iNum < nPage ){
+		if( (iNum >> 5) >= (pEngine->nFreeMapBits >> 5) ){
+			/* No more free pages */
+			break;
+		}
+		if( pEngine->aFreeMap[iNum >> 5] == 0 ){
+			/* Skip the whole word */
+			iNum = (iNum | 31) + 1;
+			continue;
+		}
+		if( !lhFreeMapTest(pEngine,iNum) ){
+			iNum++;
+			continue;
+		}
+		n = lhFreeMapRun(pEngine,iNum,nWant,nPage);
+		if( n > nBest ){
+			iBest = iNum;
+			nBest = n;
+			if( n >= nWant ){
+				break;
+			}
+		}
+		iNum += n;
+	}
+	if( nBest < nWant && nBest < L_HASH_MIN_EXTENT ){
+		/* Grow the file */
+		iBest = nPage;
+		nBest = nWant;
+	}
+	pEngine->iExtNext = iBest;
+	pEngine->nExtLeft = nBest;
+}
+/*
+ * Take the next page of the reserved extent. The reservation is dropped
+ * and *ppOut is left untouched if that page is no longer available.
+ */
+static int lhExtentTake(lhash_kv_engine *pEngine,unqlite_page **ppOut)
+{
+	lhash_free_page *pEntry;
+	unqlite_page *pPage;
+	pgno iNum,nPage;
+	int rc;
+	iNum = pEngine->iExtNext;
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	if( iNum >= nPage ){
+		if( iNum > nPage ){
+			/* File shrunk in the meantime */
+			pEngine->nExtLeft = 0;
+			return UNQLITE_OK;
+		}
+		/* Append a new page */
+		rc = pEngine->pIo->xNew(pEngine->pIo->pHandle,&pPage);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}else{
+		pEntry = lhFreeMirrorFind(pEngine,iNum);
+		if( pEntry == 0 ){
+			/* Reused or mirror dropped */
+			pEngine->nExtLeft = 0;
+			return UNQLITE_OK;
+		}
+		/* Unlink from the free list. Unlike the head of the list, this page
+		 * must be journalled so that a rollback restores its link. */
+		rc = lhFreeUnlinkPage(pEngine,pEntry);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pPage);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	pEngine->iExtNext = pPage->pgno + 1;
+	pEngine->nExtLeft--;
+	*ppOut = pPage;
+	return UNQLITE_OK;
+}
+/*
+ * Acquire a page for an overflow chain which still need nByte bytes.
+ * iNear is the page number right after the chain tail (zero for the
+ * first page of a chain). Chains spanning several pages are laid out
+ * in contiguous extents so that reading or flushing them is sequential.
+ */
+static int lhAcquireOvflPage(lhash_kv_engine *pEngine,pgno iNear,sxu64 nByte,unqlite_page **ppOut)
+{
+	sxu64 nWant;
+	int rc;
+	if( pEngine->nExtLeft < 1 || pEngine->iExtNext != iNear ){
+		/* Reserve a new extent */
+		pEngine->nExtLeft = 0;
+		nWant = (nByte + L_HASH_OVERFLOW_SIZE(pEngine->iPageSize) - 1) / L_HASH_OVERFLOW_SIZE(pEngine->iPageSize);
+		if( nWant > 1 ){
+			lhReserveExtent(pEngine,iNear,(pgno)nWant);
+		}
+	}
+	if( pEngine->nExtLeft > 0 ){
+		*ppOut = 0;
+		rc = lhExtentTake(pEngine,ppOut);
+		if( rc != UNQLITE_OK || *ppOut ){
+			return rc;
+		}
+	}
+	/* Single page */
+	return lhAcquirePage(pEngine,ppOut);
+}
 /*
  * Write a bucket map record to disk.
  */
@@ -49698,6 +50951,7 @@ static int lhMapWriteRecord(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
 {
 	lhash_bmap_page *pMap = &pEngine->sPageMap;
 	unqlite_page *pPage = 0;
+	sxu16 iOfft;
 	int rc;
 	if( pMap->iPtr > (pEngine->iPageSize - 16) /* 8 byte logical bucket number + 8 byte real bucket number */ ){
 		unqlite_page *pOld;
@@ -49750,12 +51004,13 @@ static int lhMapWriteRecord(lhash_kv_engine *pEngine,pgno iLogic,pgno iReal)
 		return rc;
 	}
 	/* Write the data */
+	iOfft = pMap->iPtr;
 	SyBigEndianPack64(&pPage->zData[pMap->iPtr],iLogic);
 	pMap->iPtr += 8;
 	SyBigEndianPack64(&pPage->zData[pMap->iPtr],iReal);
 	pMap->iPtr += 8;
 	/* Install the bucket map */
-	rc = lhMapInstallBucket(pEngine,iLogic,iReal);
+	rc = lhMapInstallBucket(pEngine,iLogic,iReal,pMap->iNum,iOfft);
 	if( rc == UNQLITE_OK ){
 		/* Total number of records */
 		pMap->nRec++;
@@ -49785,8 +51040,8 @@ static int lhPageDefragment(lhpage *pPage)
 	lhcell *pCell;
 	/* Get a temporary page from the pager. This opertaion never fail */
 	zTmp = pEngine->pIo->xTmpPage(pEngine->pIo->pHandle);
-	/* Move the target cells to the begining */
-	pCell = pPage->pList;
+	/* Move the target cells to the begining. The cells of a slave page are kept by its master */
+	pCell = pPage->pMaster->pList;
 	/* Write the slave page number */
 	SyBigEndianPack64(&zTmp[2/*Offset of the first cell */+2/*Offset of the first free block */],pPage->sHdr.iSlave);
 	zPtr = &zTmp[L_HASH_PAGE_HDR_SZ]; /* Offset to start writing from */
@@ -49815,7 +51070,7 @@ static int lhPageDefragment(lhpage *pPage)
 			SyBigEndianPack32(zPtr,pCell->nKey);
 			zPtr += 4;
 			/* 8 byte data length */
-			SyBigEndianPack64(zPtr,pCell->nData);
+			SyBigEndianPack64(zPtr,L_HASH_CELL_DATA_LEN(pCell));
 			zPtr += 8;
 			/* 2 byte offset of the next cell */
 			SyBigEndianPack16(zPtr,pCell->iNext);
@@ -49963,7 +51218,7 @@ static int lhCellWriteHeader(lhcell *pCell)
 	SyBigEndianPack32(zRaw,pCell->nKey);
 	zRaw += 4;
 	/* 8 byte data length */
-	SyBigEndianPack64(zRaw,pCell->nData);
+	SyBigEndianPack64(zRaw,L_HASH_CELL_DATA_LEN(pCell));
 	zRaw += 8;
 	/* 2 byte offset of the next cell */
 	pCell->iNext = pPage->sHdr.iOfft;
@@ -50010,11 +51265,19 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 	unqlite_page *pOvfl,*pFirst,*pNew;
 	const unsigned char *zPtr,*zEnd;
 	unsigned char *zRaw,*zRawEnd;
+	sxu64 nRemain;
 	sxu32 nAvail;
 	va_list ap;
 	int rc;
+	/* Total payload size so that the chain can be laid out in a single extent */
+	nRemain = nKeylen;
+	va_start(ap,nKeylen);
+	while( va_arg(ap,const void *) != 0 ){
+		nRemain += va_arg(ap,sxu64);
+	}
+	va_end(ap);
 	/* Acquire a new overflow page */
-	rc = lhAcquirePage(pEngine,&pOvfl);
+	rc = lhAcquireOvflPage(pEngine,0,nRemain + 8/* Data page */ + 2/* Data offset*/,&pOvfl);
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
@@ -50042,7 +51305,7 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 		}
 		if( zRaw >= zRawEnd ){
 			/* Acquire a new page */
-			rc = lhAcquirePage(pEngine,&pNew);
+			rc = lhAcquireOvflPage(pEngine,pOvfl->pgno + 1,nRemain,&pNew);
 			if( rc != UNQLITE_OK ){
 				return rc;
 			}
@@ -50067,6 +51330,7 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 		/* Synchronize pointers */
 		zPtr += nKeylen;
 		zRaw += nKeylen;
+		nRemain -= nKeylen;
 	}
 	rc = UNQLITE_OK;
 	va_start(ap,nKeylen);
@@ -50095,7 +51359,7 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 			}
 			if( zRaw >= zRawEnd ){
 				/* Acquire a new page */
-				rc = lhAcquirePage(pEngine,&pNew);
+				rc = lhAcquireOvflPage(pEngine,pOvfl->pgno + 1,nRemain,&pNew);
 				if( rc != UNQLITE_OK ){
 					va_end(ap);
 					return rc;
@@ -50122,6 +51386,7 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 			/* Synchronize pointers */
 			zPtr += nDatalen;
 			zRaw += nDatalen;
+			nRemain -= nDatalen;
 		}
 	}
 	/* Unref the overflow page */
@@ -50129,6 +51394,75 @@ static int lhCellWriteOvflPayload(lhcell *pCell,const void *pKey,sxu32 nKeylen,.
 	va_end(ap);
 	return UNQLITE_OK;
 }
+/*
+ * Write a value made of up to two chunks to overflow pages, compressed when enabled.
+ * The stored length and the codec are returned so that the caller can update the cell header.
+ */
+static int lhCellWriteOvflValue(
+	lhcell *pCell,
+	const void *pKey,sxu32 nKeylen,
+	const void *pFirst,sxu64 nFirst,
+	const void *pSecond,sxu64 nSecond,
+	sxu64 *pnStored,sxu8 *piCodec
+	)
+{
+	lhash_kv_engine *pEngine = pCell->pPage->pHash;
+	SyBlob sWorker;
+	int rc;
+	SyBlobInit(&sWorker,&pEngine->sAllocator);
+	*piCodec = lhCompressValue(pEngine,&sWorker,pFirst,nFirst,pSecond,nSecond);
+	if( *piCodec != 0 ){
+		*pnStored = (sxu64)SyBlobLength(&sWorker);
+		rc = lhCellWriteOvflPayload(pCell,pKey,nKeylen,SyBlobData(&sWorker),*pnStored,(const void *)0);
+	}else{
+		*pnStored = nFirst + nSecond;
+		rc = lhCellWriteOvflPayload(pCell,pKey,nKeylen,pFirst,nFirst,pSecond,nSecond,(const void *)0);
+	}
+	SyBlobRelease(&sWorker);
+	return rc;
+}
+/*
+ * Rewrite the uncompressed length stored at the start of a compressed overflow value.
+ * It may straddle two overflow pages.
+ */
+static int lhCellWriteRawLength(lhcell *pCell,sxu64 nRaw)
+{
+	lhash_kv_engine *pEngine = pCell->pPage->pHash;
+	pgno iOvfl = pCell->iDataPage;
+	sxu32 iOfft = pCell->iDataOfft;
+	unsigned char zHdr[8];
+	unqlite_page *pOvfl;
+	sxu32 nDone = 0;
+	sxu32 n;
+	int rc;
+	SyBigEndianPack64(zHdr,nRaw);
+	while( nDone < sizeof(zHdr) ){
+		if( iOvfl == 0 ){
+			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Corrupt overflow page");
+			return UNQLITE_CORRUPT;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = pEngine->pIo->xWrite(pOvfl);
+		if( rc != UNQLITE_OK ){
+			pEngine->pIo->xPageUnref(pOvfl);
+			return rc;
+		}
+		n = (sxu32)pEngine->iPageSize - iOfft;
+		if( n > (sxu32)sizeof(zHdr) - nDone ){
+			n = (sxu32)sizeof(zHdr) - nDone;
+		}
+		SyMemcpy((const void *)&zHdr[nDone],(void *)&pOvfl->zData[iOfft],n);
+		nDone += n;
+		/* Next overflow page in the chain */
+		SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
+		pEngine->pIo->xPageUnref(pOvfl);
+		iOfft = 8;
+	}
+	return UNQLITE_OK;
+}
 /*
  * Restore a page to the free list.
  */
@@ -50147,6 +51481,9 @@ static int lhRestorePage(lhash_kv_engine *pEngine,unqlite_page *pPage)
 	SyBigEndianPack64(pPage->zData,pEngine->nFreeList);
 	pEngine->nFreeList = pPage->pgno;
 	SyBigEndianPack64(&pEngine->pHeader->zData[4/*Magic*/+4/*Hash*/],pEngine->nFreeList);
+	lhFreeMirrorUpdate(pEngine,pPage->pgno,1);
+	/* The page may belong to a chain a read ahead walk stopped in */
+	SyZero((void *)pEngine->aChainPos,sizeof(pEngine->aChainPos));
 	/* All done */
 	return UNQLITE_OK;
 }
@@ -50309,7 +51646,10 @@ static int lhRecordOverwrite(
 	const unsigned char *zPtr,*zEnd;
 	unqlite_page *pOvfl,*pOld,*pNew;
 	lhpage *pPage = pCell->pPage;
+	SyBlob sWorker;
+	sxu64 nStored;
 	sxu32 nAvail;
+	sxu8 iCodec;
 	pgno iOvfl;
 	int rc;
 	/* Acquire a writer lock on this page */
@@ -50337,17 +51677,22 @@ static int lhRecordOverwrite(
 			/* Check if another chunk is available for this cell */
 			rc = lhAllocateSpace(pPage,L_HASH_CELL_SZ + pCell->nKey + nByte,&iOfft);
 			if( rc != UNQLITE_OK ){
+				sxu64 nStored;
+				sxu8 iCodec;
 				/* Transfer the payload to an overflow page */
-				rc = lhCellWriteOvflPayload(pCell,&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ],pCell->nKey,pData,nByte,(const void *)0);
+				rc = lhCellWriteOvflValue(pCell,&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ],pCell->nKey,
+					pData,(sxu64)nByte,(const void *)0,0,&nStored,&iCodec);
 				if( rc != UNQLITE_OK ){
 					return rc;
 				}
 				/* Update the cell header */
-				SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],(sxu64)nByte);
+				SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],nStored | ((sxu64)iCodec << L_HASH_CODEC_SHIFT));
 				/* Restore freespace */
 				lhRestoreSpace(pPage,(sxu16)(pCell->iStart + L_HASH_CELL_SZ),(sxu16)(pCell->nKey + pCell->nData));
 				/* New data size */
-				pCell->nData = (sxu64)nByte;
+				pCell->nData = nStored;
+				pCell->iCodec = iCodec;
+				pCell->nRaw = (sxu64)nByte;
 			}else{
 				sxu16 iOldOfft = pCell->iStart;
 				sxu32 iOld = (sxu32)pCell->nData;
@@ -50359,9 +51704,20 @@ static int lhRecordOverwrite(
 		}
 		return UNQLITE_OK;
 	}
+	/* The data to be stored, compressed when enabled */
+	SyBlobInit(&sWorker,&pEngine->sAllocator);
+	zPtr = (const unsigned char *)pData;
+	zEnd = &zPtr[nByte];
+	iCodec = lhCompressValue(pEngine,&sWorker,pData,(sxu64)nByte,(const void *)0,0);
+	if( iCodec != 0 ){
+		zPtr = (const unsigned char *)SyBlobData(&sWorker);
+		zEnd = &zPtr[SyBlobLength(&sWorker)];
+	}
+	nStored = (sxu64)(zEnd - zPtr);
 	/* Point to the overflow page */
 	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pCell->iDataPage,&pOvfl);
 	if( rc != UNQLITE_OK ){
+		SyBlobRelease(&sWorker);
 		return rc;
 	}
 	/* Relase all old overflow pages first */
@@ -50389,13 +51745,11 @@ static int lhRecordOverwrite(
 	/* Point to the data offset */
 	zRaw = &pOvfl->zData[pCell->iDataOfft];
 	zRawEnd = &pOvfl->zData[pEngine->iPageSize];
-	/* The data to be stored */
-	zPtr = (const unsigned char *)pData;
-	zEnd = &zPtr[nByte];
 	/* Start the overwrite process */
 	/* Acquire a writer lock */
 	rc = pEngine->pIo->xWrite(pOvfl);
 	if( rc != UNQLITE_OK ){
+		SyBlobRelease(&sWorker);
 		return rc;
 	}
 	SyBigEndianPack64(pOvfl->zData,0);
@@ -50406,12 +51760,14 @@ static int lhRecordOverwrite(
 		}
 		if( zRaw >= zRawEnd ){
 			/* Acquire a new page */
-			rc = lhAcquirePage(pEngine,&pNew);
+			rc = lhAcquireOvflPage(pEngine,pOvfl->pgno + 1,(sxu64)(zEnd-zPtr),&pNew);
 			if( rc != UNQLITE_OK ){
+				SyBlobRelease(&sWorker);
 				return rc;
 			}
 			rc = pEngine->pIo->xWrite(pNew);
 			if( rc != UNQLITE_OK ){
+				SyBlobRelease(&sWorker);
 				return rc;
 			}
 			/* Link */
@@ -50434,9 +51790,12 @@ static int lhRecordOverwrite(
 	}
 	/* Unref the last overflow page */
 	pEngine->pIo->xPageUnref(pOvfl);
+	SyBlobRelease(&sWorker);
 	/* Finally, update the cell header */
-	pCell->nData = (sxu64)nByte;
-	SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],pCell->nData);
+	pCell->nData = nStored;
+	pCell->iCodec = iCodec;
+	pCell->nRaw = (sxu64)nByte;
+	SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],L_HASH_CELL_DATA_LEN(pCell));
 	/* All done */
 	return UNQLITE_OK;
 }
@@ -50453,7 +51812,8 @@ static int lhRecordAppend(
 	lhpage *pPage = pCell->pPage;
 	unsigned char *zRaw,*zRawEnd;
 	unqlite_page *pOvfl,*pNew;
-	sxu64 nDatalen;
+	sxu64 nDatalen,nStored,nRaw;
+	SyBlob sWorker;
 	sxu32 nAvail;
 	pgno iOvfl;
 	int rc;
@@ -50472,25 +51832,27 @@ static int lhRecordAppend(
 		/* Local payload, check for a bigger place */
 		rc = lhAllocateSpace(pPage,L_HASH_CELL_SZ + pCell->nKey + pCell->nData + nByte,&iOfft);
 		if( rc != UNQLITE_OK ){
+			sxu8 iCodec;
 			/* Transfer the payload to an overflow page */
-			rc = lhCellWriteOvflPayload(pCell,
+			rc = lhCellWriteOvflValue(pCell,
 				&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ],pCell->nKey,
 				(const void *)&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ + pCell->nKey],pCell->nData,
-				pData,nByte,
-				(const void *)0);
+				pData,(sxu64)nByte,
+				&nStored,&iCodec);
 			if( rc != UNQLITE_OK ){
 				return rc;
 			}
 			/* Update the cell header */
-			SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],pCell->nData + nByte);
+			SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],nStored | ((sxu64)iCodec << L_HASH_CODEC_SHIFT));
 			/* Restore freespace */
 			lhRestoreSpace(pPage,(sxu16)(pCell->iStart + L_HASH_CELL_SZ),(sxu16)(pCell->nKey + pCell->nData));
 			/* New data size */
-			pCell->nData += nByte;
+			pCell->nRaw = pCell->nData + nByte;
+			pCell->nData = nStored;
+			pCell->iCodec = iCodec;
 		}else{
 			sxu16 iOldOfft = pCell->iStart;
 			sxu32 iOld = (sxu32)pCell->nData;
-			SyBlob sWorker;
 			SyBlobInit(&sWorker,&pEngine->sAllocator);
 			/* Copy the old data */
 			rc = SyBlobAppend(&sWorker,(const void *)&pPage->pRaw->zData[pCell->iStart + L_HASH_CELL_SZ + pCell->nKey],(sxu32)pCell->nData);
@@ -50511,9 +51873,29 @@ static int lhRecordAppend(
 		}
 		return UNQLITE_OK;
 	}
+	/* The data to be appended */
+	SyBlobInit(&sWorker,&pEngine->sAllocator);
+	zPtr = (const unsigned char *)pData;
+	zEnd = &zPtr[nByte];
+	nRaw = 0;
+	if( pCell->iCodec != 0 ){
+		/* Compressed value: append new frames */
+		rc = lhCellDataLength(pCell,&nRaw);
+		if( rc == UNQLITE_OK ){
+			rc = lhCompressFrames(pEngine,&sWorker,zPtr,(sxu64)nByte);
+		}
+		if( rc != UNQLITE_OK ){
+			SyBlobRelease(&sWorker);
+			return rc;
+		}
+		zPtr = (const unsigned char *)SyBlobData(&sWorker);
+		zEnd = &zPtr[SyBlobLength(&sWorker)];
+	}
+	nStored = (sxu64)(zEnd - zPtr);
 	/* Point to the overflow page which hold the data */
 	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pCell->iDataPage,&pOvfl);
 	if( rc != UNQLITE_OK ){
+		SyBlobRelease(&sWorker);
 		return rc;
 	}
 	/* Next overflow page in the chain */
@@ -50528,10 +51910,12 @@ static int lhRecordAppend(
 			if( iOvfl == 0 ){
 				/* Cant happen */
 				pEngine->pIo->xErr(pEngine->pIo->pHandle,"Corrupt overflow page");
+				SyBlobRelease(&sWorker);
 				return UNQLITE_CORRUPT;
 			}
 			rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pNew);
 			if( rc != UNQLITE_OK ){
+				SyBlobRelease(&sWorker);
 				return rc;
 			}
 			/* Next overflow page on the chain */
@@ -50544,7 +51928,8 @@ static int lhRecordAppend(
 			nAvail = L_HASH_OVERFLOW_SIZE(pCell->pPage->pHash->iPageSize);
 			pOvfl = pNew;
 		}
-		if( (sxu64)nAvail > nDatalen ){
+		if( (sxu64)nAvail >= nDatalen ){
+			/* A value that fills its last page exactly continues on a new page */
 			zRaw += nDatalen;
 			break;
 		}else{
@@ -50553,11 +51938,10 @@ static int lhRecordAppend(
 		zRaw += nAvail;
 	}
 	/* Start the append process */
-	zPtr = (const unsigned char *)pData;
-	zEnd = &zPtr[nByte];
 	/* Acquire a writer lock */
 	rc = pEngine->pIo->xWrite(pOvfl);
 	if( rc != UNQLITE_OK ){
+		SyBlobRelease(&sWorker);
 		return rc;
 	}
 	for(;;){
@@ -50567,12 +51951,14 @@ static int lhRecordAppend(
 		}
 		if( zRaw >= zRawEnd ){
 			/* Acquire a new page */
-			rc = lhAcquirePage(pEngine,&pNew);
+			rc = lhAcquireOvflPage(pEngine,pOvfl->pgno + 1,(sxu64)(zEnd-zPtr),&pNew);
 			if( rc != UNQLITE_OK ){
+				SyBlobRelease(&sWorker);
 				return rc;
 			}
 			rc = pEngine->pIo->xWrite(pNew);
 			if( rc != UNQLITE_OK ){
+				SyBlobRelease(&sWorker);
 				return rc;
 			}
 			/* Link */
@@ -50595,9 +51981,18 @@ static int lhRecordAppend(
 	}
 	/* Unref the last overflow page */
 	pEngine->pIo->xPageUnref(pOvfl);
+	SyBlobRelease(&sWorker);
+	if( pCell->iCodec != 0 ){
+		/* New uncompressed length */
+		pCell->nRaw = nRaw + nByte;
+		rc = lhCellWriteRawLength(pCell,pCell->nRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
 	/* Finally, update the cell header */
-	pCell->nData += nByte;
-	SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],pCell->nData);
+	pCell->nData += nStored;
+	SyBigEndianPack64(&pPage->pRaw->zData[pCell->iStart + 4 /* Hash */ + 4 /* Key */],L_HASH_CELL_DATA_LEN(pCell));
 	/* All done */
 	return UNQLITE_OK;
 }
@@ -50703,7 +52098,8 @@ static int lhStoreCell(
 	}
 	/* Write the payload */
 	if( iNeedOvfl ){
-		rc = lhCellWriteOvflPayload(pCell,pKey,nKeyLen,pData,nDataLen,(const void *)0);
+		rc = lhCellWriteOvflValue(pCell,pKey,nKeyLen,pData,(sxu64)nDataLen,(const void *)0,0,&pCell->nData,&pCell->iCodec);
+		pCell->nRaw = (sxu64)nDataLen;
 		if( rc != UNQLITE_OK ){
 			lhCellDiscard(pCell);
 			return rc;
@@ -50839,6 +52235,8 @@ static int lhTransferCell(lhcell *pTarget,lhpage *pPage)
 	/* Fill-in the structure */
 	pCell->iStart = nOfft;
 	pCell->nData  = pTarget->nData;
+	pCell->iCodec = pTarget->iCodec;
+	pCell->nRaw   = pTarget->nRaw;
 	pCell->nKey   = pTarget->nKey;
 	pCell->iOvfl  = pTarget->iOvfl;
 	pCell->iDataOfft = pTarget->iDataOfft;
@@ -50896,7 +52294,7 @@ static int lhPageSplit(
 					}
 				}
 				/* Consume the data (Very small data < 65k) */
-				rc = lhConsumeCellData(pCell,unqliteDataConsumer,&sWorker);
+				rc = lhConsumeCellData(pCell,unqliteDataConsumer,&sWorker,0);
 				if( rc != UNQLITE_OK ){
 					goto fail;
 				}
@@ -51198,6 +52596,8 @@ static int lhash_kv_open(unqlite_kv_engine *pEngine,pgno dbSize)
 	lhash_kv_engine *pHash = (lhash_kv_engine *)pEngine;
 	unqlite_page *pHeader;
 	int rc;
+	/* The page format is known by now */
+	pHash->iPageSize = pEngine->pIo->xPageSize(pEngine->pIo->pHandle);
 	if( dbSize < 1 ){
 		/* A new database, create the header */
 		rc = pEngine->pIo->xNew(pEngine->pIo->pHandle,&pHeader);
@@ -51237,7 +52637,21 @@ static void lhash_page_release(void *pUserData)
 	lhash_kv_engine *pEngine = pPage->pHash;
 	lhcell *pNext,*pCell = pPage->pList;
 	unqlite_page *pRaw = pPage->pRaw;
+	lhpage *pSlave;
 	sxu32 n;
+	if( pPage->pMaster != pPage ){
+		/* The cells of a slave page live in the list of its master: release the master with them */
+		lhash_page_release(pPage->pMaster);
+		return;
+	}
+	/* Detach the slave pages, they are parsed again with the next instance of their master */
+	pSlave = pPage->pSlave;
+	while( pSlave ){
+		lhpage *pNextSlave = pSlave->pNextSlave;
+		pSlave->pRaw->pUserData = 0;
+		SyMemBackendPoolFree(&pEngine->sAllocator,pSlave);
+		pSlave = pNextSlave;
+	}
 	/* Drop in-memory cells */
 	for( n = 0 ; n < pPage->nCell ; ++n ){
 		pNext = pCell->pNext;
@@ -51327,6 +52741,634 @@ static void lhash_kv_release(unqlite_kv_engine *pEngine)
 	/* Release the private memory backend */
 	SyMemBackendRelease(&pHash->sAllocator);
 }
+/*
+ * Online vacuum.
+ *
+ * A vacuum pass computes a target page number such that every live page
+ * would fit below it if the free pages were squeezed out of the file.
+ * Each step then walks a few buckets (master page, slave pages and cell
+ * overflow chains) and moves every live page found past the target into
+ * the lowest free page below it, fixing up the pointer that referenced
+ * it on the way. When all buckets have been visited, the free pages that
+ * ended up at the tail of the file are unlinked and the file is shrunk.
+ * Live pages created by other operations while a pass is in progress are
+ * simply left in place and picked up by the next pass.
+ */
+/*
+ * Append a page to the tail of the on-disk free list so that regular
+ * allocations (which pop the head) do not land past the vacuum target.
+ */
+static int lhVacuumAppendFree(lhash_kv_engine *pEngine,unqlite_page *pPage)
+{
+	unqlite_page *pTail;
+	int rc;
+	if( pEngine->apFree == 0 ){
+		/* Mirror dropped, the tail is unknown */
+		return lhRestorePage(pEngine,pPage);
+	}
+	rc = lhSetPagePointer(pEngine,pPage,0,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	SyZero((void *)pEngine->aChainPos,sizeof(pEngine->aChainPos));
+	if( pEngine->pFreeTail == 0 ){
+		/* Empty list */
+		rc = lhSetPagePointer(pEngine,pEngine->pHeader,4/*Magic*/+4/*Hash*/,pPage->pgno);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		pEngine->nFreeList = pPage->pgno;
+	}else{
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pEngine->pFreeTail->iNum,&pTail);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = lhSetPagePointer(pEngine,pTail,0,pPage->pgno);
+		pEngine->pIo->xPageUnref(pTail);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	if( lhFreeMirrorLink(pEngine,pPage->pgno,1) != UNQLITE_OK ){
+		/* Reloaded on the next step */
+		lhFreeMirrorRelease(pEngine);
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Move a live page past the vacuum target to the lowest free page.
+ * The new page number is stored in *piNew (unchanged if the page
+ * was not moved).
+ */
+static int lhVacuumMovePage(lhash_kv_engine *pEngine,unqlite_page *pPage,pgno *piNew)
+{
+	lhash_free_page *pEntry = 0;
+	unqlite_page *pFree;
+	pgno iNew;
+	int rc;
+	*piNew = pPage->pgno;
+	if( pPage->pgno < pEngine->iVacTarget ){
+		/* Already in place */
+		return UNQLITE_OK;
+	}
+	while( pEngine->iVacLow < pEngine->iVacTarget ){
+		pEntry = lhFreeMirrorFind(pEngine,pEngine->iVacLow);
+		if( pEntry ){
+			break;
+		}
+		pEngine->iVacLow++;
+	}
+	if( pEntry == 0 ){
+		/* No room left below the target */
+		return UNQLITE_OK;
+	}
+	iNew = pEngine->iVacLow++;
+	rc = lhFreeUnlinkPage(pEngine,pEntry);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNew,&pFree);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	/* Exchange the page numbers and release the old location */
+	rc = pEngine->pIo->xSwap(pPage,pFree);
+	if( rc == UNQLITE_OK ){
+		rc = lhVacuumAppendFree(pEngine,pFree);
+	}
+	pEngine->pIo->xPageUnref(pFree);
+	if( rc == UNQLITE_OK ){
+		*piNew = iNew;
+	}
+	return rc;
+}
+/*
+ * Relocate the bucket map pages.
+ */
+static int lhVacuumMapPages(lhash_kv_engine *pEngine)
+{
+	unqlite_page *pPrev,*pMap;
+	lhash_bmap_rec *pRec;
+	pgno iNum,iNew,nPage;
+	sxu32 iOfft,n;
+	int rc = UNQLITE_OK;
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	pPrev = pEngine->pHeader;
+	pEngine->pIo->xPageRef(pPrev);
+	iOfft = 4/*magic*/+4/*hash*/+8/* Free page */+8/*current split bucket*/+8/*Maximum split bucket*/;
+	SyBigEndianUnpack64(&pPrev->zData[iOfft],&iNum);
+	while( iNum != 0 && nPage-- > 0 ){
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pMap);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		rc = lhVacuumMovePage(pEngine,pMap,&iNew);
+		if( rc == UNQLITE_OK && iNew != iNum ){
+			rc = lhSetPagePointer(pEngine,pPrev,iOfft,iNew);
+			/* Records stored in this page */
+			pRec = pEngine->pList;
+			for( n = 0 ; n < pEngine->nBuckRec ; ++n ){
+				if( pRec->iPage == iNum ){
+					pRec->iPage = iNew;
+				}
+				pRec = pRec->pNext;
+			}
+			if( pEngine->sPageMap.iNum == iNum ){
+				pEngine->sPageMap.iNum = iNew;
+			}
+		}
+		pEngine->pIo->xPageUnref(pPrev);
+		pPrev = pMap;
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		/* Next map page on the chain */
+		iOfft = 0;
+		SyBigEndianUnpack64(pMap->zData,&iNum);
+	}
+	pEngine->pIo->xPageUnref(pPrev);
+	return rc;
+}
+/*
+ * Relocate the overflow pages of a given cell.
+ */
+static int lhVacuumCell(lhash_kv_engine *pEngine,lhcell *pCell,sxu32 *pnVisit)
+{
+	unqlite_page *pFirst = 0,*pPrev = 0,*pOvfl;
+	pgno iNum,iNext,iNew,iData = 0,nPage;
+	int rc = UNQLITE_OK;
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	iNum = pCell->iOvfl;
+	while( iNum != 0 && nPage-- > 0 ){
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pOvfl);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		(*pnVisit)++;
+		/* Next overflow page on the chain */
+		SyBigEndianUnpack64(pOvfl->zData,&iNext);
+		if( pFirst == 0 ){
+			pFirst = pOvfl;
+			SyBigEndianUnpack64(&pFirst->zData[8/*Next ovfl*/],&iData);
+		}
+		rc = lhVacuumMovePage(pEngine,pOvfl,&iNew);
+		if( rc == UNQLITE_OK && iNew != iNum ){
+			if( pPrev == 0 ){
+				/* First overflow page, referenced by the cell header */
+				rc = lhSetPagePointer(pEngine,pCell->pPage->pRaw,pCell->iStart + 4/*Hash*/ + 4/*Key*/ + 8/*Data*/ + 2 /*Next cell*/,iNew);
+				pCell->iOvfl = iNew;
+			}else{
+				rc = lhSetPagePointer(pEngine,pPrev,0,iNew);
+			}
+			if( rc == UNQLITE_OK && iData == iNum ){
+				/* Data page, referenced by the first overflow page */
+				rc = lhSetPagePointer(pEngine,pFirst,8/*Next ovfl*/,iNew);
+				pCell->iDataPage = iNew;
+			}
+		}
+		if( pPrev && pPrev != pFirst ){
+			pEngine->pIo->xPageUnref(pPrev);
+		}
+		pPrev = pOvfl;
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		iNum = iNext;
+	}
+	if( pPrev && pPrev != pFirst ){
+		pEngine->pIo->xPageUnref(pPrev);
+	}
+	if( pFirst ){
+		pEngine->pIo->xPageUnref(pFirst);
+	}
+	return rc;
+}
+/*
+ * Relocate the pages of a given bucket.
+ */
+static int lhVacuumBucket(lhash_kv_engine *pEngine,lhash_bmap_rec *pRec,sxu32 *pnVisit)
+{
+	unqlite_page *pRaw,*pMap;
+	lhpage *pMaster,*pPage;
+	lhcell *pCell;
+	pgno iNew,iSlave;
+	sxu32 n;
+	int rc;
+	rc = lhLoadPage(pEngine,pRec->iReal,0,&pMaster,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	(*pnVisit)++;
+	rc = lhVacuumMovePage(pEngine,pMaster->pRaw,&iNew);
+	if( rc == UNQLITE_OK && iNew != pRec->iReal ){
+		/* Primary page, referenced by its bucket map record */
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,pRec->iPage,&pMap);
+		if( rc == UNQLITE_OK ){
+			rc = lhSetPagePointer(pEngine,pMap,pRec->iOfft + 8/* Logical bucket number */,iNew);
+			pEngine->pIo->xPageUnref(pMap);
+		}
+		if( rc == UNQLITE_OK ){
+			pRec->iReal = iNew;
+		}
+	}
+	pPage = pMaster;
+	while( rc == UNQLITE_OK ){
+		/* Overflow pages */
+		pCell = pPage->pList;
+		for( n = 0 ; n < pPage->nCell && rc == UNQLITE_OK ; ++n ){
+			if( pCell->iOvfl > 0 ){
+				rc = lhVacuumCell(pEngine,pCell,pnVisit);
+			}
+			pCell = pCell->pNext;
+		}
+		iSlave = pPage->sHdr.iSlave;
+		if( rc != UNQLITE_OK || iSlave == 0 ){
+			break;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iSlave,&pRaw);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		if( pRaw->pUserData == 0 ){
+			/* Slave page not loaded (See lhLoadPage()), leave the rest of the chain alone */
+			pEngine->pIo->xPageUnref(pRaw);
+			break;
+		}
+		(*pnVisit)++;
+		rc = lhVacuumMovePage(pEngine,pRaw,&iNew);
+		if( rc == UNQLITE_OK && iNew != iSlave ){
+			rc = lhSetPagePointer(pEngine,pPage->pRaw,2/* Offset of the first cell */+2/* Offset of the first free block */,iNew);
+			pPage->sHdr.iSlave = iNew;
+		}
+		pPage = (lhpage *)pRaw->pUserData;
+		pEngine->pIo->xPageUnref(pRaw);
+	}
+	pEngine->pIo->xPageUnref(pMaster->pRaw);
+	return rc;
+}
+/*
+ * Unlink the free pages at the tail of the file and shrink it.
+ */
+static int lhVacuumTruncate(lhash_kv_engine *pEngine)
+{
+	lhash_free_page *pEntry;
+	pgno nPage,iNum,iEnd;
+	int rc;
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	iEnd = nPage;
+	while( iEnd > 2 && lhFreeMirrorFind(pEngine,iEnd - 1) ){
+		iEnd--;
+	}
+	if( iEnd >= nPage ){
+		/* Nothing to give back */
+		return UNQLITE_OK;
+	}
+	for( iNum = iEnd ; iNum < nPage ; ++iNum ){
+		pEntry = lhFreeMirrorFind(pEngine,iNum);
+		rc = lhFreeUnlinkPage(pEngine,pEntry);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	rc = pEngine->pIo->xTruncate(pEngine->pIo->pHandle,iEnd);
+	return rc;
+}
+/*
+ * Perform one step of the online vacuum.
+ * At most nStep pages are visited before returning (a step of zero
+ * only reports progress). On return, *pnFree holds the total number
+ * of free pages, *pnPage the total number of pages in the file and
+ * *pnRemain the number of buckets the current pass has yet to visit
+ * (zero when no pass is in progress).
+ */
+static int lhVacuumStep(
+	lhash_kv_engine *pEngine,
+	int nStep,
+	unqlite_int64 *pnFree,
+	unqlite_int64 *pnPage,
+	unqlite_int64 *pnRemain
+	)
+{
+	lhash_bmap_rec *pRec;
+	sxu32 nVisit = 0;
+	pgno nBucket,nPage;
+	int rc;
+	/* Acquire the first page (DB hash Header) so that everything gets loaded autmatically */
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	if( pEngine->apFree && (pEngine->pFreeHead ? pEngine->pFreeHead->iNum : 0) != pEngine->nFreeList ){
+		/* Out of sync mirror, reload */
+		lhFreeMirrorRelease(pEngine);
+	}
+	if( pEngine->apFree == 0 ){
+		rc = lhFreeMirrorLoad(pEngine);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	nBucket = pEngine->split_bucket + pEngine->max_split_bucket;
+	if( nStep > 0 ){
+		if( pEngine->pIo->xReadOnly(pEngine->pIo->pHandle) ){
+			pEngine->pIo->xErr(pEngine->pIo->pHandle,"Read-only database");
+			return UNQLITE_READ_ONLY;
+		}
+		nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+		if( pEngine->iVacTarget == 0 && pEngine->nFreePage > 0 && nPage > pEngine->nFreePage + 2 ){
+			/* Start a new pass. Page zero (Pager header) and page one (Hash header) never move */
+			pEngine->iVacTarget = nPage - pEngine->nFreePage;
+			pEngine->iVacLow = 2;
+			pEngine->iVacBucket = 0;
+			rc = lhVacuumMapPages(pEngine);
+		}
+		while( rc == UNQLITE_OK && pEngine->iVacTarget > 0 && pEngine->iVacBucket < nBucket && nVisit < (sxu32)nStep ){
+			pRec = lhMapFindBucket(pEngine,pEngine->iVacBucket);
+			if( pRec ){
+				rc = lhVacuumBucket(pEngine,pRec,&nVisit);
+			}
+			pEngine->iVacBucket++;
+		}
+		if( rc == UNQLITE_OK && pEngine->iVacTarget > 0 && pEngine->iVacBucket >= nBucket ){
+			/* Pass done */
+			rc = lhVacuumTruncate(pEngine);
+			pEngine->iVacTarget = 0;
+		}
+	}
+	if( pnFree ){
+		*pnFree = (unqlite_int64)pEngine->nFreePage;
+	}
+	if( pnPage ){
+		*pnPage = (unqlite_int64)pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	}
+	if( pnRemain ){
+		*pnRemain = pEngine->iVacTarget > 0 ? (unqlite_int64)(nBucket - pEngine->iVacBucket) : 0;
+	}
+	return rc;
+}
+/*
+ * Mark a page as referenced while checking the integrity of the database.
+ * A page referenced twice or past the end of the file means corruption.
+ */
+static int lhCheckMark(sxu32 *aSeen,pgno iNum,pgno nPage)
+{
+	if( iNum < 1 || iNum >= nPage || ((aSeen[iNum >> 5] >> (iNum & 31)) & 1) ){
+		return UNQLITE_CORRUPT;
+	}
+	aSeen[iNum >> 5] |= (sxu32)1 << (iNum & 31);
+	return UNQLITE_OK;
+}
+/*
+ * Walk a chain of pages linked by the page number stored at offset zero
+ * (overflow chains, bucket map pages and the free list) and mark them.
+ * The number of pages is added to *pnPage and the number of links to a
+ * page other than the next one in the file to *pnBreak.
+ */
+static int lhCheckChain(lhash_kv_engine *pEngine,sxu32 *aSeen,pgno iNum,pgno nPage,sxu64 *pnPage,sxu64 *pnBreak)
+{
+	unqlite_page *pRaw;
+	pgno iNext;
+	int rc;
+	while( iNum != 0 ){
+		rc = lhCheckMark(aSeen,iNum,nPage);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		SyBigEndianUnpack64(pRaw->zData,&iNext);
+		pEngine->pIo->xPageUnref(pRaw);
+		(*pnPage)++;
+		if( iNext != 0 && iNext != iNum + 1 && pnBreak ){
+			(*pnBreak)++;
+		}
+		iNum = iNext;
+	}
+	return UNQLITE_OK;
+}
+/*
+ * Mark the primary and slave pages of a bucket and the overflow chains
+ * of their cells. The raw pages are walked, not the loaded cells.
+ */
+static int lhCheckBucket(lhash_kv_engine *pEngine,sxu32 *aSeen,pgno iNum,pgno nPage,sxu64 *pnPage,sxu64 *pnBreak)
+{
+	const unsigned char *zCell;
+	unqlite_page *pRaw;
+	sxu16 iCell,nCell;
+	pgno iOvfl,iSlave;
+	int rc = UNQLITE_OK;
+	while( iNum != 0 && rc == UNQLITE_OK ){
+		rc = lhCheckMark(aSeen,iNum,nPage);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pRaw);
+		if( rc != UNQLITE_OK ){
+			break;
+		}
+		(*pnPage)++;
+		SyBigEndianUnpack16(pRaw->zData,&iCell);
+		SyBigEndianUnpack64(&pRaw->zData[2/* Offset of the first cell */+2/* Offset of the first free block */],&iSlave);
+		nCell = 0;
+		while( iCell > 0 && rc == UNQLITE_OK ){
+			if( iCell < L_HASH_PAGE_HDR_SZ || iCell > pEngine->iPageSize - L_HASH_CELL_SZ || ++nCell > pEngine->iPageSize / L_HASH_CELL_SZ ){
+				/* Cell outside the page or cycle */
+				rc = UNQLITE_CORRUPT;
+				break;
+			}
+			zCell = &pRaw->zData[iCell];
+			SyBigEndianUnpack64(&zCell[4/*Hash*/+4/*Key*/+8/*Data*/+2/*Next cell*/],&iOvfl);
+			if( iOvfl > 0 ){
+				rc = lhCheckChain(pEngine,aSeen,iOvfl,nPage,pnPage,pnBreak);
+			}
+			SyBigEndianUnpack16(&zCell[4/*Hash*/+4/*Key*/+8/*Data*/],&iCell);
+		}
+		pEngine->pIo->xPageUnref(pRaw);
+		iNum = iSlave;
+	}
+	return rc;
+}
+/*
+ * Check the integrity of the database. Every page must be referenced at
+ * most once: by the bucket map, a bucket, an overflow chain or the free
+ * list. When the in-memory mirror of the free list is loaded, it must
+ * match the on-disk list page for page and so must the free space bitmap.
+ * On return, *pnUsed holds the number of pages in use (the hash header
+ * included), *pnFree the length of the free list and *pnBreak the number
+ * of overflow chain links that do not lead to the next page of the file.
+ * Pages that are neither used nor free are leaked: pnUsed + pnFree is
+ * then less than the page count minus the pager header.
+ */
+static int lhCheckIntegrity(
+	lhash_kv_engine *pEngine,
+	unqlite_int64 *pnUsed,
+	unqlite_int64 *pnFree,
+	unqlite_int64 *pnBreak
+	)
+{
+	sxu64 nUsed = 1,nFree = 0,nBreak = 0,nBit = 0;
+	lhash_free_page *pEntry;
+	lhash_bmap_rec *pRec;
+	unqlite_page *pRaw;
+	sxu32 *aSeen,n;
+	pgno nPage,iNum;
+	int rc;
+	/* Acquire the first page (DB hash Header) so that everything gets loaded autmatically */
+	rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,1,0);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	nPage = pEngine->pIo->xPageCount(pEngine->pIo->pHandle);
+	aSeen = (sxu32 *)SyMemBackendAlloc(&pEngine->sAllocator,(sxu32)((nPage >> 5) + 1) * sizeof(sxu32));
+	if( aSeen == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	SyZero((void *)aSeen,(sxu32)((nPage >> 5) + 1) * sizeof(sxu32));
+	rc = lhCheckMark(aSeen,1,nPage);
+	if( rc == UNQLITE_OK ){
+		/* Bucket map pages */
+		SyBigEndianUnpack64(&pEngine->pHeader->zData[4/*magic*/+4/*hash*/+8/* Free page */+8/*current split bucket*/+8/*Maximum split bucket*/],&iNum);
+		rc = lhCheckChain(pEngine,aSeen,iNum,nPage,&nUsed,0);
+	}
+	/* Buckets */
+	pRec = pEngine->pList;
+	for( n = 0 ; n < pEngine->nBuckRec && rc == UNQLITE_OK ; ++n ){
+		rc = lhCheckBucket(pEngine,aSeen,pRec->iReal,nPage,&nUsed,&nBreak);
+		pRec = pRec->pNext;
+	}
+	if( rc == UNQLITE_OK ){
+		/* Free list, as stored in the header */
+		SyBigEndianUnpack64(&pEngine->pHeader->zData[4/*Magic*/+4/*Hash*/],&iNum);
+		if( iNum != pEngine->nFreeList ){
+			rc = UNQLITE_CORRUPT;
+		}else{
+			rc = lhCheckChain(pEngine,aSeen,iNum,nPage,&nFree,0);
+		}
+	}
+	if( rc == UNQLITE_OK && pEngine->apFree ){
+		/* In-memory mirror and free space bitmap */
+		iNum = pEngine->nFreeList;
+		for( pEntry = pEngine->pFreeHead ; pEntry && rc == UNQLITE_OK ; pEntry = pEntry->pNext ){
+			if( pEntry->iNum != iNum || !lhFreeMapTest(pEngine,iNum) || lhFreeMirrorFind(pEngine,iNum) != pEntry ){
+				rc = UNQLITE_CORRUPT;
+				break;
+			}
+			rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iNum,&pRaw);
+			if( rc == UNQLITE_OK ){
+				SyBigEndianUnpack64(pRaw->zData,&iNum);
+				pEngine->pIo->xPageUnref(pRaw);
+			}
+		}
+		for( n = 0 ; n < (pEngine->nFreeMapBits >> 5) ; ++n ){
+			sxu32 iWord = pEngine->aFreeMap[n];
+			while( iWord ){
+				iWord &= iWord - 1;
+				nBit++;
+			}
+		}
+		if( rc == UNQLITE_OK && (iNum != 0 || nBit != nFree || (sxu64)pEngine->nFreePage != nFree) ){
+			rc = UNQLITE_CORRUPT;
+		}
+	}
+	SyMemBackendFree(&pEngine->sAllocator,(void *)aSeen);
+	if( pnUsed ){
+		*pnUsed = (unqlite_int64)nUsed;
+	}
+	if( pnFree ){
+		*pnFree = (unqlite_int64)nFree;
+	}
+	if( pnBreak ){
+		*pnBreak = (unqlite_int64)nBreak;
+	}
+	return rc;
+}
+/*
+ * Read ahead the overflow pages holding bytes [iOfft,iOfft+nLen) of a record.
+ * The chain is walked from the page where the last walk of the same chain
+ * stopped, or from its head if that page lies past iOfft. Every time the walk
+ * reaches a page that was not read ahead yet, the pages that would follow it
+ * if the chain is laid out in a contiguous extent are requested at once.
+ * Compressed values are mapped to their stored bytes using the overall
+ * compression ratio.
+ */
+static int lhPrefetchData(lhash_kv_engine *pEngine,const void *pKey,sxu32 nKey,sxu64 iOfft,sxu64 nLen)
+{
+	sxu32 nOvflSize = L_HASH_OVERFLOW_SIZE(pEngine->iPageSize);
+	pgno iHintFirst = 0,iHintEnd = 0;
+	lhash_chain_pos *pPos = 0;
+	unqlite_page *pOvfl;
+	sxu64 nPos,nEnd;
+	lhcell *pCell;
+	sxu32 nByte,n;
+	pgno iOvfl;
+	int rc;
+	rc = lhRecordLookup(pEngine,pKey,nKey,&pCell);
+	if( rc != UNQLITE_OK ){
+		return rc == UNQLITE_NOTFOUND ? UNQLITE_OK : rc;
+	}
+	if( pCell->iOvfl == 0 || pCell->iDataPage == 0 ){
+		/* Data stored in the bucket page, already in memory */
+		return UNQLITE_OK;
+	}
+	if( pCell->iCodec != 0 ){
+		sxu64 nRaw;
+		rc = lhCellDataLength(pCell,&nRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		if( nRaw > 0 ){
+			iOfft = iOfft * pCell->nData / nRaw;
+			nLen = nLen * pCell->nData / nRaw + nOvflSize;
+		}
+	}
+	nEnd = iOfft + nLen;
+	if( nEnd > pCell->nData ){
+		nEnd = pCell->nData;
+	}
+	/* Start from the head, or from where the last walk of this chain stopped */
+	iOvfl = pCell->iDataPage;
+	nByte = pEngine->iPageSize - pCell->iDataOfft;
+	nPos = 0;
+	for( n = 0 ; n < L_HASH_CHAIN_POS ; ++n ){
+		if( pEngine->aChainPos[n].iHead == pCell->iDataPage ){
+			pPos = &pEngine->aChainPos[n];
+			if( pPos->nPos > 0 && pPos->nPos <= iOfft ){
+				iOvfl = pPos->iPage;
+				nPos = pPos->nPos;
+				nByte = nOvflSize;
+			}
+			break;
+		}
+	}
+	if( pPos == 0 ){
+		pPos = &pEngine->aChainPos[pEngine->iChainPos++ % L_HASH_CHAIN_POS];
+		pPos->iHead = pCell->iDataPage;
+		pPos->nPos = 0;
+	}
+	/* Walk the chain */
+	while( iOvfl > 0 && nPos < nEnd ){
+		if( nPos + nByte > iOfft && (iOvfl < iHintFirst || iOvfl >= iHintEnd) ){
+			/* Request the rest of the window */
+			iHintFirst = iOvfl;
+			iHintEnd = iOvfl + (pgno)((nEnd - nPos + nOvflSize - 1) / nOvflSize);
+			pEngine->pIo->xPrefetch(pEngine->pIo->pHandle,iHintFirst,iHintEnd - iHintFirst);
+		}
+		rc = pEngine->pIo->xGet(pEngine->pIo->pHandle,iOvfl,&pOvfl);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		/* Remember the last page reached, where the next sequential read starts */
+		pPos->iPage = iOvfl;
+		pPos->nPos = nPos;
+		SyBigEndianUnpack64(pOvfl->zData,&iOvfl);
+		pEngine->pIo->xPageUnref(pOvfl);
+		nPos += nByte;
+		nByte = nOvflSize;
+	}
+	return UNQLITE_OK;
+}
 /*
  *  Exported: xConfig() method.
  *  Configure the linear hash KV store.
@@ -51357,6 +53399,46 @@ static int lhash_kv_config(unqlite_kv_engine *pEngine,int op,va_list ap)
 		}
 		break;
 									 }
+	case UNQLITE_KV_CONFIG_VACUUM: {
+		/* One step of the online vacuum */
+		int nStep = va_arg(ap,int);
+		unqlite_int64 *pnFree = va_arg(ap,unqlite_int64 *);
+		unqlite_int64 *pnPage = va_arg(ap,unqlite_int64 *);
+		unqlite_int64 *pnRemain = va_arg(ap,unqlite_int64 *);
+		rc = lhVacuumStep(pHash,nStep,pnFree,pnPage,pnRemain);
+		break;
+								   }
+	case UNQLITE_KV_CONFIG_CHECK: {
+		/* Integrity check */
+		unqlite_int64 *pnUsed = va_arg(ap,unqlite_int64 *);
+		unqlite_int64 *pnFree = va_arg(ap,unqlite_int64 *);
+		unqlite_int64 *pnBreak = va_arg(ap,unqlite_int64 *);
+		rc = lhCheckIntegrity(pHash,pnUsed,pnFree,pnBreak);
+		break;
+								  }
+	case UNQLITE_KV_CONFIG_COMPRESSION: {
+		/* Codec of the overflow values stored from now on */
+		int iCodec = va_arg(ap,int);
+		if( iCodec != UNQLITE_KV_CODEC_NONE && iCodec != UNQLITE_KV_CODEC_LZ4 ){
+			rc = UNQLITE_INVALID;
+		}else{
+			pHash->iCodec = (sxu8)iCodec;
+		}
+		break;
+										}
+	case UNQLITE_KV_CONFIG_PREFETCH: {
+		/* Read ahead part of a record */
+		const void *pKey = va_arg(ap,const void *);
+		int nKey = va_arg(ap,int);
+		unqlite_int64 iOfft = va_arg(ap,unqlite_int64);
+		unqlite_int64 nLen = va_arg(ap,unqlite_int64);
+		if( pKey == 0 || nKey < 1 || iOfft < 0 || nLen < 0 ){
+			rc = UNQLITE_INVALID;
+		}else{
+			rc = lhPrefetchData(pHash,pKey,(sxu32)nKey,(sxu64)iOfft,(sxu64)nLen);
+		}
+		break;
+									 }
 	default:
 		/* Unknown OP */
 		rc = UNQLITE_UNKNOWN;
@@ -51604,6 +53686,8 @@ static int lhCursorDataLength(unqlite_kv_cursor *pCursor,unqlite_int64 *pLen)
 {
 	lhash_kv_cursor *pCur = (lhash_kv_cursor *)pCursor;
 	lhcell *pCell;
+	sxu64 nLen;
+	int rc;
 	
 	if( pCur->iState != L_HASH_CURSOR_STATE_CELL || pCur->pCell == 0 ){
 		/* Invalid state */
@@ -51612,8 +53696,9 @@ static int lhCursorDataLength(unqlite_kv_cursor *pCursor,unqlite_int64 *pLen)
 	/* Point to the target cell */
 	pCell = pCur->pCell;
 	/* Return data length */
-	*pLen = (unqlite_int64)pCell->nData;
-	return UNQLITE_OK;
+	rc = lhCellDataLength(pCell,&nLen);
+	*pLen = (unqlite_int64)nLen;
+	return rc;
 }
 /*
  * Consume the key.
@@ -51653,7 +53738,7 @@ static int lhCursorData(unqlite_kv_cursor *pCursor,int (*xConsumer)(const void *
 	/* Point to the target cell */
 	pCell = pCur->pCell;
 	/* Consume the data */
-	rc = lhConsumeCellData(pCell,xConsumer,pUserData);
+	rc = lhCellConsumeData(pCell,xConsumer,pUserData);
 	return rc;
 }
 /*
@@ -51694,6 +53779,84 @@ static int lhCursorDelete(unqlite_kv_cursor *pCursor)
 	rc = lhRecordRemove(pCell);
 	return rc;
 }
+/*
+ * Fetch a record from the pages in the cache only (xFetchCached method).
+ * Called under the shared side of the handle lock, along with other threads:
+ * nothing is loaded, parsed or referenced, see lhRecordLookup() for the
+ * regular lookup. UNQLITE_BUSY is returned when the bucket page, an overflow
+ * page or a large key is not in memory, and for the compressed values.
+ * The pager drops the clean pages nobody references (See page_unref()), so
+ * the values stored on overflow pages mostly take the cursor path.
+ */
+static int lhash_kv_fetch_cached(
+	unqlite_kv_engine *pKv,
+	const void *pKey,int nByte,
+	int (*xConsumer)(const void *,unsigned int,void *),void *pUserData,
+	unqlite_int64 *pDataLen
+	)
+{
+	lhash_kv_engine *pEngine = (lhash_kv_engine *)pKv;
+	const unqlite_kv_io *pIo = pEngine->pIo;
+	lhash_bmap_rec *pRec;
+	unqlite_page *pRaw;
+	lhpage *pPage;
+	lhcell *pCell;
+	pgno iBucket;
+	sxu32 nHash;
+	int rc;
+	/* The header page stays in the cache while the engine is open */
+	if( pIo->xLookup(pIo->pHandle,1,0) != UNQLITE_OK ){
+		return UNQLITE_BUSY;
+	}
+	/* Map the key to its bucket, as lhRecordLookup() does */
+	nHash = pEngine->xHash(pKey,(sxu32)nByte);
+	iBucket = nHash & (pEngine->nmax_split_nucket - 1);
+	if( iBucket >= (pEngine->split_bucket + pEngine->max_split_bucket) ){
+		iBucket = nHash & (pEngine->max_split_bucket - 1);
+	}
+	pRec = lhMapFindBucket(pEngine,iBucket);
+	if( pRec == 0 ){
+		return UNQLITE_NOTFOUND;
+	}
+	/* The master page must be parsed, its slaves are with it */
+	if( pIo->xLookup(pIo->pHandle,pRec->iReal,&pRaw) != UNQLITE_OK || pRaw->pUserData == 0 ){
+		return UNQLITE_BUSY;
+	}
+	pPage = (lhpage *)pRaw->pUserData;
+	if( pPage->nCell < 1 ){
+		return UNQLITE_NOTFOUND;
+	}
+	pCell = pPage->apCell[nHash & (pPage->nCellSize - 1)];
+	for(;;){
+		if( pCell == 0 ){
+			return UNQLITE_NOTFOUND;
+		}
+		if( pCell->nHash == nHash && pCell->nKey == (sxu32)nByte ){
+			if( SyBlobLength(&pCell->sKey) < 1 ){
+				/* Large key, compared from disk (See lhFindCell()) */
+				return UNQLITE_BUSY;
+			}
+			if( pEngine->xCmp(pKey,SyBlobData(&pCell->sKey),(sxu32)nByte) == 0 ){
+				break;
+			}
+		}
+		pCell = pCell->pNextCol;
+	}
+	if( pCell->iCodec != 0 ){
+		/* The decoder allocates and caches the raw length */
+		return UNQLITE_BUSY;
+	}
+	if( xConsumer == 0 ){
+		*pDataLen = (unqlite_int64)pCell->nData;
+		return UNQLITE_OK;
+	}
+	/* Check the overflow pages first: the consumer cannot take the data back */
+	rc = lhConsumeCellData(pCell,0,0,1);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	return lhConsumeCellData(pCell,xConsumer,pUserData,1);
+}
 /*
  * Export the linear-hash storage engine.
  */
@@ -51703,7 +53866,7 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
 		"hash",                     /* zName */
 		sizeof(lhash_kv_engine),    /* szKv */
 		sizeof(lhash_kv_cursor),    /* szCursor */
-		1,                          /* iVersion */
+		2,                          /* iVersion */
 		lhash_kv_init,              /* xInit */
 		lhash_kv_release,           /* xRelease */
 		lhash_kv_config,            /* xConfig */
@@ -51723,7 +53886,8 @@ UNQLITE_PRIVATE const unqlite_kv_methods * unqliteExportDiskKvStorage(void)
 		lhCursorDataLength,         /* xDataLength */
 		lhCursorData,               /* xData */
 		lhCursorReset,              /* xReset */
-		0                           /* xRelease */                        
+		0,                          /* xRelease */
+		lhash_kv_fetch_cached       /* xFetchCached */
 	};
 	return &sDiskStore;
 }
@@ -51791,6 +53955,9 @@ struct mem_hash_kv_engine
 	sxu32 nRecord;              /* Total number of records  */
 	sxu32 nBucket;              /* Bucket size: Must be a power of two */
 	mem_hash_record **apBucket; /* Hash bucket */
+	mem_hash_record **apOld;    /* Table being drained by an incremental rehash (NULL when idle) */
+	sxu32 nOldBucket;           /* apOld size: Must be a power of two */
+	sxu32 iMigrate;             /* Index of the next apOld bucket to migrate */
 	mem_hash_record *pFirst;    /* First inserted entry */
 	mem_hash_record *pLast;     /* Last inserted entry */
 };
@@ -51838,17 +54005,34 @@ static mem_hash_record * MemHashNewRecord(
 	/* All done */
 	return pRecord;
 }
+/*
+ * Return the bucket slot holding records with the given hash.
+ * While an incremental rehash is in progress, a record lives in the old
+ * table if its old bucket has not been migrated yet, in the new one otherwise.
+ */
+static mem_hash_record ** MemHashBucketSlot(mem_hash_kv_engine *pEngine,sxu32 nHash)
+{
+	if( pEngine->apOld ){
+		sxu32 iOld = nHash & (pEngine->nOldBucket - 1);
+		if( iOld >= pEngine->iMigrate ){
+			/* Not yet migrated */
+			return &pEngine->apOld[iOld];
+		}
+	}
+	return &pEngine->apBucket[nHash & (pEngine->nBucket - 1)];
+}
 /*
  * Install a given record in the hashtable.
  */
 static void MemHashLinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pRecord)
 {
-	sxu32 nBucket = pRecord->nHash & (pEngine->nBucket - 1);
-	pRecord->pNextHash = pEngine->apBucket[nBucket];
-	if( pEngine->apBucket[nBucket] ){
-		pEngine->apBucket[nBucket]->pPrevHash = pRecord;
+	mem_hash_record **ppBucket = MemHashBucketSlot(pEngine,pRecord->nHash);
+	pRecord->pPrevHash = 0;
+	pRecord->pNextHash = *ppBucket;
+	if( *ppBucket ){
+		(*ppBucket)->pPrevHash = pRecord;
 	}
-	pEngine->apBucket[nBucket] = pRecord;
+	*ppBucket = pRecord;
 	if( pEngine->pFirst == 0 ){
 		pEngine->pFirst = pEngine->pLast = pRecord;
 	}else{
@@ -51861,10 +54045,9 @@ static void MemHashLinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pReco
  */
 static void MemHashUnlinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pEntry)
 {
-	sxu32 nBucket = pEntry->nHash & (pEngine->nBucket - 1);
 	SyMemBackend *pAlloc = &pEngine->sAlloc;
 	if( pEntry->pPrevHash == 0 ){
-		pEngine->apBucket[nBucket] = pEntry->pNextHash;
+		*MemHashBucketSlot(pEngine,pEntry->nHash) = pEntry->pNextHash;
 	}else{
 		pEntry->pPrevHash->pNextHash = pEntry->pNextHash;
 	}
@@ -51880,6 +54063,46 @@ static void MemHashUnlinkRecord(mem_hash_kv_engine *pEngine,mem_hash_record *pEn
 	SyMemBackendFree(pAlloc,(void *)pEntry->pData);
 	SyMemBackendFree(pAlloc,pEntry); /* Key is also stored here */
 }
+/* Number of old buckets migrated per lookup while an incremental rehash is in progress */
+#define MEM_HASH_MIGRATE_STEP 8
+/*
+ * Move up to MEM_HASH_MIGRATE_STEP buckets from the old table to the new one.
+ * The old table is released once it has been fully drained.
+ */
+static void MemHashMigrateStep(mem_hash_kv_engine *pEngine)
+{
+	mem_hash_record *pEntry,*pNext;
+	sxu32 iBucket,nStep;
+	if( pEngine->apOld == 0 ){
+		/* No rehash in progress */
+		return;
+	}
+	for( nStep = 0 ; nStep < MEM_HASH_MIGRATE_STEP && pEngine->iMigrate < pEngine->nOldBucket ; nStep++ ){
+		pEntry = pEngine->apOld[pEngine->iMigrate];
+		pEngine->apOld[pEngine->iMigrate] = 0;
+		pEngine->iMigrate++;
+		while( pEntry ){
+			pNext = pEntry->pNextHash;
+			/* Install in the new bucket */
+			iBucket = pEntry->nHash & (pEngine->nBucket - 1);
+			pEntry->pPrevHash = 0;
+			pEntry->pNextHash = pEngine->apBucket[iBucket];
+			if( pEngine->apBucket[iBucket] ){
+				pEngine->apBucket[iBucket]->pPrevHash = pEntry;
+			}
+			pEngine->apBucket[iBucket] = pEntry;
+			/* Point to the next entry */
+			pEntry = pNext;
+		}
+	}
+	if( pEngine->iMigrate >= pEngine->nOldBucket ){
+		/* Old table drained, release it */
+		SyMemBackendFree(&pEngine->sAlloc,(void *)pEngine->apOld);
+		pEngine->apOld = 0;
+		pEngine->nOldBucket = 0;
+		pEngine->iMigrate = 0;
+	}
+}
 /*
  * Perform a lookup for a given entry.
  */
@@ -51889,11 +54112,12 @@ static mem_hash_record * MemHashGetEntry(
 	)
 {
 	mem_hash_record *pEntry;
-	sxu32 nHash,nBucket;
+	sxu32 nHash;
+	/* Amortize any pending rehash over lookups */
+	MemHashMigrateStep(pEngine);
 	/* Hash the entry */
 	nHash = pEngine->xHash(pKey,(sxu32)nKeyLen);
-	nBucket = nHash & (pEngine->nBucket - 1);
-	pEntry = pEngine->apBucket[nBucket];
+	pEntry = *MemHashBucketSlot(pEngine,nHash);
 	for(;;){
 		if( pEntry == 0 ){
 			break;
@@ -51908,14 +54132,19 @@ static mem_hash_record * MemHashGetEntry(
 	return 0;
 }
 /*
- * Rehash all the entries in the given table.
+ * Grow the table.
+ * Rather than rehashing every record at once, which stalls the caller for
+ * large tables, install a table twice as large and let MemHashMigrateStep()
+ * move the old buckets over a few at a time on each subsequent lookup.
  */
 static int MemHashGrowTable(mem_hash_kv_engine *pEngine)
 {
 	sxu32 nNewSize = pEngine->nBucket << 1;
-	mem_hash_record *pEntry;
 	mem_hash_record **apNew;
-	sxu32 n,iBucket;
+	if( pEngine->apOld ){
+		/* Previous rehash still in progress */
+		return UNQLITE_OK;
+	}
 	/* Allocate a new larger table */
 	apNew = (mem_hash_record **)SyMemBackendAlloc(&pEngine->sAlloc, nNewSize * sizeof(mem_hash_record *));
 	if( apNew == 0 ){
@@ -51924,77 +54153,10 @@ static int MemHashGrowTable(mem_hash_kv_engine *pEngine)
 	}
 	/* Zero the new table */
 	SyZero((void *)apNew, nNewSize * sizeof(mem_hash_record *));
-	/* Rehash all entries */
-	n = 0;
-	pEntry = pEngine->pLast;
-	for(;;){
-		
-		/* Loop one */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop two */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop three */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-
-		/* Loop four */
-		if( n >= pEngine->nRecord ){
-			break;
-		}
-		pEntry->pNextHash = pEntry->pPrevHash = 0;
-		/* Install in the new bucket */
-		iBucket = pEntry->nHash & (nNewSize - 1);
-		pEntry->pNextHash = apNew[iBucket];
-		if( apNew[iBucket] ){
-			apNew[iBucket]->pPrevHash = pEntry;
-		}
-		apNew[iBucket] = pEntry;
-		/* Point to the next entry */
-		pEntry = pEntry->pNext;
-		n++;
-	}
-	/* Release the old table and reflect the change */
-	SyMemBackendFree(&pEngine->sAlloc,(void *)pEngine->apBucket);
+	/* The current table becomes the one being drained */
+	pEngine->apOld = pEngine->apBucket;
+	pEngine->nOldBucket = pEngine->nBucket;
+	pEngine->iMigrate = 0;
 	pEngine->apBucket = apNew;
 	pEngine->nBucket  = nNewSize;
 	return UNQLITE_OK;
@@ -52294,7 +54456,7 @@ static int MemHashReplace(
 		}
 		/* Link the entry */
 		MemHashLinkRecord(pEngine,pRecord);
-		if( (pEngine->nRecord >= pEngine->nBucket * MEM_HASH_FILL_FACTOR) && pEngine->nRecord < 100000 ){
+		if( pEngine->nRecord >= pEngine->nBucket * MEM_HASH_FILL_FACTOR ){
 			/* Rehash the table */
 			MemHashGrowTable(pEngine);
 		}
@@ -52350,7 +54512,7 @@ static int MemHashAppend(
 		}
 		/* Link the entry */
 		MemHashLinkRecord(pEngine,pRecord);
-		if( pEngine->nRecord * MEM_HASH_FILL_FACTOR >= pEngine->nBucket && pEngine->nRecord < 100000 ){
+		if( pEngine->nRecord >= pEngine->nBucket * MEM_HASH_FILL_FACTOR ){
 			/* Rehash the table */
 			MemHashGrowTable(pEngine);
 		}
@@ -52592,6 +54754,14 @@ UNQLITE_PRIVATE int unqliteOsAccess(
 # include <sys/mount.h>
 #endif
 /*
+** A commit writes the database file without the handle mutex while other
+** threads fetch and prefetch pages through the same descriptor (see
+** [unqlitePagerCommitFlush()]). Positioned IO keeps their offsets apart.
+*/
+#if !defined(USE_PREAD) && !defined(USE_PREAD64)
+# define USE_PREAD
+#endif
+/*
 ** Allowed values of unixFile.fsFlags
 */
 #define UNQLITE_FSFLAGS_IS_MSDOS     0x1
@@ -55414,6 +57584,19 @@ static const unsigned char aJournalMagic[] = {
 ** size as a single disk sector. See also setSectorSize().
 */
 #define JOURNAL_HDR_SZ(pPager) (pPager->iSectorSize)
+/*
+** Databases created with UNQLITE_OPEN_PAGE_CRC end every page with a
+** CRC32C of the rest of the page. The flag is kept in the most significant
+** bit of the page size field of both the database and the journal header
+** and the KV engine only sees the page size minus the checksum.
+*/
+#define PAGER_CRC_SZ       4
+#define PAGER_FMT_PAGE_CRC 0x80000000
+#define PAGER_USABLE_SIZE(pPager) ((pPager)->iPageSize - ((pPager)->has_crc ? PAGER_CRC_SZ : 0))
+/*
+** Maximum number of pages read at once by a prefetch request.
+*/
+#define PAGER_PREFETCH_MAX 256
 /*
  * Database page handle.
  * Each raw disk page is represented in memory by an instance
@@ -55485,6 +57668,10 @@ struct Pager
   int is_mem;                    /* True for an in-memory database */
   int is_rdonly;                 /* True for a read-only database */
   int no_jrnl;                   /* TRUE to omit journaling */
+  int has_crc;                   /* TRUE if every page ends with a CRC32C (format flag) */
+  int iSyncLevel;                /* Durability level (UNQLITE_SYNC_LEVEL_*) */
+  sxi64 nHit,nMiss;              /* Page cache hits and misses of unqlitePagerAcquire() */
+  sxi64 nSync;                   /* Number of file syncs issued */
   int iPageSize;                 /* Page size in bytes (default 4K) */
   int iSectorSize;               /* Size of a single sector on disk */
   unsigned char *zTmpPage;       /* Temporary page */
@@ -55492,6 +57679,7 @@ struct Pager
   Page *pDirty;                  /* Transient list of dirty pages */
   Page *pAll;                    /* List of all pages */
   Page *pHotDirty;               /* List of hot dirty pages */
+  Page *pCommit;                 /* Pages pinned by the commit in flight */
   Page *pFirstHot;               /* First hot dirty page */
   sxu32 nHot;                    /* Total number of hot dirty pages */
   Page **apHash;                 /* Page table */
@@ -55502,6 +57690,9 @@ struct Pager
 /* Control flags */
 #define PAGER_CTRL_COMMIT_ERR   0x001 /* Commit error */
 #define PAGER_CTRL_DIRTY_COMMIT 0x002 /* Dirty commit has been applied */ 
+#define PAGER_CTRL_PREPARED     0x004 /* Commit phase one done, the journal is kept */
+#define PAGER_CTRL_FLUSH        0x008 /* Commit phase one begun, pages to write */
+#define PAGER_CTRL_COMMITTING   0x010 /* Commit in flight, writers wait for its end */
 /*
 ** Read a 32-bit integer from the given file descriptor. 
 ** All values are stored on disk as big-endian.
@@ -55767,6 +57958,186 @@ static int pager_unlink_page(Pager *pPager,Page *pPage)
 	pPager->nPage--;
 	return UNQLITE_OK;
 }
+/*
+ * CRC32C (Castagnoli) used to seal database pages. The portable version
+ * processes 8 bytes per step with the slicing-by-8 tables below, the SSE4.2
+ * instruction is used instead when the host CPU supports it.
+ */
+#define PAGER_CRC32C_POLY 0x82F63B78
+#define PAGER_CRC32C_LANE 256  /* Bytes per lane of the interleaved SSE4.2 loop */
+static sxu32 aCrc32cTable[8][256];
+#if defined(__GNUC__) && defined(__x86_64__)
+/* Shift a CRC over 1 and 2 lanes of zeros (See pager_crc32c_shift()) */
+static sxu32 aCrc32cShift1[4][256];
+static sxu32 aCrc32cShift2[4][256];
+#endif
+static sxu32 pager_crc32c_sw(sxu32 iCrc,const unsigned char *zData,sxu32 nLen)
+{
+	const sxu32 (*T)[256] = (const sxu32 (*)[256])aCrc32cTable;
+	iCrc = ~iCrc;
+	while( nLen > 0 && ((sxuptr)zData & 7) ){
+		iCrc = T[0][(iCrc ^ *zData++) & 0xFF] ^ (iCrc >> 8);
+		nLen--;
+	}
+	while( nLen >= 8 ){
+		sxu32 iLo = iCrc ^ ((sxu32)zData[0] | ((sxu32)zData[1] << 8) | ((sxu32)zData[2] << 16) | ((sxu32)zData[3] << 24));
+		sxu32 iHi = (sxu32)zData[4] | ((sxu32)zData[5] << 8) | ((sxu32)zData[6] << 16) | ((sxu32)zData[7] << 24);
+		iCrc = T[7][iLo & 0xFF] ^ T[6][(iLo >> 8) & 0xFF] ^ T[5][(iLo >> 16) & 0xFF] ^ T[4][iLo >> 24]
+			^ T[3][iHi & 0xFF] ^ T[2][(iHi >> 8) & 0xFF] ^ T[1][(iHi >> 16) & 0xFF] ^ T[0][iHi >> 24];
+		zData += 8;
+		nLen -= 8;
+	}
+	while( nLen > 0 ){
+		iCrc = T[0][(iCrc ^ *zData++) & 0xFF] ^ (iCrc >> 8);
+		nLen--;
+	}
+	return ~iCrc;
+}
+#if defined(__GNUC__) && defined(__x86_64__)
+/*
+ * Multiply two polynomials modulo the CRC32C polynomial (reflected bit order).
+ */
+static sxu32 pager_crc32c_multmodp(sxu32 a,sxu32 b)
+{
+	sxu32 m = (sxu32)1 << 31;
+	sxu32 p = 0;
+	for(;;){
+		if( a & m ){
+			p ^= b;
+			if( (a & (m - 1)) == 0 ){
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ PAGER_CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+/*
+ * Fill the tables used to append nLen zero bytes to a CRC register.
+ */
+static void pager_crc32c_zeros(sxu32 aShift[4][256],sxu32 nLen)
+{
+	sxu32 iOp = (sxu32)1 << 31; /* x^0 */
+	sxu32 iSq = (sxu32)1 << 30; /* x^1, squared below */
+	sxu32 n,k;
+	/* x^(8*nLen) mod P */
+	nLen <<= 3;
+	while( nLen > 0 ){
+		if( nLen & 1 ){
+			iOp = pager_crc32c_multmodp(iSq,iOp);
+		}
+		iSq = pager_crc32c_multmodp(iSq,iSq);
+		nLen >>= 1;
+	}
+	for( k = 0 ; k < 4 ; k++ ){
+		for( n = 0 ; n < 256 ; n++ ){
+			aShift[k][n] = pager_crc32c_multmodp(iOp,n << (8 * k));
+		}
+	}
+}
+static sxu32 pager_crc32c_shift(sxu32 aShift[4][256],sxu32 iCrc)
+{
+	return aShift[0][iCrc & 0xFF] ^ aShift[1][(iCrc >> 8) & 0xFF] ^ aShift[2][(iCrc >> 16) & 0xFF] ^ aShift[3][iCrc >> 24];
+}
+/*
+ * The crc32 instruction has a latency of 3 cycles but a throughput of one
+ * per cycle, so large buffers are processed as three independent lanes
+ * whose registers are combined afterwards.
+ */
+__attribute__((target("sse4.2")))
+static sxu32 pager_crc32c_hw(sxu32 iCrc,const unsigned char *zData,sxu32 nLen)
+{
+	unsigned long long iAcc = (sxu32)~iCrc;
+	while( nLen > 0 && ((sxuptr)zData & 7) ){
+		iAcc = __builtin_ia32_crc32qi((sxu32)iAcc,*zData++);
+		nLen--;
+	}
+	while( nLen >= 3 * PAGER_CRC32C_LANE ){
+		const unsigned long long *pA = (const unsigned long long *)zData;
+		const unsigned long long *pB = (const unsigned long long *)&zData[PAGER_CRC32C_LANE];
+		const unsigned long long *pC = (const unsigned long long *)&zData[2 * PAGER_CRC32C_LANE];
+		unsigned long long iB = 0,iC = 0;
+		sxu32 n;
+		for( n = 0 ; n < PAGER_CRC32C_LANE / 8 ; n++ ){
+			iAcc = __builtin_ia32_crc32di(iAcc,pA[n]);
+			iB = __builtin_ia32_crc32di(iB,pB[n]);
+			iC = __builtin_ia32_crc32di(iC,pC[n]);
+		}
+		iAcc = pager_crc32c_shift(aCrc32cShift2,(sxu32)iAcc) ^ pager_crc32c_shift(aCrc32cShift1,(sxu32)iB) ^ (sxu32)iC;
+		zData += 3 * PAGER_CRC32C_LANE;
+		nLen -= 3 * PAGER_CRC32C_LANE;
+	}
+	while( nLen >= 8 ){
+		iAcc = __builtin_ia32_crc32di(iAcc,*(const unsigned long long *)zData); /* Aligned above */
+		zData += 8;
+		nLen -= 8;
+	}
+	while( nLen > 0 ){
+		iAcc = __builtin_ia32_crc32qi((sxu32)iAcc,*zData++);
+		nLen--;
+	}
+	return ~(sxu32)iAcc;
+}
+#endif
+static sxu32 (*xPagerCrc32c)(sxu32,const unsigned char *,sxu32) = pager_crc32c_sw;
+/*
+ * Build the slicing tables and pick the fastest implementation.
+ * Called once from unqliteCoreInitialize().
+ */
+UNQLITE_PRIVATE void unqlitePagerInitCrc32c(void)
+{
+	sxu32 n,k,iCrc;
+	for( n = 0 ; n < 256 ; n++ ){
+		iCrc = n;
+		for( k = 0 ; k < 8 ; k++ ){
+			iCrc = (iCrc & 1) ? (iCrc >> 1) ^ PAGER_CRC32C_POLY : iCrc >> 1;
+		}
+		aCrc32cTable[0][n] = iCrc;
+	}
+	for( n = 0 ; n < 256 ; n++ ){
+		iCrc = aCrc32cTable[0][n];
+		for( k = 1 ; k < 8 ; k++ ){
+			iCrc = aCrc32cTable[0][iCrc & 0xFF] ^ (iCrc >> 8);
+			aCrc32cTable[k][n] = iCrc;
+		}
+	}
+#if defined(__GNUC__) && defined(__x86_64__)
+	if( __builtin_cpu_supports("sse4.2") ){
+		pager_crc32c_zeros(aCrc32cShift1,PAGER_CRC32C_LANE);
+		pager_crc32c_zeros(aCrc32cShift2,2 * PAGER_CRC32C_LANE);
+		xPagerCrc32c = pager_crc32c_hw;
+	}
+#endif
+}
+/*
+ * Store the checksum of a page in its last 4 bytes (big-endian).
+ */
+static void pager_page_crc_seal(Pager *pPager,unsigned char *zData)
+{
+	sxu32 nUsable = (sxu32)(pPager->iPageSize - PAGER_CRC_SZ);
+	SyBigEndianPack32(&zData[nUsable],xPagerCrc32c(0,zData,nUsable));
+}
+/*
+ * Check the checksum of a page read from disk. Pages that were
+ * never written (all zero) are accepted as is.
+ */
+static int pager_page_crc_ok(Pager *pPager,const unsigned char *zData)
+{
+	sxu32 nUsable = (sxu32)(pPager->iPageSize - PAGER_CRC_SZ);
+	sxu32 iStored;
+	sxu32 n;
+	SyBigEndianUnpack32(&zData[nUsable],&iStored);
+	if( iStored == xPagerCrc32c(0,zData,nUsable) ){
+		return TRUE;
+	}
+	for( n = 0 ; n < (sxu32)pPager->iPageSize ; n++ ){
+		if( zData[n] ){
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
 /*
  * Update the content of a cached page.
  */
@@ -55801,6 +58172,10 @@ static int pager_get_page_contents(Pager *pPager,Page *pPage,int noContent)
 		/* Read content */
 		rc = unqliteOsRead(pPager->pfd,pPage->zData,pPager->iPageSize,pPage->pgno * pPager->iPageSize);
 	}
+	if( rc == UNQLITE_OK && pPager->has_crc && !pager_page_crc_ok(pPager,pPage->zData) ){
+		unqliteGenErrorFormat(pPager->pDb,"Checksum mismatch on page %qd of '%s'",pPage->pgno,pPager->zFilename);
+		rc = UNQLITE_CORRUPT;
+	}
 	return rc;
 }
 /*
@@ -56014,7 +58389,7 @@ static Page * pager_get_hot_pages(Pager *pPager)
 ** - 4 bytes: Random number used for page hash.
 ** - 8 bytes: Initial database page count.
 ** - 4 bytes: Sector size used by the process that wrote this journal.
-** - 4 bytes: Database page size.
+** - 4 bytes: Database page size (PAGER_FMT_PAGE_CRC set if pages carry a CRC32C).
 ** 
 ** Followed by (JOURNAL_HDR_SZ - 28) bytes of unused space.
 */
@@ -56091,6 +58466,9 @@ static int pager_read_journal_header(
 	if( rc != UNQLITE_OK ){
 		return rc;
 	}
+	/* The record checksums depend on the page format */
+	pPager->has_crc = (iPageSize & PAGER_FMT_PAGE_CRC) != 0;
+	iPageSize &= ~PAGER_FMT_PAGE_CRC;
 	/* Check that the values read from the page-size and sector-size fields
     ** are within range. To be 'in range', both values need to be a power
     ** of two greater than or equal to 512 or 32, and not greater than their 
@@ -56142,8 +58520,8 @@ static int pager_write_journal_header(Pager *pPager,unsigned char *zBuf)
 	/* 4 bytes: Sector size used by the process that wrote this journal. */
 	SyBigEndianPack32(zPtr,(sxu32)pPager->iSectorSize);
 	zPtr += 4;
-	/* 4 bytes: Database page size. */
-	SyBigEndianPack32(zPtr,(sxu32)pPager->iPageSize);
+	/* 4 bytes: Database page size and format flag. */
+	SyBigEndianPack32(zPtr,(sxu32)pPager->iPageSize | (pPager->has_crc ? PAGER_FMT_PAGE_CRC : 0));
 	return UNQLITE_OK;
 }
 /*
@@ -56157,7 +58535,8 @@ static int pager_write_journal_header(Pager *pPager,unsigned char *zBuf)
 ** Each byte is interpreted as an 8-bit unsigned integer.
 **
 ** Changing the formula used to compute this checksum results in an
-** incompatible journal file format.
+** incompatible journal file format. Databases whose pages carry a CRC32C
+** use a full CRC32C (seeded with the same random value) instead.
 **
 ** If journal corruption occurs due to a power failure, the most likely 
 ** scenario is that one end or the other of the record will be changed. 
@@ -56169,6 +58548,9 @@ static sxu32 pager_cksum(Pager *pPager,const unsigned char *zData)
 {
   sxu32 cksum = pPager->cksumInit;         /* Checksum value to return */
   int i = pPager->iPageSize-200;          /* Loop counter */
+  if( pPager->has_crc ){
+    return xPagerCrc32c(cksum,zData,(sxu32)pPager->iPageSize);
+  }
   while( i>0 ){
     cksum += zData[i];
     i -= 200;
@@ -56176,6 +58558,31 @@ static sxu32 pager_cksum(Pager *pPager,const unsigned char *zData)
   return cksum;
 }
 /*
+** Reasons for syncing a file, see pager_sync().
+*/
+#define PAGER_SYNC_JOURNAL 1 /* Journal content, before the database is written */
+#define PAGER_SYNC_ORDER   2 /* Database pages written ahead of the commit */
+#define PAGER_SYNC_COMMIT  3 /* Database file at the end of a commit or of a rollback */
+/*
+** Sync a file according to the durability level of the pager.
+** The commit level keeps only the final sync of the database file,
+** as a data-only sync. The none level never syncs.
+*/
+static int pager_sync(Pager *pPager,unqlite_file *pFile,int iReason,int flags)
+{
+	if( pPager->iSyncLevel == UNQLITE_SYNC_LEVEL_NONE ){
+		return UNQLITE_OK;
+	}
+	if( pPager->iSyncLevel == UNQLITE_SYNC_LEVEL_COMMIT ){
+		if( iReason != PAGER_SYNC_COMMIT ){
+			return UNQLITE_OK;
+		}
+		flags = UNQLITE_SYNC_NORMAL|UNQLITE_SYNC_DATAONLY;
+	}
+	pPager->nSync++;
+	return unqliteOsSync(pFile,flags);
+}
+/*
 ** Read a single page from the journal file opened on file descriptor
 ** jfd. Playback this one page. Update the offset to read from.
 */
@@ -56309,7 +58716,7 @@ end_playback:
 	SyMemBackendFree(pPager->pAllocator,(void *)zTmp);
 	if( rc == UNQLITE_OK ){
 		/* Sync the database file */
-		unqliteOsSync(pPager->pfd,UNQLITE_SYNC_FULL);
+		pager_sync(pPager,pPager->pfd,PAGER_SYNC_COMMIT,UNQLITE_SYNC_FULL);
 	}
 	if( rc == UNQLITE_DONE ){
 		rc = UNQLITE_OK;
@@ -56500,7 +58907,7 @@ static int pager_journal_rollback(Pager *pPager,int check_hot)
 		goto fail;
 	}
 	/* Sync the journal file */
-	unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
+	pager_sync(pPager,pPager->pjfd,PAGER_SYNC_JOURNAL,UNQLITE_SYNC_NORMAL);
 	/* Finally rollback the database */
 	rc = pager_playback(pPager);
 	/* Switch back to shared lock */
@@ -56542,8 +58949,8 @@ static int pager_write_db_header(Pager *pPager)
 	/* Sector size */
 	SyBigEndianPack32(zRaw,(sxu32)pPager->iSectorSize);
 	zRaw += 4; /* 4 byte sector size */
-	/* Page size */
-	SyBigEndianPack32(zRaw,(sxu32)pPager->iPageSize);
+	/* Page size and format flag */
+	SyBigEndianPack32(zRaw,(sxu32)pPager->iPageSize | (pPager->has_crc ? PAGER_FMT_PAGE_CRC : 0));
 	zRaw += 4; /* 4 byte page size */
 	/* Key value storage engine */
 	nLen = (sxu16)SyStrlen(pEngine->pIo->pMethods->zName);
@@ -56583,9 +58990,11 @@ static int pager_extract_header(Pager *pPager,const unsigned char *zRaw,sxu32 nB
 	/* Sector size */
 	SyBigEndianUnpack32(zRaw,(sxu32 *)&pPager->iSectorSize);
 	zRaw += 4; /* 4 byte sector size */
-	/* Page size */
+	/* Page size and format flag */
 	SyBigEndianUnpack32(zRaw,(sxu32 *)&pPager->iPageSize);
 	zRaw += 4; /* 4 byte page size */
+	pPager->has_crc = (pPager->iPageSize & PAGER_FMT_PAGE_CRC) != 0;
+	pPager->iPageSize &= ~PAGER_FMT_PAGE_CRC;
 	/* Check that the values read from the page-size and sector-size fields
     ** are within range. To be 'in range', both values need to be a power
     ** of two greater than or equal to 512 or 32, and not greater than their 
@@ -56667,6 +59076,8 @@ static int pager_read_db_header(Pager *pPager)
 		/* Set a default page and sector size */
 		pPager->iSectorSize = GetSectorSize(pPager->pfd);
 		pPager->iPageSize = unqliteGetPageSize();
+		/* Page format of the new database */
+		pPager->has_crc = !pPager->is_mem && (pPager->iOpenFlags & UNQLITE_OPEN_PAGE_CRC) != 0;
 		SyStringInitFromBuf(&pPager->sKv,pPager->pEngine->pIo->pMethods->zName,SyStrlen(pPager->pEngine->pIo->pMethods->zName));
 		pPager->dbSize = 0;
 	}
@@ -56923,17 +59334,11 @@ static int unqliteFinalizeJournal(Pager *pPager,int *pRetry,int close_jrnl)
 			rc = UNQLITE_OK;
 		}
 	}
-	/* Sync the journal and close it */
-	rc = unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
-	if( close_jrnl ){
-		/* close the journal file */
-		if( UNQLITE_OK != unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd) ){
-			if( rc != UNQLITE_OK /* unqliteOsSync */ ){
-				return rc;
-			}
-		}
-		pPager->pjfd = 0;
+	if( !close_jrnl ){
+		/* Sync the journal */
+		pager_sync(pPager,pPager->pjfd,PAGER_SYNC_JOURNAL,UNQLITE_SYNC_NORMAL);
 	}
+	/* Otherwise, the final commit syncs and closes it (See pager_commit_begin()) */
 	if( (*pRetry) == 1 ){
 		if( pager_lock_db(pPager,EXCLUSIVE_LOCK) == UNQLITE_OK ){
 			/* Got exclusive lock */
@@ -56989,51 +59394,6 @@ static int page_write(Pager *pPager,Page *pPage)
 	return UNQLITE_OK;
 }
 /*
-** The argument is the first in a linked list of dirty pages connected
-** by the PgHdr.pDirty pointer. This function writes each one of the
-** in-memory pages in the list to the database file. The argument may
-** be NULL, representing an empty list. In this case this function is
-** a no-op.
-**
-** The pager must hold at least a RESERVED lock when this function
-** is called. Before writing anything to the database file, this lock
-** is upgraded to an EXCLUSIVE lock. If the lock cannot be obtained,
-** UNQLITE_BUSY is returned and no data is written to the database file.
-*/
-static int pager_write_dirty_pages(Pager *pPager,Page *pDirty)
-{
-	int rc = UNQLITE_OK;
-	Page *pNext;
-	for(;;){
-		if( pDirty == 0 ){
-			break;
-		}
-		/* Point to the next dirty page */
-		pNext = pDirty->pDirtyPrev; /* Not a bug: Reverse link */
-		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
-			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
-			if( rc != UNQLITE_OK ){
-				/* A rollback should be done */
-				break;
-			}
-		}
-		/* Remove stale flags */
-		pDirty->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
-		if( pDirty->nRef < 1 ){
-			/* Unlink the page now it is unused */
-			pager_unlink_page(pPager,pDirty);
-			/* Release the page */
-			pager_release_page(pPager,pDirty);
-		}
-		/* Point to the next page */
-		pDirty = pNext;
-	}
-	pPager->pDirty = pPager->pFirstDirty = 0;
-	pPager->pHotDirty = pPager->pFirstHot = 0;
-	pPager->nHot = 0;
-	return rc;
-}
-/*
 ** The argument is the first in a linked list of hot dirty pages connected
 ** by the PgHdr.pHotDirty pointer. This function writes each one of the
 ** in-memory pages in the list to the database file. The argument may
@@ -57055,7 +59415,19 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}
 		/* Point to the next page */
 		pNext = pDirty->pPrevHot; /* Not a bug: Reverse link */
+		if( pDirty->nRef > 0 ){
+			/* Referenced again since it was made hot and the caller may still
+			 * modify it without a new write request. Leave it on the dirty list.
+			 */
+			pDirty->flags &= ~PAGE_HOT_DIRTY;
+			pDirty->pNextHot = pDirty->pPrevHot = 0;
+			pDirty = pNext;
+			continue;
+		}
 		if( (pDirty->flags & PAGE_DONT_WRITE) == 0 ){
+			if( pPager->has_crc ){
+				pager_page_crc_seal(pPager,pDirty->zData);
+			}
 			rc = unqliteOsWrite(pPager->pfd,pDirty->zData,pPager->iPageSize,pDirty->pgno * pPager->iPageSize);
 			if( rc != UNQLITE_OK ){
 				break;
@@ -57084,12 +59456,23 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 	return rc;
 }
 /*
- * Commit a transaction: Phase one.
+ * Commit a transaction: Phase one. It runs in three steps so that the
+ * file IO can be done without the DB mutex (See unqliteDbCommit()):
+ *
+ *   pager_commit_begin() finalizes the journal and pins the dirty pages,
+ *   pager_commit_flush() syncs the journal, writes the pinned pages and
+ *                        syncs the database file,
+ *   pager_commit_end()   closes the journal and unpins the pages.
+ *
+ * The pinned pages are the version being committed. They stay in the
+ * cache, unchanged since writers wait for the end of the commit, so
+ * readers keep reading that version from the cache while it is written.
+ * The pages not in the cache are not written and are read from disk.
  */
-static int pager_commit_phase1(Pager *pPager)
+static int pager_commit_begin(Pager *pPager)
 {
 	int get_excl = 0;
-	Page *pDirty;
+	Page *pDirty,*pPage;
 	int rc;
 	/* If no database changes have been made, return early. */
 	if( pPager->iState < PAGER_WRITER_CACHEMOD ){
@@ -57119,18 +59502,42 @@ static int pager_commit_phase1(Pager *pPager)
 			return rc;
 		}
 	}
+	/* Seal and pin the dirty pages */
+	for( pPage = pDirty ; pPage ; pPage = pPage->pDirtyPrev /* Not a bug: Reverse link */ ){
+		if( pPager->has_crc && (pPage->flags & PAGE_DONT_WRITE) == 0 ){
+			pager_page_crc_seal(pPager,pPage->zData);
+		}
+		page_ref(pPage);
+	}
+	pPager->pCommit = pDirty;
+	pPager->iFlags |= PAGER_CTRL_FLUSH;
+	return UNQLITE_OK;
+}
+/*
+ * Write the pages pinned by pager_commit_begin(). Only the files and the
+ * pinned pages are used here, so the DB mutex need not be held.
+ */
+static int pager_commit_flush(Pager *pPager)
+{
+	Page *pPage;
+	int rc;
+	if( pPager->pjfd ){
+		/* Sync the journal before any page is overwritten */
+		pager_sync(pPager,pPager->pjfd,PAGER_SYNC_JOURNAL,UNQLITE_SYNC_NORMAL);
+	}
 	if( pPager->iFlags & PAGER_CTRL_DIRTY_COMMIT ){
 		/* Synce the database first if a dirty commit have been applied */
-		unqliteOsSync(pPager->pfd,UNQLITE_SYNC_NORMAL);
+		pager_sync(pPager,pPager->pfd,PAGER_SYNC_ORDER,UNQLITE_SYNC_NORMAL);
 	}
 	/* Write the dirty pages */
-	rc = pager_write_dirty_pages(pPager,pDirty);
-	if( rc != UNQLITE_OK ){
-		/* Rollback your DB */
-		pPager->iFlags |= PAGER_CTRL_COMMIT_ERR;
-		pPager->pFirstDirty = pDirty;
-		unqliteGenError(pPager->pDb,"IO error while writing dirty pages, rollback your database");
-		return rc;
+	for( pPage = pPager->pCommit ; pPage ; pPage = pPage->pDirtyPrev ){
+		if( (pPage->flags & PAGE_DONT_WRITE) == 0 ){
+			rc = unqliteOsWrite(pPager->pfd,pPage->zData,pPager->iPageSize,pPage->pgno * pPager->iPageSize);
+			if( rc != UNQLITE_OK ){
+				/* A rollback should be done */
+				return rc;
+			}
+		}
 	}
 	/* If the file on disk is not the same size as the database image,
      * then use unqliteOsTruncate to grow or shrink the file here.
@@ -57139,12 +59546,55 @@ static int pager_commit_phase1(Pager *pPager)
 		unqliteOsTruncate(pPager->pfd,pPager->iPageSize * pPager->dbSize);
 	}
 	/* Sync the database file */
-	unqliteOsSync(pPager->pfd,UNQLITE_SYNC_FULL);
+	pager_sync(pPager,pPager->pfd,PAGER_SYNC_COMMIT,UNQLITE_SYNC_FULL);
+	return UNQLITE_OK;
+}
+/*
+ * Close the journal and unpin the pages written by pager_commit_flush().
+ * rc is the result of the flush.
+ */
+static int pager_commit_end(Pager *pPager,int rc)
+{
+	Page *pPage,*pNext;
+	pPage = pPager->pCommit;
+	pPager->pCommit = 0;
+	pPager->iFlags &= ~PAGER_CTRL_FLUSH;
+	if( pPager->pjfd ){
+		/* close the journal file */
+		unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
+		pPager->pjfd = 0;
+	}
+	if( rc != UNQLITE_OK ){
+		/* The pages stay dirty until the rollback */
+		for( ; pPage ; pPage = pPage->pDirtyPrev ){
+			pPage->nRef--;
+		}
+		pPager->iFlags |= PAGER_CTRL_COMMIT_ERR;
+		unqliteGenError(pPager->pDb,"IO error while writing dirty pages, rollback your database");
+		return rc;
+	}
+	for( ; pPage ; pPage = pNext ){
+		pNext = pPage->pDirtyPrev; /* Not a bug: Reverse link */
+		/* Remove stale flags */
+		pPage->flags &= ~(PAGE_DIRTY|PAGE_DONT_WRITE|PAGE_NEED_SYNC|PAGE_IN_JOURNAL|PAGE_HOT_DIRTY);
+		/* Release the page now if it is unused */
+		page_unref(pPage);
+	}
+	pPager->pDirty = pPager->pFirstDirty = 0;
+	pPager->pHotDirty = pPager->pFirstHot = 0;
+	pPager->nHot = 0;
 	/* Remove stale flags */
 	pPager->iJournalOfft = 0;
 	pPager->nRec = 0;
 	return UNQLITE_OK;
 }
+/*
+ * True if the commit has a journal file to unlink in phase two.
+ */
+static int pager_has_journal(Pager *pPager)
+{
+	return !pPager->is_mem && !pPager->no_jrnl && pPager->iState > PAGER_READER;
+}
 /*
  * Commit a transaction: Phase two.
  */
@@ -57155,10 +59605,7 @@ static int pager_commit_phase2(Pager *pPager)
 			return UNQLITE_OK;
 		}
 		if( pPager->iState != PAGER_READER ){
-			if( !pPager->no_jrnl ){
-				/* Finally, unlink the journal file */
-				unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
-			}
+			/* The journal file was unlinked by unqlitePagerCommitFlush() */
 			/* Downgrade to shraed lock */
 			pager_unlock_db(pPager,SHARED_LOCK);
 			pPager->iState = PAGER_READER;
@@ -57225,28 +59672,95 @@ static int pager_dirty_commit(Pager *pPager)
 **   * the database file is truncated (if required), and
 **   * the database file synced.
 **   * the journal file is deleted.
+**
+** With bPrepare, it does commit phase one only: the dirty pages are
+** written and synced but the journal is kept, so the transaction is
+** rolled back by [unqlite_rollback()] or when the database is next opened,
+** until [unqlite_commit()] removes it. This lets a caller commit several
+** databases as a whole.
+**
+** The commit is split in three calls. unqlitePagerCommitBegin() puts the
+** commit in flight when there is file IO to do (See unqlitePagerInCommit()).
+** unqlitePagerCommitFlush() does the IO and can be called without the DB
+** mutex. unqlitePagerCommitEnd() completes the commit with its result.
 */
-UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager)
+UNQLITE_PRIVATE int unqlitePagerCommitBegin(Pager *pPager,int bPrepare)
 {
 	int rc;
-	/* Commit: Phase One */
-	rc = pager_commit_phase1(pPager);
+	if( (pPager->iFlags & PAGER_CTRL_PREPARED) == 0 ){
+		/* Commit: Phase One */
+		rc = pager_commit_begin(pPager);
+		if( rc != UNQLITE_OK ){
+			/* Disable the auto-commit flag */
+			pPager->pDb->iFlags |= UNQLITE_FL_DISABLE_AUTO_COMMIT;
+			return rc;
+		}
+	}
+	if( (pPager->iFlags & PAGER_CTRL_FLUSH) || (!bPrepare && pager_has_journal(pPager)) ){
+		pPager->iFlags |= PAGER_CTRL_COMMITTING;
+	}
+	return UNQLITE_OK;
+}
+UNQLITE_PRIVATE int unqlitePagerCommitFlush(Pager *pPager,int bPrepare)
+{
+	int rc = UNQLITE_OK;
+	if( pPager->iFlags & PAGER_CTRL_FLUSH ){
+		rc = pager_commit_flush(pPager);
+	}
+	if( rc == UNQLITE_OK && !bPrepare && pager_has_journal(pPager) ){
+		/* Commit: Phase Two. Finally, unlink the journal file */
+		unqliteOsDelete(pPager->pVfs,pPager->zJournal,1);
+	}
+	return rc;
+}
+UNQLITE_PRIVATE int unqlitePagerCommitEnd(Pager *pPager,int rc,int bPrepare)
+{
+	pPager->iFlags &= ~PAGER_CTRL_COMMITTING;
+	if( pPager->iFlags & PAGER_CTRL_FLUSH ){
+		rc = pager_commit_end(pPager,rc);
+	}
 	if( rc != UNQLITE_OK ){
-		goto fail;
+		/* Disable the auto-commit flag */
+		pPager->pDb->iFlags |= UNQLITE_FL_DISABLE_AUTO_COMMIT;
+		return rc;
+	}
+	if( bPrepare ){
+		if( pPager->iState >= PAGER_WRITER_CACHEMOD && !pPager->is_mem ){
+			pPager->iFlags |= PAGER_CTRL_PREPARED;
+		}
+		return UNQLITE_OK;
 	}
 	/* Commit: Phase Two */
 	rc = pager_commit_phase2(pPager);
 	if( rc != UNQLITE_OK ){
-		goto fail;
+		pPager->pDb->iFlags |= UNQLITE_FL_DISABLE_AUTO_COMMIT;
+		return rc;
 	}
 	/* Remove stale flags */
-	pPager->iFlags &= ~PAGER_CTRL_COMMIT_ERR;
+	pPager->iFlags &= ~(PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_PREPARED);
 	/* All done */
 	return UNQLITE_OK;
-fail:
-	/* Disable the auto-commit flag */
-	pPager->pDb->iFlags |= UNQLITE_FL_DISABLE_AUTO_COMMIT;
-	return rc;
+}
+/*
+ * True while a commit is in flight, between unqlitePagerCommitBegin()
+ * and unqlitePagerCommitEnd().
+ */
+UNQLITE_PRIVATE int unqlitePagerInCommit(Pager *pPager)
+{
+	return (pPager->iFlags & PAGER_CTRL_COMMITTING) != 0;
+}
+/*
+ * Commit a transaction in one go (See unqlitePagerCommitBegin()).
+ */
+UNQLITE_PRIVATE int unqlitePagerCommit(Pager *pPager)
+{
+	int rc;
+	rc = unqlitePagerCommitBegin(pPager,FALSE);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = unqlitePagerCommitFlush(pPager,FALSE);
+	return unqlitePagerCommitEnd(pPager,rc,FALSE);
 }
 /*
  * Reset the pager to its initial state. This is caused by
@@ -57259,7 +59773,7 @@ static int pager_reset_state(Pager *pPager,int bResetKvEngine)
 	const unqlite_kv_io *pIo;
 	int rc;
 	/* Remove stale flags */
-	pPager->iFlags &= ~(PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT);
+	pPager->iFlags &= ~(PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT|PAGER_CTRL_PREPARED);
 	pPager->iJournalOfft = 0;
 	pPager->nRec = 0;
 	/* Database original size */
@@ -57306,7 +59820,7 @@ static int pager_reset_state(Pager *pPager,int bResetKvEngine)
 		pEngine->pIo = pIo;
 		if( pIo->pMethods->xInit ){
 			/* Call the init method */
-			rc = pIo->pMethods->xInit(pEngine,pPager->iPageSize);
+			rc = pIo->pMethods->xInit(pEngine,PAGER_USABLE_SIZE(pPager));
 			if( rc != UNQLITE_OK ){
 				return rc;
 			}
@@ -57361,11 +59875,11 @@ UNQLITE_PRIVATE int unqlitePagerRollback(Pager *pPager,int bResetKvEngine)
 			/* Close any outstanding joural file */
 			if( pPager->pjfd ){
 				/* Sync the journal file */
-				unqliteOsSync(pPager->pjfd,UNQLITE_SYNC_NORMAL);
+				pager_sync(pPager,pPager->pjfd,PAGER_SYNC_JOURNAL,UNQLITE_SYNC_NORMAL);
 			}
 			unqliteOsCloseFree(pPager->pAllocator,pPager->pjfd);
 			pPager->pjfd = 0;
-			if( pPager->iFlags & (PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT) ){
+			if( pPager->iFlags & (PAGER_CTRL_COMMIT_ERR|PAGER_CTRL_DIRTY_COMMIT|PAGER_CTRL_PREPARED) ){
 				/* Perform the rollback */
 				rc = pager_journal_rollback(pPager,0);
 				if( rc != UNQLITE_OK ){
@@ -57475,6 +59989,7 @@ static int unqlitePagerAcquire(
 		return pPage ? UNQLITE_OK : UNQLITE_NOTFOUND;
 	}
 	if( pPage == 0 ){
+		pPager->nMiss++;
 		/* Allocate a new page */
 		pPage = pager_alloc_page(pPager,pgno);
 		if( pPage == 0 ){
@@ -57490,6 +60005,7 @@ static int unqlitePagerAcquire(
 		/* Link the page */
 		pager_link_page(pPager,pPage);
 	}else{
+		pPager->nHit++;
 		if( ppPage ){
 			page_ref(pPage);
 		}
@@ -57500,6 +60016,129 @@ static int unqlitePagerAcquire(
 	}
 	return UNQLITE_OK;
 }
+/*
+ * Read a run of pages ahead of time with a single request so that the
+ * operating system caches them before they are acquired one by one.
+ * Pages already in the pager cache are skipped and the content is thrown
+ * away: it is checked when the pages are actually loaded. This is only a
+ * hint, IO errors are ignored.
+ */
+static int unqlitePagerPrefetch(Pager *pPager,pgno iFirst,pgno nPage)
+{
+	unsigned char *zBuf;
+	pgno iEnd,nRead;
+	int rc;
+	if( pPager->is_mem || (pPager->iOpenFlags & UNQLITE_OPEN_MMAP) ){
+		/* Nothing to read ahead */
+		return UNQLITE_OK;
+	}
+	rc = pager_shared_lock(pPager);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	iEnd = iFirst + nPage;
+	if( iEnd > pPager->dbSize ){
+		iEnd = pPager->dbSize;
+	}
+	/* Trim the cached pages at both ends */
+	while( iFirst < iEnd && pager_fetch_page(pPager,iFirst) ){
+		iFirst++;
+	}
+	while( iEnd > iFirst && pager_fetch_page(pPager,iEnd - 1) ){
+		iEnd--;
+	}
+	if( iFirst >= iEnd ){
+		return UNQLITE_OK;
+	}
+	nRead = iEnd - iFirst > PAGER_PREFETCH_MAX ? PAGER_PREFETCH_MAX : iEnd - iFirst;
+	zBuf = (unsigned char *)SyMemBackendAlloc(pPager->pAllocator,(sxu32)nRead * (sxu32)pPager->iPageSize);
+	if( zBuf == 0 ){
+		return UNQLITE_NOMEM;
+	}
+	while( iFirst < iEnd ){
+		if( nRead > iEnd - iFirst ){
+			nRead = iEnd - iFirst;
+		}
+		unqliteOsRead(pPager->pfd,zBuf,(unqlite_int64)nRead * pPager->iPageSize,iFirst * pPager->iPageSize);
+		iFirst += nRead;
+	}
+	SyMemBackendFree(pPager->pAllocator,zBuf);
+	return UNQLITE_OK;
+}
+/*
+ * Shrink the database image to nPage pages.
+ * The original content of every page past the new end of file is written
+ * to the journal first so that a rollback can restore it. The file itself
+ * is truncated during the commit (See pager_commit_flush()).
+ */
+static int unqlitePagerTruncate(Pager *pPager,pgno nPage)
+{
+	unqlite_page *pRaw;
+	pgno iNum;
+	int rc;
+	if( pPager->is_rdonly ){
+		unqliteGenError(pPager->pDb,"Read-Only database");
+		return UNQLITE_READ_ONLY;
+	}
+	if( nPage < 2 || nPage >= pPager->dbSize ){
+		/* Nothing to truncate (Page one is never dropped) */
+		return UNQLITE_OK;
+	}
+	for( iNum = nPage ; iNum < pPager->dbOrigSize && iNum < pPager->dbSize ; ++iNum ){
+		if( pPager->pVec && unqliteBitvecTest(pPager->pVec,iNum) ){
+			/* Already journalled */
+			continue;
+		}
+		rc = unqlitePagerAcquire(pPager,iNum,&pRaw,0,0);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+		rc = unqlitePageWrite(pRaw);
+		page_unref((Page *)pRaw);
+		if( rc != UNQLITE_OK ){
+			return rc;
+		}
+	}
+	/* Reflect the change */
+	pPager->dbSize = nPage;
+	return UNQLITE_OK;
+}
+/*
+ * Exchange the page numbers of two in-memory pages.
+ * Both pages are journalled under their current numbers first, so the
+ * content of each page is written to the other location on commit.
+ * The in-memory page objects (and any pUserData attached to them) are
+ * left untouched.
+ */
+static int unqlitePagerSwapPage(Page *pA,Page *pB)
+{
+	Pager *pPager = pA->pPager;
+	pgno iNum;
+	int rc;
+	if( pA == pB ){
+		return UNQLITE_OK;
+	}
+	/* Make both pages writable */
+	rc = unqlitePageWrite((unqlite_page *)pA);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	rc = unqlitePageWrite((unqlite_page *)pB);
+	if( rc != UNQLITE_OK ){
+		return rc;
+	}
+	/* Rehash under the new numbers */
+	pager_unlink_page(pPager,pA);
+	pager_unlink_page(pPager,pB);
+	pA->pNext = pA->pPrev = pA->pNextCollide = pA->pPrevCollide = 0;
+	pB->pNext = pB->pPrev = pB->pNextCollide = pB->pPrevCollide = 0;
+	iNum = pA->pgno;
+	pA->pgno = pB->pgno;
+	pB->pgno = iNum;
+	pager_link_page(pPager,pA);
+	pager_link_page(pPager,pB);
+	return UNQLITE_OK;
+}
 /*
  * Return true if we are dealing with an in-memory database.
  */
@@ -57657,6 +60296,37 @@ fail:
 	SyMemBackendFree(&pDb->sMem,pIo);
 	return rc;
 }
+/*
+ * Install the named KV storage engine before the database is first used.
+ * An existing database keeps the engine recorded in its header, which is
+ * installed back when the header is read. The in-memory engine needs an
+ * in-memory database since it never writes a page.
+ */
+UNQLITE_PRIVATE int unqlitePagerSetKvEngine(Pager *pPager,const char *zName)
+{
+	unqlite_kv_methods *pMethods;
+	if( zName == 0 ){
+		return UNQLITE_INVALID;
+	}
+	pMethods = unqliteFindKVStore(zName,SyStrlen(zName));
+	if( pMethods == 0 ){
+		unqliteGenErrorFormat(pPager->pDb,"No such Key/Value storage engine '%s'",zName);
+		return UNQLITE_NOTIMPLEMENTED;
+	}
+	if( pPager->pEngine && pMethods == pPager->pEngine->pIo->pMethods ){
+		/* Already installed */
+		return UNQLITE_OK;
+	}
+	if( pPager->iState != PAGER_OPEN || pPager->dbSize > 0 ){
+		unqliteGenError(pPager->pDb,"Cannot change the Key/Value storage engine of a database in use");
+		return UNQLITE_LOCKED;
+	}
+	if( !pPager->is_mem && pMethods == unqliteFindKVStore("mem",sizeof("mem") - 1) ){
+		unqliteGenError(pPager->pDb,"The in-memory Key/Value storage engine needs an in-memory database");
+		return UNQLITE_INVALID;
+	}
+	return unqlitePagerRegisterKvEngine(pPager,pMethods);
+}
 /*
  * Return the underlying KV storage engine instance.
  */
@@ -57749,6 +60419,7 @@ UNQLITE_PRIVATE int unqlitePagerOpen(
 	SyRandomness(&pPager->sPrng,(void *)&pPager->cksumInit,sizeof(sxu32));
 	/* Unlimited cache size */
 	pPager->nCacheMax = SXU32_HIGH;
+	pPager->iSyncLevel = UNQLITE_SYNC_LEVEL_FULL;
 	/* Copy filename and journal name */
 	if( !is_mem ){
 		pPager->zFilename = (char *)&pPager[1];
@@ -57807,6 +60478,45 @@ UNQLITE_PRIVATE int unqlitePagerSetCachesize(Pager *pPager,int mxPage)
 	pPager->nCacheMax = mxPage;
 	return UNQLITE_OK;
 }
+/*
+ * Set the durability level of the commits (See pager_sync()).
+ */
+UNQLITE_PRIVATE int unqlitePagerSetSyncLevel(Pager *pPager,int iLevel)
+{
+	if( iLevel < UNQLITE_SYNC_LEVEL_NONE || iLevel > UNQLITE_SYNC_LEVEL_FULL ){
+		return UNQLITE_INVALID;
+	}
+	pPager->iSyncLevel = iLevel;
+	return UNQLITE_OK;
+}
+/*
+ * Page cache and sync counters. Any of the pointers may be NULL.
+ */
+UNQLITE_PRIVATE void unqlitePagerStats(Pager *pPager,sxi64 *pnHit,sxi64 *pnMiss,sxi64 *pnSync)
+{
+	if( pnHit ){
+		*pnHit = pPager->nHit;
+	}
+	if( pnMiss ){
+		*pnMiss = pPager->nMiss;
+	}
+	if( pnSync ){
+		*pnSync = pPager->nSync;
+	}
+}
+/*
+ * Count a fetch served from the cache without the handle mutex (See
+ * unqliteDbFetchShared()). Several of them may count at once, never
+ * along with the calls that hold the mutex.
+ */
+UNQLITE_PRIVATE void unqlitePagerCountHit(Pager *pPager)
+{
+#if defined(UNQLITE_SHARED_FETCH)
+	__atomic_fetch_add(&pPager->nHit,1,__ATOMIC_RELAXED);
+#else
+	pPager->nHit++;
+#endif
+}
 /*
  * Shutdown the page cache. Free all memory and close the database file.
  */
@@ -57866,13 +60576,28 @@ static int unqliteKvIoPageGet(unqlite_kv_handle pHandle,pgno iNum,unqlite_page *
 	return rc;
 }
 /* 
- * Refer to [unqlitePagerAcquire()]
+ * Look up a page in the cache only. Nothing is read, locked or referenced,
+ * so the fetches from the cache can call it at once under the shared side
+ * of the handle lock (See unqliteDbFetchShared()). The cached page cannot
+ * be released before they leave it. The lookups are not counted as cache
+ * hits, the fetch is (See unqlitePagerCountHit()).
  */
 static int unqliteKvIoPageLookup(unqlite_kv_handle pHandle,pgno iNum,unqlite_page **ppPage)
 {
-	int rc;
-	rc = unqlitePagerAcquire((Pager *)pHandle,iNum,ppPage,1,0);
-	return rc;
+	Pager *pPager = (Pager *)pHandle;
+	Page *pPage;
+	if( pPager->iState == PAGER_OPEN ){
+		/* Nothing is cached before the first shared lock */
+		return UNQLITE_NOTFOUND;
+	}
+	pPage = pager_fetch_page(pPager,iNum);
+	if( pPage == 0 ){
+		return UNQLITE_NOTFOUND;
+	}
+	if( ppPage ){
+		*ppPage = (unqlite_page *)pPage;
+	}
+	return UNQLITE_OK;
 }
 /* 
  * Refer to [unqlitePagerAcquire()]
@@ -57981,7 +60706,8 @@ static int unqliteKvIoReadOnly(unqlite_kv_handle pHandle)
  */
 static int unqliteKvIoPageSize(unqlite_kv_handle pHandle)
 {
-	return ((Pager *)pHandle)->iPageSize;
+	/* Usable size, without the page checksum if any */
+	return PAGER_USABLE_SIZE((Pager *)pHandle);
 }
 /* 
  * Refer to the declaration of the [Pager] structure
@@ -58017,6 +60743,44 @@ static void unqliteKvIoErr(unqlite_kv_handle pHandle,const char *zErr)
 	Pager *pPager = (Pager *)pHandle;
 	unqliteGenError(pPager->pDb,zErr);
 }
+/* 
+ * Total number of pages in the database image.
+ * Refer to the declaration of the [Pager] structure
+ */
+static pgno unqliteKvIoPageCount(unqlite_kv_handle pHandle)
+{
+	return ((Pager *)pHandle)->dbSize;
+}
+/* 
+ * Refer to [unqlitePagerTruncate()]
+ */
+static int unqliteKvIoTruncate(unqlite_kv_handle pHandle,pgno nPage)
+{
+	int rc;
+	rc = unqlitePagerTruncate((Pager *)pHandle,nPage);
+	return rc;
+}
+/* 
+ * Refer to [unqlitePagerPrefetch()]
+ */
+static int unqliteKvIoPrefetch(unqlite_kv_handle pHandle,pgno iFirst,pgno nPage)
+{
+	int rc;
+	rc = unqlitePagerPrefetch((Pager *)pHandle,iFirst,nPage);
+	return rc;
+}
+/* 
+ * Refer to [unqlitePagerSwapPage()]
+ */
+static int unqliteKvIoPageSwap(unqlite_page *pA,unqlite_page *pB)
+{
+	int rc;
+	if( pA == 0 || pB == 0 ){
+		return UNQLITE_OK;
+	}
+	rc = unqlitePagerSwapPage((Page *)pA,(Page *)pB);
+	return rc;
+}
 /*
  * Init an instance of the [unqlite_kv_io] structure.
  */
@@ -58047,6 +60811,11 @@ static int pager_kv_io_init(Pager *pPager,unqlite_kv_methods *pMethods,unqlite_k
 
 	pIo->xErr = unqliteKvIoErr;
 
+	pIo->xPageCount = unqliteKvIoPageCount;
+	pIo->xTruncate  = unqliteKvIoTruncate;
+	pIo->xSwap      = unqliteKvIoPageSwap;
+	pIo->xPrefetch  = unqliteKvIoPrefetch;
+
 	return UNQLITE_OK;
 }
 /*
@@ -389,6 +389,20 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_CONFIG_KV_ENGINE           4  /* ONE ARGUMENT: const char *zKvName */
 #define UNQLITE_CONFIG_DISABLE_AUTO_COMMIT 5  /* NO ARGUMENTS */
 #define UNQLITE_CONFIG_GET_KV_NAME         6  /* ONE ARGUMENT: const char **pzPtr */
+#define UNQLITE_CONFIG_SYNC_LEVEL          7  /* ONE ARGUMENT: int iLevel */
+#define UNQLITE_CONFIG_PAGER_STATS         8  /* THREE ARGUMENTS: unqlite_int64 *pnHit,unqlite_int64 *pnMiss,unqlite_int64 *pnSync */
+#define UNQLITE_CONFIG_PREPARE_COMMIT      9  /* NO ARGUMENTS */
+/*
+ * Durability levels for [unqlite_config()] with UNQLITE_CONFIG_SYNC_LEVEL.
+ *
+ * UNQLITE_SYNC_LEVEL_NONE:   Never sync. A crash of the host may lose or corrupt the database.
+ * UNQLITE_SYNC_LEVEL_COMMIT: A single data-only sync of the database file per commit. The journal
+ *                            is not synced so a power loss during a commit may corrupt the database.
+ * UNQLITE_SYNC_LEVEL_FULL:   Sync the journal before and the database after each commit (Default).
+ */
+#define UNQLITE_SYNC_LEVEL_NONE   0
+#define UNQLITE_SYNC_LEVEL_COMMIT 1
+#define UNQLITE_SYNC_LEVEL_FULL   2
 /*
  * UnQLite/Jx9 Virtual Machine Configuration Commands.
  *
@@ -434,6 +448,15 @@ typedef sxi64 unqlite_int64;
  */
 #define UNQLITE_KV_CONFIG_HASH_FUNC  1 /* ONE ARGUMENT: unsigned int (*xHash)(const void *,unsigned int) */
 #define UNQLITE_KV_CONFIG_CMP_FUNC   2 /* ONE ARGUMENT: int (*xCmp)(const void *,const void *,unsigned int) */
+#define UNQLITE_KV_CONFIG_VACUUM     3 /* FOUR ARGUMENTS: int nStep,unqlite_int64 *pnFree,unqlite_int64 *pnPage,unqlite_int64 *pnRemain */
+#define UNQLITE_KV_CONFIG_CHECK      4 /* THREE ARGUMENTS: unqlite_int64 *pnUsed,unqlite_int64 *pnFree,unqlite_int64 *pnBreak */
+#define UNQLITE_KV_CONFIG_COMPRESSION 5 /* ONE ARGUMENT: int iCodec */
+#define UNQLITE_KV_CONFIG_PREFETCH   6 /* FOUR ARGUMENTS: const void *pKey,int nKey,unqlite_int64 iOfft,unqlite_int64 nLen */
+/*
+ * Value codecs for UNQLITE_KV_CONFIG_COMPRESSION.
+ */
+#define UNQLITE_KV_CODEC_NONE 0 /* Store values raw */
+#define UNQLITE_KV_CODEC_LZ4  1 /* LZ4 block format */
 /*
  * Global Library Configuration Commands.
  *
@@ -479,6 +502,7 @@ typedef sxi64 unqlite_int64;
 #define UNQLITE_OPEN_OMIT_JOURNALING  0x00000040  /* Omit journaling for this database. Ok for [unqlite_open] */
 #define UNQLITE_OPEN_IN_MEMORY        0x00000080  /* An in memory database. Ok for [unqlite_open]*/
 #define UNQLITE_OPEN_MMAP             0x00000100  /* Obtain a memory view of the whole file. Ok for [unqlite_open] */
+#define UNQLITE_OPEN_PAGE_CRC         0x00000200  /* Store a CRC32C in every page of a new database. Ok for [unqlite_open] */
 /*
  * Synchronization Type Flags
  *
@@ -693,6 +717,10 @@ struct unqlite_kv_io
 	void (*xSetUnpin)(unqlite_kv_handle,void (*xPageUnpin)(void *)); 
 	void (*xSetReload)(unqlite_kv_handle,void (*xPageReload)(void *));
 	void (*xErr)(unqlite_kv_handle,const char *);
+	pgno (*xPageCount)(unqlite_kv_handle);
+	int (*xTruncate)(unqlite_kv_handle,pgno);
+	int (*xSwap)(unqlite_page *,unqlite_page *);
+	int (*xPrefetch)(unqlite_kv_handle,pgno,pgno);
 };
 /*
  * Key/Value Storage Engine Cursor Object
@@ -745,7 +773,7 @@ struct unqlite_kv_methods
   const char *zName; /* Storage engine name [i.e. Hash, B+tree, LSM, R-tree, Mem, etc.]*/
   int szKv;          /* 'unqlite_kv_engine' subclass size */
   int szCursor;      /* 'unqlite_kv_cursor' subclass size */
-  int iVersion;      /* Structure version, currently 1 */
+  int iVersion;      /* Structure version, 2 with xFetchCached */
   /* Storage engine methods */
   int (*xInit)(unqlite_kv_engine *,int iPageSize);
   void (*xRelease)(unqlite_kv_engine *);
@@ -775,6 +803,12 @@ struct unqlite_kv_methods
   int (*xData)(unqlite_kv_cursor *,int (*xConsumer)(const void *,unsigned int,void *),void *pUserData);
   void (*xReset)(unqlite_kv_cursor *);
   void (*xCursorRelease)(unqlite_kv_cursor *);
+  /* Version 2: fetch a record from the pages in the cache only, without changing anything, so that
+   * several threads can run it at once. No consumer asks for the data length. Returns UNQLITE_BUSY
+   * when the record is not in memory: the caller then seeks it with a cursor.
+   */
+  int (*xFetchCached)(unqlite_kv_engine *,const void *pKey,int nByte,
+	  int (*xConsumer)(const void *,unsigned int,void *),void *pUserData,unqlite_int64 *pDataLen);
 };
 /*
  * UnQLite journal file suffix.